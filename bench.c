@@ -0,0 +1,1307 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <spa/param/video/raw.h>
+
+#include "codec.h"
+#include "convert.h"
+#include "latency.h"
+#include "pool.h"
+#include "recorder.h"
+#include "scale.h"
+#include "server.h"
+#include "shmexport.h"
+#include "shmring.h"
+#include "tilediff.h"
+#include "wire.h"
+#include "yuv.h"
+
+#define BENCH_MIN_NS 300000000ull
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint8_t *alloc_random(size_t size)
+{
+    uint8_t *data = aligned_alloc(64, (size + 63) & ~(size_t)63);
+
+    for (size_t i = 0; i < size; i++)
+        data[i] = rand();
+    return data;
+}
+
+static const struct
+{
+    uint32_t format;
+    const char *name;
+} format_names[] = {
+    {SPA_VIDEO_FORMAT_RGBx, "RGBx"},
+    {SPA_VIDEO_FORMAT_BGRx, "BGRx"},
+    {SPA_VIDEO_FORMAT_xRGB, "xRGB"},
+    {SPA_VIDEO_FORMAT_xBGR, "xBGR"},
+    {SPA_VIDEO_FORMAT_RGBA, "RGBA"},
+    {SPA_VIDEO_FORMAT_BGRA, "BGRA"},
+    {SPA_VIDEO_FORMAT_ARGB, "ARGB"},
+    {SPA_VIDEO_FORMAT_ABGR, "ABGR"},
+    {SPA_VIDEO_FORMAT_RGB, "RGB"},
+    {SPA_VIDEO_FORMAT_BGR, "BGR"},
+};
+
+static const char *format_name(uint32_t format)
+{
+    for (size_t i = 0; i < SPA_N_ELEMENTS(format_names); i++)
+    {
+        if (format_names[i].format == format)
+            return format_names[i].name;
+    }
+    return "?";
+}
+
+// MB/s of source pixels converted with `c`, output left in `dst`.
+static double time_convert(const struct convert *c, uint8_t *dst, uint32_t dst_stride,
+                           const uint8_t *src, uint32_t src_stride,
+                           uint32_t width, uint32_t height)
+{
+    uint64_t start = now_ns(), elapsed;
+    uint32_t iterations = 0;
+
+    do
+    {
+        convert_rows(c, dst, dst_stride, src, src_stride, width, height);
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+
+    return (double)width * height * c->src_bpp * iterations / (elapsed / 1e9) / 1e6;
+}
+
+static int bench_convert(int argc, char *argv[])
+{
+    static const uint32_t pairs[][2] = {
+        {SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx},
+        {SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBA},
+        {SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRA},
+        {SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_ARGB},
+        {SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_BGRA},
+        {SPA_VIDEO_FORMAT_xRGB, SPA_VIDEO_FORMAT_BGRx},
+        {SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGB},
+        {SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGRx},
+        {SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGR},
+    };
+    const uint32_t width = WIDTH, height = HEIGHT;
+    const uint32_t stride = (width * 4 + 63) & ~63u;
+    uint8_t *src = alloc_random((size_t)stride * height);
+    uint8_t *ref = aligned_alloc(64, (size_t)stride * height);
+    uint8_t *dst = aligned_alloc(64, (size_t)stride * height);
+    enum convert_impl best = convert_best_impl();
+    int res = 0;
+
+    printf("%-14s %10s %10s %10s %8s\n", "conversion", "scalar", "sse2", "avx2", "speedup");
+    for (size_t i = 0; i < SPA_N_ELEMENTS(pairs); i++)
+    {
+        double mbs[CONVERT_IMPL_AVX2 + 1] = {};
+        char name[32];
+
+        snprintf(name, sizeof(name), "%s->%s", format_name(pairs[i][0]),
+                 format_name(pairs[i][1]));
+        for (enum convert_impl impl = CONVERT_IMPL_SCALAR; impl <= best; impl++)
+        {
+            struct convert c;
+            uint8_t *out = impl == CONVERT_IMPL_SCALAR ? ref : dst;
+
+            if (convert_init(&c, pairs[i][1], pairs[i][0], impl) < 0)
+                continue;
+            mbs[impl] = time_convert(&c, out, stride, src, stride, width, height);
+
+            for (uint32_t y = 0; impl != CONVERT_IMPL_SCALAR && y < height; y++)
+            {
+                if (memcmp(ref + (size_t)y * stride, dst + (size_t)y * stride,
+                           width * c.dst_bpp) != 0)
+                {
+                    printf("%s: %s output differs from scalar at row %u\n",
+                           name, convert_impl_name(impl), y);
+                    res = 1;
+                    break;
+                }
+            }
+        }
+        printf("%-14s %10.0f %10.0f %10.0f %7.1fx\n", name,
+               mbs[CONVERT_IMPL_SCALAR], mbs[CONVERT_IMPL_SSE2], mbs[CONVERT_IMPL_AVX2],
+               mbs[best] / mbs[CONVERT_IMPL_SCALAR]);
+    }
+
+    free(src);
+    free(ref);
+    free(dst);
+    return res;
+}
+
+static void yuv_image_alloc(struct yuv_image *img, uint32_t format,
+                            uint32_t width, uint32_t height)
+{
+    uint32_t cw = (width + 1) / 2, ch = (height + 1) / 2;
+
+    memset(img, 0, sizeof(*img));
+    img->format = format;
+    img->width = width;
+    img->height = height;
+    img->strides[0] = (width + 63) & ~63u;
+    img->planes[0] = aligned_alloc(64, (size_t)img->strides[0] * height);
+    if (format == SPA_VIDEO_FORMAT_NV12)
+    {
+        img->strides[1] = (cw * 2 + 63) & ~63u;
+        img->planes[1] = aligned_alloc(64, (size_t)img->strides[1] * ch);
+    }
+    else
+    {
+        img->strides[1] = img->strides[2] = (cw + 63) & ~63u;
+        img->planes[1] = aligned_alloc(64, (size_t)img->strides[1] * ch);
+        img->planes[2] = aligned_alloc(64, (size_t)img->strides[2] * ch);
+    }
+}
+
+static void yuv_image_free(struct yuv_image *img)
+{
+    for (int i = 0; i < 3; i++)
+        free(img->planes[i]);
+}
+
+// Floating point BT.601/BT.709 reference of a BGRx image, as planar Y, U, V.
+static void yuv_reference(uint8_t *ref[3], const uint8_t *src, uint32_t stride,
+                          uint32_t width, uint32_t height,
+                          enum yuv_matrix matrix, enum yuv_range range)
+{
+    double kr = matrix == YUV_BT709 ? 0.2126 : 0.299;
+    double kb = matrix == YUV_BT709 ? 0.0722 : 0.114;
+    double ys = range == YUV_RANGE_FULL ? 1.0 : 219.0 / 255.0;
+    double cs = range == YUV_RANGE_FULL ? 1.0 : 224.0 / 255.0;
+    double yo = range == YUV_RANGE_FULL ? 0 : 16;
+    uint32_t cw = (width + 1) / 2;
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            const uint8_t *p = src + (size_t)y * stride + x * 4;
+            ref[0][(size_t)y * width + x] =
+                lround(yo + ys * (kr * p[2] + (1 - kr - kb) * p[1] + kb * p[0]));
+        }
+    }
+    for (uint32_t y = 0; y < height; y += 2)
+    {
+        for (uint32_t x = 0; x < width; x += 2)
+        {
+            double r = 0, g = 0, b = 0, l, u, v;
+            for (uint32_t i = 0; i < 4; i++)
+            {
+                uint32_t sx = x + (i & 1), sy = y + i / 2;
+                const uint8_t *p = src + (size_t)(sy < height ? sy : y) * stride +
+                                   (sx < width ? sx : x) * 4;
+                r += p[2] / 4.0, g += p[1] / 4.0, b += p[0] / 4.0;
+            }
+            l = kr * r + (1 - kr - kb) * g + kb * b;
+            u = 128 + cs * (b - l) / (2 * (1 - kb));
+            v = 128 + cs * (r - l) / (2 * (1 - kr));
+            ref[1][(size_t)(y / 2) * cw + x / 2] = u < 0 ? 0 : u > 255 ? 255 : lround(u);
+            ref[2][(size_t)(y / 2) * cw + x / 2] = v < 0 ? 0 : v > 255 ? 255 : lround(v);
+        }
+    }
+}
+
+// PSNR of one plane of `img` against the packed reference plane.
+static double yuv_psnr(const struct yuv_image *img, int plane, const uint8_t *ref)
+{
+    uint32_t w = plane ? (img->width + 1) / 2 : img->width;
+    uint32_t h = plane ? (img->height + 1) / 2 : img->height;
+    double se = 0;
+
+    for (uint32_t y = 0; y < h; y++)
+    {
+        for (uint32_t x = 0; x < w; x++)
+        {
+            int v;
+            if (plane && img->format == SPA_VIDEO_FORMAT_NV12)
+                v = img->planes[1][(size_t)y * img->strides[1] + x * 2 + plane - 1];
+            else
+                v = img->planes[plane][(size_t)y * img->strides[plane] + x];
+            se += (double)(v - ref[(size_t)y * w + x]) * (v - ref[(size_t)y * w + x]);
+        }
+    }
+    if (se == 0)
+        return INFINITY;
+    return 10 * log10(255.0 * 255.0 / (se / ((double)w * h)));
+}
+
+static int bench_yuv(int argc, char *argv[])
+{
+    static const char *matrix_names[] = {"bt601", "bt709"};
+    static const char *range_names[] = {"limited", "full"};
+    const uint32_t width = WIDTH, height = HEIGHT;
+    const uint32_t stride = width * 4;
+    uint8_t *src = alloc_random((size_t)stride * height);
+    uint8_t *ref[3];
+    enum convert_impl best = convert_best_impl() == CONVERT_IMPL_AVX2 ? CONVERT_IMPL_AVX2 : CONVERT_IMPL_SCALAR;
+    const enum convert_impl impls[] = {CONVERT_IMPL_SCALAR, best};
+    uint32_t n_impls = best != CONVERT_IMPL_SCALAR ? 2 : 1;
+    int res = 0;
+
+    // Random noise is the worst case for subsampling, smooth it a bit so the
+    // PSNR reflects the arithmetic rather than the chroma decimation.
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 4; x < stride; x++)
+            src[(size_t)y * stride + x] = (src[(size_t)y * stride + x] + src[(size_t)y * stride + x - 4] * 3) / 4;
+    }
+
+    ref[0] = malloc((size_t)width * height);
+    ref[1] = malloc((size_t)(width + 1) / 2 * ((height + 1) / 2));
+    ref[2] = malloc((size_t)(width + 1) / 2 * ((height + 1) / 2));
+
+    printf("%-26s %8s %10s %10s %8s %8s %8s\n", "conversion", "impl", "MB/s", "speedup",
+           "psnr-y", "psnr-u", "psnr-v");
+    for (int matrix = YUV_BT601; matrix <= YUV_BT709; matrix++)
+    {
+        for (int range = YUV_RANGE_LIMITED; range <= YUV_RANGE_FULL; range++)
+        {
+            yuv_reference(ref, src, stride, width, height, matrix, range);
+
+            for (int f = 0; f < 2; f++)
+            {
+                uint32_t format = f ? SPA_VIDEO_FORMAT_I420 : SPA_VIDEO_FORMAT_NV12;
+                struct yuv_image out[2];
+                double scalar_mbs = 0;
+                char name[64];
+
+                snprintf(name, sizeof(name), "BGRx->%s %s %s", f ? "I420" : "NV12",
+                         matrix_names[matrix], range_names[range]);
+                for (uint32_t k = 0; k < n_impls; k++)
+                {
+                    enum convert_impl impl = impls[k];
+                    struct yuv_converter c;
+                    struct yuv_image *img = &out[impl != CONVERT_IMPL_SCALAR];
+                    uint64_t start, elapsed;
+                    uint32_t iterations = 0;
+                    double mbs;
+
+                    yuv_image_alloc(img, format, width, height);
+                    if (yuv_converter_init(&c, format, SPA_VIDEO_FORMAT_BGRx, matrix, range, impl) < 0)
+                        continue;
+
+                    start = now_ns();
+                    do
+                    {
+                        yuv_convert(&c, img, src, stride, 0, height);
+                        iterations++;
+                        elapsed = now_ns() - start;
+                    } while (elapsed < BENCH_MIN_NS);
+                    mbs = (double)stride * height * iterations / (elapsed / 1e9) / 1e6;
+                    if (impl == CONVERT_IMPL_SCALAR)
+                        scalar_mbs = mbs;
+
+                    printf("%-26s %8s %10.0f %9.1fx %8.2f %8.2f %8.2f\n", name,
+                           convert_impl_name(c.impl), mbs, mbs / scalar_mbs,
+                           yuv_psnr(img, 0, ref[0]), yuv_psnr(img, 1, ref[1]),
+                           yuv_psnr(img, 2, ref[2]));
+                    if (yuv_psnr(img, 0, ref[0]) < 45 || yuv_psnr(img, 1, ref[1]) < 45 ||
+                        yuv_psnr(img, 2, ref[2]) < 45)
+                    {
+                        printf("%s: %s PSNR below 45 dB\n", name, convert_impl_name(c.impl));
+                        res = 1;
+                    }
+                }
+
+                if (best != CONVERT_IMPL_SCALAR)
+                {
+                    for (int p = 0; p < (f ? 3 : 2); p++)
+                    {
+                        uint32_t cw = (width + 1) / 2;
+                        uint32_t h = p ? (height + 1) / 2 : height;
+                        // Only the written bytes, the row padding is left
+                        // uninitialized.
+                        uint32_t w = !p ? width : f ? cw : 2 * cw;
+
+                        for (uint32_t y = 0; y < h; y++)
+                        {
+                            if (memcmp(out[0].planes[p] + (size_t)y * out[0].strides[p],
+                                       out[1].planes[p] + (size_t)y * out[1].strides[p], w) != 0)
+                            {
+                                printf("%s: avx2 plane %d differs from scalar\n", name, p);
+                                res = 1;
+                                break;
+                            }
+                        }
+                    }
+                    yuv_image_free(&out[1]);
+                }
+                yuv_image_free(&out[0]);
+            }
+        }
+    }
+
+    for (int i = 0; i < 3; i++)
+        free(ref[i]);
+    free(src);
+    return res;
+}
+
+#define SHM_BENCH_MAX_READERS SHM_EXPORT_MAX_READERS
+
+struct shm_bench_reader
+{
+    pthread_t thread;
+    const char *path;
+    atomic_bool *stop;
+    bool slow;
+    bool connected;
+    uint64_t bytes;
+    uint64_t checksum;
+    struct shm_reader_stats stats;
+};
+
+// Reads every pixel of every frame it takes, like a consumer that does
+// real work on the frame would.
+static void *shm_bench_reader(void *data)
+{
+    struct shm_bench_reader *b = data;
+    struct shm_reader *reader = shm_reader_connect(b->path);
+    struct shm_frame frame;
+
+    if (!reader)
+        return NULL;
+    b->connected = true;
+    while (!atomic_load(b->stop))
+    {
+        uint64_t sum = 0;
+        int res = shm_reader_acquire(reader, &frame, 10);
+
+        if (res == -ETIMEDOUT)
+            continue;
+        if (res < 0)
+            break;
+        for (uint32_t i = 0; i < frame.n_planes; i++)
+        {
+            const uint64_t *words = (const uint64_t *)frame.planes[i].data;
+            for (size_t j = 0; j < frame.planes[i].size / 8; j++)
+                sum += words[j];
+        }
+        if (b->slow)
+            usleep(5000);
+        if (shm_reader_release(reader, &frame))
+        {
+            b->checksum += sum;
+            for (uint32_t i = 0; i < frame.n_planes; i++)
+                b->bytes += frame.planes[i].size;
+        }
+    }
+    shm_reader_get_stats(reader, &b->stats);
+    shm_reader_destroy(reader);
+    return NULL;
+}
+
+// One writer publishing frames as fast as it can copy them, `argv[1]`
+// readers (4 by default) taking them. With "slow" as `argv[2]` the last
+// reader stalls 5 ms per frame, the others must not notice.
+static int bench_shm(int argc, char *argv[])
+{
+    const uint32_t width = WIDTH, height = HEIGHT, stride = WIDTH * 4;
+    uint32_t n_readers = argc > 1 ? atoi(argv[1]) : 4;
+    bool slow = argc > 2 && strcmp(argv[2], "slow") == 0;
+    struct shm_bench_reader readers[SHM_BENCH_MAX_READERS] = {};
+    struct frame frame = {.format = SPA_VIDEO_FORMAT_BGRx, .width = width, .height = height};
+    struct shm_writer_stats stats;
+    struct shm_writer *writer;
+    atomic_bool stop = false;
+    uint64_t start, elapsed;
+    char path[64];
+    int res = 0;
+
+    if (n_readers < 1 || n_readers > SHM_BENCH_MAX_READERS)
+        n_readers = 4;
+    snprintf(path, sizeof(path), "/tmp/screencast-bench-%d.sock", getpid());
+    writer = shm_writer_new(path, SHM_EXPORT_SLOTS, (size_t)stride * height);
+    if (!writer)
+        return 1;
+
+    frame.n_planes = 1;
+    frame.planes[0].data = alloc_random((size_t)stride * height);
+    frame.planes[0].stride = stride;
+    frame.planes[0].size = stride * height;
+    frame_damage_full(&frame);
+
+    for (uint32_t i = 0; i < n_readers; i++)
+    {
+        readers[i].path = path;
+        readers[i].stop = &stop;
+        readers[i].slow = slow && i == n_readers - 1;
+        pthread_create(&readers[i].thread, NULL, shm_bench_reader, &readers[i]);
+    }
+    start = now_ns();
+    do
+    {
+        shm_writer_accept(writer);
+        shm_writer_get_stats(writer, &stats);
+        usleep(1000);
+    } while (stats.readers < n_readers && now_ns() - start < 2000000000ull);
+
+    start = now_ns();
+    do
+    {
+        shm_writer_publish(writer, &frame, false);
+        elapsed = now_ns() - start;
+    } while (elapsed < 3 * BENCH_MIN_NS);
+    atomic_store(&stop, true);
+    for (uint32_t i = 0; i < n_readers; i++)
+        pthread_join(readers[i].thread, NULL);
+    shm_writer_get_stats(writer, &stats);
+
+    printf("writer: %u readers, %.0f frames/s, %.0f MB/s\n", stats.readers,
+           stats.published / (elapsed / 1e9),
+           (double)stats.published * frame.planes[0].size / (elapsed / 1e9) / 1e6);
+    printf("%-8s %10s %10s %10s %10s\n", "reader", "frames/s", "MB/s", "lost", "torn");
+    for (uint32_t i = 0; i < n_readers; i++)
+    {
+        struct shm_bench_reader *b = &readers[i];
+
+        printf("%-8u %10.0f %10.0f %10lu %10lu%s\n", i, b->stats.frames / (elapsed / 1e9),
+               b->bytes / (elapsed / 1e9) / 1e6, (unsigned long)b->stats.lost,
+               (unsigned long)b->stats.torn, b->slow ? "  (slow)" : "");
+        if (!b->connected || (!b->slow && b->stats.frames == 0))
+        {
+            printf("reader %u got no frames\n", i);
+            res = 1;
+        }
+    }
+
+    shm_writer_destroy(writer);
+    free((void *)frame.planes[0].data);
+    return res;
+}
+
+#define BENCH_POOL_FRAMES 8
+
+// Frames that stand in for capture buffers: consumers get them through a
+// ring and hand them back by releasing, a frame still held can't be reused.
+struct bench_pool
+{
+    struct frame frames[BENCH_POOL_FRAMES];
+    struct frame_pool pool;
+    uint64_t busy;
+    uint8_t *pixels;
+    uint64_t published;
+    uint64_t starved; // times no frame was free
+};
+
+static void bench_pool_init(struct bench_pool *p, uint32_t width, uint32_t height)
+{
+    uint32_t stride = width * 4;
+
+    memset(p, 0, sizeof(*p));
+    p->pixels = alloc_random((size_t)stride * height);
+    for (uint32_t i = 0; i < BENCH_POOL_FRAMES; i++)
+    {
+        struct frame *frame = &p->frames[i];
+
+        frame->id = i;
+        frame->pool = &p->pool;
+        frame->format = SPA_VIDEO_FORMAT_BGRx;
+        frame->width = width;
+        frame->height = height;
+        frame->n_planes = 1;
+        frame->planes[0] = (struct frame_plane){p->pixels, stride, stride * height};
+        frame_damage_full(frame);
+    }
+}
+
+// Push the next free frame, like on_stream_process does with a dequeued
+// buffer. Returns false when every frame is still held.
+static bool bench_pool_push(struct bench_pool *p, struct frame_ring *ring)
+{
+    struct frame *frame = NULL;
+
+    p->busy &= ~frame_pool_drain(&p->pool);
+    for (uint32_t i = 0; i < BENCH_POOL_FRAMES && !frame; i++)
+        if (!(p->busy & (UINT64_C(1) << i)))
+            frame = &p->frames[i];
+    if (!frame)
+    {
+        p->starved++;
+        return false;
+    }
+    p->busy |= UINT64_C(1) << frame->id;
+    frame->seq = p->published++;
+    frame->queued_ns = frame_ring_now_ns();
+    atomic_store(&frame->refs, 1);
+    frame_ring_push(ring, frame);
+    frame_release(frame);
+    return true;
+}
+
+#define CODEC_GLYPHS 48
+
+// 8x14 cells, bit c of row r set for dark pixels.
+static uint8_t codec_glyphs[CODEC_GLYPHS][14];
+
+static void codec_glyph(uint8_t *pixels, uint32_t stride, uint32_t x, uint32_t y, uint32_t glyph)
+{
+    for (uint32_t r = 0; r < 14; r++)
+    {
+        uint32_t *row = (uint32_t *)(pixels + (size_t)(y + r) * stride) + x;
+
+        for (uint32_t c = 0; c < 8; c++)
+        {
+            if (codec_glyphs[glyph][r] >> c & 1)
+                row[c] = 0x00202428;
+        }
+    }
+}
+
+static void codec_noise(uint8_t *pixels, uint32_t stride, const struct frame_rect *r)
+{
+    for (uint32_t y = r->y; y < r->y + r->height; y++)
+    {
+        uint32_t *row = (uint32_t *)(pixels + (size_t)y * stride);
+
+        for (uint32_t x = r->x; x < r->x + r->width; x++)
+            row[x] = rand() & 0x00ffffff;
+    }
+}
+
+// A gradient desktop with three flat windows full of text.
+static void codec_desktop(uint8_t *pixels, uint32_t width, uint32_t height, uint32_t stride)
+{
+    static const uint32_t windows[][4] = {
+        {80, 60, 900, 700}, {700, 240, 1100, 760}, {1280, 40, 600, 980},
+    };
+
+    for (uint32_t g = 0; g < CODEC_GLYPHS; g++)
+    {
+        for (uint32_t r = 0; r < 14; r++)
+            codec_glyphs[g][r] = r < 3 || r > 11 ? 0 : rand() & rand() & 0x7e;
+    }
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint32_t *row = (uint32_t *)(pixels + (size_t)y * stride);
+
+        for (uint32_t x = 0; x < width; x++)
+            row[x] = 0x00203060 + ((y * 96 / height) << 16) + x * 64 / width;
+    }
+    for (size_t w = 0; w < SPA_N_ELEMENTS(windows); w++)
+    {
+        uint32_t x0 = windows[w][0], y0 = windows[w][1], ww = windows[w][2], wh = windows[w][3];
+
+        for (uint32_t y = y0; y < y0 + wh; y++)
+        {
+            uint32_t *row = (uint32_t *)(pixels + (size_t)y * stride);
+
+            for (uint32_t x = x0; x < x0 + ww; x++)
+                row[x] = y < y0 + 28 ? 0x00303438 : 0x00f4f4f2;
+        }
+        for (uint32_t y = y0 + 40; y + 18 < y0 + wh; y += 18)
+        {
+            uint32_t len = 20 + rand() % ((ww - 24) / 8 - 20);
+
+            for (uint32_t c = 0; c < len; c++)
+                codec_glyph(pixels, stride, x0 + 12 + c * 8, y, rand() % CODEC_GLYPHS);
+        }
+    }
+}
+
+struct server_bench_client
+{
+    pthread_t thread;
+    const char *path;
+    struct latency_histogram *latency;
+    uint32_t delay_us; // between reads of a slow client, 0 for a fast one
+    bool connected;
+    uint64_t frames;
+    uint64_t bytes;
+};
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    uint8_t *p = data;
+
+    while (size)
+    {
+        ssize_t res = read(fd, p, size);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        p += res;
+        size -= res;
+    }
+    return true;
+}
+
+// Reads 64 KiB at a time, `delay_us` apart.
+static bool read_slowly(int fd, void *data, size_t size, uint32_t delay_us)
+{
+    uint8_t *p = data;
+
+    while (size)
+    {
+        size_t chunk = size < 65536 ? size : 65536;
+
+        usleep(delay_us);
+        if (!read_all(fd, p, chunk))
+            return false;
+        p += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+// Reads frames until the server hangs up, timing each from the capture
+// side's queued_ns until its last byte arrived.
+static void *server_bench_client(void *data)
+{
+    struct server_bench_client *b = data;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stream_frame_header header;
+    uint8_t *pixels = NULL;
+    size_t capacity = 0;
+    int fd;
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", b->path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto done;
+    b->connected = true;
+    while (read_all(fd, &header, sizeof(header)) &&
+           (header.magic == STREAM_MAGIC || header.magic == STREAM_CODEC_MAGIC))
+    {
+        size_t size = header.cursor_size;
+
+        for (uint32_t i = 0; i < header.n_planes && i < FRAME_MAX_PLANES; i++)
+            size += header.sizes[i];
+        if (size > capacity)
+        {
+            free(pixels);
+            capacity = size;
+            if (!(pixels = malloc(capacity)))
+                break;
+        }
+        if (b->delay_us ? !read_slowly(fd, pixels, size, b->delay_us)
+                        : !read_all(fd, pixels, size))
+            break;
+        if (!b->delay_us)
+            latency_record_since(b->latency, header.queued_ns);
+        b->frames++;
+        b->bytes += sizeof(header) + size;
+    }
+
+done:
+    if (fd >= 0)
+        close(fd);
+    free(pixels);
+    return NULL;
+}
+
+// A stream server fed `argv[2]` frames per second (60 by default, 0 for as
+// fast as it takes them) and `argv[1]` clients (100 by default) reading
+// them, as codec packets with "encode" as `argv[3]`. Frames come from a pool of our own, like the capture buffers, so a
+// slow client holding on to them starves the producer the same way.
+// `argv[4]` of the clients (none by default) read each at its own crawl, so
+// they sit on different frames, which must not run the pool dry and stall
+// the others.
+static int bench_server(int argc, char *argv[])
+{
+    uint32_t n_clients = argc > 1 ? atoi(argv[1]) : 100;
+    uint32_t fps = argc > 2 ? atoi(argv[2]) : 60;
+    bool encode = argc > 3 && strcmp(argv[3], "encode") == 0;
+    uint32_t n_slow = argc > 4 ? atoi(argv[4]) : 0;
+    uint64_t slow_total = 0;
+    struct server_bench_client *clients;
+    struct bench_pool pool;
+    struct latency_histogram *latency = latency_stage("client");
+    struct stream_server_stats stats;
+    struct stream_server *server;
+    uint64_t start, elapsed, next, total = 0;
+    char path[64];
+    int res = 0;
+
+    if (n_clients < 1 || n_clients > STREAM_MAX_CLIENTS)
+        n_clients = 100;
+    if (n_slow >= n_clients)
+        n_slow = n_clients - 1;
+    snprintf(path, sizeof(path), "/tmp/screencast-bench-%d.sock", getpid());
+    if (!(server = stream_server_new(path, encode)))
+        return 1;
+    clients = calloc(n_clients, sizeof(*clients));
+
+    bench_pool_init(&pool, WIDTH, HEIGHT);
+    // Noise is the codec's worst case, screens look more like this.
+    if (encode)
+        codec_desktop(pool.pixels, WIDTH, HEIGHT, WIDTH * 4);
+
+    for (uint32_t i = 0; i < n_clients; i++)
+    {
+        clients[i].path = path;
+        clients[i].latency = latency;
+        // From 6.5 to 65 MB/s, frames take them up to a second or so.
+        clients[i].delay_us = i < n_slow ? 1000 + 9000 * i / n_slow : 0;
+        pthread_create(&clients[i].thread, NULL, server_bench_client, &clients[i]);
+    }
+    start = now_ns();
+    do
+    {
+        stream_server_get_stats(server, &stats);
+        usleep(1000);
+    } while (stats.clients < n_clients && now_ns() - start < 2000000000ull);
+
+    start = next = now_ns();
+    do
+    {
+        bool pushed = bench_pool_push(&pool, stream_server_ring(server));
+
+        if (fps)
+        {
+            next += 1000000000ull / fps;
+            while (now_ns() < next)
+                usleep(100);
+        }
+        else if (!pushed)
+            usleep(100);
+        elapsed = now_ns() - start;
+    } while (elapsed < 10 * BENCH_MIN_NS);
+
+    stream_server_stop(server);
+    for (uint32_t i = 0; i < n_clients; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        if (clients[i].delay_us)
+        {
+            slow_total += clients[i].frames;
+            continue;
+        }
+        if (!clients[i].connected || clients[i].frames == 0)
+        {
+            printf("client %u got no frames\n", i);
+            res = 1;
+        }
+        total += clients[i].frames;
+    }
+    stream_server_get_stats(server, &stats);
+
+    printf("%u clients, %.0f frames/s published, %lu starved, %lu replaced, %lu copied\n",
+           n_clients, pool.published / (elapsed / 1e9), (unsigned long)pool.starved,
+           (unsigned long)stats.dropped, (unsigned long)stats.copied);
+    if (n_slow)
+        printf("%u slow clients, %.1f frames/s\n", n_slow, slow_total / (elapsed / 1e9));
+    if (n_slow && pool.starved)
+    {
+        printf("slow clients held back the capture pool\n");
+        res = 1;
+    }
+    printf("aggregate %.0f frames/s, %.0f MB/s\n", total / (elapsed / 1e9),
+           stats.bytes / (elapsed / 1e9) / 1e6);
+    printf("latency p50 %.2f ms, p99 %.2f ms, p999 %.2f ms, max %.2f ms\n",
+           latency_percentile(latency, 50) / 1e6, latency_percentile(latency, 99) / 1e6,
+           latency_percentile(latency, 99.9) / 1e6, atomic_load(&latency->max) / 1e6);
+
+    stream_server_destroy(server);
+    free(clients);
+    free(pool.pixels);
+    return res;
+}
+
+// The recorder fed frames as fast as it takes them, into `argv[1]`
+// (screencast-bench.raw in /var/tmp by default, .y4m for Y4M), with
+// "direct" as `argv[2]` through O_DIRECT. The file is removed afterwards.
+static int bench_record(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "/var/tmp/screencast-bench.raw";
+    bool direct = argc > 2 && strcmp(argv[2], "direct") == 0;
+    struct recorder_stats stats;
+    struct recorder *recorder;
+    struct bench_pool pool;
+    uint64_t start, elapsed;
+    int res = 0;
+
+    if (!(recorder = recorder_new(path, direct)))
+        return 1;
+    bench_pool_init(&pool, WIDTH, HEIGHT);
+
+    start = now_ns();
+    do
+    {
+        if (!bench_pool_push(&pool, recorder_ring(recorder)))
+            usleep(100);
+        elapsed = now_ns() - start;
+    } while (elapsed < 10 * BENCH_MIN_NS);
+    recorder_stop(recorder);
+    recorder_get_stats(recorder, &stats);
+
+    printf("%s: %lu of %lu frames written, %.0f MB/s, %lu starved\n",
+           stats.io_uring ? "io_uring" : "pwrite", (unsigned long)stats.frames,
+           (unsigned long)pool.published, stats.bytes / (stats.write_ns / 1e9) / 1e6,
+           (unsigned long)pool.starved);
+    if (stats.frames == 0)
+        res = 1;
+
+    recorder_destroy(recorder);
+    unlink(path);
+    free(pool.pixels);
+    return res;
+}
+
+#define SCALING_STRIPE_ROWS 64
+
+struct scaling_job
+{
+    const uint8_t *src;
+    uint32_t stride;
+    const struct yuv_converter *c;
+    const struct yuv_image *image;
+};
+
+static void scaling_stripe(void *data, uint32_t index, struct work_arena *arena)
+{
+    const struct scaling_job *job = data;
+    struct yuv_image view = *job->image;
+    uint32_t y0 = index * SCALING_STRIPE_ROWS, rows = view.height - y0;
+
+    if (rows > SCALING_STRIPE_ROWS)
+        rows = SCALING_STRIPE_ROWS;
+    view.height = rows;
+    view.planes[0] += (size_t)y0 * view.strides[0];
+    view.planes[1] += (size_t)(y0 / 2) * view.strides[1];
+    view.planes[2] += (size_t)(y0 / 2) * view.strides[2];
+    yuv_convert(job->c, &view, job->src + (size_t)y0 * job->stride, job->stride, 0, rows);
+}
+
+// A 4K BGRx frame converted to I420 in stripes and tile hashed on pools of
+// 1 to `argv[1]` threads (one per online CPU by default). Striped output
+// must match a single yuv_convert of the whole frame.
+static int bench_scaling(int argc, char *argv[])
+{
+    const uint32_t width = 3840, height = 2160, stride = width * 4;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t max_threads = argc > 1 ? atoi(argv[1]) : n_cpus > 0 ? n_cpus : 1;
+    uint8_t *src = alloc_random((size_t)stride * height);
+    struct frame frame = {
+        .format = SPA_VIDEO_FORMAT_BGRx,
+        .width = width,
+        .height = height,
+        .n_planes = 1,
+        .planes = {{src, stride, stride * height}},
+    };
+    struct yuv_image ref, img;
+    struct yuv_converter c;
+    double yuv_base = 0, hash_base = 0;
+    int res = 0;
+
+    max_threads = max_threads < 1 ? 1 : max_threads > WORK_POOL_MAX_THREADS ? WORK_POOL_MAX_THREADS : max_threads;
+    yuv_converter_init(&c, SPA_VIDEO_FORMAT_I420, SPA_VIDEO_FORMAT_BGRx, YUV_BT709,
+                       YUV_RANGE_LIMITED, CONVERT_IMPL_AUTO);
+    yuv_image_alloc(&ref, SPA_VIDEO_FORMAT_I420, width, height);
+    yuv_image_alloc(&img, SPA_VIDEO_FORMAT_I420, width, height);
+    yuv_convert(&c, &ref, src, stride, 0, height);
+
+    printf("%-8s %10s %8s %10s %8s %12s\n", "threads", "yuv MB/s", "speedup", "hash MB/s",
+           "speedup", "steals/job");
+    for (uint32_t n = 1; n <= max_threads; n++)
+    {
+        struct work_pool *pool = work_pool_new(n);
+        struct scaling_job job = {src, stride, &c, &img};
+        struct work_pool_stats stats;
+        struct tilediff td;
+        uint64_t start, elapsed;
+        uint32_t iterations = 0;
+        double yuv_mbs, hash_mbs;
+
+        if (!pool || tilediff_init(&td, n, CONVERT_IMPL_AUTO) < 0)
+        {
+            work_pool_destroy(pool);
+            res = 1;
+            break;
+        }
+
+        start = now_ns();
+        do
+        {
+            work_pool_run(pool, (height + SCALING_STRIPE_ROWS - 1) / SCALING_STRIPE_ROWS,
+                          scaling_stripe, &job);
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < BENCH_MIN_NS);
+        yuv_mbs = (double)stride * height * iterations / (elapsed / 1e9) / 1e6;
+        work_pool_get_stats(pool, &stats);
+        for (int p = 0; p < 3; p++)
+        {
+            uint32_t h = p ? (height + 1) / 2 : height;
+            if (memcmp(img.planes[p], ref.planes[p], (size_t)img.strides[p] * h) != 0)
+            {
+                printf("%u threads: plane %d differs from the unstriped conversion\n", n, p);
+                res = 1;
+            }
+        }
+
+        // Every tile is hashed each time, an unchanged frame costs the same.
+        iterations = 0;
+        start = now_ns();
+        do
+        {
+            tilediff_process(&td, &frame, false);
+            iterations++;
+            elapsed = now_ns() - start;
+        } while (elapsed < BENCH_MIN_NS);
+        hash_mbs = (double)stride * height * iterations / (elapsed / 1e9) / 1e6;
+
+        if (n == 1)
+        {
+            yuv_base = yuv_mbs;
+            hash_base = hash_mbs;
+        }
+        printf("%-8u %10.0f %7.2fx %10.0f %7.2fx %12.2f\n", n, yuv_mbs, yuv_mbs / yuv_base,
+               hash_mbs, hash_mbs / hash_base, (double)stats.steals / stats.jobs);
+        tilediff_clear(&td);
+        work_pool_destroy(pool);
+    }
+
+    yuv_image_free(&ref);
+    yuv_image_free(&img);
+    free(src);
+    return res;
+}
+
+// Source MB/s of scaler_rows over a whole frame.
+static double time_scale(const struct scaler *s, uint8_t *dst, const uint8_t *src,
+                         uint32_t src_stride, void *scratch)
+{
+    uint64_t start = now_ns(), elapsed;
+    uint32_t iterations = 0;
+
+    do
+    {
+        scaler_rows(s, dst, s->dst_width * convert_format_bpp(s->dst_format), src, src_stride, 0,
+                    s->dst_height, scratch);
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+    return (double)src_stride * s->src_height * iterations / (elapsed / 1e9) / 1e6;
+}
+
+// 1080p and 4K BGRx down to 720p and half size with every filter, fused
+// with a conversion to RGBA. AVX2 output must match the scalar one, and a
+// flat frame must stay flat.
+static int bench_scale(int argc, char *argv[])
+{
+    static const struct
+    {
+        uint32_t src_width, src_height, dst_width, dst_height;
+    } sizes[] = {
+        {1920, 1080, 1280, 720},
+        {1920, 1080, 960, 540},
+        {3840, 2160, 1280, 720},
+        {3840, 2160, 1920, 1080},
+        {3840, 2160, 320, 180},
+    };
+    enum convert_impl best = convert_best_impl() == CONVERT_IMPL_AVX2 ? CONVERT_IMPL_AVX2 : CONVERT_IMPL_SCALAR;
+    const enum convert_impl impls[] = {CONVERT_IMPL_SCALAR, best};
+    uint32_t n_impls = best != CONVERT_IMPL_SCALAR ? 2 : 1;
+    uint8_t *src = alloc_random((size_t)3840 * 4 * 2160);
+    uint8_t *flat = malloc((size_t)3840 * 4 * 2160);
+    uint8_t *out[2] = {malloc((size_t)1920 * 4 * 1080), malloc((size_t)1920 * 4 * 1080)};
+    int res = 0;
+
+    memset(flat, 0x5a, (size_t)3840 * 4 * 2160);
+    printf("%-24s %-9s %-10s %10s %10s %8s\n", "scale", "filter", "format", "scalar MB/s",
+           "best MB/s", "speedup");
+    for (size_t i = 0; i < SPA_N_ELEMENTS(sizes); i++)
+    {
+        for (int filter = SCALE_FILTER_BOX; filter <= SCALE_FILTER_AREA; filter++)
+        {
+            for (int f = 0; f < 2; f++)
+            {
+                uint32_t format = f ? SPA_VIDEO_FORMAT_RGBA : SPA_VIDEO_FORMAT_BGRx;
+                uint32_t src_stride = sizes[i].src_width * 4;
+                size_t size = (size_t)sizes[i].dst_width * 4 * sizes[i].dst_height;
+                double mbs[2] = {0, 0};
+                char name[32];
+
+                for (uint32_t k = 0; k < n_impls; k++)
+                {
+                    enum convert_impl impl = impls[k];
+                    struct scaler s;
+                    void *scratch;
+
+                    if (scaler_init(&s, format, sizes[i].dst_width, sizes[i].dst_height,
+                                    SPA_VIDEO_FORMAT_BGRx, sizes[i].src_width,
+                                    sizes[i].src_height, filter, impl) < 0)
+                    {
+                        res = 1;
+                        continue;
+                    }
+                    scratch = aligned_alloc(64, (scaler_scratch_size(&s) + 63) & ~(size_t)63);
+                    mbs[impl != CONVERT_IMPL_SCALAR] =
+                        time_scale(&s, out[impl != CONVERT_IMPL_SCALAR], src, src_stride, scratch);
+
+                    scaler_rows(&s, out[1], sizes[i].dst_width * 4, flat, src_stride, 0,
+                                sizes[i].dst_height, scratch);
+                    for (size_t j = 0; j < size; j++)
+                    {
+                        // Padding of BGRx goes opaque in RGBA.
+                        if (out[1][j] != (f && j % 4 == 3 ? 0xff : 0x5a))
+                        {
+                            printf("%s: flat frame changed at byte %zu\n", scale_filter_name(filter), j);
+                            res = 1;
+                            break;
+                        }
+                    }
+                    if (impl != CONVERT_IMPL_SCALAR)
+                        time_scale(&s, out[1], src, src_stride, scratch);
+                    free(scratch);
+                    scaler_clear(&s);
+                }
+                if (best != CONVERT_IMPL_SCALAR && memcmp(out[0], out[1], size) != 0)
+                {
+                    printf("%s: avx2 output differs from scalar\n", scale_filter_name(filter));
+                    res = 1;
+                }
+
+                snprintf(name, sizeof(name), "%ux%u->%ux%u", sizes[i].src_width,
+                         sizes[i].src_height, sizes[i].dst_width, sizes[i].dst_height);
+                printf("%-24s %-9s %-10s %10.0f %10.0f %7.1fx\n", name, scale_filter_name(filter),
+                       f ? "BGRx->RGBA" : "BGRx", mbs[0], best != CONVERT_IMPL_SCALAR ? mbs[1] : mbs[0],
+                       best != CONVERT_IMPL_SCALAR ? mbs[1] / mbs[0] : 1.0);
+            }
+        }
+    }
+
+    free(src);
+    free(flat);
+    free(out[0]);
+    free(out[1]);
+    return res;
+}
+
+enum codec_scene
+{
+    CODEC_SCENE_KEY,       // the desktop as a key packet every time
+    CODEC_SCENE_UNCHANGED, // fully damaged, nothing changed
+    CODEC_SCENE_TYPING,    // a line of text appears
+    CODEC_SCENE_SCROLL,    // a window's text moves up a line
+    CODEC_SCENE_VIDEO,     // a 640x360 area of noise
+};
+
+static const char *const codec_scene_names[] = {
+    "keyframe", "unchanged", "typing", "scroll", "video",
+};
+
+// `b` is the frame after `a`, changed only within `damage`. Going back
+// from `b` to `a` changes the same area.
+static void codec_scene(enum codec_scene scene, uint8_t *a, uint8_t *b, const uint8_t *desktop,
+                        uint32_t width, uint32_t height, struct frame_rect *damage)
+{
+    const uint32_t stride = width * 4;
+
+    memcpy(a, desktop, (size_t)stride * height);
+    memcpy(b, desktop, (size_t)stride * height);
+    *damage = (struct frame_rect){0, 0, width, height};
+    switch (scene)
+    {
+    case CODEC_SCENE_KEY:
+    case CODEC_SCENE_UNCHANGED:
+        break;
+    case CODEC_SCENE_TYPING:
+        *damage = (struct frame_rect){92, 724, 480, 14};
+        for (uint32_t c = 0; c < 60; c++)
+            codec_glyph(b, stride, 92 + c * 8, 724, rand() % CODEC_GLYPHS);
+        break;
+    case CODEC_SCENE_SCROLL:
+        *damage = (struct frame_rect){1280, 68, 600, 952};
+        for (uint32_t y = damage->y; y < damage->y + damage->height; y++)
+        {
+            uint32_t *row = (uint32_t *)(b + (size_t)y * stride) + damage->x;
+
+            if (y + 18 < damage->y + damage->height)
+                memcpy(row, a + (size_t)(y + 18) * stride + damage->x * 4, damage->width * 4);
+            else
+                for (uint32_t x = 0; x < damage->width; x++)
+                    row[x] = 0x00f4f4f2;
+        }
+        break;
+    case CODEC_SCENE_VIDEO:
+        *damage = (struct frame_rect){200, 300, 640, 360};
+        codec_noise(a, stride, damage);
+        codec_noise(b, stride, damage);
+        break;
+    }
+}
+
+// 1080p BGRx screen content through the lossless codec on pools of
+// `argv[1]` threads (one per online CPU by default), alternating between
+// two frames of each scene. MB/s count raw frame bytes. Every packet must
+// decode to the frame it was encoded from, and AVX2 packets must match the
+// scalar ones byte for byte.
+static int bench_codec(int argc, char *argv[])
+{
+    const uint32_t width = WIDTH, height = HEIGHT, stride = WIDTH * 4;
+    const size_t frame_size = (size_t)stride * height;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t n_threads = argc > 1 ? atoi(argv[1]) : n_cpus > 0 ? n_cpus : 1;
+    enum convert_impl best = convert_best_impl() == CONVERT_IMPL_AVX2 ? CONVERT_IMPL_AVX2 : CONVERT_IMPL_SCALAR;
+    const enum convert_impl impls[] = {CONVERT_IMPL_SCALAR, best};
+    uint32_t n_impls = best != CONVERT_IMPL_SCALAR ? 2 : 1;
+    uint8_t *desktop = malloc(frame_size), *a = malloc(frame_size), *b = malloc(frame_size);
+    uint8_t *packets[3] = {malloc(frame_size * 2), malloc(frame_size * 2), malloc(frame_size * 2)};
+    uint8_t *scalar = malloc(frame_size * 2);
+    size_t sizes[3], scalar_size = 0;
+    int res = 0;
+
+    srand(1);
+    codec_desktop(desktop, width, height, stride);
+    printf("%-10s %-7s %10s %10s %10s %8s\n", "scene", "impl", "enc MB/s", "dec MB/s",
+           "packet KB", "ratio");
+    for (int scene = CODEC_SCENE_KEY; scene <= CODEC_SCENE_VIDEO; scene++)
+    {
+        struct frame frames[2] = {
+            {.format = SPA_VIDEO_FORMAT_BGRx, .width = width, .height = height, .n_planes = 1,
+             .planes = {{a, stride, frame_size}}, .n_damage = 1},
+            {.format = SPA_VIDEO_FORMAT_BGRx, .width = width, .height = height, .n_planes = 1,
+             .planes = {{b, stride, frame_size}}, .n_damage = 1},
+        };
+        bool key = scene == CODEC_SCENE_KEY;
+
+        codec_scene(scene, a, b, desktop, width, height, &frames[1].damage[0]);
+        frames[0].damage[0] = frames[1].damage[0];
+
+        for (uint32_t k = 0; k < n_impls; k++)
+        {
+            enum convert_impl impl = impls[k];
+            struct codec_encoder enc;
+            struct codec_decoder dec;
+            uint64_t start, elapsed;
+            uint32_t iterations = 0;
+            double enc_mbs, dec_mbs;
+
+            if (codec_encoder_init(&enc, n_threads, impl) < 0 ||
+                codec_decoder_init(&dec, n_threads, impl) < 0)
+            {
+                res = 1;
+                break;
+            }
+
+            // a as a key packet, then a to b and back.
+            for (int i = 0; i < 3; i++)
+            {
+                const uint8_t *packet;
+
+                if (codec_encode(&enc, &frames[i & 1], key || i == 0, false, &packet, &sizes[i]) < 0)
+                {
+                    res = 1;
+                    sizes[i] = 0;
+                }
+                memcpy(packets[i], packet, sizes[i]);
+                if (codec_decode(&dec, packets[i], sizes[i]) < 0 ||
+                    memcmp(dec.pixels, i & 1 ? b : a, frame_size) != 0)
+                {
+                    printf("%s: packet %d doesn't decode to its frame\n", codec_scene_names[scene], i);
+                    res = 1;
+                }
+            }
+            if (impl == CONVERT_IMPL_SCALAR)
+            {
+                memcpy(scalar, packets[1], sizes[1]);
+                scalar_size = sizes[1];
+            }
+            else if (sizes[1] != scalar_size || memcmp(scalar, packets[1], sizes[1]) != 0)
+            {
+                printf("%s: avx2 packet differs from scalar\n", codec_scene_names[scene]);
+                res = 1;
+            }
+
+            start = now_ns();
+            do
+            {
+                const uint8_t *packet;
+                size_t size;
+
+                codec_encode(&enc, &frames[(iterations + 1) & 1], key, false, &packet, &size);
+                iterations++;
+                elapsed = now_ns() - start;
+            } while (elapsed < BENCH_MIN_NS);
+            enc_mbs = (double)frame_size * iterations / (elapsed / 1e9) / 1e6;
+
+            iterations = 0;
+            start = now_ns();
+            do
+            {
+                codec_decode(&dec, packets[1 + (iterations & 1)], sizes[1 + (iterations & 1)]);
+                iterations++;
+                elapsed = now_ns() - start;
+            } while (elapsed < BENCH_MIN_NS);
+            dec_mbs = (double)frame_size * iterations / (elapsed / 1e9) / 1e6;
+
+            printf("%-10s %-7s %10.0f %10.0f %10.1f %7.0fx\n", codec_scene_names[scene],
+                   convert_impl_name(impl), enc_mbs, dec_mbs, (sizes[1] + sizes[2]) / 2 / 1024.0,
+                   2.0 * frame_size / (sizes[1] + sizes[2]));
+            codec_encoder_clear(&enc);
+            codec_decoder_clear(&dec);
+        }
+    }
+
+    free(desktop);
+    free(a);
+    free(b);
+    for (int i = 0; i < 3; i++)
+        free(packets[i]);
+    free(scalar);
+    return res;
+}
+
+static const struct
+{
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+} benches[] = {
+    {"convert", bench_convert},
+    {"yuv", bench_yuv},
+    {"shm", bench_shm},
+    {"server", bench_server},
+    {"record", bench_record},
+    {"scaling", bench_scaling},
+    {"scale", bench_scale},
+    {"codec", bench_codec},
+};
+
+int main(int argc, char *argv[])
+{
+    int res = 0;
+    bool found = false;
+
+    for (size_t i = 0; i < SPA_N_ELEMENTS(benches); i++)
+    {
+        if (argc > 1 && strcmp(argv[1], benches[i].name) != 0)
+            continue;
+        printf("== %s\n", benches[i].name);
+        res |= benches[i].run(argc > 1 ? argc - 1 : 0, argv + 1);
+        found = true;
+    }
+    if (!found)
+    {
+        printf("usage: %s [", argv[0]);
+        for (size_t i = 0; i < SPA_N_ELEMENTS(benches); i++)
+            printf("%s%s", i ? "|" : "", benches[i].name);
+        printf("]\n");
+        return 1;
+    }
+    return res;
+}
@@ -0,0 +1,655 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CODEC_X86 1
+#endif
+
+#define OP_INDEX 0x00
+#define OP_DIFF 0x40
+#define OP_LUMA 0x80
+#define OP_RUN 0xc0
+#define OP_RGB 0xfe
+#define OP_RGBA 0xff
+#define OP_MASK 0xc0
+#define MAX_RUN 62
+
+// Row mask, then every pixel as the widest op.
+#define TILE_SLOT (sizeof(uint64_t) + CODEC_TILE * CODEC_TILE * 5)
+
+// Pixels are handled as little endian 32-bit values. Bytes 0 to 2 take the
+// place of QOI's red, green and blue and byte 3 of alpha, whatever the
+// format calls them; only how well the differences compress depends on it.
+static inline uint32_t pixel_hash(uint32_t v)
+{
+    return ((v & 0xff) * 3 + (v >> 8 & 0xff) * 5 + (v >> 16 & 0xff) * 7 + (v >> 24) * 11) & 63;
+}
+
+static inline int8_t byte_diff(uint32_t a, uint32_t b, int shift)
+{
+    return (int8_t)((a >> shift) - (b >> shift));
+}
+
+static inline uint32_t pixel_add(uint32_t v, int d0, int d1, int d2)
+{
+    uint32_t b0 = (v + d0) & 0xff, b1 = ((v >> 8) + d1) & 0xff, b2 = ((v >> 16) + d2) & 0xff;
+
+    return (v & 0xff000000) | b2 << 16 | b1 << 8 | b0;
+}
+
+static uint32_t run_scalar(const uint32_t *px, uint32_t n, uint32_t value)
+{
+    uint32_t i = 0;
+
+    while (i < n && px[i] == value)
+        i++;
+    return i;
+}
+
+static void sub_scalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+        dst[i] = a[i] - b[i];
+}
+
+static void add_scalar(uint8_t *dst, const uint8_t *src, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+        dst[i] += src[i];
+}
+
+#ifdef CODEC_X86
+__attribute__((target("avx2"))) static uint32_t run_avx2(const uint32_t *px, uint32_t n,
+                                                         uint32_t value)
+{
+    const __m256i v = _mm256_set1_epi32(value);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(px + i)), v);
+        uint32_t mask = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+
+        if (mask != 0xff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + run_scalar(px + i, n - i, value);
+}
+
+__attribute__((target("avx2"))) static void sub_avx2(uint8_t *dst, const uint8_t *a,
+                                                     const uint8_t *b, uint32_t size)
+{
+    uint32_t i = 0;
+
+    for (; i + 32 <= size; i += 32)
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_sub_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                            _mm256_loadu_si256((const __m256i *)(b + i))));
+    sub_scalar(dst + i, a + i, b + i, size - i);
+}
+
+__attribute__((target("avx2"))) static void add_avx2(uint8_t *dst, const uint8_t *src,
+                                                     uint32_t size)
+{
+    uint32_t i = 0;
+
+    for (; i + 32 <= size; i += 32)
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_add_epi8(_mm256_loadu_si256((const __m256i *)(dst + i)),
+                                            _mm256_loadu_si256((const __m256i *)(src + i))));
+    add_scalar(dst + i, src + i, size - i);
+}
+#endif
+
+static inline uint32_t run_length(enum convert_impl impl, const uint32_t *px, uint32_t n,
+                                  uint32_t value)
+{
+#ifdef CODEC_X86
+    if (impl == CONVERT_IMPL_AVX2)
+        return run_avx2(px, n, value);
+#endif
+    return run_scalar(px, n, value);
+}
+
+static inline void rows_sub(enum convert_impl impl, uint8_t *dst, const uint8_t *a,
+                            const uint8_t *b, uint32_t size)
+{
+#ifdef CODEC_X86
+    if (impl == CONVERT_IMPL_AVX2)
+    {
+        sub_avx2(dst, a, b, size);
+        return;
+    }
+#endif
+    sub_scalar(dst, a, b, size);
+}
+
+static inline void rows_add(enum convert_impl impl, uint8_t *dst, const uint8_t *src,
+                            uint32_t size)
+{
+#ifdef CODEC_X86
+    if (impl == CONVERT_IMPL_AVX2)
+    {
+        add_avx2(dst, src, size);
+        return;
+    }
+#endif
+    add_scalar(dst, src, size);
+}
+
+// Returns the bytes written, at most 5 per pixel. Runs are measured with
+// the SIMD scan, which makes long unchanged stretches nearly free.
+static size_t ops_encode(enum convert_impl impl, uint8_t *out, const uint32_t *px, uint32_t n)
+{
+    uint32_t index[64] = {0}, prev = 0;
+    uint8_t *p = out;
+
+    for (uint32_t i = 0; i < n;)
+    {
+        uint32_t v = px[i], h;
+
+        if (v == prev)
+        {
+            uint32_t run = run_length(impl, px + i, n - i, prev);
+
+            i += run;
+            for (; run > MAX_RUN; run -= MAX_RUN)
+                *p++ = OP_RUN | (MAX_RUN - 1);
+            *p++ = OP_RUN | (run - 1);
+            continue;
+        }
+
+        h = pixel_hash(v);
+        if (index[h] == v)
+        {
+            *p++ = OP_INDEX | h;
+        }
+        else if ((v ^ prev) >> 24 == 0)
+        {
+            int d0 = byte_diff(v, prev, 0), d1 = byte_diff(v, prev, 8);
+            int d2 = byte_diff(v, prev, 16);
+            int d01 = d0 - d1, d21 = d2 - d1;
+
+            index[h] = v;
+            if (d0 >= -2 && d0 <= 1 && d1 >= -2 && d1 <= 1 && d2 >= -2 && d2 <= 1)
+            {
+                *p++ = OP_DIFF | (d0 + 2) << 4 | (d1 + 2) << 2 | (d2 + 2);
+            }
+            else if (d1 >= -32 && d1 <= 31 && d01 >= -8 && d01 <= 7 && d21 >= -8 && d21 <= 7)
+            {
+                *p++ = OP_LUMA | (d1 + 32);
+                *p++ = (d01 + 8) << 4 | (d21 + 8);
+            }
+            else
+            {
+                *p++ = OP_RGB;
+                memcpy(p, &v, 3);
+                p += 3;
+            }
+        }
+        else
+        {
+            index[h] = v;
+            *p++ = OP_RGBA;
+            memcpy(p, &v, 4);
+            p += 4;
+        }
+        prev = v;
+        i++;
+    }
+    return p - out;
+}
+
+// False unless `size` bytes decode to exactly `n` pixels.
+static bool ops_decode(uint32_t *px, uint32_t n, const uint8_t *p, size_t size)
+{
+    const uint8_t *end = p + size;
+    uint32_t index[64] = {0}, prev = 0, i = 0;
+
+    while (i < n && p < end)
+    {
+        uint8_t op = *p++;
+
+        if (op == OP_RGB)
+        {
+            uint32_t v = 0;
+
+            if (end - p < 3)
+                return false;
+            memcpy(&v, p, 3);
+            p += 3;
+            prev = (prev & 0xff000000) | v;
+            index[pixel_hash(prev)] = prev;
+        }
+        else if (op == OP_RGBA)
+        {
+            if (end - p < 4)
+                return false;
+            memcpy(&prev, p, 4);
+            p += 4;
+            index[pixel_hash(prev)] = prev;
+        }
+        else if ((op & OP_MASK) == OP_INDEX)
+        {
+            prev = index[op];
+        }
+        else if ((op & OP_MASK) == OP_DIFF)
+        {
+            prev = pixel_add(prev, (op >> 4 & 3) - 2, (op >> 2 & 3) - 2, (op & 3) - 2);
+            index[pixel_hash(prev)] = prev;
+        }
+        else if ((op & OP_MASK) == OP_LUMA)
+        {
+            int d1 = (op & 0x3f) - 32;
+
+            if (p == end)
+                return false;
+            prev = pixel_add(prev, d1 + (*p >> 4) - 8, d1, d1 + (*p & 0xf) - 8);
+            index[pixel_hash(prev)] = prev;
+            p++;
+        }
+        else
+        {
+            uint32_t run = (op & 0x3f) + 1;
+
+            if (run > n - i)
+                return false;
+            while (run--)
+                px[i++] = prev;
+            continue;
+        }
+        px[i++] = prev;
+    }
+    return i == n && p == end;
+}
+
+static inline void tile_rect(uint32_t tiles_x, uint32_t width, uint32_t height, uint32_t tile,
+                             struct frame_rect *rect)
+{
+    rect->x = tile % tiles_x * CODEC_TILE;
+    rect->y = tile / tiles_x * CODEC_TILE;
+    rect->width = width - rect->x < CODEC_TILE ? width - rect->x : CODEC_TILE;
+    rect->height = height - rect->y < CODEC_TILE ? height - rect->y : CODEC_TILE;
+}
+
+static uint8_t *encoder_slot(struct codec_encoder *enc, uint32_t index)
+{
+    return enc->buffer + sizeof(struct codec_packet_header) +
+           (size_t)enc->tiles_x * enc->tiles_y * sizeof(struct codec_tile) +
+           (size_t)index * TILE_SLOT;
+}
+
+// Gather the tile's pixels, or the differences of its changed rows, then
+// bring the reference up to date. A tile left out of the packet has size 0.
+static void encode_tile(void *data, uint32_t index, struct work_arena *arena)
+{
+    struct codec_encoder *enc = data;
+    const struct frame_plane *plane = &enc->frame->planes[0];
+    const uint32_t ref_stride = enc->width * 4;
+    struct frame_rect r;
+    uint8_t *out = encoder_slot(enc, index), *px;
+    uint32_t row_bytes, n_rows = 0;
+    uint64_t mask = 0;
+    size_t header = enc->key ? 0 : sizeof(mask);
+
+    tile_rect(enc->tiles_x, enc->width, enc->height, enc->candidates[index], &r);
+    row_bytes = r.width * 4;
+    if (!(px = work_arena_alloc(arena, (size_t)row_bytes * r.height)))
+    {
+        atomic_store(&enc->failed, true);
+        enc->sizes[index] = 0;
+        return;
+    }
+
+    for (uint32_t y = 0; y < r.height; y++)
+    {
+        const uint8_t *src = plane->data + (size_t)(r.y + y) * plane->stride + r.x * 4;
+        uint8_t *ref = enc->reference + (size_t)(r.y + y) * ref_stride + r.x * 4;
+
+        if (enc->key)
+            memcpy(px + (size_t)n_rows * row_bytes, src, row_bytes);
+        else if (memcmp(src, ref, row_bytes) != 0)
+            rows_sub(enc->impl, px + (size_t)n_rows * row_bytes, src, ref, row_bytes);
+        else
+            continue;
+        memcpy(ref, src, row_bytes);
+        mask |= UINT64_C(1) << y;
+        n_rows++;
+    }
+    if (n_rows == 0)
+    {
+        enc->sizes[index] = 0;
+        return;
+    }
+    if (!enc->key)
+        memcpy(out, &mask, sizeof(mask));
+    enc->sizes[index] =
+        header + ops_encode(enc->impl, out + header, (const uint32_t *)px, n_rows * r.width);
+}
+
+int codec_encoder_init(struct codec_encoder *enc, uint32_t n_threads, enum convert_impl impl)
+{
+    memset(enc, 0, sizeof(*enc));
+    if (impl == CONVERT_IMPL_AUTO)
+        impl = convert_best_impl();
+    enc->impl = impl;
+    if (!(enc->pool = work_pool_new(n_threads < 1 ? 1 : n_threads)))
+        return -ENOMEM;
+    return 0;
+}
+
+static void encoder_free(struct codec_encoder *enc)
+{
+    free(enc->reference);
+    free(enc->buffer);
+    free(enc->dirty);
+    free(enc->candidates);
+    free(enc->sizes);
+    enc->reference = NULL;
+    enc->buffer = NULL;
+    enc->dirty = NULL;
+    enc->candidates = NULL;
+    enc->sizes = NULL;
+    enc->valid = false;
+}
+
+void codec_encoder_clear(struct codec_encoder *enc)
+{
+    work_pool_destroy(enc->pool);
+    enc->pool = NULL;
+    encoder_free(enc);
+}
+
+static int encoder_configure(struct codec_encoder *enc, const struct frame *frame)
+{
+    uint32_t tiles_x = (frame->width + CODEC_TILE - 1) / CODEC_TILE;
+    uint32_t tiles_y = (frame->height + CODEC_TILE - 1) / CODEC_TILE;
+    size_t n_tiles = (size_t)tiles_x * tiles_y;
+
+    encoder_free(enc);
+    enc->format = frame->format;
+    enc->width = frame->width;
+    enc->height = frame->height;
+    enc->tiles_x = tiles_x;
+    enc->tiles_y = tiles_y;
+    enc->reference = malloc((size_t)frame->width * frame->height * 4);
+    enc->buffer = malloc(sizeof(struct codec_packet_header) +
+                         n_tiles * (sizeof(struct codec_tile) + TILE_SLOT));
+    enc->dirty = calloc(n_tiles, sizeof(*enc->dirty));
+    enc->candidates = calloc(n_tiles, sizeof(*enc->candidates));
+    enc->sizes = calloc(n_tiles, sizeof(*enc->sizes));
+    if (!enc->reference || !enc->buffer || !enc->dirty || !enc->candidates || !enc->sizes)
+    {
+        encoder_free(enc);
+        enc->width = enc->height = 0;
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+// Tiles to compare, in increasing order.
+static void encoder_candidates(struct codec_encoder *enc, const struct frame *frame, bool all)
+{
+    uint32_t n_tiles = enc->tiles_x * enc->tiles_y;
+
+    enc->n_candidates = 0;
+    if (all)
+    {
+        for (uint32_t i = 0; i < n_tiles; i++)
+            enc->candidates[enc->n_candidates++] = i;
+        return;
+    }
+    memset(enc->dirty, 0, n_tiles);
+    for (uint32_t i = 0; i < frame->n_damage; i++)
+    {
+        const struct frame_rect *d = &frame->damage[i];
+        uint32_t x1 = d->x + d->width < enc->width ? d->x + d->width : enc->width;
+        uint32_t y1 = d->y + d->height < enc->height ? d->y + d->height : enc->height;
+
+        if (d->x >= x1 || d->y >= y1)
+            continue;
+        for (uint32_t ty = d->y / CODEC_TILE; ty <= (y1 - 1) / CODEC_TILE; ty++)
+            memset(enc->dirty + ty * enc->tiles_x + d->x / CODEC_TILE, 1,
+                   (x1 - 1) / CODEC_TILE - d->x / CODEC_TILE + 1);
+    }
+    for (uint32_t i = 0; i < n_tiles; i++)
+    {
+        if (enc->dirty[i])
+            enc->candidates[enc->n_candidates++] = i;
+    }
+}
+
+int codec_encode(struct codec_encoder *enc, const struct frame *frame, bool key, bool full,
+                 const uint8_t **packet, size_t *size)
+{
+    struct codec_packet_header header;
+    struct codec_tile *tiles;
+    uint32_t n_tiles = 0;
+    uint8_t *out;
+    int res;
+
+    if (convert_format_bpp(frame->format) != 4 || frame->n_planes < 1 || frame->width == 0 ||
+        frame->height == 0 || frame->width > CODEC_MAX_SIZE || frame->height > CODEC_MAX_SIZE)
+        return -ENOTSUP;
+    if (frame->format != enc->format || frame->width != enc->width ||
+        frame->height != enc->height || !enc->buffer)
+    {
+        if ((res = encoder_configure(enc, frame)) < 0)
+            return res;
+    }
+    if (!enc->valid)
+        key = true;
+
+    encoder_candidates(enc, frame, key || full);
+    enc->frame = frame;
+    enc->key = key;
+    atomic_store(&enc->failed, false);
+    work_pool_run(enc->pool, enc->n_candidates, encode_tile, enc);
+    enc->frame = NULL;
+    // Some tiles of the reference may be ahead of the decoder now.
+    if (atomic_load(&enc->failed))
+    {
+        enc->valid = false;
+        return -ENOMEM;
+    }
+    enc->valid = true;
+
+    for (uint32_t i = 0; i < enc->n_candidates; i++)
+        n_tiles += enc->sizes[i] != 0;
+    header = (struct codec_packet_header){
+        .magic = CODEC_MAGIC,
+        .format = frame->format,
+        .width = frame->width,
+        .height = frame->height,
+        .flags = key ? CODEC_PACKET_KEY : 0,
+        .n_tiles = n_tiles,
+    };
+    memcpy(enc->buffer, &header, sizeof(header));
+
+    // Payloads move towards the start only, the directory ends before the
+    // first slot.
+    tiles = (struct codec_tile *)(enc->buffer + sizeof(header));
+    out = (uint8_t *)(tiles + n_tiles);
+    n_tiles = 0;
+    for (uint32_t i = 0; i < enc->n_candidates; i++)
+    {
+        if (!enc->sizes[i])
+            continue;
+        tiles[n_tiles++] = (struct codec_tile){enc->candidates[i], enc->sizes[i]};
+        memmove(out, encoder_slot(enc, i), enc->sizes[i]);
+        out += enc->sizes[i];
+    }
+
+    *packet = enc->buffer;
+    *size = out - enc->buffer;
+    enc->frames++;
+    enc->keyframes += key;
+    enc->raw_bytes += (uint64_t)frame->width * frame->height * 4;
+    enc->coded_bytes += *size;
+    return 0;
+}
+
+static void decode_tile(void *data, uint32_t index, struct work_arena *arena)
+{
+    struct codec_decoder *dec = data;
+    const struct codec_tile *t = &dec->tiles[index];
+    const uint8_t *p = dec->packet + dec->offsets[index];
+    size_t size = t->size;
+    struct frame_rect r;
+    uint64_t mask;
+    uint32_t row_bytes, n_rows;
+    uint8_t *px;
+
+    tile_rect(dec->tiles_x, dec->width, dec->height, t->index, &r);
+    row_bytes = r.width * 4;
+    mask = r.height < 64 ? (UINT64_C(1) << r.height) - 1 : ~UINT64_C(0);
+    if (!dec->key)
+    {
+        uint64_t coded;
+
+        if (size < sizeof(coded))
+            goto fail;
+        memcpy(&coded, p, sizeof(coded));
+        if (coded & ~mask)
+            goto fail;
+        mask = coded;
+        p += sizeof(coded);
+        size -= sizeof(coded);
+    }
+    n_rows = __builtin_popcountll(mask);
+    if (!(px = work_arena_alloc(arena, (size_t)n_rows * row_bytes)) ||
+        !ops_decode((uint32_t *)px, n_rows * r.width, p, size))
+        goto fail;
+
+    for (uint32_t y = 0; y < r.height; y++)
+    {
+        uint8_t *dst = dec->pixels + (size_t)(r.y + y) * dec->stride + r.x * 4;
+
+        if (!(mask & UINT64_C(1) << y))
+            continue;
+        if (dec->key)
+            memcpy(dst, px, row_bytes);
+        else
+            rows_add(dec->impl, dst, px, row_bytes);
+        px += row_bytes;
+    }
+    return;
+
+fail:
+    atomic_store(&dec->failed, true);
+}
+
+int codec_decoder_init(struct codec_decoder *dec, uint32_t n_threads, enum convert_impl impl)
+{
+    memset(dec, 0, sizeof(*dec));
+    if (impl == CONVERT_IMPL_AUTO)
+        impl = convert_best_impl();
+    dec->impl = impl;
+    if (!(dec->pool = work_pool_new(n_threads < 1 ? 1 : n_threads)))
+        return -ENOMEM;
+    return 0;
+}
+
+static void decoder_free(struct codec_decoder *dec)
+{
+    free(dec->pixels);
+    free(dec->tiles);
+    free(dec->offsets);
+    dec->pixels = NULL;
+    dec->tiles = NULL;
+    dec->offsets = NULL;
+    dec->width = dec->height = 0;
+    dec->valid = false;
+}
+
+void codec_decoder_clear(struct codec_decoder *dec)
+{
+    work_pool_destroy(dec->pool);
+    dec->pool = NULL;
+    decoder_free(dec);
+}
+
+static int decoder_configure(struct codec_decoder *dec, const struct codec_packet_header *h)
+{
+    size_t n_tiles = (size_t)((h->width + CODEC_TILE - 1) / CODEC_TILE) *
+                     ((h->height + CODEC_TILE - 1) / CODEC_TILE);
+
+    decoder_free(dec);
+    dec->pixels = malloc((size_t)h->width * h->height * 4);
+    dec->tiles = calloc(n_tiles, sizeof(*dec->tiles));
+    dec->offsets = calloc(n_tiles, sizeof(*dec->offsets));
+    if (!dec->pixels || !dec->tiles || !dec->offsets)
+    {
+        decoder_free(dec);
+        return -ENOMEM;
+    }
+    dec->format = h->format;
+    dec->width = h->width;
+    dec->height = h->height;
+    dec->stride = h->width * 4;
+    dec->tiles_x = (h->width + CODEC_TILE - 1) / CODEC_TILE;
+    return 0;
+}
+
+int codec_decode(struct codec_decoder *dec, const uint8_t *packet, size_t size)
+{
+    struct codec_packet_header h;
+    uint32_t n_tiles;
+    size_t offset;
+    int res;
+
+    if (size < sizeof(h))
+        goto bad;
+    memcpy(&h, packet, sizeof(h));
+    if (h.magic != CODEC_MAGIC || convert_format_bpp(h.format) != 4 || h.width == 0 ||
+        h.height == 0 || h.width > CODEC_MAX_SIZE || h.height > CODEC_MAX_SIZE)
+        goto bad;
+    dec->key = h.flags & CODEC_PACKET_KEY;
+    if (!dec->key && (!dec->valid || h.format != dec->format || h.width != dec->width ||
+                      h.height != dec->height))
+        return -EPROTO;
+    if (h.width != dec->width || h.height != dec->height)
+    {
+        if ((res = decoder_configure(dec, &h)) < 0)
+            return res;
+    }
+    dec->format = h.format;
+
+    // Key packets code every tile, other packets each tile at most once.
+    n_tiles = dec->tiles_x * ((h.height + CODEC_TILE - 1) / CODEC_TILE);
+    if (h.n_tiles > n_tiles || (dec->key && h.n_tiles != n_tiles) ||
+        (size - sizeof(h)) / sizeof(struct codec_tile) < h.n_tiles)
+        goto bad;
+    memcpy(dec->tiles, packet + sizeof(h), h.n_tiles * sizeof(struct codec_tile));
+    offset = sizeof(h) + h.n_tiles * sizeof(struct codec_tile);
+    for (uint32_t i = 0; i < h.n_tiles; i++)
+    {
+        const struct codec_tile *t = &dec->tiles[i];
+
+        if (t->index >= n_tiles || (i > 0 && t->index <= t[-1].index) || size - offset < t->size)
+            goto bad;
+        dec->offsets[i] = offset;
+        offset += t->size;
+    }
+    if (offset != size)
+        goto bad;
+
+    dec->packet = packet;
+    atomic_store(&dec->failed, false);
+    work_pool_run(dec->pool, h.n_tiles, decode_tile, dec);
+    dec->packet = NULL;
+    if (atomic_load(&dec->failed))
+        goto bad;
+    dec->valid = true;
+    dec->frames++;
+    dec->keyframes += dec->key;
+    return 0;
+
+bad:
+    dec->valid = false;
+    return -EBADMSG;
+}
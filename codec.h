@@ -0,0 +1,130 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+#include "frame.h"
+#include "pool.h"
+
+// Row masks of a tile are 64 bits, tiles can't be taller.
+#define CODEC_TILE 64
+// Largest frame side accepted by the decoder.
+#define CODEC_MAX_SIZE 16384
+
+#define CODEC_MAGIC 0x44434353 // "SCCD"
+// Every tile is coded, without reference to an earlier packet.
+#define CODEC_PACKET_KEY (1u << 0)
+
+// A packet starts with this header, then `n_tiles` directory entries in
+// increasing tile order, then the tile payloads in the same order, back to
+// back. Tiles not in the directory are unchanged since the previous packet.
+struct codec_packet_header
+{
+    uint32_t magic;
+    uint32_t format; // enum spa_video_format, 4 bytes per pixel
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint32_t n_tiles;
+};
+
+struct codec_tile
+{
+    uint32_t index; // tile row * tiles per row + tile column
+    uint32_t size;  // of the payload
+};
+
+// Lossless coding for screen content, where most of a frame is the same as
+// in the previous one and the rest is flat areas and text. Frames are cut
+// into CODEC_TILE square tiles; a key packet codes all of them, other
+// packets only tiles with rows that differ from the previous frame. Those
+// start with a little endian 64-bit mask of the rows coded and hold the
+// rows minus the previous frame's, byte by byte, so unchanged pixels within
+// them are zero. Either way the pixels then go through QOI style ops: runs,
+// a 64 entry cache of recent values, small differences to the last value,
+// or the value itself. Tiles are coded and decoded independently, on the
+// pool's threads.
+struct codec_encoder
+{
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    enum convert_impl impl;
+
+    // The last frame encoded, as the decoder will have it.
+    uint8_t *reference;
+    bool valid;
+
+    // Header, room for every directory entry, then a worst case payload
+    // slot per candidate tile, compacted after each frame.
+    uint8_t *buffer;
+    uint8_t *dirty; // tiles the damage touches
+    uint32_t *candidates;
+    uint32_t *sizes;
+    uint32_t n_candidates;
+
+    // Tiles are the pool's items.
+    const struct frame *frame;
+    bool key;
+    atomic_bool failed;
+    struct work_pool *pool;
+
+    uint64_t frames;
+    uint64_t keyframes;
+    uint64_t raw_bytes;
+    uint64_t coded_bytes;
+};
+
+// `n_threads` counts the calling thread, 1 runs everything inline.
+int codec_encoder_init(struct codec_encoder *enc, uint32_t n_threads, enum convert_impl impl);
+void codec_encoder_clear(struct codec_encoder *enc);
+
+// Encode `frame` against the previous frame encoded. Only tiles its damage
+// touches are compared; `full` compares every tile, for a frame whose damage
+// doesn't cover everything changed since the last one encoded, like after a
+// skip. A `key` packet can be decoded on its own, which every first packet
+// and the first after a format or size change are anyway. The packet stays
+// valid until the next call. Returns -ENOTSUP for a format that isn't
+// 4 bytes per pixel.
+int codec_encode(struct codec_encoder *enc, const struct frame *frame, bool key, bool full,
+                 const uint8_t **packet, size_t *size);
+
+// Reconstructs frames from packets, into `pixels` with `stride` bytes per
+// row. Nothing can be decoded before a key packet.
+struct codec_decoder
+{
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t tiles_x;
+    enum convert_impl impl;
+    uint8_t *pixels;
+    bool valid;
+
+    const uint8_t *packet;
+    struct codec_tile *tiles; // directory of the packet
+    size_t *offsets;          // of each payload in the packet
+    bool key;
+    atomic_bool failed;
+    struct work_pool *pool;
+
+    uint64_t frames;
+    uint64_t keyframes;
+};
+
+int codec_decoder_init(struct codec_decoder *dec, uint32_t n_threads, enum convert_impl impl);
+void codec_decoder_clear(struct codec_decoder *dec);
+
+// Apply a packet to `pixels`. Returns -EPROTO for a packet that needs a
+// frame the decoder doesn't have, -EBADMSG for a malformed one, after which
+// the decoder waits for the next key packet.
+int codec_decode(struct codec_decoder *dec, const uint8_t *packet, size_t size);
+
+#endif
@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <string.h>
+
+#include <spa/param/video/raw.h>
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVERT_X86 1
+#endif
+
+enum
+{
+    C_R,
+    C_G,
+    C_B,
+    C_A,
+    C_X,
+};
+
+// Memory byte order of the packed formats, SPA names them in byte order.
+static const struct
+{
+    uint32_t format;
+    uint32_t bpp;
+    uint8_t channels[4];
+} convert_formats[] = {
+    {SPA_VIDEO_FORMAT_RGBx, 4, {C_R, C_G, C_B, C_X}},
+    {SPA_VIDEO_FORMAT_BGRx, 4, {C_B, C_G, C_R, C_X}},
+    {SPA_VIDEO_FORMAT_xRGB, 4, {C_X, C_R, C_G, C_B}},
+    {SPA_VIDEO_FORMAT_xBGR, 4, {C_X, C_B, C_G, C_R}},
+    {SPA_VIDEO_FORMAT_RGBA, 4, {C_R, C_G, C_B, C_A}},
+    {SPA_VIDEO_FORMAT_BGRA, 4, {C_B, C_G, C_R, C_A}},
+    {SPA_VIDEO_FORMAT_ARGB, 4, {C_A, C_R, C_G, C_B}},
+    {SPA_VIDEO_FORMAT_ABGR, 4, {C_A, C_B, C_G, C_R}},
+    {SPA_VIDEO_FORMAT_RGB, 3, {C_R, C_G, C_B}},
+    {SPA_VIDEO_FORMAT_BGR, 3, {C_B, C_G, C_R}},
+};
+
+static int find_format(uint32_t format)
+{
+    for (uint32_t i = 0; i < sizeof(convert_formats) / sizeof(convert_formats[0]); i++)
+    {
+        if (convert_formats[i].format == format)
+            return i;
+    }
+    return -1;
+}
+
+uint32_t convert_format_bpp(uint32_t format)
+{
+    int i = find_format(format);
+    return i < 0 ? 0 : convert_formats[i].bpp;
+}
+
+int convert_format_alpha(uint32_t format)
+{
+    int i = find_format(format);
+
+    if (i < 0 || convert_formats[i].bpp != 4)
+        return -1;
+    for (int j = 0; j < 4; j++)
+    {
+        if (convert_formats[i].channels[j] == C_A || convert_formats[i].channels[j] == C_X)
+            return j;
+    }
+    return -1;
+}
+
+static void convert_row_copy(const struct convert *c, uint8_t *dst,
+                             const uint8_t *src, uint32_t width)
+{
+    memcpy(dst, src, (size_t)width * c->dst_bpp);
+}
+
+// Reference implementation, also used for row tails of the SIMD kernels.
+static void convert_row_scalar(const struct convert *c, uint8_t *dst,
+                               const uint8_t *src, uint32_t width)
+{
+    const uint32_t sb = c->src_bpp, db = c->dst_bpp;
+
+    for (uint32_t x = 0; x < width; x++, src += sb, dst += db)
+    {
+        for (uint32_t j = 0; j < db; j++)
+            dst[j] = c->map[j] < 0 ? 0xff : src[c->map[j]];
+    }
+}
+
+#ifdef CONVERT_X86
+// SSE2 has no byte shuffle, every output byte is moved into place with a
+// 32-bit shift and a mask. Only used for 32-bit to 32-bit conversions.
+__attribute__((target("sse2"))) static void convert_row_sse2(const struct convert *c,
+                                                             uint8_t *dst,
+                                                             const uint8_t *src,
+                                                             uint32_t width)
+{
+    __m128i count[4], mask[4];
+    int left[4];
+    const __m128i alpha = _mm_set1_epi32(c->alpha);
+    uint32_t x = 0;
+
+    for (int j = 0; j < 4; j++)
+    {
+        int shift = c->map[j] < 0 ? 0 : 8 * (c->map[j] - j);
+        left[j] = shift < 0;
+        count[j] = _mm_cvtsi32_si128(shift < 0 ? -shift : shift);
+        mask[j] = _mm_set1_epi32(c->map[j] < 0 ? 0 : 0xffu << (8 * j));
+    }
+
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+        __m128i o = alpha;
+
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i t = left[j] ? _mm_sll_epi32(v, count[j]) : _mm_srl_epi32(v, count[j]);
+            o = _mm_or_si128(o, _mm_and_si128(t, mask[j]));
+        }
+        _mm_storeu_si128((__m128i *)(dst + x * 4), o);
+    }
+    convert_row_scalar(c, dst + x * 4, src + x * 4, width - x);
+}
+
+// Eight pixels per iteration. 24-bit rows are spread to 12 bytes per lane
+// before the in-lane pshufb and packed back afterwards, so the same kernel
+// covers swizzles, 24<->32 packing and 24-bit swaps.
+__attribute__((target("avx2"))) static void convert_row_avx2(const struct convert *c,
+                                                             uint8_t *dst,
+                                                             const uint8_t *src,
+                                                             uint32_t width)
+{
+    const uint32_t sb = c->src_bpp, db = c->dst_bpp;
+    const __m256i shuffle = _mm256_loadu_si256((const __m256i *)c->shuffle);
+    const __m256i alpha = _mm256_set1_epi32(c->alpha);
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    // 24-bit rows load and store 32 bytes for 24 used ones, keep the
+    // access inside the row.
+    const uint32_t step = (sb == 3 || db == 3) ? 11 : 8;
+    uint32_t x = 0;
+
+    for (; x + step <= width; x += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + x * sb));
+        if (sb == 3)
+            v = _mm256_permutevar8x32_epi32(v, spread);
+        v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha);
+        if (db == 3)
+            v = _mm256_permutevar8x32_epi32(v, pack);
+        _mm256_storeu_si256((__m256i *)(dst + x * db), v);
+    }
+    convert_row_scalar(c, dst + x * db, src + x * sb, width - x);
+}
+#endif
+
+enum convert_impl convert_best_impl(void)
+{
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return CONVERT_IMPL_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return CONVERT_IMPL_SSE2;
+#endif
+    return CONVERT_IMPL_SCALAR;
+}
+
+const char *convert_impl_name(enum convert_impl impl)
+{
+    switch (impl)
+    {
+    case CONVERT_IMPL_AUTO:
+        return "auto";
+    case CONVERT_IMPL_SCALAR:
+        return "scalar";
+    case CONVERT_IMPL_SSE2:
+        return "sse2";
+    case CONVERT_IMPL_AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+int convert_init(struct convert *c, uint32_t dst_format, uint32_t src_format,
+                 enum convert_impl impl)
+{
+    int si = find_format(src_format), di = find_format(dst_format);
+    int src_pos[5] = {-1, -1, -1, -1, -1};
+    uint32_t j;
+
+    if (si < 0 || di < 0)
+        return -ENOTSUP;
+
+    if (impl == CONVERT_IMPL_AUTO)
+        impl = convert_best_impl();
+    else if (impl > convert_best_impl())
+        return -ENOTSUP;
+
+    memset(c, 0, sizeof(*c));
+    c->src_format = src_format;
+    c->dst_format = dst_format;
+    c->src_bpp = convert_formats[si].bpp;
+    c->dst_bpp = convert_formats[di].bpp;
+    c->impl = impl;
+
+    for (j = 0; j < c->src_bpp; j++)
+        src_pos[convert_formats[si].channels[j]] = j;
+
+    for (j = 0; j < c->dst_bpp; j++)
+    {
+        int ch = convert_formats[di].channels[j];
+        // Padding takes the source alpha when there is one, so RGBA->RGBx->RGBA
+        // round trips; otherwise alpha is forced opaque.
+        if (ch == C_A || ch == C_X)
+            ch = C_A;
+        c->map[j] = src_pos[ch];
+        if (c->map[j] < 0)
+            c->alpha |= 0xffu << (8 * j);
+    }
+
+    // Expand to a pshufb mask, the same for both 128-bit lanes.
+    memset(c->shuffle, 0x80, sizeof(c->shuffle));
+    for (uint32_t p = 0; p < 4; p++)
+    {
+        for (j = 0; j < c->dst_bpp; j++)
+        {
+            if (c->map[j] < 0)
+                continue;
+            c->shuffle[p * c->dst_bpp + j] = p * c->src_bpp + c->map[j];
+            c->shuffle[16 + p * c->dst_bpp + j] = p * c->src_bpp + c->map[j];
+        }
+    }
+
+    c->row = convert_row_scalar;
+    if (src_format == dst_format)
+        c->row = convert_row_copy;
+#ifdef CONVERT_X86
+    else if (impl == CONVERT_IMPL_AVX2)
+        c->row = convert_row_avx2;
+    else if (impl == CONVERT_IMPL_SSE2 && c->src_bpp == 4 && c->dst_bpp == 4)
+        c->row = convert_row_sse2;
+#endif
+    return 0;
+}
+
+void convert_rows(const struct convert *c,
+                  uint8_t *dst, uint32_t dst_stride,
+                  const uint8_t *src, uint32_t src_stride,
+                  uint32_t width, uint32_t height)
+{
+    for (uint32_t y = 0; y < height; y++)
+        c->row(c, dst + (size_t)y * dst_stride, src + (size_t)y * src_stride, width);
+}
+
+void convert_rects(const struct convert *c,
+                   uint8_t *dst, uint32_t dst_stride,
+                   const uint8_t *src, uint32_t src_stride,
+                   const struct frame_rect *rects, uint32_t n_rects)
+{
+    for (uint32_t i = 0; i < n_rects; i++)
+    {
+        const struct frame_rect *r = &rects[i];
+        convert_rows(c, dst + (size_t)r->y * dst_stride + r->x * c->dst_bpp, dst_stride,
+                     src + (size_t)r->y * src_stride + r->x * c->src_bpp, src_stride,
+                     r->width, r->height);
+    }
+}
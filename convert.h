@@ -0,0 +1,65 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stdint.h>
+
+#include "frame.h"
+
+enum convert_impl
+{
+    CONVERT_IMPL_AUTO,
+    CONVERT_IMPL_SCALAR,
+    CONVERT_IMPL_SSE2,
+    CONVERT_IMPL_AVX2,
+};
+
+struct convert;
+typedef void (*convert_row_func_t)(const struct convert *c, uint8_t *dst,
+                                   const uint8_t *src, uint32_t width);
+
+// Conversion between two packed RGB formats (enum spa_video_format). Every
+// output byte is taken from one input byte or forced to 0xff when the input
+// has no alpha channel, so swizzles, 24<->32 bit packing and alpha forcing
+// are all the same permutation kernel.
+struct convert
+{
+    uint32_t src_format;
+    uint32_t dst_format;
+    uint32_t src_bpp;
+    uint32_t dst_bpp;
+    enum convert_impl impl;
+    convert_row_func_t row;
+
+    int8_t map[4];       // source byte for each output byte, -1 for 0xff
+    uint8_t shuffle[32]; // map expanded to a pshufb mask over 8 pixels
+    uint32_t alpha;      // bytes forced to 0xff, as a little endian pixel
+};
+
+// Bytes per pixel of a packed RGB format, 0 if the format isn't handled.
+uint32_t convert_format_bpp(uint32_t format);
+
+// Byte of a 32-bit pixel holding alpha or padding, -1 for other formats.
+int convert_format_alpha(uint32_t format);
+
+// Best implementation the CPU supports.
+enum convert_impl convert_best_impl(void);
+const char *convert_impl_name(enum convert_impl impl);
+
+// Returns -ENOTSUP if either format isn't a packed RGB format or `impl`
+// isn't available on this CPU.
+int convert_init(struct convert *c, uint32_t dst_format, uint32_t src_format,
+                 enum convert_impl impl);
+
+void convert_rows(const struct convert *c,
+                  uint8_t *dst, uint32_t dst_stride,
+                  const uint8_t *src, uint32_t src_stride,
+                  uint32_t width, uint32_t height);
+
+// Convert only the given regions, for damage driven updates of a persistent
+// destination image of the same size.
+void convert_rects(const struct convert *c,
+                   uint8_t *dst, uint32_t dst_stride,
+                   const uint8_t *src, uint32_t src_stride,
+                   const struct frame_rect *rects, uint32_t n_rects);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "cursor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CURSOR_X86 1
+#endif
+
+typedef void (*cursor_row_func_t)(uint8_t *dst, const uint32_t *src, uint32_t width,
+                                  uint32_t alpha);
+
+static cursor_row_func_t cursor_row_;
+
+// Rounded x / 255 for x in [0, 255 * 255].
+static inline uint32_t div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+struct cursor_image *cursor_image_new(uint32_t id, uint32_t frame_format,
+                                      uint32_t bitmap_format, uint32_t width,
+                                      uint32_t height, uint32_t stride, const uint8_t *pixels)
+{
+    struct cursor_image *image;
+    struct convert convert;
+    int alpha = convert_format_alpha(frame_format);
+
+    if (alpha < 0 || convert_format_bpp(bitmap_format) != 4 || !width || !height ||
+        width > CURSOR_MAX_SIZE || height > CURSOR_MAX_SIZE ||
+        convert_init(&convert, frame_format, bitmap_format, CONVERT_IMPL_AUTO) < 0)
+        return NULL;
+    if (!(image = malloc(sizeof(*image) + (size_t)width * height * 4)))
+        return NULL;
+    atomic_init(&image->refs, 1);
+    image->id = id;
+    image->format = frame_format;
+    image->width = width;
+    image->height = height;
+    image->alpha = alpha;
+
+    // The padding byte of the frame format takes the bitmap's alpha.
+    convert_rows(&convert, (uint8_t *)image->pixels, width * 4, pixels, stride, width, height);
+    for (uint32_t i = 0; i < width * height; i++)
+    {
+        uint8_t *p = (uint8_t *)&image->pixels[i];
+
+        for (int j = 0; j < 4; j++)
+        {
+            if (j != alpha)
+                p[j] = div255(p[j] * p[alpha]);
+        }
+    }
+    return image;
+}
+
+void cursor_image_unref(struct cursor_image *image)
+{
+    if (image && atomic_fetch_sub_explicit(&image->refs, 1, memory_order_acq_rel) == 1)
+        free(image);
+}
+
+struct cursor_image *cursor_cache_get(struct cursor_cache *cache, uint32_t id)
+{
+    for (uint32_t i = 0; i < CURSOR_CACHE_SIZE; i++)
+    {
+        if (cache->images[i] && cache->images[i]->id == id)
+            return cache->images[i];
+    }
+    return NULL;
+}
+
+void cursor_cache_put(struct cursor_cache *cache, struct cursor_image *image)
+{
+    uint32_t slot = cache->next;
+
+    for (uint32_t i = 0; i < CURSOR_CACHE_SIZE; i++)
+    {
+        if (cache->images[i] && cache->images[i]->id == image->id)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == cache->next)
+        cache->next = (cache->next + 1) % CURSOR_CACHE_SIZE;
+    cursor_image_unref(cache->images[slot]);
+    cache->images[slot] = image;
+}
+
+void cursor_cache_clear(struct cursor_cache *cache)
+{
+    for (uint32_t i = 0; i < CURSOR_CACHE_SIZE; i++)
+        cursor_image_unref(cache->images[i]);
+    memset(cache, 0, sizeof(*cache));
+}
+
+bool cursor_rect(const struct frame_cursor *cursor, uint32_t width, uint32_t height,
+                 struct frame_rect *rect)
+{
+    int64_t x0, y0, x1, y1;
+
+    if (!cursor->image)
+        return false;
+    x0 = cursor->x > 0 ? cursor->x : 0;
+    y0 = cursor->y > 0 ? cursor->y : 0;
+    x1 = (int64_t)cursor->x + cursor->image->width;
+    y1 = (int64_t)cursor->y + cursor->image->height;
+    x1 = x1 < width ? x1 : width;
+    y1 = y1 < height ? y1 : height;
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+    *rect = (struct frame_rect){x0, y0, x1 - x0, y1 - y0};
+    return true;
+}
+
+void cursor_damage(const struct frame_cursor *drawn, const struct frame_cursor *cursor,
+                   uint32_t width, uint32_t height, struct frame_rect *rects,
+                   uint32_t *n_rects)
+{
+    struct frame_rect rect;
+
+    if (cursor_equal(drawn, cursor))
+        return;
+    if (cursor_rect(drawn, width, height, &rect))
+        frame_rects_add(rects, n_rects, width, height, rect.x, rect.y, rect.width, rect.height);
+    if (cursor_rect(cursor, width, height, &rect))
+        frame_rects_add(rects, n_rects, width, height, rect.x, rect.y, rect.width, rect.height);
+}
+
+void cursor_track(struct frame_cursor *drawn, const struct frame_cursor *cursor)
+{
+    cursor_image_ref(cursor->image);
+    cursor_image_unref(drawn->image);
+    *drawn = *cursor;
+}
+
+// dst = src + dst * (255 - src alpha) / 255 on every byte, the padding
+// byte included, which ends up opaque over an opaque frame.
+static void cursor_row_scalar(uint8_t *dst, const uint32_t *src, uint32_t width,
+                              uint32_t alpha)
+{
+    for (uint32_t x = 0; x < width; x++, dst += 4)
+    {
+        const uint8_t *s = (const uint8_t *)&src[x];
+        uint32_t inv = 255 - s[alpha];
+
+        if (inv == 255)
+            continue;
+        for (int j = 0; j < 4; j++)
+            dst[j] = s[j] + div255(dst[j] * inv);
+    }
+}
+
+#ifdef CURSOR_X86
+// Four pixels per iteration, widened to 16 bits for the multiply.
+__attribute__((target("sse2"))) static void cursor_row_sse2(uint8_t *dst, const uint32_t *src,
+                                                            uint32_t width, uint32_t alpha)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i ones = _mm_set1_epi8(-1);
+    const __m128i low = _mm_set1_epi32(0xff);
+    uint32_t x = 0;
+
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + x * 4));
+        __m128i a = alpha ? _mm_srli_epi32(s, 24) : _mm_and_si128(s, low);
+        __m128i lo, hi;
+
+        // Fully transparent pixels, most of a cursor's bounding box.
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xffff)
+            continue;
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        a = _mm_xor_si128(_mm_or_si128(a, _mm_slli_epi32(a, 16)), ones);
+
+        lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero));
+        hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero));
+        lo = _mm_add_epi16(lo, round);
+        hi = _mm_add_epi16(hi, round);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        d = _mm_adds_epu8(s, _mm_packus_epi16(lo, hi));
+        _mm_storeu_si128((__m128i *)(dst + x * 4), d);
+    }
+    cursor_row_scalar(dst + x * 4, src + x, width - x, alpha);
+}
+#endif
+
+static cursor_row_func_t cursor_row_func(void)
+{
+    if (!cursor_row_)
+    {
+        cursor_row_ = cursor_row_scalar;
+#ifdef CURSOR_X86
+        if (convert_best_impl() >= CONVERT_IMPL_SSE2)
+            cursor_row_ = cursor_row_sse2;
+#endif
+    }
+    return cursor_row_;
+}
+
+void cursor_blend(const struct frame_cursor *cursor, uint8_t *dst, uint32_t dst_stride,
+                  const struct frame_rect *clip)
+{
+    const struct cursor_image *image = cursor->image;
+    cursor_row_func_t row = cursor_row_func();
+    int64_t x0, y0, x1, y1;
+
+    if (!image)
+        return;
+    x0 = cursor->x > (int64_t)clip->x ? cursor->x : (int64_t)clip->x;
+    y0 = cursor->y > (int64_t)clip->y ? cursor->y : (int64_t)clip->y;
+    x1 = (int64_t)cursor->x + image->width;
+    y1 = (int64_t)cursor->y + image->height;
+    x1 = x1 < (int64_t)clip->x + clip->width ? x1 : (int64_t)clip->x + clip->width;
+    y1 = y1 < (int64_t)clip->y + clip->height ? y1 : (int64_t)clip->y + clip->height;
+
+    for (int64_t y = y0; y < y1 && x0 < x1; y++)
+        row(dst + (size_t)y * dst_stride + (size_t)x0 * 4,
+            image->pixels + (size_t)(y - cursor->y) * image->width + (x0 - cursor->x),
+            x1 - x0, image->alpha);
+}
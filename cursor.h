@@ -0,0 +1,90 @@
+#ifndef CURSOR_H
+#define CURSOR_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+// Largest bitmap asked for in SPA_META_Cursor, bigger ones are dropped.
+#define CURSOR_MAX_SIZE 256
+// Bitmaps kept per stream. Compositors resend a bitmap only when the
+// shape behind an id changes, so a pointer moving between widgets mostly
+// switches between a few cached ids.
+#define CURSOR_CACHE_SIZE 8
+
+// A cursor bitmap, premultiplied and already in the byte order of the
+// frames it is drawn on, alpha in their alpha or padding byte. Immutable
+// once created, frames hold references while consumers may draw it.
+struct cursor_image
+{
+    atomic_uint refs;
+    uint32_t id;
+    uint32_t format; // enum spa_video_format of the frames
+    uint32_t width;
+    uint32_t height;
+    uint32_t alpha; // byte of a pixel holding alpha
+    uint32_t pixels[];
+};
+
+// Convert a SPA_META_Cursor bitmap in `bitmap_format` for frames in
+// `frame_format`. NULL if either isn't a 32-bit packed format.
+struct cursor_image *cursor_image_new(uint32_t id, uint32_t frame_format,
+                                      uint32_t bitmap_format, uint32_t width,
+                                      uint32_t height, uint32_t stride, const uint8_t *pixels);
+
+static inline struct cursor_image *cursor_image_ref(struct cursor_image *image)
+{
+    if (image)
+        atomic_fetch_add_explicit(&image->refs, 1, memory_order_relaxed);
+    return image;
+}
+
+void cursor_image_unref(struct cursor_image *image);
+
+// Bitmaps by cursor id, owned by the thread reading the metadata.
+struct cursor_cache
+{
+    struct cursor_image *images[CURSOR_CACHE_SIZE];
+    uint32_t next; // slot replaced when an unknown id arrives
+};
+
+struct cursor_image *cursor_cache_get(struct cursor_cache *cache, uint32_t id);
+// Takes over the reference on `image`, replacing the bitmap of its id.
+void cursor_cache_put(struct cursor_cache *cache, struct cursor_image *image);
+void cursor_cache_clear(struct cursor_cache *cache);
+
+// Part of a width x height frame the cursor covers, false if none.
+bool cursor_rect(const struct frame_cursor *cursor, uint32_t width, uint32_t height,
+                 struct frame_rect *rect);
+
+static inline bool cursor_equal(const struct frame_cursor *a, const struct frame_cursor *b)
+{
+    return a->image == b->image && (!a->image || (a->x == b->x && a->y == b->y));
+}
+
+// A consumer keeping its own copy of the picture redraws where the cursor
+// was and where it is once it changed: adds both to `rects`, see
+// frame_rects_add.
+void cursor_damage(const struct frame_cursor *drawn, const struct frame_cursor *cursor,
+                   uint32_t width, uint32_t height, struct frame_rect *rects,
+                   uint32_t *n_rects);
+
+// Remember the cursor a consumer drew, with a reference of its own.
+void cursor_track(struct frame_cursor *drawn, const struct frame_cursor *cursor);
+
+// Whether the cursor of `frame` can be drawn on a packed copy of it.
+static inline bool cursor_drawable(const struct frame *frame)
+{
+    return frame->cursor.image && frame->n_planes == 1 &&
+           frame->cursor.image->format == frame->format;
+}
+
+// Draw the cursor over the pixels of `clip` in a copy of the frame at
+// `dst`, which starts at the frame's top left corner. Only the cursor
+// pixels inside `clip` are touched, the rest of the copy is left as is.
+void cursor_blend(const struct frame_cursor *cursor, uint8_t *dst, uint32_t dst_stride,
+                  const struct frame_rect *clip);
+
+#endif
@@ -0,0 +1,160 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FRAME_MAX_PLANES 4
+
+// Upper bound of buffers a stream may negotiate. Returned buffers are tracked
+// in a 64-bit mask, so this can't grow past 64.
+#define MAX_BUFFERS 64
+
+// Damage rectangles kept per frame, more regions are merged into the last one.
+#define FRAME_MAX_DAMAGE 16
+
+struct frame_rect
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+// One plane of a captured frame. `data` points straight into the mapped
+// PipeWire buffer, so consumers read pixels in place.
+struct frame_plane
+{
+    const uint8_t *data;
+    uint32_t stride;
+    uint32_t size;
+};
+
+struct frame_pool;
+struct cursor_image;
+
+// Pointer sent as metadata next to the pixels, which don't contain it.
+// Consumers that show or store the picture composite it, see cursor.h.
+struct frame_cursor
+{
+    struct cursor_image *image; // NULL while hidden, referenced by the frame
+    int32_t x;                  // top left corner of the image in the frame
+    int32_t y;
+};
+
+// Zero-copy view of a buffer dequeued in on_stream_process. The view stays
+// valid while the frame holds references; the last frame_release() hands the
+// buffer back to its pool.
+struct frame
+{
+    uint32_t id; // index into the mapped buffer cache
+    uint64_t seq;
+    uint32_t format; // enum spa_video_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    struct frame_plane planes[FRAME_MAX_PLANES];
+
+    int64_t pts; // SPA_META_Header pts, -1 without header metadata
+
+    // Regions changed since the previous frame. Without damage metadata this
+    // is the whole frame; n_damage == 0 means nothing changed.
+    uint32_t n_damage;
+    struct frame_rect damage[FRAME_MAX_DAMAGE];
+
+    // Where the pointer is. A frame with no damage may still have moved it,
+    // compare with the previous frame's cursor.
+    struct frame_cursor cursor;
+
+    struct frame_pool *pool;
+    atomic_uint refs;
+    uint64_t queued_ns; // monotonic time the frame was published
+};
+
+// Frames are returned by setting their id in `returned`. The owner of the
+// pool drains the mask on its own thread, so releasing never blocks and
+// may happen from any thread.
+struct frame_pool
+{
+    _Atomic uint64_t returned;
+    void (*wake)(void *data);
+    void *wake_data;
+};
+
+static inline void frame_damage_full(struct frame *frame)
+{
+    frame->n_damage = 1;
+    frame->damage[0] = (struct frame_rect){0, 0, frame->width, frame->height};
+}
+
+// Add a rectangle to a damage list of at most FRAME_MAX_DAMAGE entries,
+// clipped to a width x height frame.
+static inline void frame_rects_add(struct frame_rect *rects, uint32_t *n_rects,
+                                   uint32_t frame_width, uint32_t frame_height,
+                                   int32_t x, int32_t y, uint32_t width, uint32_t height)
+{
+    int64_t x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+    int64_t x1 = (int64_t)x + width, y1 = (int64_t)y + height;
+    struct frame_rect *last;
+
+    if (x1 > frame_width)
+        x1 = frame_width;
+    if (y1 > frame_height)
+        y1 = frame_height;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    if (*n_rects < FRAME_MAX_DAMAGE)
+    {
+        rects[(*n_rects)++] = (struct frame_rect){x0, y0, x1 - x0, y1 - y0};
+        return;
+    }
+
+    last = &rects[FRAME_MAX_DAMAGE - 1];
+    if (last->x < x0)
+        x0 = last->x;
+    if (last->y < y0)
+        y0 = last->y;
+    if (last->x + last->width > x1)
+        x1 = last->x + last->width;
+    if (last->y + last->height > y1)
+        y1 = last->y + last->height;
+    *last = (struct frame_rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+// Add a rectangle to the damage list, clipped to the frame.
+static inline void frame_damage_add(struct frame *frame, int32_t x, int32_t y,
+                                    uint32_t width, uint32_t height)
+{
+    frame_rects_add(frame->damage, &frame->n_damage, frame->width, frame->height, x, y,
+                    width, height);
+}
+
+static inline void frame_ref(struct frame *frame)
+{
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+
+static inline void frame_release(struct frame *frame)
+{
+    struct frame_pool *pool = frame->pool;
+    uint64_t prev;
+
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    // Only the first return since the last drain needs to wake the owner.
+    prev = atomic_fetch_or_explicit(&pool->returned, UINT64_C(1) << frame->id,
+                                    memory_order_release);
+    if (prev == 0 && pool->wake)
+        pool->wake(pool->wake_data);
+}
+
+// Take all returned frame ids, for the pool owner only.
+static inline uint64_t frame_pool_drain(struct frame_pool *pool)
+{
+    return atomic_exchange_explicit(&pool->returned, 0, memory_order_acquire);
+}
+
+#endif
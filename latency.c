@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "latency.h"
+
+static struct latency_histogram stages_[LATENCY_MAX_STAGES];
+static atomic_uint n_stages_;
+static pthread_mutex_t stages_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+struct latency_histogram *latency_stage(const char *name)
+{
+    struct latency_histogram *hist = NULL;
+    unsigned i, n;
+
+    pthread_mutex_lock(&stages_lock_);
+    n = atomic_load(&n_stages_);
+    for (i = 0; i < n; i++)
+    {
+        if (strcmp(stages_[i].name, name) == 0)
+            hist = &stages_[i];
+    }
+    if (!hist && n < LATENCY_MAX_STAGES)
+    {
+        hist = &stages_[n];
+        snprintf(hist->name, sizeof(hist->name), "%s", name);
+        // latency_dump reads the count first, the name is set before.
+        atomic_store(&n_stages_, n + 1);
+    }
+    pthread_mutex_unlock(&stages_lock_);
+    if (!hist)
+        printf("Too many latency stages, %s is not recorded\n", name);
+    return hist;
+}
+
+static uint32_t latency_bucket(uint64_t ns)
+{
+    uint32_t shift;
+
+    if (ns < LATENCY_SUB_BUCKETS)
+        return ns;
+    shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Highest value that lands in `bucket`.
+static uint64_t latency_bucket_value(uint32_t bucket)
+{
+    uint32_t block = bucket / LATENCY_SUB_BUCKETS, shift;
+
+    if (block == 0)
+        return bucket;
+    shift = block - 1;
+    return ((uint64_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift) +
+           ((UINT64_C(1) << shift) - 1);
+}
+
+void latency_record(struct latency_histogram *hist, uint64_t ns)
+{
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&hist->buckets[latency_bucket(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&hist->max, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        ;
+}
+
+uint64_t latency_percentile(struct latency_histogram *hist, double percentile)
+{
+    uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+    uint64_t target = (uint64_t)(count * percentile / 100.0 + 0.5), seen = 0;
+    uint32_t i;
+
+    if (target == 0)
+        target = 1;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+        if (seen >= target)
+            return latency_bucket_value(i);
+    }
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+void latency_dump(void)
+{
+    unsigned i, n = atomic_load(&n_stages_);
+
+    printf("Latency (ms)          count      mean       p50       p99      p999       max\n");
+    for (i = 0; i < n; i++)
+    {
+        struct latency_histogram *hist = &stages_[i];
+        uint64_t count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+        uint64_t sum = atomic_load_explicit(&hist->sum, memory_order_relaxed);
+
+        if (!count)
+        {
+            printf("  %-16s %8u\n", hist->name, 0);
+            continue;
+        }
+        printf("  %-16s %8lu %9.3f %9.3f %9.3f %9.3f %9.3f\n", hist->name,
+               (unsigned long)count, sum / 1e6 / count,
+               latency_percentile(hist, 50.0) / 1e6,
+               latency_percentile(hist, 99.0) / 1e6,
+               latency_percentile(hist, 99.9) / 1e6,
+               atomic_load_explicit(&hist->max, memory_order_relaxed) / 1e6);
+    }
+}
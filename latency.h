@@ -0,0 +1,52 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+// Log-linear buckets like HdrHistogram: values below 2^LATENCY_SUB_BITS
+// get a bucket each, every power of two above is split into
+// 2^LATENCY_SUB_BITS buckets, so any value is off by at most 1/32.
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((65 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+#define LATENCY_MAX_STAGES 16
+
+// Fixed size histogram of nanosecond latencies. Recording is a couple of
+// relaxed atomic adds, so any number of threads may record into the same
+// histogram without locks or allocations.
+struct latency_histogram
+{
+    char name[32];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[LATENCY_BUCKETS];
+};
+
+// Histogram of a named stage, created on first use. Stages live until the
+// process exits; look them up once at setup, not per frame.
+struct latency_histogram *latency_stage(const char *name);
+
+void latency_record(struct latency_histogram *hist, uint64_t ns);
+
+// Latency from `start_ns` (CLOCK_MONOTONIC) until now. Timestamps from the
+// future, like a pts on another clock, are not recorded.
+static inline void latency_record_since(struct latency_histogram *hist, int64_t start_ns)
+{
+    uint64_t now = frame_ring_now_ns();
+
+    if (hist && start_ns > 0 && (uint64_t)start_ns <= now)
+        latency_record(hist, now - start_ns);
+}
+
+// Value below which `percentile` (0..100) of the recorded latencies fall.
+uint64_t latency_percentile(struct latency_histogram *hist, double percentile);
+
+// Print p50, p99, p999 and max of every stage.
+void latency_dump(void);
+
+#endif
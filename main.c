@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -11,35 +13,196 @@
 
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 
 static GDBusConnection *connection = NULL;
 static GDBusProxy *screencast_proxy = NULL;
 
-#define WIDTH 1920
-#define HEIGHT 1080
+#include "latency.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "scale.h"
+#include "server.h"
+#include "shmexport.h"
+#include "trace.h"
+#include "wire.h"
+#ifdef HAVE_SDL
+#include "preview.h"
+#endif
 
-#define MAX_BUFFERS 64
+GCancellable *cancellable = NULL;
+GMainLoop *mainloop_ = NULL;
+int exit_status_ = 0;
 
-#include "sdl.h"
+// The portal handshake runs as a chain of asynchronous calls, each stage
+// is entered from the callback of the previous one.
+enum portal_stage
+{
+    PORTAL_STAGE_INIT,
+    PORTAL_STAGE_CONNECT,
+    PORTAL_STAGE_CREATE_SESSION,
+    PORTAL_STAGE_SELECT_SOURCES,
+    PORTAL_STAGE_START,
+    PORTAL_STAGE_OPEN_REMOTE,
+    PORTAL_STAGE_STREAMING,
+    PORTAL_STAGE_FIRST_FRAME,
+    PORTAL_STAGE_FAILED,
+    PORTAL_STAGE_CLOSED,
+    PORTAL_N_STAGES,
+};
 
-uint32_t pw_stream_node_id;
-int pw_fd;
+const char *portal_stage_names_[PORTAL_N_STAGES] = {
+    "init", "connect", "create-session", "select-sources",
+    "start", "open-remote", "streaming", "first-frame", "failed", "closed",
+};
 
-void start_request_response_signal_handler(GDBusConnection *connection,
-                                           const char *sender_name,
-                                           const char *object_path,
-                                           const char *interface_name,
-                                           const char *signal_name,
-                                           GVariant *parameters,
-                                           gpointer user_data);
+// Method calls return as soon as the portal created its request object.
+#define PORTAL_CALL_TIMEOUT_MS 5000
+// The whole handshake, including a source selection dialog.
+#define PORTAL_HANDSHAKE_TIMEOUT_S 60
 
-gchar *session_handle_ = "";
+#define MAX_SESSIONS 16
 
-GCancellable *cancellable = NULL;
+// One screen cast session: the portal handles and signal subscriptions of
+// its handshake and the PipeWire streams it ends up with. Every callback
+// gets its session as user data, so any number can run side by side on
+// the same D-Bus connection and PipeWire context.
+struct portal_session
+{
+    uint32_t index;
+    enum portal_stage stage;
+    // Monotonic time each stage was entered, 0 if it never was.
+    gint64 stage_time[PORTAL_N_STAGES];
+    GCancellable *cancellable;
+    guint timeout_id;
+
+    gchar *session_handle;
+    gchar *restore_token;
+    uint32_t session_request_signal_id;
+    uint32_t sources_request_signal_id;
+    uint32_t start_request_signal_id;
+    uint32_t session_closed_signal_id;
+
+    uint32_t capture_source_type;
+    uint32_t node_ids[WIRE_MAX_STREAMS];
+    uint32_t n_streams;
+    int pw_fd;
+    struct wire_session *wire;
+};
+
+// Picks the formats negotiated for every session, see wire_set_consumer.
+enum wire_consumer consumer_ = WIRE_CONSUMER_SHM;
+
+// Shares the first stream of the first session with local processes.
+struct shm_export *shm_export_ = NULL;
+
+// Streams the first stream of the first session to socket clients.
+struct stream_server *stream_server_ = NULL;
+
+// Records the first stream of the first session to disk.
+struct recorder *recorder_ = NULL;
+
+// Traces every stream of the first session for later replay.
+struct trace_writer *trace_ = NULL;
+
+// Part of every session's first stream that is captured, empty for all.
+struct frame_rect roi_ = {0};
+
+// Scales the first stream of the first session before its consumers see
+// it, NULL to hand them the captured size.
+struct scale_stage *scale_stage_ = NULL;
+
+#ifdef HAVE_SDL
+// Shows the first stream of the first session, NULL when headless.
+struct preview *preview_ = NULL;
+#endif
+
+struct portal_session *sessions_[MAX_SESSIONS];
+uint32_t n_sessions_ = 0;
+uint32_t n_active_sessions_ = 0;
+
+void portal_set_stage(struct portal_session *session, enum portal_stage stage)
+{
+    session->stage = stage;
+    session->stage_time[stage] = g_get_monotonic_time();
+}
+
+void portal_report(struct portal_session *session)
+{
+    gint64 start = session->stage_time[PORTAL_STAGE_INIT];
+    gint64 prev = start;
+
+    printf("Session %u:\n", session->index);
+    for (int i = 0; i < PORTAL_N_STAGES; i++)
+    {
+        if (!session->stage_time[i])
+            continue;
+        printf("  %-16s +%8.1f ms  (%.1f ms)\n", portal_stage_names_[i],
+               (session->stage_time[i] - start) / 1000.0,
+               (session->stage_time[i] - prev) / 1000.0);
+        prev = session->stage_time[i];
+    }
+    if (session->stage_time[PORTAL_STAGE_FIRST_FRAME])
+        printf("Time to first frame: %.1f ms\n",
+               (session->stage_time[PORTAL_STAGE_FIRST_FRAME] - start) / 1000.0);
+}
+
+void cleanup(struct portal_session *session);
+
+// The main loop keeps running while any session is alive.
+void portal_session_finished(struct portal_session *session)
+{
+    cleanup(session);
+    if (--n_active_sessions_ == 0 && mainloop_)
+        g_main_loop_quit(mainloop_);
+}
+
+// Abort the handshake: pending calls are cancelled through the session's
+// cancellable, their callbacks see G_IO_ERROR_CANCELLED and return without
+// side effects.
+void portal_fail(struct portal_session *session, const char *message)
+{
+    if (session->stage == PORTAL_STAGE_FAILED || session->stage == PORTAL_STAGE_CLOSED)
+        return;
+    printf("Portal %s failed: %s\n", portal_stage_names_[session->stage], message);
+    portal_set_stage(session, PORTAL_STAGE_FAILED);
+    portal_report(session);
+    exit_status_ = -1;
+    portal_session_finished(session);
+}
+
+gboolean on_portal_timeout(gpointer user_data)
+{
+    struct portal_session *session = user_data;
+
+    session->timeout_id = 0;
+    portal_fail(session, "timed out");
+    return G_SOURCE_REMOVE;
+}
+
+// Finish an async call; FALSE if it failed or the handshake was aborted.
+gboolean portal_call_finish(struct portal_session *session, GAsyncResult *result,
+                            GVariant **reply, GUnixFDList **fds)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (fds)
+        *reply = g_dbus_proxy_call_with_unix_fd_list_finish(screencast_proxy, fds,
+                                                            result, &error);
+    else
+        *reply = g_dbus_proxy_call_finish(screencast_proxy, result, &error);
+    if (!*reply)
+    {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            portal_fail(session, error->message);
+        return FALSE;
+    }
+    return TRUE;
+}
 
 const char *kDesktopRequestObjectPath = "/org/freedesktop/portal/desktop/request";
-const gchar *prepare_signal_handle(const gchar *token,
-                                   GDBusConnection *connection)
+gchar *prepare_signal_handle(const gchar *token,
+                             GDBusConnection *connection)
 {
     gchar *sender =
         g_strdup(g_dbus_connection_get_unique_name(connection) + 1); // cut ":" from string
@@ -50,12 +213,12 @@ const gchar *prepare_signal_handle(const gchar *token,
             sender[i] = '_'; // replace "." in string
         }
     }
-    const gchar *handle = g_strconcat(kDesktopRequestObjectPath, "/", sender,
-                                      "/", token, /*end of varargs*/ NULL);
+    gchar *handle = g_strconcat(kDesktopRequestObjectPath, "/", sender,
+                                "/", token, /*end of varargs*/ NULL);
+    g_free(sender);
     return handle;
 }
 
-uint32_t sources_request_signal_id_;
 const char *kDesktopBusName = "org.freedesktop.portal.Desktop";
 const char *kRequestInterfaceName = "org.freedesktop.portal.Request";
 uint32_t setup_request_response_signal(const char *object_path,
@@ -69,20 +232,168 @@ uint32_t setup_request_response_signal(const char *object_path,
         callback, user_data, /*user_data_free_func=*/NULL);
 }
 
-void process_pipewire(int, uint32_t);
-void on_portal_done()
+// Signal subscriptions are one shot, drop them as soon as they fired.
+void unsubscribe_signal(uint32_t *id)
+{
+    if (*id)
+        g_dbus_connection_signal_unsubscribe(connection, *id);
+    *id = 0;
+}
+
+// Sessions live until the process exits, the report never outlives them.
+gboolean on_first_frame_idle(gpointer user_data)
+{
+    portal_report(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+// Stream worker thread, hop over to the main loop for the report.
+void on_first_frame(void *data)
+{
+    struct portal_session *session = data;
+
+    session->stage_time[PORTAL_STAGE_FIRST_FRAME] = g_get_monotonic_time();
+    g_idle_add(on_first_frame_idle, session);
+}
+
+// Through the scale stage when there is one.
+static void session_add_consumer(struct portal_session *session, struct frame_ring *ring)
+{
+    if (scale_stage_)
+        scale_stage_add_consumer(scale_stage_, ring);
+    else
+        wire_add_consumer(session->wire, 0, ring);
+}
+
+// Consumers are fed from the first stream of the first session only.
+void session_add_consumers(struct portal_session *session)
+{
+    if (session->index != 0)
+        return;
+    if (shm_export_)
+        session_add_consumer(session, shm_export_ring(shm_export_));
+    if (stream_server_)
+        session_add_consumer(session, stream_server_ring(stream_server_));
+    if (recorder_)
+        session_add_consumer(session, recorder_ring(recorder_));
+#ifdef HAVE_SDL
+    if (preview_)
+        session_add_consumer(session, preview_mailbox(preview_));
+#endif
+    if (scale_stage_)
+        wire_add_consumer(session->wire, 0, scale_stage_ring(scale_stage_));
+}
+
+// Create the wire for a session that is done with the handshake, FALSE if
+// that failed the session.
+gboolean session_wire_new(struct portal_session *session)
+{
+    if (session->timeout_id)
+    {
+        g_source_remove(session->timeout_id);
+        session->timeout_id = 0;
+    }
+    portal_set_stage(session, PORTAL_STAGE_STREAMING);
+    session->wire = wire_session_new();
+    if (!session->wire)
+    {
+        portal_fail(session, "Failed to create the PipeWire session.");
+        return FALSE;
+    }
+    wire_set_consumer(session->wire, consumer_);
+#ifdef HAVE_SDL
+    if (preview_ && session->index == 0)
+    {
+        uint32_t formats[WIRE_MAX_FORMATS];
+
+        wire_set_formats(session->wire, formats,
+                         preview_formats(preview_, formats, WIRE_MAX_FORMATS));
+    }
+#endif
+    wire_set_first_frame_callback(session->wire, on_first_frame, session);
+    wire_set_roi(session->wire, 0, &roi_);
+    return TRUE;
+}
+
+void on_portal_done(struct portal_session *session)
+{
+    if (!session_wire_new(session))
+        return;
+    if (trace_ && session->index == 0)
+        wire_set_trace(session->wire, trace_);
+    if (wire_session_connect(session->wire, session->pw_fd, session->node_ids,
+                             session->n_streams) < 0)
+    {
+        portal_fail(session, "Failed to connect to PipeWire.");
+        return;
+    }
+    session_add_consumers(session);
+}
+
+gboolean on_replay_done_idle(gpointer user_data)
+{
+    struct portal_session *session = user_data;
+    struct wire_stream_stats stats;
+
+    for (uint32_t i = 0; i < wire_stream_count(session->wire); i++)
+    {
+        if (wire_get_stream_stats(session->wire, i, &stats) < 0)
+            continue;
+        printf("Stream %u: %ux%u, %lu frames, %lu published, %lu unchanged, "
+               "%.1f%% of tiles changed last\n", i,
+               stats.width, stats.height, (unsigned long)stats.frames,
+               (unsigned long)stats.published, (unsigned long)stats.unchanged,
+               stats.change_ratio * 100);
+    }
+    portal_set_stage(session, PORTAL_STAGE_CLOSED);
+    portal_session_finished(session);
+    return G_SOURCE_REMOVE;
+}
+
+// Replay thread, the session is torn down from the main loop.
+void on_replay_done(void *data)
+{
+    g_idle_add(on_replay_done_idle, data);
+}
+
+// Stands in for the whole portal handshake, the session is fed from a
+// trace instead of PipeWire.
+void replay_start(struct portal_session *session, const char *path, gboolean realtime)
 {
-    process_pipewire(pw_fd, pw_stream_node_id);
+    if (!session_wire_new(session))
+        return;
+    if (wire_session_replay(session->wire, path, realtime) < 0)
+    {
+        portal_fail(session, "Failed to open the trace.");
+        return;
+    }
+    session_add_consumers(session);
+    if (wire_session_replay_start(session->wire, on_replay_done, session) < 0)
+        portal_fail(session, "Failed to start the replay.");
 }
 
-uint32_t start_request_signal_id;
-gchar *start_handle = "";
+void start_request_response_signal_handler(GDBusConnection *connection,
+                                           const char *sender_name,
+                                           const char *object_path,
+                                           const char *interface_name,
+                                           const char *signal_name,
+                                           GVariant *parameters,
+                                           gpointer user_data);
+
+void on_start_called(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    g_autoptr(GVariant) reply = NULL;
+
+    // The streams arrive with the Response signal.
+    portal_call_finish(user_data, result, &reply, NULL);
+}
 
-void start_request()
+void start_request(struct portal_session *session)
 {
     GVariantBuilder builder;
     gchar *variant_string;
 
+    portal_set_stage(session, PORTAL_STAGE_START);
     g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
     // token for handle
     variant_string =
@@ -90,24 +401,21 @@ void start_request()
     g_variant_builder_add(&builder, "{sv}", "handle_token",
                           g_variant_new_string(variant_string));
     //"/org/freedesktop/portal/desktop/request"
-    start_handle = prepare_signal_handle(variant_string, connection);
-    start_request_signal_id = setup_request_response_signal(
-        start_handle, start_request_response_signal_handler, NULL, connection);
+    g_autofree gchar *start_handle = prepare_signal_handle(variant_string, connection);
+    session->start_request_signal_id = setup_request_response_signal(
+        start_handle, start_request_response_signal_handler, session, connection);
+    g_free(variant_string);
 
     // "Identifier for the application window", this is Wayland, so not "x11:...".
     const char parent_window[] = "";
 
     printf("Starting the portal session.\n");
-    g_autoptr(GError) error = NULL;
-    g_dbus_proxy_call_sync(
+    g_dbus_proxy_call(
         screencast_proxy, "Start",
-        g_variant_new("(osa{sv})", session_handle_, parent_window,
+        g_variant_new("(osa{sv})", session->session_handle, parent_window,
                       &builder),
-        G_DBUS_CALL_FLAGS_NONE, /*timeout=*/-1, cancellable, &error);
-    if (error)
-    {
-        on_portal_done();
-    }
+        G_DBUS_CALL_FLAGS_NONE, PORTAL_CALL_TIMEOUT_MS, session->cancellable,
+        on_start_called, session);
 }
 
 void sources_request_response_signal_handler(GDBusConnection *connection,
@@ -118,54 +426,197 @@ void sources_request_response_signal_handler(GDBusConnection *connection,
                                              GVariant *parameters,
                                              gpointer user_data)
 {
-
+    struct portal_session *session = user_data;
     uint32_t portal_response;
+
+    unsubscribe_signal(&session->sources_request_signal_id);
     g_variant_get(parameters, "(u@a{sv})", &portal_response, NULL);
     if (portal_response)
     {
-        printf("Failed to select sources for the screen cast session.");
-        on_portal_done();
+        portal_fail(session, "Failed to select sources for the screen cast session.");
         return;
     }
-    start_request();
+    start_request(session);
 }
 
-gchar *restore_token = "";
-uint32_t capture_source_type;
+// Source selection sent with SelectSources, also the key of its restore
+// token in the cache.
+uint32_t source_types_ = 1U; // monitor
+gboolean multiple_sources_ = true;
+// Persist until explicitly revoked, the portal hands out a new single use
+// token with every Start.
+uint32_t persist_mode_ = 2U;
 
-void cleanup()
+// Concurrent sessions each restore their own selection.
+gchar *restore_token_key(struct portal_session *session)
 {
+    return g_strdup_printf("types-%u-multiple-%d-session-%u", source_types_,
+                           multiple_sources_, session->index);
 }
 
-void open_pipewire_remote()
+gchar *restore_token_cache_path()
 {
-    GVariantBuilder builder;
-    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    return g_build_filename(g_get_user_cache_dir(), "screencast-consume",
+                            "restore-tokens", NULL);
+}
 
-    printf("Opening the PipeWire remote.\n");
-    GUnixFDList *outlist = NULL;
+gchar *restore_token_load(struct portal_session *session)
+{
+    g_autofree gchar *path = restore_token_cache_path();
+    g_autofree gchar *key = restore_token_key(session);
+    g_autoptr(GKeyFile) cache = g_key_file_new();
+
+    if (!g_key_file_load_from_file(cache, path, G_KEY_FILE_NONE, NULL))
+        return NULL;
+    return g_key_file_get_string(cache, "restore_token", key, NULL);
+}
+
+// g_file_set_contents writes a temporary file and renames it over the cache,
+// a crash never leaves a truncated file behind.
+void restore_token_store(struct portal_session *session, const gchar *token)
+{
+    g_autofree gchar *path = restore_token_cache_path();
+    g_autofree gchar *dir = g_path_get_dirname(path);
+    g_autofree gchar *key = restore_token_key(session);
+    g_autofree gchar *data = NULL;
+    g_autoptr(GKeyFile) cache = g_key_file_new();
     g_autoptr(GError) error = NULL;
-    g_autoptr(GVariant) variant = g_dbus_proxy_call_with_unix_fd_list_sync(
-        screencast_proxy, "OpenPipeWireRemote",
-        g_variant_new("(oa{sv})", session_handle_, &builder),
-        G_DBUS_CALL_FLAGS_NONE, /*timeout=*/-1, /*outlist=*/NULL, &outlist, cancellable,
-        &error);
-    if (error)
+    gsize length;
+
+    g_key_file_load_from_file(cache, path, G_KEY_FILE_KEEP_COMMENTS, NULL);
+    g_key_file_set_string(cache, "restore_token", key, token);
+    data = g_key_file_to_data(cache, &length, NULL);
+
+    if (g_mkdir_with_parents(dir, 0700) < 0 ||
+        !g_file_set_contents(path, data, length, &error))
+        printf("Failed to store the restore token in %s: %s\n", path,
+               error ? error->message : g_strerror(errno));
+}
+
+const char *kSessionInterfaceName = "org.freedesktop.portal.Session";
+
+// Drop everything the session holds. The struct itself stays around, an
+// already queued first frame report may still refer to it.
+void cleanup(struct portal_session *session)
+{
+    if (session->timeout_id)
+    {
+        g_source_remove(session->timeout_id);
+        session->timeout_id = 0;
+    }
+    g_cancellable_cancel(session->cancellable);
+    // Consumer rings must outlive the stream worker that feeds them.
+    if (shm_export_ && session->index == 0)
+        shm_export_stop(shm_export_);
+    if (stream_server_ && session->index == 0)
+        stream_server_stop(stream_server_);
+    if (recorder_ && session->index == 0)
+        recorder_stop(recorder_);
+    if (trace_ && session->index == 0)
+        trace_writer_stop(trace_);
+#ifdef HAVE_SDL
+    if (preview_ && session->index == 0)
+        preview_stop(preview_);
+#endif
+    if (scale_stage_ && session->index == 0)
+        scale_stage_stop(scale_stage_);
+    if (session->wire)
+    {
+        wire_session_destroy(session->wire);
+        session->wire = NULL;
+    }
+    if (shm_export_ && session->index == 0)
+    {
+        shm_export_destroy(shm_export_);
+        shm_export_ = NULL;
+    }
+    if (stream_server_ && session->index == 0)
+    {
+        stream_server_destroy(stream_server_);
+        stream_server_ = NULL;
+    }
+    if (recorder_ && session->index == 0)
+    {
+        recorder_destroy(recorder_);
+        recorder_ = NULL;
+    }
+    if (trace_ && session->index == 0)
     {
-        cleanup();
+        trace_writer_destroy(trace_);
+        trace_ = NULL;
     }
-    error = NULL;
+#ifdef HAVE_SDL
+    if (preview_ && session->index == 0)
+    {
+        preview_destroy(preview_);
+        preview_ = NULL;
+    }
+#endif
+    if (scale_stage_ && session->index == 0)
+    {
+        struct scale_stage_stats stats;
+
+        scale_stage_get_stats(scale_stage_, &stats);
+        printf("Scaled %lu frames, %lu pointer only, %lu dropped, %.2f ms per frame\n",
+               (unsigned long)stats.frames, (unsigned long)stats.cursor,
+               (unsigned long)stats.dropped,
+               stats.frames ? stats.scale_ns / 1e6 / stats.frames : 0.0);
+        scale_stage_destroy(scale_stage_);
+        scale_stage_ = NULL;
+    }
+    if (!connection)
+        return;
+    unsubscribe_signal(&session->session_request_signal_id);
+    unsubscribe_signal(&session->sources_request_signal_id);
+    unsubscribe_signal(&session->start_request_signal_id);
+    if (session->session_closed_signal_id)
+    {
+        // Still open on the portal side, close it there too.
+        unsubscribe_signal(&session->session_closed_signal_id);
+        g_dbus_connection_call(connection, kDesktopBusName, session->session_handle,
+                               kSessionInterfaceName, "Close", NULL, NULL,
+                               G_DBUS_CALL_FLAGS_NONE, PORTAL_CALL_TIMEOUT_MS,
+                               NULL, NULL, NULL);
+    }
+}
+
+void on_open_pipewire_remote_called(GObject *source, GAsyncResult *result,
+                                    gpointer user_data)
+{
+    struct portal_session *session = user_data;
+    g_autoptr(GVariant) variant = NULL;
+    g_autoptr(GUnixFDList) outlist = NULL;
+    g_autoptr(GError) error = NULL;
     int32_t index;
+
+    if (!portal_call_finish(session, result, &variant, &outlist))
+        return;
+
     g_variant_get(variant, "(h)", &index);
-    pw_fd = g_unix_fd_list_get(outlist, index, &error);
+    session->pw_fd = g_unix_fd_list_get(outlist, index, &error);
 
-    if (pw_fd == -1)
+    if (session->pw_fd == -1)
     {
-        cleanup();
+        portal_fail(session, error ? error->message : "no PipeWire fd");
         return;
     }
 
-    on_portal_done();
+    on_portal_done(session);
+}
+
+void open_pipewire_remote(struct portal_session *session)
+{
+    GVariantBuilder builder;
+
+    portal_set_stage(session, PORTAL_STAGE_OPEN_REMOTE);
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+
+    printf("Opening the PipeWire remote.\n");
+    g_dbus_proxy_call_with_unix_fd_list(
+        screencast_proxy, "OpenPipeWireRemote",
+        g_variant_new("(oa{sv})", session->session_handle, &builder),
+        G_DBUS_CALL_FLAGS_NONE, PORTAL_CALL_TIMEOUT_MS, /*fd_list=*/NULL,
+        session->cancellable, on_open_pipewire_remote_called, session);
 }
 
 bool StartScreenCastStream()
@@ -180,16 +631,19 @@ void start_request_response_signal_handler(GDBusConnection *connection,
                                            GVariant *parameters,
                                            gpointer user_data)
 {
+    struct portal_session *session = user_data;
     printf("Start signal received.\n");
     uint32_t portal_response;
-    g_autoptr(GVariant) response_data;
-    g_autoptr(GVariantIter) iter;
-    gchar *restore_token_ = "";
+    g_autoptr(GVariant) response_data = NULL;
+    g_autoptr(GVariantIter) iter = NULL;
+    gchar *restore_token_ = NULL;
+    unsubscribe_signal(&session->start_request_signal_id);
     g_variant_get(parameters, "(u@a{sv})", &portal_response,
                   &response_data);
     if (portal_response || !response_data)
     {
-        on_portal_done();
+        portal_fail(session, "Failed to start the screen cast session.");
+        return;
     }
 
     // Array of PipeWire streams. See
@@ -198,33 +652,41 @@ void start_request_response_signal_handler(GDBusConnection *connection,
     if (g_variant_lookup(response_data, "streams", "a(ua{sv})",
                          &iter))
     {
-        g_autoptr(GVariant) variant;
+        GVariant *variant;
 
-        while (g_variant_iter_next(iter, "@(ua{sv})", &variant))
+        session->n_streams = 0;
+        while (session->n_streams < WIRE_MAX_STREAMS &&
+               g_variant_iter_next(iter, "@(ua{sv})", &variant))
         {
             uint32_t stream_id;
             uint32_t type;
-            g_autoptr(GVariant) options;
+            g_autoptr(GVariant) options = NULL;
 
             g_variant_get(variant, "(u@a{sv})", &stream_id, &options);
             if (g_variant_lookup(options, "source_type", "u", &type))
             {
-                capture_source_type = (uint32_t)(type);
+                session->capture_source_type = (uint32_t)(type);
             }
 
-            pw_stream_node_id = stream_id;
-
-            break;
+            session->node_ids[session->n_streams++] = stream_id;
+            g_variant_unref(variant);
         }
     }
+    if (!session->n_streams)
+    {
+        portal_fail(session, "The portal returned no streams.");
+        return;
+    }
 
     if (g_variant_lookup(response_data, "restore_token", "s",
-                         restore_token_))
+                         &restore_token_))
     {
-        restore_token = restore_token_;
+        g_free(session->restore_token);
+        session->restore_token = restore_token_;
+        restore_token_store(session, session->restore_token);
     }
 
-    open_pipewire_remote();
+    open_pipewire_remote(session);
 }
 
 const char *kDesktopSessionObjectPath = "/org/freedesktop/portal/desktop/session";
@@ -234,10 +696,8 @@ gchar *new_session_path(int token)
 }
 
 const char *portal_prefix = "pythonMss";
-gchar *portal_handle = "";
-int session_request_signal_id = 0;
 
-void sources_request();
+void sources_request(struct portal_session *session);
 void on_session_closed_signal(GDBusConnection *connection,
                               const char *sender_name,
                               const char *object_path,
@@ -245,8 +705,6 @@ void on_session_closed_signal(GDBusConnection *connection,
                               const char *signal_name,
                               GVariant *parameters,
                               gpointer user_data);
-int session_closed_signal_id_ = 0;
-char *kSessionInterfaceName = "org.freedesktop.portal.Session";
 void request_session_response_signale_handler(
     GDBusConnection *connection,
     const char *sender_name,
@@ -256,64 +714,71 @@ void request_session_response_signale_handler(
     GVariant *parameters,
     gpointer user_data)
 {
-
+    struct portal_session *session = user_data;
     uint32_t portal_response;
     g_autoptr(GVariant) response_data = NULL;
+    unsubscribe_signal(&session->session_request_signal_id);
     g_variant_get(parameters, /*format_string=*/"(u@a{sv})", &portal_response,
                   &response_data);
     g_autoptr(GVariant) g_session_handle =
         g_variant_lookup_value(response_data, /*key=*/"session_handle",
                                /*expected_type=*/NULL);
-    session_handle_ = g_variant_dup_string(
-        /*value=*/g_session_handle, /*length=*/NULL);
+    session->session_handle =
+        g_session_handle
+            ? g_variant_dup_string(/*value=*/g_session_handle, /*length=*/NULL)
+            : NULL;
 
-    if (session_handle_ == "" || !session_handle_ || portal_response)
+    if (!session->session_handle || !*session->session_handle || portal_response)
     {
-        printf("Failed to request the session subscription.\n");
-        // OnPortalDone(RequestResponse::kError);
+        portal_fail(session, "Failed to request the session subscription.");
         return;
     }
 
-    session_closed_signal_id_ = g_dbus_connection_signal_subscribe(
+    session->session_closed_signal_id = g_dbus_connection_signal_subscribe(
         connection, kDesktopBusName, kSessionInterfaceName, /*member=*/"Closed",
-        session_handle_, /*arg0=*/NULL, G_DBUS_SIGNAL_FLAGS_NONE,
-        on_session_closed_signal, NULL, /*user_data_free_func=*/NULL);
-    sources_request();
+        session->session_handle, /*arg0=*/NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+        on_session_closed_signal, session, /*user_data_free_func=*/NULL);
+    sources_request(session);
 }
 
-void setup_session_request_handlers()
+void on_create_session_called(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    g_autoptr(GVariant) reply = NULL;
+
+    // The session handle arrives with the Response signal.
+    portal_call_finish(user_data, result, &reply, NULL);
+}
+
+void setup_session_request_handlers(struct portal_session *session)
 {
     GVariantBuilder builder;
     gchar *variant_string;
 
+    portal_set_stage(session, PORTAL_STAGE_CREATE_SESSION);
     g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
     variant_string = g_strdup_printf("%s_session%d", portal_prefix,
                                      g_random_int_range(0, G_MAXINT));
     g_variant_builder_add(&builder, "{sv}", "session_handle_token",
                           g_variant_new_string(variant_string));
+    g_free(variant_string);
 
     variant_string = g_strdup_printf("%s_%d", portal_prefix,
                                      g_random_int_range(0, G_MAXINT));
     g_variant_builder_add(&builder, "{sv}", "handle_token",
                           g_variant_new_string(variant_string));
 
-    portal_handle = prepare_signal_handle(variant_string, connection);
+    g_autofree gchar *portal_handle = prepare_signal_handle(variant_string, connection);
+    g_free(variant_string);
 
-    session_request_signal_id = setup_request_response_signal(
-        portal_handle, request_session_response_signale_handler, NULL,
+    session->session_request_signal_id = setup_request_response_signal(
+        portal_handle, request_session_response_signale_handler, session,
         connection);
 
-    "Desktop session requested.";
-    g_autoptr(GError) error;
-    g_dbus_proxy_call_sync(
+    printf("Desktop session requested.\n");
+    g_dbus_proxy_call(
         screencast_proxy, "CreateSession", g_variant_new("(a{sv})", &builder),
-        G_DBUS_CALL_FLAGS_NONE, /*timeout=*/-1, cancellable,
-        &error);
-    if (error)
-    {
-        cleanup();
-        exit(-1);
-    }
+        G_DBUS_CALL_FLAGS_NONE, PORTAL_CALL_TIMEOUT_MS, session->cancellable,
+        on_create_session_called, session);
 }
 
 void on_session_closed_signal(GDBusConnection *connection,
@@ -324,28 +789,38 @@ void on_session_closed_signal(GDBusConnection *connection,
                               GVariant *parameters,
                               gpointer user_data)
 {
-    // OnScreenCastSessionClosed();
+    struct portal_session *session = user_data;
 
-    // Unsubscribe from the signal and free the session handle to avoid calling
-    // Session::Close from the destructor since it's already closed
-    g_dbus_connection_signal_unsubscribe(connection,
-                                         session_closed_signal_id_);
+    printf("Session %u closed by the portal.\n", session->index);
+    // Unsubscribe from the signal so cleanup doesn't call Session::Close,
+    // it's already closed.
+    unsubscribe_signal(&session->session_closed_signal_id);
+    portal_set_stage(session, PORTAL_STAGE_CLOSED);
+    portal_session_finished(session);
 }
 
-void sources_request()
+void on_select_sources_called(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    g_autoptr(GVariant) reply = NULL;
+
+    // The selection arrives with the Response signal.
+    portal_call_finish(user_data, result, &reply, NULL);
+}
+
+void sources_request(struct portal_session *session)
 {
-    g_autoptr(GError) error = NULL;
     GVariantBuilder builder;
     gchar *token_string;
 
+    portal_set_stage(session, PORTAL_STAGE_SELECT_SOURCES);
     g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
     // We want to record monitor content.
     g_variant_builder_add(
         &builder, "{sv}", "types",
-        g_variant_new_uint32((uint32_t)(1U)));
-    // We don't want to allow selection of multiple sources.
+        g_variant_new_uint32(source_types_));
+    // Every selected monitor gets its own pw_stream.
     g_variant_builder_add(&builder, "{sv}", "multiple",
-                          g_variant_new_boolean(false));
+                          g_variant_new_boolean(multiple_sources_));
 
     g_autoptr(GVariant) cursorModesVariant =
         g_dbus_proxy_get_cached_property(screencast_proxy, "AvailableCursorModes");
@@ -373,73 +848,270 @@ void sources_request()
         // Make request only if xdg-desktop-portal has required API version
         if (version >= 4)
         {
-            uint32_t persist_mode_ = 0U;
             g_variant_builder_add(
                 &builder, "{sv}", "persist_mode",
                 g_variant_new_uint32((uint32_t)(persist_mode_)));
-            /*if (!restore_token_.empty())
+            // A valid token restores the previous selection without a
+            // dialog, a stale one just brings the dialog back.
+            gchar *cached_token = restore_token_load(session);
+            if (cached_token && *cached_token)
             {
+                printf("Restoring the previous source selection.\n");
+                g_free(session->restore_token);
+                session->restore_token = cached_token;
                 g_variant_builder_add(&builder, "{sv}", "restore_token",
-                                      g_variant_new_string(restore_token_.c_str()));
-            }*/
+                                      g_variant_new_string(session->restore_token));
+            }
+            else
+            {
+                g_free(cached_token);
+            }
         }
     }
     token_string = g_strdup_printf("pythonMss%d", g_random_int_range(0, G_MAXINT));
     g_variant_builder_add(&builder, "{sv}", "handle_token",
                           g_variant_new_string(token_string));
     /// request token path
-    const gchar *sources_handle = prepare_signal_handle(token_string, connection);
-    sources_request_signal_id_ = setup_request_response_signal(
+    g_autofree gchar *sources_handle = prepare_signal_handle(token_string, connection);
+    session->sources_request_signal_id = setup_request_response_signal(
         sources_handle, sources_request_response_signal_handler,
-        NULL, connection);
+        session, connection);
+    g_free(token_string);
 
     printf("Requesting sources from the screen cast session.\n");
 
-    error = NULL;
-    g_autoptr(GVariant) result = g_dbus_proxy_call_sync(
+    g_dbus_proxy_call(
         screencast_proxy, "SelectSources",
-        g_variant_new("(oa{sv})", session_handle_, &builder),
-        G_DBUS_CALL_FLAGS_NONE, /*timeout=*/-1, cancellable, &error);
-    if (error)
+        g_variant_new("(oa{sv})", session->session_handle, &builder),
+        G_DBUS_CALL_FLAGS_NONE, PORTAL_CALL_TIMEOUT_MS, session->cancellable,
+        on_select_sources_called, session);
+}
+
+struct portal_session *portal_session_new()
+{
+    struct portal_session *session = g_new0(struct portal_session, 1);
+
+    session->index = n_sessions_;
+    session->pw_fd = -1;
+    session->cancellable = g_cancellable_new();
+    portal_set_stage(session, PORTAL_STAGE_INIT);
+    session->timeout_id = g_timeout_add_seconds(PORTAL_HANDSHAKE_TIMEOUT_S,
+                                                on_portal_timeout, session);
+    sessions_[n_sessions_++] = session;
+    n_active_sessions_++;
+    return session;
+}
+
+void on_proxy_created(GObject *source, GAsyncResult *result, gpointer user_data)
+{
+    g_autoptr(GError) error = NULL;
+
+    screencast_proxy = g_dbus_proxy_new_finish(result, &error);
+    for (uint32_t i = 0; i < n_sessions_; i++)
     {
-        return -1;
+        // Already timed out while the proxy was being created.
+        if (sessions_[i]->stage == PORTAL_STAGE_FAILED)
+            continue;
+        if (!screencast_proxy)
+        {
+            if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                portal_fail(sessions_[i], error->message);
+            continue;
+        }
+        setup_session_request_handlers(sessions_[i]);
     }
 }
 
-int main(int argc, char *argv[])
+void on_bus_got(GObject *source, GAsyncResult *result, gpointer user_data)
 {
     g_autoptr(GError) error = NULL;
+
+    connection = g_bus_get_finish(result, &error);
     if (!connection)
     {
-        connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
-
-        if (error)
+        for (uint32_t i = 0; i < n_sessions_; i++)
         {
-            printf(
-                "Error retrieving D-Bus connection: %s \n",
-                error->message);
-            return -1;
+            if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                portal_fail(sessions_[i], error->message);
         }
+        return;
     }
-    if (!screencast_proxy)
+    g_dbus_proxy_new(connection, G_DBUS_PROXY_FLAGS_NONE,
+                     NULL, "org.freedesktop.portal.Desktop",
+                     "/org/freedesktop/portal/desktop",
+                     "org.freedesktop.portal.ScreenCast", cancellable,
+                     on_proxy_created, NULL);
+}
+
+gboolean on_dump_latency(gpointer user_data)
+{
+    latency_dump();
+    return G_SOURCE_CONTINUE;
+}
+
+// Finish every session still alive like a close from the portal would, so
+// consumers write out what they hold and the portal sessions are closed,
+// then leave the main loop so the latencies are dumped on the way out.
+gboolean on_quit_signal(gpointer user_data)
+{
+    for (uint32_t i = 0; i < n_sessions_; i++)
     {
-        error = NULL;
-        screencast_proxy = g_dbus_proxy_new_sync(
-            connection, G_DBUS_PROXY_FLAGS_NONE,
-            NULL, "org.freedesktop.portal.Desktop",
-            "/org/freedesktop/portal/desktop",
-            "org.freedesktop.portal.ScreenCast", NULL, &error);
+        struct portal_session *session = sessions_[i];
 
-        if (error)
+        if (session->stage == PORTAL_STAGE_FAILED || session->stage == PORTAL_STAGE_CLOSED)
+            continue;
+        portal_set_stage(session, PORTAL_STAGE_CLOSED);
+        portal_session_finished(session);
+    }
+    g_main_loop_quit(mainloop_);
+    return G_SOURCE_REMOVE;
+}
+
+int main(int argc, char *argv[])
+{
+    g_autoptr(GOptionContext) context = g_option_context_new("- screen cast consumer");
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *consumer = NULL;
+    g_autofree gchar *metrics_path = NULL;
+    g_autofree gchar *export_path = NULL;
+    g_autofree gchar *serve_address = NULL;
+    gboolean serve_encoded = FALSE;
+    g_autofree gchar *record_path = NULL;
+    gboolean record_direct = FALSE;
+    g_autofree gchar *trace_path = NULL;
+    g_autofree gchar *replay_path = NULL;
+    gboolean replay_realtime = FALSE;
+    g_autofree gchar *roi = NULL;
+    g_autofree gchar *scale = NULL;
+    int n_sessions = 1;
+#ifdef HAVE_SDL
+    gboolean preview = FALSE;
+#endif
+    GOptionEntry entries[] = {
+#ifdef HAVE_SDL
+        {"preview", 'p', 0, G_OPTION_ARG_NONE, &preview,
+         "Show the first stream in a window", NULL},
+#endif
+        {"sessions", 'n', 0, G_OPTION_ARG_INT, &n_sessions,
+         "Number of concurrent capture sessions", "N"},
+        {"consumer", 'c', 0, G_OPTION_ARG_STRING, &consumer,
+         "What the frames are for: encoder, recorder or shm", "KIND"},
+        {"metrics", 'm', 0, G_OPTION_ARG_FILENAME, &metrics_path,
+         "Serve Prometheus metrics on a Unix socket", "PATH"},
+        {"export", 'e', 0, G_OPTION_ARG_FILENAME, &export_path,
+         "Share frames with local readers through a Unix socket", "PATH"},
+        {"serve", 's', 0, G_OPTION_ARG_STRING, &serve_address,
+         "Stream frames to clients on a Unix socket or loopback tcp:HOST:PORT", "ADDRESS"},
+        {"encode", 0, 0, G_OPTION_ARG_NONE, &serve_encoded,
+         "Send --serve clients losslessly compressed frames", NULL},
+        {"record", 'r', 0, G_OPTION_ARG_FILENAME, &record_path,
+         "Record the first stream, as Y4M if PATH ends in .y4m", "PATH"},
+        {"direct", 0, 0, G_OPTION_ARG_NONE, &record_direct,
+         "Record with O_DIRECT, bypassing the page cache", NULL},
+        {"trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_path,
+         "Trace the first session's frames for --replay", "PATH"},
+        {"replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_path,
+         "Feed the consumers from a trace instead of the portal", "PATH"},
+        {"realtime", 0, 0, G_OPTION_ARG_NONE, &replay_realtime,
+         "Replay at the recorded pace instead of as fast as possible", NULL},
+        {"roi", 0, 0, G_OPTION_ARG_STRING, &roi,
+         "Capture only this part of the first stream", "X,Y,WxH"},
+        {"scale", 0, 0, G_OPTION_ARG_STRING, &scale,
+         "Scale the first stream for its consumers, with box, bilinear or area", "WxH[,FILTER]"},
+        {NULL},
+    };
+
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error))
+    {
+        printf("%s\n", error->message);
+        return -1;
+    }
+    if (g_strcmp0(consumer, "encoder") == 0)
+        consumer_ = WIRE_CONSUMER_ENCODER;
+    else if (g_strcmp0(consumer, "recorder") == 0)
+        consumer_ = WIRE_CONSUMER_RECORDER;
+    else if (consumer && g_strcmp0(consumer, "shm") != 0)
+    {
+        printf("Unknown consumer %s\n", consumer);
+        return -1;
+    }
+    else if (!consumer && record_path)
+        consumer_ = WIRE_CONSUMER_RECORDER;
+
+    if (roi && (sscanf(roi, "%u,%u,%ux%u", &roi_.x, &roi_.y, &roi_.width, &roi_.height) != 4 ||
+                !roi_.width || !roi_.height || roi_.x > UINT16_MAX || roi_.y > UINT16_MAX ||
+                roi_.width > UINT16_MAX || roi_.height > UINT16_MAX))
+    {
+        printf("Invalid region %s, expected X,Y,WxH\n", roi);
+        return -1;
+    }
+
+    if (scale)
+    {
+        uint32_t width = 0, height = 0;
+        char filter[16] = "area";
+        int res = sscanf(scale, "%ux%u,%15s", &width, &height, filter);
+
+        if (res < 2 || !width || !height || width > UINT16_MAX || height > UINT16_MAX ||
+            scale_filter_from_name(filter) < 0)
         {
-            printf("[portals] Error retrieving D-Bus proxy: %s\n",
-                   error->message);
+            printf("Invalid scale %s, expected WxH[,box|bilinear|area]\n", scale);
             return -1;
         }
-        cancellable = g_cancellable_new();
-        setup_session_request_handlers();
-        GMainLoop *mainloop = g_main_loop_new(NULL, TRUE);
-        g_main_loop_run(mainloop);
+        if (!(scale_stage_ = scale_stage_new(width, height, scale_filter_from_name(filter), 0)))
+            return -1;
+    }
+
+    n_sessions = CLAMP(n_sessions, 1, MAX_SESSIONS);
+    if (metrics_path && metrics_serve(metrics_path) < 0)
+    {
+        printf("Failed to serve metrics on %s\n", metrics_path);
+        return -1;
+    }
+    if (export_path && !(shm_export_ = shm_export_new(export_path)))
+        return -1;
+    if (serve_address && !(stream_server_ = stream_server_new(serve_address, serve_encoded)))
+        return -1;
+    if (record_path && !(recorder_ = recorder_new(record_path, record_direct)))
+        return -1;
+    if (replay_path && trace_path)
+    {
+        printf("A replay can't be traced\n");
+        return -1;
     }
-    return 0;
+    if (trace_path && !(trace_ = trace_writer_new(trace_path)))
+        return -1;
+#ifdef HAVE_SDL
+    if (preview && !(preview_ = preview_new("screencast-consume")))
+        return -1;
+#endif
+    cancellable = g_cancellable_new();
+    mainloop_ = g_main_loop_new(NULL, FALSE);
+    if (replay_path)
+    {
+        replay_start(portal_session_new(), replay_path, replay_realtime);
+        // Failed before the main loop could be quit.
+        if (n_active_sessions_ == 0)
+            return exit_status_;
+    }
+    else
+    {
+        for (int i = 0; i < n_sessions; i++)
+            portal_set_stage(portal_session_new(), PORTAL_STAGE_CONNECT);
+
+        // The bus connection and the proxy are shared by all sessions.
+        g_bus_get(G_BUS_TYPE_SESSION, cancellable, on_bus_got, NULL);
+    }
+
+    g_unix_signal_add(SIGUSR1, on_dump_latency, NULL);
+    g_unix_signal_add(SIGINT, on_quit_signal, NULL);
+    g_unix_signal_add(SIGTERM, on_quit_signal, NULL);
+    g_main_loop_run(mainloop_);
+    // Session.Close calls are only queued, send them before exiting.
+    if (connection)
+        g_dbus_connection_flush_sync(connection, NULL, NULL);
+    metrics_stop();
+    latency_dump();
+    return exit_status_;
 }
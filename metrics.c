@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+struct metric_desc
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+// Metrics sharing a name are printed as one family, their entries must be
+// next to each other.
+static const struct metric_desc metric_descs_[METRIC_COUNT] = {
+    [METRIC_FRAMES_RECEIVED] = {"screencast_frames_received_total", NULL,
+                                "Buffers dequeued from PipeWire."},
+    [METRIC_FRAMES_PUBLISHED] = {"screencast_frames_published_total", NULL,
+                                 "Frames handed to the consumers."},
+    [METRIC_FRAMES_DROPPED] = {"screencast_frames_dropped_total", NULL,
+                               "Frames a consumer never saw because it was behind."},
+    [METRIC_FRAMES_DUPLICATED] = {"screencast_frames_duplicated_total", NULL,
+                                  "Frames identical to the previous one, not published."},
+    [METRIC_FRAMES_CORRUPTED] = {"screencast_frames_corrupted_total", NULL,
+                                 "Buffers flagged corrupted by the producer."},
+    [METRIC_CURSOR_FRAMES] = {"screencast_cursor_frames_total", NULL,
+                              "Buffers that only moved the pointer, the last pixels shown again."},
+    [METRIC_RENEGOTIATIONS] = {"screencast_renegotiations_total", NULL,
+                               "Format or buffer renegotiations requested."},
+    [METRIC_FORMATS_NEGOTIATED] = {"screencast_formats_negotiated_total", NULL,
+                                   "Formats agreed on with the producer."},
+    [METRIC_BUFFERS_ADDED] = {"screencast_buffers_added_total", NULL,
+                              "Buffers the producer added to the pools."},
+    [METRIC_BUFFERS_REMOVED] = {"screencast_buffers_removed_total", NULL,
+                                "Buffers the producer removed from the pools."},
+    [METRIC_BUFFERS_DEQUEUED] = {"screencast_buffers_dequeued_total", NULL,
+                                 "Buffers held by the pipeline after a dequeue."},
+    [METRIC_BUFFERS_REQUEUED] = {"screencast_buffers_requeued_total", NULL,
+                                 "Buffers given back once every consumer released them."},
+    [METRIC_CONVERT_BYTES] = {"screencast_convert_bytes_total", NULL,
+                              "Pixel bytes read by hashing, uploads and conversions."},
+    [METRIC_CONVERT_NS] = {"screencast_convert_seconds_total", NULL,
+                           "Time spent on those bytes."},
+    [METRIC_TILES_HASHED] = {"screencast_tilediff_tiles_total", NULL,
+                             "Tiles compared with the previous frame by the tile diff."},
+    [METRIC_TILES_CHANGED] = {"screencast_tilediff_tiles_changed_total", NULL,
+                              "Of those, tiles that differed."},
+    [METRIC_STREAM_STATE_ERROR] = {"screencast_stream_state_changes_total", "state=\"error\"",
+                                   "Stream state transitions by new state."},
+    [METRIC_STREAM_STATE_UNCONNECTED] = {"screencast_stream_state_changes_total",
+                                         "state=\"unconnected\"", NULL},
+    [METRIC_STREAM_STATE_CONNECTING] = {"screencast_stream_state_changes_total",
+                                        "state=\"connecting\"", NULL},
+    [METRIC_STREAM_STATE_PAUSED] = {"screencast_stream_state_changes_total",
+                                    "state=\"paused\"", NULL},
+    [METRIC_STREAM_STATE_STREAMING] = {"screencast_stream_state_changes_total",
+                                       "state=\"streaming\"", NULL},
+    [METRIC_CORE_ERRORS] = {"screencast_core_errors_total", NULL,
+                            "Errors reported by the PipeWire core."},
+};
+
+_Thread_local struct metrics_shard *metrics_shard_ = NULL;
+
+static struct metrics_shard shards_[METRICS_MAX_THREADS];
+static struct metrics_shard shared_shard_ = {.shared = true};
+static pthread_once_t shard_key_once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key_;
+
+static pthread_mutex_t core_info_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static char core_name_[64];
+static char core_version_[32];
+
+static int listen_fd_ = -1;
+static int stop_fd_ = -1;
+static pthread_t server_thread_;
+static char socket_path_[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+
+// The counts stay in the shard, the next thread that takes it adds on top.
+static void metrics_shard_release(void *data)
+{
+    struct metrics_shard *shard = data;
+
+    atomic_store(&shard->in_use, false);
+}
+
+static void metrics_shard_key_init(void)
+{
+    pthread_key_create(&shard_key_, metrics_shard_release);
+}
+
+struct metrics_shard *metrics_shard_acquire(void)
+{
+    pthread_once(&shard_key_once_, metrics_shard_key_init);
+    for (uint32_t i = 0; i < METRICS_MAX_THREADS; i++)
+    {
+        bool expected = false;
+
+        if (atomic_compare_exchange_strong(&shards_[i].in_use, &expected, true))
+        {
+            metrics_shard_ = &shards_[i];
+            pthread_setspecific(shard_key_, metrics_shard_);
+            return metrics_shard_;
+        }
+    }
+    metrics_shard_ = &shared_shard_;
+    return metrics_shard_;
+}
+
+uint64_t metrics_get(enum metric metric)
+{
+    uint64_t sum = atomic_load_explicit(&shared_shard_.counters[metric], memory_order_relaxed);
+
+    for (uint32_t i = 0; i < METRICS_MAX_THREADS; i++)
+        sum += atomic_load_explicit(&shards_[i].counters[metric], memory_order_relaxed);
+    return sum;
+}
+
+void metrics_set_core_info(const char *name, const char *version)
+{
+    pthread_mutex_lock(&core_info_lock_);
+    snprintf(core_name_, sizeof(core_name_), "%s", name ? name : "");
+    snprintf(core_version_, sizeof(core_version_), "%s", version ? version : "");
+    pthread_mutex_unlock(&core_info_lock_);
+}
+
+static void metrics_format(FILE *out)
+{
+    const char *family = NULL;
+
+    for (uint32_t i = 0; i < METRIC_COUNT; i++)
+    {
+        const struct metric_desc *desc = &metric_descs_[i];
+        uint64_t value = metrics_get(i);
+
+        if (!family || strcmp(family, desc->name) != 0)
+        {
+            fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", desc->name, desc->help,
+                    desc->name);
+            family = desc->name;
+        }
+        if (i == METRIC_CONVERT_NS)
+            fprintf(out, "%s %.9f\n", desc->name, value / 1e9);
+        else if (desc->labels)
+            fprintf(out, "%s{%s} %lu\n", desc->name, desc->labels, (unsigned long)value);
+        else
+            fprintf(out, "%s %lu\n", desc->name, (unsigned long)value);
+    }
+
+    // Gauges derived from the counters, so they cost the hot path nothing.
+    fprintf(out, "# HELP screencast_buffers Buffers in the pools of all streams.\n"
+                 "# TYPE screencast_buffers gauge\nscreencast_buffers %ld\n",
+            (long)(metrics_get(METRIC_BUFFERS_ADDED) - metrics_get(METRIC_BUFFERS_REMOVED)));
+    fprintf(out, "# HELP screencast_buffers_in_use Buffers held by the pipeline and its consumers.\n"
+                 "# TYPE screencast_buffers_in_use gauge\nscreencast_buffers_in_use %ld\n",
+            (long)(metrics_get(METRIC_BUFFERS_DEQUEUED) - metrics_get(METRIC_BUFFERS_REQUEUED)));
+    uint64_t tiles = metrics_get(METRIC_TILES_HASHED);
+    fprintf(out, "# HELP screencast_tilediff_change_ratio Share of compared tiles that changed.\n"
+                 "# TYPE screencast_tilediff_change_ratio gauge\n"
+                 "screencast_tilediff_change_ratio %.6f\n",
+            tiles ? (double)metrics_get(METRIC_TILES_CHANGED) / tiles : 0.0);
+
+    pthread_mutex_lock(&core_info_lock_);
+    if (core_name_[0])
+        fprintf(out, "# HELP screencast_pipewire_info PipeWire daemon of the last connection.\n"
+                     "# TYPE screencast_pipewire_info gauge\n"
+                     "screencast_pipewire_info{name=\"%s\",version=\"%s\"} 1\n",
+                core_name_, core_version_);
+    pthread_mutex_unlock(&core_info_lock_);
+}
+
+static void metrics_respond(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char request[1024], *body = NULL, header[128];
+    size_t size = 0;
+    FILE *out;
+
+    // The request isn't looked at, but read it so closing doesn't reset
+    // the connection before the client read the response.
+    if (poll(&pfd, 1, 100) > 0 && read(fd, request, sizeof(request)) < 0)
+        return;
+
+    if (!(out = open_memstream(&body, &size)))
+        return;
+    metrics_format(out);
+    fclose(out);
+
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n\r\n", size);
+    if (write(fd, header, strlen(header)) >= 0)
+    {
+        for (size_t done = 0; done < size;)
+        {
+            ssize_t res = write(fd, body + done, size - done);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                break;
+            done += res;
+        }
+    }
+    free(body);
+}
+
+static void *metrics_server(void *data)
+{
+    struct pollfd pfds[2] = {
+        {.fd = listen_fd_, .events = POLLIN},
+        {.fd = stop_fd_, .events = POLLIN},
+    };
+
+    (void)data;
+
+    while (true)
+    {
+        if (poll(pfds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Metrics server poll failed: %m\n");
+            break;
+        }
+        if (pfds[1].revents)
+            break;
+
+        int fd = accept(listen_fd_, NULL, NULL);
+        if (fd < 0)
+            continue;
+        metrics_respond(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int res;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    stop_fd_ = eventfd(0, EFD_CLOEXEC);
+    if (listen_fd_ < 0 || stop_fd_ < 0)
+    {
+        res = -errno;
+        goto fail;
+    }
+    // A socket left behind by an earlier run.
+    unlink(path);
+    if (bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd_, 8) < 0)
+    {
+        res = -errno;
+        goto fail;
+    }
+    snprintf(socket_path_, sizeof(socket_path_), "%s", path);
+
+    if ((res = pthread_create(&server_thread_, NULL, metrics_server, NULL)) != 0)
+    {
+        res = -res;
+        unlink(socket_path_);
+        socket_path_[0] = '\0';
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (listen_fd_ >= 0)
+        close(listen_fd_);
+    if (stop_fd_ >= 0)
+        close(stop_fd_);
+    listen_fd_ = stop_fd_ = -1;
+    return res;
+}
+
+void metrics_stop(void)
+{
+    uint64_t one = 1;
+
+    if (listen_fd_ < 0)
+        return;
+    if (write(stop_fd_, &one, sizeof(one)) < 0)
+        printf("Failed to stop the metrics server: %m\n");
+    pthread_join(server_thread_, NULL);
+    close(listen_fd_);
+    close(stop_fd_);
+    listen_fd_ = stop_fd_ = -1;
+    unlink(socket_path_);
+}
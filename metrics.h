@@ -0,0 +1,78 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+enum metric
+{
+    METRIC_FRAMES_RECEIVED,
+    METRIC_FRAMES_PUBLISHED,
+    METRIC_FRAMES_DROPPED,    // by a consumer ring that was full or had an unread frame
+    METRIC_FRAMES_DUPLICATED, // identical to the previous frame, not published
+    METRIC_FRAMES_CORRUPTED,
+    METRIC_CURSOR_FRAMES, // buffers with only a pointer update, published without pixels
+    METRIC_RENEGOTIATIONS,
+    METRIC_FORMATS_NEGOTIATED,
+    METRIC_BUFFERS_ADDED,
+    METRIC_BUFFERS_REMOVED,
+    METRIC_BUFFERS_DEQUEUED,
+    METRIC_BUFFERS_REQUEUED,
+    METRIC_CONVERT_BYTES, // pixel passes over frames: tile hashing, uploads, conversions
+    METRIC_CONVERT_NS,
+    METRIC_TILES_HASHED, // by the tile diff of streams without damage metadata
+    METRIC_TILES_CHANGED,
+    // One per enum pw_stream_state, from PW_STREAM_STATE_ERROR.
+    METRIC_STREAM_STATE_ERROR,
+    METRIC_STREAM_STATE_UNCONNECTED,
+    METRIC_STREAM_STATE_CONNECTING,
+    METRIC_STREAM_STATE_PAUSED,
+    METRIC_STREAM_STATE_STREAMING,
+    METRIC_CORE_ERRORS,
+    METRIC_COUNT,
+};
+
+#define METRICS_MAX_THREADS 64
+
+// Counters of one thread. Only the owning thread writes them, so an update
+// is a plain load and store; shards never share a cache line, so neither
+// other recording threads nor a scrape slow down the owner.
+struct metrics_shard
+{
+    _Alignas(64) _Atomic uint64_t counters[METRIC_COUNT];
+    atomic_bool in_use;
+    // Handed out to every thread once all shards are taken, updated with
+    // atomic adds.
+    bool shared;
+};
+
+extern _Thread_local struct metrics_shard *metrics_shard_;
+struct metrics_shard *metrics_shard_acquire(void);
+
+static inline void metrics_add(enum metric metric, uint64_t value)
+{
+    struct metrics_shard *shard = metrics_shard_ ? metrics_shard_ : metrics_shard_acquire();
+    _Atomic uint64_t *counter = &shard->counters[metric];
+
+    if (shard->shared)
+        atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+    else
+        atomic_store_explicit(counter,
+                              atomic_load_explicit(counter, memory_order_relaxed) + value,
+                              memory_order_relaxed);
+}
+
+// Sum of a counter over all threads.
+uint64_t metrics_get(enum metric metric);
+
+// Name and version of the PipeWire daemon, exported as labels.
+void metrics_set_core_info(const char *name, const char *version);
+
+// Serve the counters as Prometheus text on a Unix socket at `path`, from a
+// thread of its own. Any request on a connection gets one HTTP response,
+// so `curl --unix-socket` or a scrape proxy can read it.
+int metrics_serve(const char *path);
+void metrics_stop(void);
+
+#endif
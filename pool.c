@@ -0,0 +1,312 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// First block of an arena, later ones double. Covers a 64 row stripe of a
+// 4K BGRx frame.
+#define WORK_ARENA_BLOCK (4u << 20)
+#define WORK_ALIGN 64
+
+struct work_arena_block
+{
+    struct work_arena_block *next;
+    size_t size;
+    // Padded so the data after the header is aligned.
+    uint8_t pad[WORK_ALIGN - sizeof(void *) - sizeof(size_t)];
+    uint8_t data[];
+};
+
+// Indices not taken yet, begin in the low and end in the high half so the
+// owner and thieves can both claim from it with one compare-and-swap.
+#define RANGE(begin, end) ((uint64_t)(begin) | (uint64_t)(end) << 32)
+#define RANGE_BEGIN(range) ((uint32_t)(range))
+#define RANGE_END(range) ((uint32_t)((range) >> 32))
+
+struct work_thread
+{
+    _Alignas(64) _Atomic uint64_t range;
+    struct work_arena arena;
+    struct work_pool *pool;
+    pthread_t thread;
+};
+
+struct work_pool
+{
+    uint32_t n_threads;
+    work_func_t func;
+    void *data;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    uint32_t busy;
+    bool quit;
+
+    _Atomic uint64_t jobs;
+    _Atomic uint64_t items;
+    _Atomic uint64_t steals;
+
+    struct work_thread threads[];
+};
+
+void *work_arena_alloc(struct work_arena *arena, size_t size)
+{
+    struct work_arena_block *block = arena->blocks;
+    void *p;
+
+    size = (size + WORK_ALIGN - 1) & ~(size_t)(WORK_ALIGN - 1);
+    if (!block || arena->used + size > block->size)
+    {
+        size_t capacity = block ? block->size * 2 : WORK_ARENA_BLOCK;
+
+        if (capacity < size)
+            capacity = size;
+        if (!(block = aligned_alloc(WORK_ALIGN, sizeof(*block) + capacity)))
+            return NULL;
+        block->next = arena->blocks;
+        block->size = capacity;
+        arena->blocks = block;
+        arena->used = 0;
+    }
+    p = block->data + arena->used;
+    arena->used += size;
+    return p;
+}
+
+static void work_arena_free(struct work_arena *arena)
+{
+    struct work_arena_block *block, *next;
+
+    for (block = arena->blocks; block; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+    arena->blocks = NULL;
+    arena->used = 0;
+}
+
+// Start the next item with an empty arena. An item that outgrew the newest
+// block left several behind, they are merged so the next one fits in one.
+static void work_arena_reset(struct work_arena *arena)
+{
+    struct work_arena_block *block = arena->blocks;
+    size_t size = 0;
+
+    arena->used = 0;
+    if (!block || !block->next)
+        return;
+    for (; block; block = block->next)
+        size += block->size;
+    work_arena_free(arena);
+    if (work_arena_alloc(arena, size))
+        arena->used = 0;
+}
+
+// Claim the first index of the thread's own share.
+static bool work_pop(struct work_thread *t, uint32_t *index)
+{
+    uint64_t range = atomic_load_explicit(&t->range, memory_order_relaxed);
+
+    while (RANGE_BEGIN(range) < RANGE_END(range))
+    {
+        if (atomic_compare_exchange_weak(&t->range, &range, range + 1))
+        {
+            *index = RANGE_BEGIN(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Move the back half of the largest share left into the empty share of
+// `self`, false once every share is empty. The job's items may still be
+// running then, work_pool_run waits for the threads, not the items.
+static bool work_steal(struct work_pool *pool, struct work_thread *self)
+{
+    for (;;)
+    {
+        struct work_thread *victim = NULL;
+        uint64_t range = 0;
+        uint32_t most = 0, take;
+
+        for (uint32_t i = 0; i < pool->n_threads; i++)
+        {
+            uint64_t r = atomic_load_explicit(&pool->threads[i].range, memory_order_relaxed);
+
+            if (RANGE_END(r) - RANGE_BEGIN(r) > most)
+            {
+                victim = &pool->threads[i];
+                range = r;
+                most = RANGE_END(r) - RANGE_BEGIN(r);
+            }
+        }
+        if (!victim)
+            return false;
+
+        // A share value always means the same indices, so a stale one
+        // that compares equal is still the right one to split.
+        take = (most + 1) / 2;
+        if (atomic_compare_exchange_strong(&victim->range, &range,
+                                           RANGE(RANGE_BEGIN(range), RANGE_END(range) - take)))
+        {
+            atomic_store_explicit(&self->range,
+                                  RANGE(RANGE_END(range) - take, RANGE_END(range)),
+                                  memory_order_relaxed);
+            atomic_fetch_add_explicit(&pool->steals, 1, memory_order_relaxed);
+            return true;
+        }
+    }
+}
+
+static void work_pool_work(struct work_pool *pool, struct work_thread *t)
+{
+    uint64_t items = 0;
+    uint32_t index;
+
+    do
+    {
+        while (work_pop(t, &index))
+        {
+            work_arena_reset(&t->arena);
+            pool->func(pool->data, index, &t->arena);
+            items++;
+        }
+    } while (work_steal(pool, t));
+    atomic_fetch_add_explicit(&pool->items, items, memory_order_relaxed);
+}
+
+static void *work_thread_main(void *data)
+{
+    struct work_thread *t = data;
+    struct work_pool *pool = t->pool;
+    // Threads are created before the first job, generation is still 0.
+    uint64_t generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (generation == pool->generation && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        work_pool_work(pool, t);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct work_pool *work_pool_new(uint32_t n_threads)
+{
+    struct work_pool *pool;
+    size_t size;
+
+    if (n_threads == 0)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? n_cpus : 1;
+    }
+    if (n_threads > WORK_POOL_MAX_THREADS)
+        n_threads = WORK_POOL_MAX_THREADS;
+
+    size = sizeof(*pool) + n_threads * sizeof(pool->threads[0]);
+    if (!(pool = aligned_alloc(64, (size + 63) & ~(size_t)63)))
+        return NULL;
+    memset(pool, 0, size);
+    pool->n_threads = n_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (uint32_t i = 0; i < n_threads; i++)
+        pool->threads[i].pool = pool;
+    // Thread 0 is whoever calls work_pool_run.
+    for (uint32_t i = 1; i < n_threads; i++)
+    {
+        if (pthread_create(&pool->threads[i].thread, NULL, work_thread_main,
+                           &pool->threads[i]) != 0)
+        {
+            pool->n_threads = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+void work_pool_destroy(struct work_pool *pool)
+{
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 1; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i].thread, NULL);
+    for (uint32_t i = 0; i < pool->n_threads; i++)
+        work_arena_free(&pool->threads[i].arena);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+uint32_t work_pool_threads(const struct work_pool *pool)
+{
+    return pool->n_threads;
+}
+
+void work_pool_run(struct work_pool *pool, uint32_t n_items, work_func_t func, void *data)
+{
+    uint32_t n = pool->n_threads;
+
+    if (n_items == 0)
+        return;
+    atomic_fetch_add_explicit(&pool->jobs, 1, memory_order_relaxed);
+    pool->func = func;
+    pool->data = data;
+    for (uint32_t i = 0; i < n; i++)
+        atomic_store_explicit(&pool->threads[i].range,
+                              RANGE((uint64_t)n_items * i / n, (uint64_t)n_items * (i + 1) / n),
+                              memory_order_relaxed);
+
+    // Shares and the job are published by the lock the threads wake under.
+    if (n > 1 && n_items > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = n - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    work_pool_work(pool, &pool->threads[0]);
+    if (n > 1 && n_items > 1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy > 0)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pool->func = NULL;
+    pool->data = NULL;
+}
+
+void work_pool_get_stats(struct work_pool *pool, struct work_pool_stats *stats)
+{
+    stats->jobs = atomic_load_explicit(&pool->jobs, memory_order_relaxed);
+    stats->items = atomic_load_explicit(&pool->items, memory_order_relaxed);
+    stats->steals = atomic_load_explicit(&pool->steals, memory_order_relaxed);
+}
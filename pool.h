@@ -0,0 +1,50 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WORK_POOL_MAX_THREADS 64
+
+// Scratch memory of one pool thread. Allocations are bump pointers into
+// blocks kept for the thread's lifetime and valid until the item that made
+// them returns, so stripes get buffers without malloc or stack space.
+struct work_arena
+{
+    struct work_arena_block *blocks; // newest first
+    size_t used;                     // of the newest block
+};
+
+// Memory for the running item, 64-byte aligned, NULL if out of memory.
+void *work_arena_alloc(struct work_arena *arena, size_t size);
+
+// Runs `func` for every index of a job, `arena` belongs to the thread
+// running it.
+typedef void (*work_func_t)(void *data, uint32_t index, struct work_arena *arena);
+
+// Fork-join pool for splitting a frame into stripes. Each thread starts on
+// its own contiguous share of the indices and takes them front to back, a
+// thread that runs dry steals the back half of the largest share left. One
+// job runs at a time, from one thread at a time.
+struct work_pool;
+
+// `n_threads` counts the calling thread, 0 picks one per online CPU and 1
+// runs every job inline.
+struct work_pool *work_pool_new(uint32_t n_threads);
+void work_pool_destroy(struct work_pool *pool);
+uint32_t work_pool_threads(const struct work_pool *pool);
+
+// Run `func` for indices [0, n_items) on all threads, the caller included.
+// Returns once every item finished, the frame the items read can then be
+// released.
+void work_pool_run(struct work_pool *pool, uint32_t n_items, work_func_t func, void *data);
+
+struct work_pool_stats
+{
+    uint64_t jobs;
+    uint64_t items;
+    uint64_t steals; // shares taken from another thread
+};
+void work_pool_get_stats(struct work_pool *pool, struct work_pool_stats *stats);
+
+#endif
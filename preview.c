@@ -0,0 +1,430 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cursor.h"
+#include "latency.h"
+#include "metrics.h"
+#include "preview.h"
+#include "sdl.h"
+
+// Longest the present thread sleeps on the mailbox before it looks at the
+// window events again.
+#define PREVIEW_POLL_MS 10
+#define PREVIEW_REPORT_NS 1000000000ull
+#define PREVIEW_MAX_FORMATS 16
+
+// Rows [y, y + height) of the texture to upload.
+struct preview_span
+{
+    uint32_t y;
+    uint32_t height;
+};
+
+struct preview
+{
+    struct frame_ring mailbox;
+    pthread_t thread;
+    atomic_bool quit;
+
+    // The window and renderer are created on the present thread, the
+    // creator waits until that is done.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool ready;
+    int init_res;
+
+    char title[64];
+    uint32_t formats[PREVIEW_MAX_FORMATS];
+    uint32_t n_formats;
+
+    // Present thread only.
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    uint32_t format; // enum spa_video_format of the texture
+    uint32_t width;
+    uint32_t height;
+    uint32_t unsupported_format;
+    struct frame_cursor cursor; // drawn into the texture
+    bool closed;
+    struct latency_histogram *latency; // dequeue until uploaded
+
+    _Atomic uint64_t frames;
+    _Atomic uint64_t presented;
+    _Atomic uint64_t rows;
+    _Atomic uint64_t upload_ns;
+    _Atomic uint64_t upload_total_ns;
+    _Atomic uint64_t present_ns;
+    _Atomic uint64_t present_total_ns;
+};
+
+static int preview_open(struct preview *p)
+{
+    SDL_RendererInfo info;
+    uint32_t i, n;
+
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0)
+    {
+        printf("Failed to initialize SDL: %s\n", SDL_GetError());
+        return -EIO;
+    }
+    p->window = SDL_CreateWindow(p->title, SDL_WINDOWPOS_UNDEFINED,
+                                 SDL_WINDOWPOS_UNDEFINED, 960, 540, SDL_WINDOW_RESIZABLE);
+    if (!p->window)
+    {
+        printf("Failed to create preview window: %s\n", SDL_GetError());
+        return -EIO;
+    }
+    p->renderer = SDL_CreateRenderer(p->window, -1,
+                                     SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!p->renderer || SDL_GetRendererInfo(p->renderer, &info) < 0)
+    {
+        printf("Failed to create preview renderer: %s\n", SDL_GetError());
+        return -EIO;
+    }
+
+    // Only packed formats, frames are uploaded row by row from one plane.
+    n = sdl_renderer_formats(&info, p->formats, PREVIEW_MAX_FORMATS);
+    for (i = 0; i < n; i++)
+    {
+        if (!SDL_ISPIXELFORMAT_FOURCC(id_to_sdl_format(p->formats[i])))
+            p->formats[p->n_formats++] = p->formats[i];
+    }
+    printf("Preview renderer %s, %u formats\n", info.name, p->n_formats);
+    return p->n_formats ? 0 : -ENOTSUP;
+}
+
+static void preview_close(struct preview *p)
+{
+    if (p->texture)
+        SDL_DestroyTexture(p->texture);
+    if (p->renderer)
+        SDL_DestroyRenderer(p->renderer);
+    if (p->window)
+        SDL_DestroyWindow(p->window);
+    p->texture = NULL;
+    p->renderer = NULL;
+    p->window = NULL;
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+}
+
+// Rows touched by the damage as disjoint spans sorted by y.
+static uint32_t preview_damage_spans(const struct frame_rect *rects, uint32_t n_rects,
+                                     struct preview_span *spans)
+{
+    uint32_t i, j, n = 0;
+
+    for (i = 0; i < n_rects; i++)
+    {
+        struct preview_span span = {rects[i].y, rects[i].height};
+
+        for (j = n; j > 0 && spans[j - 1].y > span.y; j--)
+            spans[j] = spans[j - 1];
+        spans[j] = span;
+        n++;
+    }
+
+    for (i = 0, j = 0; i < n; i++)
+    {
+        uint32_t end = spans[i].y + spans[i].height;
+
+        if (j > 0 && spans[i].y <= spans[j - 1].y + spans[j - 1].height)
+        {
+            if (end > spans[j - 1].y + spans[j - 1].height)
+                spans[j - 1].height = end - spans[j - 1].y;
+            continue;
+        }
+        spans[j++] = spans[i];
+    }
+    return j;
+}
+
+// Copy the damaged rows of `frame` into the texture, each span through its
+// own SDL_LockTexture so rows outside the damage keep their old pixels.
+// The pointer is drawn over the uploaded rows, where it was and where it is
+// are uploaded once it moved.
+static int preview_upload(struct preview *p, const struct frame *frame, bool full,
+                          uint32_t *rows)
+{
+    struct preview_span spans[FRAME_MAX_DAMAGE];
+    struct frame_rect rects[FRAME_MAX_DAMAGE];
+    struct frame_cursor cursor = {0};
+    Uint32 sdl_format = id_to_sdl_format(frame->format);
+    uint32_t i, n_spans, n_rects, row_bytes;
+
+    if (frame->n_planes != 1 || sdl_format == SDL_PIXELFORMAT_UNKNOWN ||
+        SDL_ISPIXELFORMAT_FOURCC(sdl_format))
+    {
+        if (p->unsupported_format != frame->format)
+            printf("Preview can't show format %u\n", frame->format);
+        p->unsupported_format = frame->format;
+        return -ENOTSUP;
+    }
+
+    if (!p->texture || p->format != frame->format || p->width != frame->width ||
+        p->height != frame->height)
+    {
+        if (p->texture)
+            SDL_DestroyTexture(p->texture);
+        p->texture = SDL_CreateTexture(p->renderer, sdl_format, SDL_TEXTUREACCESS_STREAMING,
+                                       frame->width, frame->height);
+        if (!p->texture)
+        {
+            printf("Failed to create preview texture: %s\n", SDL_GetError());
+            return -EIO;
+        }
+        SDL_RenderSetLogicalSize(p->renderer, frame->width, frame->height);
+        p->format = frame->format;
+        p->width = frame->width;
+        p->height = frame->height;
+        full = true;
+    }
+
+    if (cursor_drawable(frame))
+        cursor = frame->cursor;
+    if (full)
+    {
+        spans[0] = (struct preview_span){0, frame->height};
+        n_spans = 1;
+    }
+    else
+    {
+        n_rects = frame->n_damage;
+        memcpy(rects, frame->damage, n_rects * sizeof(rects[0]));
+        cursor_damage(&p->cursor, &cursor, frame->width, frame->height, rects, &n_rects);
+        n_spans = preview_damage_spans(rects, n_rects, spans);
+    }
+
+    row_bytes = frame->width * SDL_BYTESPERPIXEL(sdl_format);
+    for (i = 0; i < n_spans; i++)
+    {
+        SDL_Rect rect = {0, spans[i].y, frame->width, spans[i].height};
+        const uint8_t *src = frame->planes[0].data + (size_t)spans[i].y * frame->planes[0].stride;
+        uint8_t *dst;
+        void *pixels;
+        int pitch;
+
+        if (SDL_LockTexture(p->texture, &rect, &pixels, &pitch) < 0)
+        {
+            printf("Failed to lock preview texture: %s\n", SDL_GetError());
+            return -EIO;
+        }
+        dst = pixels;
+        for (uint32_t y = 0; y < spans[i].height; y++)
+            memcpy(dst + (size_t)y * pitch, src + (size_t)y * frame->planes[0].stride, row_bytes);
+        if (cursor.image)
+        {
+            struct frame_cursor span_cursor = {cursor.image, cursor.x,
+                                               cursor.y - (int32_t)spans[i].y};
+
+            cursor_blend(&span_cursor, dst, pitch,
+                         &(struct frame_rect){0, 0, frame->width, spans[i].height});
+        }
+        SDL_UnlockTexture(p->texture);
+        *rows += spans[i].height;
+    }
+    cursor_track(&p->cursor, &cursor);
+    return 0;
+}
+
+static void preview_present(struct preview *p)
+{
+    SDL_RenderClear(p->renderer);
+    if (p->texture)
+        SDL_RenderCopy(p->renderer, p->texture, NULL, NULL);
+    SDL_RenderPresent(p->renderer);
+}
+
+// Window events. A closed window only stops the drawing, frames keep being
+// taken from the mailbox until preview_stop.
+static bool preview_handle_events(struct preview *p)
+{
+    bool redraw = false;
+    SDL_Event event;
+
+    while (SDL_PollEvent(&event))
+    {
+        if (event.type == SDL_QUIT)
+        {
+            p->closed = true;
+            SDL_HideWindow(p->window);
+        }
+        else if (event.type == SDL_WINDOWEVENT &&
+                 (event.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                  event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED))
+        {
+            redraw = true;
+        }
+    }
+    return redraw && !p->closed;
+}
+
+static void *preview_thread(void *data)
+{
+    struct preview *p = data;
+    uint64_t report_start = frame_ring_now_ns();
+    uint64_t upload_max = 0, present_max = 0, upload_sum = 0, present_sum = 0;
+    uint32_t frames = 0;
+    int res = preview_open(p);
+
+    pthread_mutex_lock(&p->lock);
+    p->init_res = res;
+    p->ready = true;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    if (res < 0)
+    {
+        preview_close(p);
+        return NULL;
+    }
+
+    while (!atomic_load(&p->quit))
+    {
+        bool redraw = preview_handle_events(p);
+        struct frame *frame = frame_ring_wait(&p->mailbox, PREVIEW_POLL_MS);
+        uint64_t start, uploaded, queued_ns;
+        uint32_t rows = 0;
+
+        if (!frame)
+        {
+            if (redraw)
+                preview_present(p);
+            continue;
+        }
+
+        start = frame_ring_now_ns();
+        queued_ns = frame->queued_ns;
+        atomic_fetch_add_explicit(&p->frames, 1, memory_order_relaxed);
+        res = 0;
+        if (!p->closed)
+            res = preview_upload(p, frame, frame_ring_skipped(&p->mailbox), &rows);
+        // The pixels are in the texture now, the buffer goes back to the
+        // stream before present waits for vsync.
+        latency_record_since(p->latency, queued_ns);
+        metrics_add(METRIC_CONVERT_BYTES, (uint64_t)rows * frame->planes[0].stride);
+        frame_release(frame);
+        uploaded = frame_ring_now_ns();
+        metrics_add(METRIC_CONVERT_NS, uploaded - start);
+
+        if (p->closed || res < 0 || (!rows && !redraw))
+            continue;
+        preview_present(p);
+
+        uint64_t upload_ns = uploaded - start;
+        uint64_t present_ns = frame_ring_now_ns() - queued_ns;
+
+        atomic_fetch_add_explicit(&p->presented, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&p->rows, rows, memory_order_relaxed);
+        atomic_store_explicit(&p->upload_ns, upload_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&p->upload_total_ns, upload_ns, memory_order_relaxed);
+        atomic_store_explicit(&p->present_ns, present_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit(&p->present_total_ns, present_ns, memory_order_relaxed);
+
+        frames++;
+        upload_sum += upload_ns;
+        present_sum += present_ns;
+        upload_max = upload_ns > upload_max ? upload_ns : upload_max;
+        present_max = present_ns > present_max ? present_ns : present_max;
+        if (uploaded - report_start >= PREVIEW_REPORT_NS)
+        {
+            printf("Preview: %u frames, upload %.2f ms (max %.2f), present latency %.2f ms (max %.2f)\n",
+                   frames, upload_sum / 1e6 / frames, upload_max / 1e6,
+                   present_sum / 1e6 / frames, present_max / 1e6);
+            report_start = uploaded;
+            frames = 0;
+            upload_sum = present_sum = upload_max = present_max = 0;
+        }
+    }
+
+    preview_close(p);
+    return NULL;
+}
+
+struct preview *preview_new(const char *title)
+{
+    struct preview *p = calloc(1, sizeof(*p));
+    int res;
+
+    if (!p)
+        return NULL;
+    if (frame_ring_init(&p->mailbox, FRAME_RING_LATEST) < 0)
+    {
+        free(p);
+        return NULL;
+    }
+    snprintf(p->title, sizeof(p->title), "%s", title);
+    p->latency = latency_stage("preview");
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if ((res = pthread_create(&p->thread, NULL, preview_thread, p)) != 0)
+    {
+        printf("Failed to start the preview thread: %s\n", strerror(res));
+        p->ready = true;
+        p->init_res = -res;
+    }
+    else
+    {
+        pthread_mutex_lock(&p->lock);
+        while (!p->ready)
+            pthread_cond_wait(&p->cond, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+        if (p->init_res < 0)
+            pthread_join(p->thread, NULL);
+    }
+
+    if (p->init_res < 0)
+    {
+        frame_ring_clear(&p->mailbox);
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+uint32_t preview_formats(struct preview *preview, uint32_t *formats, uint32_t max_formats)
+{
+    uint32_t n = preview->n_formats < max_formats ? preview->n_formats : max_formats;
+
+    memcpy(formats, preview->formats, n * sizeof(*formats));
+    return n;
+}
+
+struct frame_ring *preview_mailbox(struct preview *preview)
+{
+    return &preview->mailbox;
+}
+
+void preview_get_stats(struct preview *preview, struct preview_stats *stats)
+{
+    stats->frames = atomic_load_explicit(&preview->frames, memory_order_relaxed);
+    stats->presented = atomic_load_explicit(&preview->presented, memory_order_relaxed);
+    stats->rows = atomic_load_explicit(&preview->rows, memory_order_relaxed);
+    stats->upload_ns = atomic_load_explicit(&preview->upload_ns, memory_order_relaxed);
+    stats->upload_total_ns = atomic_load_explicit(&preview->upload_total_ns, memory_order_relaxed);
+    stats->present_ns = atomic_load_explicit(&preview->present_ns, memory_order_relaxed);
+    stats->present_total_ns = atomic_load_explicit(&preview->present_total_ns, memory_order_relaxed);
+}
+
+void preview_stop(struct preview *preview)
+{
+    if (atomic_exchange(&preview->quit, true))
+        return;
+    frame_ring_wake(&preview->mailbox);
+    pthread_join(preview->thread, NULL);
+}
+
+void preview_destroy(struct preview *preview)
+{
+    preview_stop(preview);
+    frame_ring_clear(&preview->mailbox);
+    cursor_image_unref(preview->cursor.image);
+    pthread_cond_destroy(&preview->cond);
+    pthread_mutex_destroy(&preview->lock);
+    free(preview);
+}
@@ -0,0 +1,43 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <stdint.h>
+
+#include "ring.h"
+
+// SDL preview window. Frames arrive through a FRAME_RING_LATEST mailbox and
+// are written straight into a streaming texture on the preview's own present
+// thread, so a slow or vsync bound present only ever drops frames from the
+// mailbox and never holds up the stream. Each frame is released as soon as
+// its pixels are in the texture, before present.
+struct preview;
+
+struct preview_stats
+{
+    uint64_t frames;           // taken from the mailbox
+    uint64_t presented;
+    uint64_t rows;             // uploaded to the texture
+    uint64_t upload_ns;        // last frame: lock, copy and unlock
+    uint64_t upload_total_ns;
+    uint64_t present_ns;       // last frame: from publishing until present returned
+    uint64_t present_total_ns;
+};
+
+// Opens the window and renderer on the present thread, NULL if SDL can't.
+struct preview *preview_new(const char *title);
+
+// Formats the renderer takes without a conversion, in order of preference,
+// for wire_set_formats().
+uint32_t preview_formats(struct preview *preview, uint32_t *formats, uint32_t max_formats);
+
+// Hand to wire_add_consumer().
+struct frame_ring *preview_mailbox(struct preview *preview);
+
+void preview_get_stats(struct preview *preview, struct preview_stats *stats);
+
+// Stop the present thread. The mailbox stays valid until preview_destroy,
+// call that once the stream feeding it is gone.
+void preview_stop(struct preview *preview);
+void preview_destroy(struct preview *preview);
+
+#endif
@@ -0,0 +1,851 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#include <spa/param/video/raw.h>
+
+#include "convert.h"
+#include "cursor.h"
+#include "latency.h"
+#include "pool.h"
+#include "recorder.h"
+#include "yuv.h"
+
+// Longest the recorder thread waits for a frame before it looks at quit.
+#define RECORDER_POLL_MS 50
+#define RECORDER_REPORT_NS 1000000000ull
+// Rows converted per pool item for Y4M, even so stripes share no chroma
+// row. 64 rows of a 4K frame are 1 MB of BGRx, about a core's L2.
+#define RECORDER_STRIPE_ROWS 64
+
+#define RECORDER_ALIGN_UP(v) (((v) + RECORDER_ALIGN - 1) & ~(uint64_t)(RECORDER_ALIGN - 1))
+
+#ifdef HAVE_IO_URING
+// Just enough of io_uring for a few writes in flight, straight on the
+// syscalls so there is no liburing to depend on.
+struct uring
+{
+    int fd;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static void uring_clear(struct uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_map && u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_size);
+    if (u->sq_map)
+        munmap(u->sq_map, u->sq_map_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p = {};
+    int res;
+
+    memset(u, 0, sizeof(*u));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -errno;
+
+    u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_map_size > u->sq_map_size)
+            u->sq_map_size = u->cq_map_size;
+        u->cq_map_size = u->sq_map_size;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED)
+    {
+        u->sq_map = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_map = u->sq_map;
+    else
+    {
+        u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED)
+        {
+            u->cq_map = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+    {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    u->sq_tail = (_Atomic unsigned *)((uint8_t *)u->sq_map + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)((uint8_t *)u->sq_map + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((uint8_t *)u->sq_map + p.sq_off.array);
+    u->cq_head = (_Atomic unsigned *)((uint8_t *)u->cq_map + p.cq_off.head);
+    u->cq_tail = (_Atomic unsigned *)((uint8_t *)u->cq_map + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)((uint8_t *)u->cq_map + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_map + p.cq_off.cqes);
+    return 0;
+
+fail:
+    res = -errno;
+    uring_clear(u);
+    return res;
+}
+
+static int uring_enter(struct uring *u, unsigned to_submit, unsigned min_complete)
+{
+    int res;
+
+    while ((res = syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete,
+                          min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    return res < 0 ? -errno : res;
+}
+
+// Never more writes in flight than entries, so there is always a free sqe.
+static int uring_write(struct uring *u, int fd, const void *data, uint32_t size,
+                       uint64_t offset, uint64_t user_data)
+{
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    unsigned index = tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+
+    int res = uring_enter(u, 1, 0);
+    return res < 0 ? res : 0;
+}
+
+// Take one completion. Returns 0 if there is none and `wait` isn't set.
+static int uring_reap(struct uring *u, bool wait, struct io_uring_cqe *cqe)
+{
+    while (true)
+    {
+        unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+        int res;
+
+        if (head != atomic_load_explicit(u->cq_tail, memory_order_acquire))
+        {
+            *cqe = u->cqes[head & u->cq_mask];
+            atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+            return 1;
+        }
+        if (!wait)
+            return 0;
+        if ((res = uring_enter(u, 0, 1)) < 0)
+            return res;
+    }
+}
+#endif
+
+struct record_buffer
+{
+    uint8_t *data;
+    size_t capacity;
+    uint32_t size; // being written
+    uint64_t offset;
+    bool busy;
+};
+
+struct recorder
+{
+    bool y4m;
+    bool direct;
+    int fd;
+    struct frame_ring ring;
+    pthread_t thread;
+    bool running;
+    atomic_bool quit;
+    struct latency_histogram *latency; // dequeue until copied out
+#ifdef HAVE_IO_URING
+    struct uring uring;
+#endif
+    bool use_uring;
+    bool failed;
+
+    struct record_buffer buffers[RECORDER_DEPTH];
+    uint32_t in_flight;
+    // Unaligned end of the last write under O_DIRECT, goes in front of the
+    // next one.
+    uint8_t *carry;
+    uint32_t carry_size;
+    uint64_t offset;  // of the next write
+    uint64_t written; // bytes appended so far, including the carry
+
+    // The first frame fixes the Y4M stream's format and size.
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    bool y4m_ready;
+    struct yuv_converter yuv;
+    // Formats the YUV converter doesn't take are swizzled to BGRx first,
+    // a stripe at a time into the converting thread's arena.
+    struct convert swizzle;
+    bool swizzle_first;
+    // Converts Y4M frames in stripes of RECORDER_STRIPE_ROWS.
+    struct work_pool *pool;
+    // Rows under the pointer with the cursor drawn in, before and after
+    // the swizzle.
+    uint8_t *cursor_patch;
+
+    // Offsets of the raw container's frame records, written on stop.
+    uint64_t *index;
+    uint64_t n_index;
+    uint64_t index_capacity;
+
+    _Atomic uint64_t frames;
+    _Atomic uint64_t refused;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t start_ns;
+    _Atomic uint64_t end_ns;
+};
+
+// Synchronous write of a whole range, for the fallback and the tail of the
+// file.
+static int write_all(int fd, const uint8_t *data, size_t size, uint64_t offset)
+{
+    while (size)
+    {
+        ssize_t res = pwrite(fd, data, size, offset);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -errno;
+        data += res;
+        size -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+static void recorder_fail(struct recorder *r, int res)
+{
+    if (!r->failed)
+        printf("Recording stopped, write failed: %s\n", strerror(-res));
+    r->failed = true;
+}
+
+static void recorder_complete(struct recorder *r, struct record_buffer *buf)
+{
+    buf->busy = false;
+    r->in_flight--;
+    atomic_fetch_add_explicit(&r->bytes, buf->size, memory_order_relaxed);
+    atomic_store_explicit(&r->end_ns, frame_ring_now_ns(), memory_order_relaxed);
+}
+
+// Collect finished writes, waiting for at least one if `wait` is set.
+static void recorder_reap(struct recorder *r, bool wait)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_cqe cqe;
+    int res;
+
+    while (r->in_flight && (res = uring_reap(&r->uring, wait, &cqe)) != 0)
+    {
+        struct record_buffer *buf;
+
+        if (res < 0)
+        {
+            // Nothing comes back anymore, forget what was in flight.
+            recorder_fail(r, res);
+            for (uint32_t i = 0; i < RECORDER_DEPTH; i++)
+                r->buffers[i].busy = false;
+            r->in_flight = 0;
+            return;
+        }
+        buf = &r->buffers[cqe.user_data];
+        if (cqe.res == -EINVAL)
+        {
+            // Kernels before 5.6 have io_uring but not IORING_OP_WRITE. A
+            // write that is invalid for other reasons fails again below.
+            if (r->use_uring)
+                printf("io_uring can't write here, recording with pwrite\n");
+            r->use_uring = false;
+            cqe.res = 0;
+        }
+        // Short or refused writes are finished synchronously.
+        if (cqe.res >= 0 && (uint32_t)cqe.res < buf->size &&
+            (res = write_all(r->fd, buf->data + cqe.res, buf->size - cqe.res,
+                             buf->offset + cqe.res)) < 0)
+            cqe.res = res;
+        if (cqe.res < 0)
+            recorder_fail(r, cqe.res);
+        recorder_complete(r, buf);
+        wait = false;
+    }
+#else
+    (void)r;
+    (void)wait;
+#endif
+}
+
+static int recorder_submit(struct recorder *r, struct record_buffer *buf)
+{
+    int res;
+
+    buf->busy = true;
+    r->in_flight++;
+    if (!atomic_load_explicit(&r->start_ns, memory_order_relaxed))
+        atomic_store_explicit(&r->start_ns, frame_ring_now_ns(), memory_order_relaxed);
+#ifdef HAVE_IO_URING
+    if (r->use_uring)
+    {
+        if ((res = uring_write(&r->uring, r->fd, buf->data, buf->size, buf->offset,
+                               buf - r->buffers)) == 0)
+            return 0;
+        printf("io_uring submit failed (%s), recording with pwrite\n", strerror(-res));
+        r->use_uring = false;
+        // Whatever made it in still completes, wait for it before the
+        // offsets are reused.
+        r->in_flight--;
+        recorder_reap(r, true);
+        r->in_flight++;
+    }
+#endif
+    res = write_all(r->fd, buf->data, buf->size, buf->offset);
+    recorder_complete(r, buf);
+    return res;
+}
+
+static struct record_buffer *recorder_buffer(struct recorder *r, size_t size)
+{
+    struct record_buffer *buf = NULL;
+
+    // Always room for the carry in front and the rounding at the end.
+    size = RECORDER_ALIGN_UP(size + RECORDER_ALIGN);
+    for (uint32_t i = 0; i < RECORDER_DEPTH && !buf; i++)
+        if (!r->buffers[i].busy)
+            buf = &r->buffers[i];
+    if (buf->capacity < size)
+    {
+        free(buf->data);
+        buf->capacity = 0;
+        if (!(buf->data = aligned_alloc(RECORDER_ALIGN, size)))
+            return NULL;
+        buf->capacity = size;
+    }
+    memcpy(buf->data, r->carry, r->carry_size);
+    buf->size = r->carry_size;
+    return buf;
+}
+
+// Write out the aligned part of `buf`, keep the rest for the next one.
+static int recorder_flush(struct recorder *r, struct record_buffer *buf)
+{
+    uint32_t size = buf->size;
+
+    r->written += size - r->carry_size;
+    r->carry_size = 0;
+    if (r->direct)
+    {
+        r->carry_size = size % RECORDER_ALIGN;
+        size -= r->carry_size;
+        memcpy(r->carry, buf->data + size, r->carry_size);
+    }
+    if (size == 0)
+        return 0;
+    buf->size = size;
+    buf->offset = r->offset;
+    r->offset += size;
+    return recorder_submit(r, buf);
+}
+
+static void pack_rows(uint8_t *dst, uint32_t row_size, const uint8_t *src, uint32_t stride,
+                      uint32_t rows)
+{
+    if (row_size == stride)
+    {
+        memcpy(dst, src, (size_t)row_size * rows);
+        return;
+    }
+    for (uint32_t y = 0; y < rows; y++)
+        memcpy(dst + (size_t)y * row_size, src + (size_t)y * stride, row_size);
+}
+
+static int recorder_index_add(struct recorder *r, uint64_t offset)
+{
+    if (r->n_index == r->index_capacity)
+    {
+        uint64_t capacity = r->index_capacity ? r->index_capacity * 2 : 1024;
+        uint64_t *index = realloc(r->index, capacity * sizeof(*index));
+
+        if (!index)
+            return -ENOMEM;
+        r->index = index;
+        r->index_capacity = capacity;
+    }
+    r->index[r->n_index++] = offset;
+    return 0;
+}
+
+static int recorder_record_raw(struct recorder *r, const struct frame *frame)
+{
+    struct record_frame_header header = {
+        .magic = RECORD_FRAME_MAGIC,
+        .format = frame->format,
+        .width = frame->width,
+        .height = frame->height,
+        .n_planes = frame->n_planes,
+        .seq = frame->seq,
+        .pts = frame->pts,
+    };
+    uint32_t bpp = convert_format_bpp(frame->format);
+    struct record_buffer *buf;
+    size_t size = sizeof(header);
+    uint8_t *p;
+
+    // Packed formats lose the stride padding, anything else is kept as is.
+    for (uint32_t i = 0; i < frame->n_planes; i++)
+    {
+        const struct frame_plane *plane = &frame->planes[i];
+        bool pack = bpp && frame->n_planes == 1 && plane->stride >= frame->width * bpp &&
+                    plane->size >= (uint64_t)plane->stride * (frame->height - 1) +
+                                       frame->width * bpp;
+
+        header.strides[i] = pack ? frame->width * bpp : plane->stride;
+        header.sizes[i] = pack ? header.strides[i] * frame->height : plane->size;
+        size += header.sizes[i];
+    }
+    if (r->written == 0)
+        size += sizeof(struct record_file_header);
+
+    if (!(buf = recorder_buffer(r, size)))
+        return -ENOMEM;
+    p = buf->data + buf->size;
+    if (r->written == 0)
+    {
+        struct record_file_header file = {RECORD_MAGIC, RECORD_VERSION};
+
+        memcpy(p, &file, sizeof(file));
+        p += sizeof(file);
+    }
+    if (recorder_index_add(r, r->written + (p - (buf->data + buf->size))) < 0)
+        return -ENOMEM;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (uint32_t i = 0; i < frame->n_planes; i++)
+    {
+        const struct frame_plane *plane = &frame->planes[i];
+
+        if (header.strides[i] != plane->stride)
+            pack_rows(p, header.strides[i], plane->data, plane->stride, frame->height);
+        else
+            memcpy(p, plane->data, header.sizes[i]);
+        // Recordings show the pointer, drawn over the copy.
+        if (i == 0 && cursor_drawable(frame))
+            cursor_blend(&frame->cursor, p, header.strides[0],
+                         &(struct frame_rect){0, 0, frame->width, frame->height});
+        p += header.sizes[i];
+    }
+    buf->size = p - buf->data;
+    return recorder_flush(r, buf);
+}
+
+// Set up the conversion for the stream's first frame.
+static int recorder_y4m_init(struct recorder *r, const struct frame *frame)
+{
+    uint32_t src_format = frame->format;
+
+    if (yuv_converter_init(&r->yuv, SPA_VIDEO_FORMAT_I420, src_format, YUV_BT709,
+                           YUV_RANGE_LIMITED, CONVERT_IMPL_AUTO) < 0)
+    {
+        if (convert_init(&r->swizzle, SPA_VIDEO_FORMAT_BGRx, src_format, CONVERT_IMPL_AUTO) < 0)
+            return -ENOTSUP;
+        r->swizzle_first = true;
+        src_format = SPA_VIDEO_FORMAT_BGRx;
+        yuv_converter_init(&r->yuv, SPA_VIDEO_FORMAT_I420, src_format, YUV_BT709,
+                           YUV_RANGE_LIMITED, CONVERT_IMPL_AUTO);
+    }
+    r->format = frame->format;
+    r->width = frame->width;
+    r->height = frame->height;
+    r->y4m_ready = true;
+    return 0;
+}
+
+// The pixels under the pointer are converted a second time, from a copy
+// with the cursor drawn in. The copy is aligned to the 2x2 chroma grid.
+static void recorder_y4m_cursor(struct recorder *r, const struct frame *frame,
+                                const struct yuv_image *image)
+{
+    const struct frame_plane *plane = &frame->planes[0];
+    struct frame_cursor cursor;
+    struct frame_rect rect;
+    struct yuv_image sub;
+    uint32_t x0, y0, x1, y1, width, height, stride;
+    uint8_t *patch;
+
+    if (!cursor_drawable(frame) || !cursor_rect(&frame->cursor, frame->width, frame->height, &rect))
+        return;
+    x0 = rect.x & ~1u;
+    y0 = rect.y & ~1u;
+    x1 = (rect.x + rect.width + 1) & ~1u;
+    y1 = (rect.y + rect.height + 1) & ~1u;
+    width = (x1 < frame->width ? x1 : frame->width) - x0;
+    height = (y1 < frame->height ? y1 : frame->height) - y0;
+    stride = width * 4;
+    if (!r->cursor_patch &&
+        !(r->cursor_patch = malloc(2 * (size_t)(CURSOR_MAX_SIZE + 2) * (CURSOR_MAX_SIZE + 2) * 4)))
+        return;
+
+    patch = r->cursor_patch;
+    pack_rows(patch, stride, plane->data + (size_t)y0 * plane->stride + (size_t)x0 * 4,
+              plane->stride, height);
+    cursor = (struct frame_cursor){frame->cursor.image, frame->cursor.x - (int32_t)x0,
+                                   frame->cursor.y - (int32_t)y0};
+    cursor_blend(&cursor, patch, stride, &(struct frame_rect){0, 0, width, height});
+    if (r->swizzle_first)
+    {
+        convert_rows(&r->swizzle, patch + (size_t)stride * height, stride, patch, stride,
+                     width, height);
+        patch += (size_t)stride * height;
+    }
+
+    sub = *image;
+    sub.width = width;
+    sub.height = height;
+    sub.planes[0] += (size_t)y0 * sub.strides[0] + x0;
+    sub.planes[1] += (size_t)(y0 / 2) * sub.strides[1] + x0 / 2;
+    sub.planes[2] += (size_t)(y0 / 2) * sub.strides[2] + x0 / 2;
+    yuv_convert(&r->yuv, &sub, patch, stride, 0, height);
+}
+
+struct recorder_y4m_job
+{
+    struct recorder *r;
+    const struct frame *frame;
+    const struct yuv_image *image;
+};
+
+// Convert one stripe of rows, as an image of its own so stripes are
+// independent. Only the last stripe can have an odd number of rows.
+static void recorder_y4m_stripe(void *data, uint32_t index, struct work_arena *arena)
+{
+    const struct recorder_y4m_job *job = data;
+    const struct frame *frame = job->frame;
+    struct recorder *r = job->r;
+    struct yuv_image view = *job->image;
+    uint32_t y0 = index * RECORDER_STRIPE_ROWS, rows = frame->height - y0;
+    const uint8_t *src = frame->planes[0].data + (size_t)y0 * frame->planes[0].stride;
+    uint32_t src_stride = frame->planes[0].stride;
+
+    if (rows > RECORDER_STRIPE_ROWS)
+        rows = RECORDER_STRIPE_ROWS;
+    view.height = rows;
+    view.planes[0] += (size_t)y0 * view.strides[0];
+    view.planes[1] += (size_t)(y0 / 2) * view.strides[1];
+    view.planes[2] += (size_t)(y0 / 2) * view.strides[2];
+    if (r->swizzle_first)
+    {
+        uint8_t *scratch = work_arena_alloc(arena, (size_t)frame->width * 4 * rows);
+
+        if (!scratch)
+            return;
+        convert_rows(&r->swizzle, scratch, frame->width * 4, src, src_stride, frame->width, rows);
+        src = scratch;
+        src_stride = frame->width * 4;
+    }
+    yuv_convert(&r->yuv, &view, src, src_stride, 0, rows);
+}
+
+static int recorder_record_y4m(struct recorder *r, const struct frame *frame)
+{
+    static const char frame_tag[] = "FRAME\n";
+    uint32_t chroma_width = (frame->width + 1) / 2, chroma_height = (frame->height + 1) / 2;
+    size_t luma = (size_t)frame->width * frame->height;
+    size_t chroma = (size_t)chroma_width * chroma_height;
+    char header[128];
+    int header_size = 0;
+    struct record_buffer *buf;
+    struct yuv_image image;
+    uint8_t *p;
+
+    if (!r->y4m_ready)
+    {
+        if (recorder_y4m_init(r, frame) < 0)
+        {
+            // No frame will ever match, refused from now on.
+            printf("Can't record format %u as Y4M\n", frame->format);
+            r->format = SPA_VIDEO_FORMAT_UNKNOWN;
+            r->y4m_ready = true;
+            return -ENOTSUP;
+        }
+        // The stream's real rate is variable, players get the nominal one
+        // and the raw container keeps the pts.
+        header_size = snprintf(header, sizeof(header),
+                               "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+                               frame->width, frame->height);
+    }
+    // Y4M can't change mid-stream.
+    if (frame->format != r->format || frame->width != r->width || frame->height != r->height)
+        return -ENOTSUP;
+
+    if (!(buf = recorder_buffer(r, header_size + sizeof(frame_tag) - 1 + luma + 2 * chroma)))
+        return -ENOMEM;
+    p = buf->data + buf->size;
+    memcpy(p, header, header_size);
+    p += header_size;
+    memcpy(p, frame_tag, sizeof(frame_tag) - 1);
+    p += sizeof(frame_tag) - 1;
+
+    // Converted straight into the write buffer.
+    image = (struct yuv_image){
+        .format = SPA_VIDEO_FORMAT_I420,
+        .width = frame->width,
+        .height = frame->height,
+        .planes = {p, p + luma, p + luma + chroma},
+        .strides = {frame->width, chroma_width, chroma_width},
+    };
+    work_pool_run(r->pool, (frame->height + RECORDER_STRIPE_ROWS - 1) / RECORDER_STRIPE_ROWS,
+                  recorder_y4m_stripe, &(struct recorder_y4m_job){r, frame, &image});
+    recorder_y4m_cursor(r, frame, &image);
+    buf->size = p + luma + 2 * chroma - buf->data;
+    return recorder_flush(r, buf);
+}
+
+// Write out the carry and, for the raw container, the index.
+static void recorder_finish(struct recorder *r)
+{
+    struct record_index_trailer trailer = {
+        .magic = RECORD_INDEX_MAGIC,
+        .n_frames = r->n_index,
+    };
+    int res;
+
+    while (r->in_flight)
+        recorder_reap(r, true);
+    if (r->failed || r->written == 0)
+        return;
+
+    // The tail isn't aligned, write it through the page cache.
+    if (r->direct && fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT) < 0)
+    {
+        recorder_fail(r, -errno);
+        return;
+    }
+    if ((res = write_all(r->fd, r->carry, r->carry_size, r->offset)) < 0)
+    {
+        recorder_fail(r, res);
+        return;
+    }
+    r->offset += r->carry_size;
+    atomic_fetch_add_explicit(&r->bytes, r->carry_size, memory_order_relaxed);
+    r->carry_size = 0;
+    if (r->y4m)
+        return;
+
+    trailer.index_offset = r->offset;
+    if ((res = write_all(r->fd, (const uint8_t *)r->index, r->n_index * sizeof(*r->index),
+                         r->offset)) < 0 ||
+        (res = write_all(r->fd, (const uint8_t *)&trailer, sizeof(trailer),
+                         r->offset + r->n_index * sizeof(*r->index))) < 0)
+        recorder_fail(r, res);
+}
+
+static void recorder_report(struct recorder *r, uint64_t *last_ns)
+{
+    struct recorder_stats stats;
+    uint64_t now = frame_ring_now_ns();
+
+    if (now - *last_ns < RECORDER_REPORT_NS)
+        return;
+    *last_ns = now;
+    recorder_get_stats(r, &stats);
+    if (stats.write_ns)
+        printf("Recorder: %lu frames, %.1f MB/s, %lu dropped\n", (unsigned long)stats.frames,
+               stats.bytes / (stats.write_ns / 1e9) / 1e6, (unsigned long)stats.dropped);
+}
+
+static void *recorder_thread(void *data)
+{
+    struct recorder *r = data;
+    uint64_t last_report = frame_ring_now_ns();
+
+    while (!atomic_load(&r->quit))
+    {
+        struct frame *frame;
+        int res;
+
+        // Never take a frame without a buffer for it, meanwhile the ring
+        // keeps replacing it with the newest.
+        recorder_reap(r, r->in_flight == RECORDER_DEPTH);
+        recorder_report(r, &last_report);
+        if (!(frame = frame_ring_wait(&r->ring, RECORDER_POLL_MS)))
+            continue;
+
+        res = r->failed ? -EIO
+              : r->y4m  ? recorder_record_y4m(r, frame)
+                        : recorder_record_raw(r, frame);
+        if (res == 0)
+            atomic_fetch_add_explicit(&r->frames, 1, memory_order_relaxed);
+        else
+            atomic_fetch_add_explicit(&r->refused, 1, memory_order_relaxed);
+        if (res < 0 && res != -ENOTSUP && res != -EIO)
+            recorder_fail(r, res);
+        latency_record_since(r->latency, frame->queued_ns);
+        frame_release(frame);
+    }
+    recorder_finish(r);
+    return NULL;
+}
+
+struct recorder *recorder_new(const char *path, bool direct)
+{
+    struct recorder *r = calloc(1, sizeof(*r));
+    size_t length = strlen(path);
+    int res;
+
+    if (!r)
+        return NULL;
+    if (frame_ring_init(&r->ring, FRAME_RING_LATEST) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    r->fd = -1;
+    r->latency = latency_stage("record");
+    r->y4m = length > 4 && strcmp(path + length - 4, ".y4m") == 0;
+#ifdef HAVE_IO_URING
+    r->uring.fd = -1;
+#endif
+
+    r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (direct ? O_DIRECT : 0), 0644);
+    if (r->fd < 0 && direct && errno == EINVAL)
+    {
+        // tmpfs and friends.
+        printf("%s doesn't support O_DIRECT, writing through the page cache\n", path);
+        direct = false;
+        r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (r->fd < 0)
+    {
+        printf("Failed to open %s: %m\n", path);
+        goto fail;
+    }
+    r->direct = direct;
+    if (!(r->carry = aligned_alloc(RECORDER_ALIGN, RECORDER_ALIGN)))
+        goto fail;
+    // A 4K frame at 60 fps is more conversion than one core does.
+    if (r->y4m && !(r->pool = work_pool_new(0)))
+        goto fail;
+
+#ifdef HAVE_IO_URING
+    if ((res = uring_init(&r->uring, RECORDER_DEPTH)) == 0)
+        r->use_uring = true;
+    else
+        printf("io_uring unavailable (%s), recording with pwrite\n", strerror(-res));
+#endif
+
+    if ((res = pthread_create(&r->thread, NULL, recorder_thread, r)) != 0)
+    {
+        printf("Failed to start the recorder thread: %s\n", strerror(res));
+        goto fail;
+    }
+    r->running = true;
+    printf("Recording %s to %s%s\n", r->y4m ? "Y4M" : "raw frames", path,
+           direct ? " with O_DIRECT" : "");
+    return r;
+
+fail:
+    recorder_destroy(r);
+    return NULL;
+}
+
+struct frame_ring *recorder_ring(struct recorder *rec)
+{
+    return &rec->ring;
+}
+
+void recorder_get_stats(struct recorder *rec, struct recorder_stats *stats)
+{
+    struct frame_ring_stats ring;
+    uint64_t start = atomic_load_explicit(&rec->start_ns, memory_order_relaxed);
+    uint64_t end = atomic_load_explicit(&rec->end_ns, memory_order_relaxed);
+
+    frame_ring_get_stats(&rec->ring, &ring);
+    stats->frames = atomic_load_explicit(&rec->frames, memory_order_relaxed);
+    stats->dropped = ring.dropped + atomic_load_explicit(&rec->refused, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&rec->bytes, memory_order_relaxed);
+    stats->write_ns = start && end > start ? end - start : 0;
+    stats->io_uring = rec->use_uring;
+}
+
+void recorder_stop(struct recorder *rec)
+{
+    struct recorder_stats stats;
+
+    if (!rec->running || atomic_exchange(&rec->quit, true))
+        return;
+    frame_ring_wake(&rec->ring);
+    pthread_join(rec->thread, NULL);
+
+    recorder_get_stats(rec, &stats);
+    printf("Recorded %lu frames, %lu MB at %.1f MB/s with %s, %lu dropped\n",
+           (unsigned long)stats.frames, (unsigned long)(stats.bytes >> 20),
+           stats.write_ns ? stats.bytes / (stats.write_ns / 1e9) / 1e6 : 0.0,
+           stats.io_uring ? "io_uring" : "pwrite", (unsigned long)stats.dropped);
+}
+
+void recorder_destroy(struct recorder *rec)
+{
+    recorder_stop(rec);
+#ifdef HAVE_IO_URING
+    if (rec->uring.fd >= 0)
+        uring_clear(&rec->uring);
+#endif
+    if (rec->fd >= 0)
+        close(rec->fd);
+    for (uint32_t i = 0; i < RECORDER_DEPTH; i++)
+        free(rec->buffers[i].data);
+    free(rec->carry);
+    work_pool_destroy(rec->pool);
+    free(rec->cursor_patch);
+    free(rec->index);
+    frame_ring_clear(&rec->ring);
+    free(rec);
+}
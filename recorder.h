@@ -0,0 +1,88 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "ring.h"
+
+// Writes in flight at once. The copy into the next buffer overlaps the
+// write of the previous one, more only helps disks with deep queues.
+#define RECORDER_DEPTH 2
+// Buffers, write sizes and offsets are aligned to this for O_DIRECT.
+#define RECORDER_ALIGN 4096
+
+// Raw container, for any path not ending in .y4m: a file header, then one
+// record per frame with its planes packed row after row, then the offsets
+// of all frame records and a trailer at the very end of the file.
+#define RECORD_MAGIC 0x57524353       // "SCRW"
+#define RECORD_FRAME_MAGIC 0x46524353 // "SCRF"
+#define RECORD_INDEX_MAGIC 0x49524353 // "SCRI"
+#define RECORD_VERSION 1
+
+struct record_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct record_frame_header
+{
+    uint32_t magic;
+    uint32_t format; // enum spa_video_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    uint32_t reserved;
+    uint64_t seq;
+    int64_t pts;
+    uint32_t strides[FRAME_MAX_PLANES];
+    uint32_t sizes[FRAME_MAX_PLANES];
+};
+
+// Follows `n_frames` little endian uint64_t file offsets of the frame
+// records, which start at `index_offset`.
+struct record_index_trailer
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t n_frames;
+    uint64_t index_offset;
+};
+
+// Records a stream to disk on a thread of its own, fed through a
+// FRAME_RING_LATEST ring by wire_add_consumer(). Frames are copied into one
+// of RECORDER_DEPTH aligned buffers and the capture buffer is released right
+// away, then written with io_uring where the kernel has it and pwrite
+// otherwise. While every buffer is still being written the ring keeps only
+// the newest frame, so a stalled disk drops frames instead of holding
+// capture buffers.
+//
+// A path ending in .y4m gets a YUV4MPEG2 stream, converted to I420.
+struct recorder;
+
+struct recorder_stats
+{
+    uint64_t frames;   // written
+    uint64_t dropped;  // replaced in the ring or not recordable
+    uint64_t bytes;    // written to the file
+    uint64_t write_ns; // since the first write was submitted
+    bool io_uring;
+};
+
+// With `direct` the file is opened O_DIRECT, bypassing the page cache.
+struct recorder *recorder_new(const char *path, bool direct);
+
+// Hand to wire_add_consumer().
+struct frame_ring *recorder_ring(struct recorder *rec);
+
+void recorder_get_stats(struct recorder *rec, struct recorder_stats *stats);
+
+// Same two steps as the other consumers: stop before the session is
+// destroyed, which writes out what is in flight and finishes the file,
+// destroy after.
+void recorder_stop(struct recorder *rec);
+void recorder_destroy(struct recorder *rec);
+
+#endif
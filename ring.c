@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+
+#define RING_MASK (MAX_BUFFERS - 1)
+#define RING_SKIPPED ((uintptr_t)1)
+
+_Static_assert((MAX_BUFFERS & RING_MASK) == 0, "MAX_BUFFERS must be a power of two");
+
+int frame_ring_init(struct frame_ring *ring, enum frame_ring_mode mode)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->mode = mode;
+    ring->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->wakeup_fd < 0)
+        return -errno;
+    return 0;
+}
+
+// Drops every frame still held by the ring. Only call once the producer
+// stopped pushing.
+void frame_ring_clear(struct frame_ring *ring)
+{
+    struct frame *frame;
+
+    while ((frame = frame_ring_pop(ring)))
+        frame_release(frame);
+    if (ring->wakeup_fd >= 0)
+        close(ring->wakeup_fd);
+    ring->wakeup_fd = -1;
+}
+
+static void ring_wakeup(struct frame_ring *ring)
+{
+    uint64_t one = 1;
+
+    // Pairs with the store in frame_ring_wait, the eventfd is only written
+    // when the consumer is about to sleep.
+    if (!atomic_load(&ring->waiting) && !atomic_load(&ring->polled))
+        return;
+    if (write(ring->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        printf("Failed to wake frame consumer: %m\n");
+}
+
+void frame_ring_wake(struct frame_ring *ring)
+{
+    uint64_t one = 1;
+
+    if (write(ring->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        printf("Failed to wake frame consumer: %m\n");
+}
+
+int frame_ring_poll_fd(struct frame_ring *ring)
+{
+    atomic_store(&ring->polled, true);
+    return ring->wakeup_fd;
+}
+
+bool frame_ring_push(struct frame_ring *ring, struct frame *frame)
+{
+    uint64_t start = frame_ring_now_ns();
+    bool queued = true;
+
+    frame_ref(frame);
+    atomic_fetch_add_explicit(&ring->pushed, 1, memory_order_relaxed);
+
+    if (ring->mode == FRAME_RING_LATEST)
+    {
+        uintptr_t old = atomic_load(&ring->latest), value;
+
+        // Replacing an unconsumed frame loses its damage, tag the new one.
+        do
+            value = (uintptr_t)frame | (old ? RING_SKIPPED : 0);
+        while (!atomic_compare_exchange_weak(&ring->latest, &old, value));
+
+        if (old)
+        {
+            queued = false;
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            frame_release((struct frame *)(old & ~RING_SKIPPED));
+        }
+    }
+    else
+    {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if (head - tail >= MAX_BUFFERS)
+        {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            ring->skip_pending = true;
+            frame_release(frame);
+            queued = false;
+            goto done;
+        }
+        ring->slots[head & RING_MASK] = (uintptr_t)frame | (ring->skip_pending ? RING_SKIPPED : 0);
+        ring->skip_pending = false;
+        atomic_store(&ring->head, head + 1);
+    }
+    ring_wakeup(ring);
+
+done:
+    atomic_fetch_add_explicit(&ring->producer_wait_ns, frame_ring_now_ns() - start,
+                              memory_order_relaxed);
+    return queued;
+}
+
+struct frame *frame_ring_pop(struct frame_ring *ring)
+{
+    struct frame *frame;
+    uintptr_t value = 0;
+
+    if (ring->mode == FRAME_RING_LATEST)
+    {
+        value = atomic_exchange(&ring->latest, 0);
+    }
+    else
+    {
+        unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned head = atomic_load(&ring->head);
+
+        if (head != tail)
+        {
+            value = ring->slots[tail & RING_MASK];
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+        }
+    }
+
+    frame = (struct frame *)(value & ~RING_SKIPPED);
+    if (frame)
+    {
+        ring->skipped = value & RING_SKIPPED;
+        atomic_fetch_add_explicit(&ring->popped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&ring->queue_wait_ns,
+                                  frame_ring_now_ns() - frame->queued_ns,
+                                  memory_order_relaxed);
+    }
+    return frame;
+}
+
+struct frame *frame_ring_wait(struct frame_ring *ring, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = ring->wakeup_fd, .events = POLLIN};
+    struct frame *frame;
+    uint64_t start, value;
+
+    if ((frame = frame_ring_pop(ring)))
+        return frame;
+
+    start = frame_ring_now_ns();
+    atomic_store(&ring->waiting, true);
+    // Re-check after announcing ourselves, a push may have raced with the
+    // first pop and skipped the wakeup.
+    while (!(frame = frame_ring_pop(ring)))
+    {
+        int res = poll(&pfd, 1, timeout_ms);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        // Either a push or frame_ring_wake, the final pop below tells.
+        if (read(ring->wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            printf("Failed to read frame ring wakeup: %m\n");
+        break;
+    }
+    atomic_store(&ring->waiting, false);
+
+    atomic_fetch_add_explicit(&ring->consumer_wait_ns, frame_ring_now_ns() - start,
+                              memory_order_relaxed);
+    if (!frame)
+        frame = frame_ring_pop(ring);
+    return frame;
+}
+
+void frame_ring_get_stats(struct frame_ring *ring, struct frame_ring_stats *stats)
+{
+    stats->pushed = atomic_load_explicit(&ring->pushed, memory_order_relaxed);
+    stats->popped = atomic_load_explicit(&ring->popped, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    stats->producer_wait_ns = atomic_load_explicit(&ring->producer_wait_ns, memory_order_relaxed);
+    stats->queue_wait_ns = atomic_load_explicit(&ring->queue_wait_ns, memory_order_relaxed);
+    stats->consumer_wait_ns = atomic_load_explicit(&ring->consumer_wait_ns, memory_order_relaxed);
+}
@@ -0,0 +1,98 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "frame.h"
+
+enum frame_ring_mode
+{
+    // Keep only the newest frame, an unconsumed older one is dropped.
+    FRAME_RING_LATEST,
+    // Queue every frame, new frames are dropped while the ring is full. It
+    // has MAX_BUFFERS slots, as many frames as one pool has out, so only a
+    // producer pushing frames of several pools can fill it.
+    FRAME_RING_QUEUE,
+};
+
+struct frame_ring_stats
+{
+    uint64_t pushed;
+    uint64_t popped;
+    uint64_t dropped;
+    uint64_t producer_wait_ns; // time the producer spent publishing
+    uint64_t queue_wait_ns;    // time frames sat in the ring
+    uint64_t consumer_wait_ns; // time the consumer blocked in frame_ring_wait
+};
+
+// Lock-free single-producer single-consumer ring of frame handles. The
+// producer is the PipeWire thread, the consumer any other thread. Every
+// frame in the ring holds one reference that the consumer must drop with
+// frame_release() once it is done with the pixels.
+//
+// Handles carry a tag bit when frames before them were dropped, so damage
+// driven consumers know the frame's damage list doesn't cover everything
+// that changed since the frame they saw last.
+struct frame_ring
+{
+    enum frame_ring_mode mode;
+    int wakeup_fd;
+
+    _Alignas(64) atomic_uint head;
+    _Atomic uintptr_t latest;
+    atomic_bool waiting;
+    atomic_bool polled; // see frame_ring_poll_fd
+    bool skip_pending; // producer only
+
+    _Alignas(64) atomic_uint tail;
+    bool skipped; // consumer only, see frame_ring_skipped
+
+    _Alignas(64) uintptr_t slots[MAX_BUFFERS];
+
+    _Atomic uint64_t pushed;
+    _Atomic uint64_t popped;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t producer_wait_ns;
+    _Atomic uint64_t queue_wait_ns;
+    _Atomic uint64_t consumer_wait_ns;
+};
+
+int frame_ring_init(struct frame_ring *ring, enum frame_ring_mode mode);
+void frame_ring_clear(struct frame_ring *ring);
+
+// Producer side, never blocks. Takes its own reference on `frame`. Returns
+// false if `frame` or an unconsumed older frame was dropped.
+bool frame_ring_push(struct frame_ring *ring, struct frame *frame);
+
+// Consumer side. frame_ring_pop returns NULL when empty, frame_ring_wait
+// blocks up to `timeout_ms` (-1 forever) for the next frame. It also
+// returns NULL early after frame_ring_wake, so a consumer can be stopped.
+struct frame *frame_ring_pop(struct frame_ring *ring);
+struct frame *frame_ring_wait(struct frame_ring *ring, int timeout_ms);
+void frame_ring_wake(struct frame_ring *ring);
+
+// For consumers with a poll loop of their own: the returned eventfd becomes
+// readable on every push from now on. Read it, then frame_ring_pop until
+// the ring is empty.
+int frame_ring_poll_fd(struct frame_ring *ring);
+
+// Whether frames were dropped right before the one last popped, the
+// consumer must then treat that frame as fully damaged.
+static inline bool frame_ring_skipped(const struct frame_ring *ring)
+{
+    return ring->skipped;
+}
+
+void frame_ring_get_stats(struct frame_ring *ring, struct frame_ring_stats *stats);
+
+static inline uint64_t frame_ring_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,748 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cursor.h"
+#include "metrics.h"
+#include "pool.h"
+#include "ring.h"
+#include "scale.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCALE_X86 1
+#endif
+
+// The vertical pass keeps 8 fractional bits, the horizontal one rounds
+// them away together with its own weights.
+#define SCALE_ROW_SHIFT (SCALE_SHIFT - 8)
+#define SCALE_COLUMN_SHIFT (SCALE_SHIFT + 8)
+
+static const char *scale_filter_names[] = {
+    [SCALE_FILTER_BOX] = "box",
+    [SCALE_FILTER_BILINEAR] = "bilinear",
+    [SCALE_FILTER_AREA] = "area",
+};
+
+const char *scale_filter_name(enum scale_filter filter)
+{
+    return filter <= SCALE_FILTER_AREA ? scale_filter_names[filter] : "?";
+}
+
+int scale_filter_from_name(const char *name)
+{
+    for (int i = SCALE_FILTER_BOX; i <= SCALE_FILTER_AREA; i++)
+    {
+        if (strcmp(name, scale_filter_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Source pixels and weights of output pixel `i`, in `w` from source pixel
+// `*first` on. Returns how many there are.
+static uint32_t scale_taps_compute(double *w, int64_t *first, uint32_t i, double scale,
+                                   enum scale_filter filter)
+{
+    double a = i * scale, b = (i + 1) * scale;
+    int64_t j0, j1;
+
+    switch (filter)
+    {
+    case SCALE_FILTER_BILINEAR:
+    {
+        double center = (i + 0.5) * scale - 0.5, f;
+
+        j0 = (int64_t)floor(center);
+        f = center - j0;
+        *first = j0;
+        w[0] = 1 - f;
+        w[1] = f;
+        return 2;
+    }
+    case SCALE_FILTER_BOX:
+        j0 = llround(a);
+        j1 = llround(b);
+        if (j1 <= j0)
+            j1 = j0 + 1;
+        *first = j0;
+        for (int64_t j = j0; j < j1; j++)
+            w[j - j0] = 1.0 / (j1 - j0);
+        return j1 - j0;
+    case SCALE_FILTER_AREA:
+    default:
+        j0 = (int64_t)floor(a);
+        j1 = (int64_t)ceil(b);
+        *first = j0;
+        for (int64_t j = j0; j < j1; j++)
+            w[j - j0] = (fmin(b, j + 1) - fmax(a, j)) / scale;
+        return j1 - j0;
+    }
+}
+
+static void scale_taps_clear(struct scale_taps *t)
+{
+    free(t->start);
+    free(t->weights);
+    memset(t, 0, sizeof(*t));
+}
+
+// Taps mapping `src` pixels to `dst`. Taps past the edges fold onto the
+// edge pixel, windows are moved inside the source so every output can
+// read n pixels from its start.
+static int scale_taps_init(struct scale_taps *t, uint32_t src, uint32_t dst,
+                           enum scale_filter filter)
+{
+    double scale = (double)src / dst;
+    double *w, *folded;
+    uint32_t n = filter == SCALE_FILTER_BILINEAR ? 2 : (uint32_t)ceil(scale) + 1;
+
+    if (n > src)
+        n = src;
+    t->n = n;
+    t->start = malloc(dst * sizeof(*t->start));
+    t->weights = malloc((size_t)dst * n * sizeof(*t->weights));
+    w = malloc(((size_t)ceil(scale) + 2) * 2 * sizeof(*w));
+    if (!t->start || !t->weights || !w)
+    {
+        free(w);
+        scale_taps_clear(t);
+        return -ENOMEM;
+    }
+    folded = w + (size_t)ceil(scale) + 2;
+
+    for (uint32_t i = 0; i < dst; i++)
+    {
+        int64_t first, start;
+        uint32_t count = scale_taps_compute(w, &first, i, scale, filter);
+        int32_t sum = 0;
+        int16_t *q = t->weights + (size_t)i * n;
+
+        start = first < 0 ? 0 : first;
+        if (start > (int64_t)(src - n))
+            start = src - n;
+        memset(folded, 0, n * sizeof(*folded));
+        for (uint32_t k = 0; k < count; k++)
+        {
+            int64_t j = first + k;
+
+            j = j < 0 ? 0 : j >= src ? src - 1 : j;
+            folded[j - start] += w[k];
+        }
+
+        for (uint32_t k = 0; k < n; k++)
+        {
+            q[k] = lround(folded[k] * (1 << SCALE_SHIFT));
+            sum += q[k];
+        }
+        // Spread the rounding error over the taps a unit at a time, the
+        // sum is exact and no weight turns negative.
+        for (uint32_t k = 0; sum != 1 << SCALE_SHIFT; k = (k + 1) % n)
+        {
+            int step = sum < 1 << SCALE_SHIFT ? 1 : -1;
+
+            if (folded[k] == 0 || q[k] + step < 0)
+                continue;
+            q[k] += step;
+            sum += step;
+        }
+        t->start[i] = start;
+    }
+    free(w);
+    return 0;
+}
+
+// Vertical pass over bytes [x0, x1) of output row y.
+static void scale_rows_span(const struct scaler *s, uint16_t *acc, const uint8_t *src,
+                            uint32_t src_stride, uint32_t y, uint32_t x0, uint32_t x1)
+{
+    const int16_t *w = s->rows.weights + (size_t)y * s->rows.n;
+    const uint8_t *row = src + (size_t)s->rows.start[y] * src_stride;
+
+    for (uint32_t x = x0; x < x1; x++)
+    {
+        int32_t sum = 1 << (SCALE_ROW_SHIFT - 1);
+
+        for (uint32_t t = 0; t < s->rows.n; t++)
+            sum += w[t] * row[(size_t)t * src_stride + x];
+        acc[x] = sum >> SCALE_ROW_SHIFT;
+    }
+}
+
+static void scale_rows_scalar(const struct scaler *s, uint16_t *acc, const uint8_t *src,
+                              uint32_t src_stride, uint32_t y)
+{
+    scale_rows_span(s, acc, src, src_stride, y, 0, s->src_width * s->bpp);
+}
+
+static void scale_columns_scalar(const struct scaler *s, uint8_t *dst, const uint16_t *acc)
+{
+    uint32_t n = s->columns.n, bpp = s->bpp;
+
+    for (uint32_t x = 0; x < s->dst_width; x++)
+    {
+        const int16_t *w = s->columns.weights + (size_t)x * n;
+        const uint16_t *p = acc + (size_t)s->columns.start[x] * bpp;
+
+        for (uint32_t c = 0; c < bpp; c++)
+        {
+            uint32_t sum = 1u << (SCALE_COLUMN_SHIFT - 1);
+
+            for (uint32_t t = 0; t < n; t++)
+                sum += w[t] * p[t * bpp + c];
+            dst[x * bpp + c] = sum >> SCALE_COLUMN_SHIFT;
+        }
+    }
+}
+
+#ifdef SCALE_X86
+// 16 bytes of every tap row at a time, two rows interleaved per madd so
+// each multiply-add covers a pair of taps.
+__attribute__((target("avx2"))) static void scale_rows_avx2(const struct scaler *s,
+                                                            uint16_t *acc, const uint8_t *src,
+                                                            uint32_t src_stride, uint32_t y)
+{
+    const int16_t *w = s->rows.weights + (size_t)y * s->rows.n;
+    const uint8_t *row = src + (size_t)s->rows.start[y] * src_stride;
+    const uint32_t n = s->rows.n, bytes = s->src_width * s->bpp;
+    const __m256i round = _mm256_set1_epi32(1 << (SCALE_ROW_SHIFT - 1));
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t x = 0;
+
+    for (; x + 16 <= bytes; x += 16)
+    {
+        __m256i lo = round, hi = round;
+        uint32_t t = 0;
+
+        for (; t + 2 <= n; t += 2)
+        {
+            __m256i a = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(row + (size_t)t * src_stride + x)));
+            __m256i b = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(row + (size_t)(t + 1) * src_stride + x)));
+            __m256i wv = _mm256_set1_epi32((uint16_t)w[t] | (uint32_t)(uint16_t)w[t + 1] << 16);
+
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), wv));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), wv));
+        }
+        if (t < n)
+        {
+            __m256i a = _mm256_cvtepu8_epi16(
+                _mm_loadu_si128((const __m128i *)(row + (size_t)t * src_stride + x)));
+            __m256i wv = _mm256_set1_epi32((uint16_t)w[t]);
+
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, zero), wv));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, zero), wv));
+        }
+        // Lane-wise pack puts the halves back in order.
+        lo = _mm256_srli_epi32(lo, SCALE_ROW_SHIFT);
+        hi = _mm256_srli_epi32(hi, SCALE_ROW_SHIFT);
+        _mm256_storeu_si256((__m256i *)(acc + x), _mm256_packus_epi32(lo, hi));
+    }
+    scale_rows_span(s, acc, src, src_stride, y, x, bytes);
+}
+
+// One 4-byte pixel at a time, the taps two by two in the two lanes.
+__attribute__((target("avx2"))) static void scale_columns_avx2(const struct scaler *s,
+                                                               uint8_t *dst, const uint16_t *acc)
+{
+    const uint32_t n = s->columns.n;
+    const __m128i round = _mm_set1_epi32(1 << (SCALE_COLUMN_SHIFT - 1));
+
+    for (uint32_t x = 0; x < s->dst_width; x++)
+    {
+        const int16_t *w = s->columns.weights + (size_t)x * n;
+        const uint16_t *p = acc + (size_t)s->columns.start[x] * 4;
+        __m256i sum = _mm256_setzero_si256();
+        __m128i sum4;
+        uint32_t t = 0;
+
+        for (; t + 2 <= n; t += 2)
+        {
+            __m256i px = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(p + t * 4)));
+            __m256i wv = _mm256_set_m128i(_mm_set1_epi32(w[t + 1]), _mm_set1_epi32(w[t]));
+
+            sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(px, wv));
+        }
+        sum4 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        if (t < n)
+        {
+            __m128i px = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(p + t * 4)));
+
+            sum4 = _mm_add_epi32(sum4, _mm_mullo_epi32(px, _mm_set1_epi32(w[t])));
+        }
+        sum4 = _mm_srli_epi32(_mm_add_epi32(sum4, round), SCALE_COLUMN_SHIFT);
+        sum4 = _mm_packus_epi32(sum4, sum4);
+        sum4 = _mm_packus_epi16(sum4, sum4);
+        uint32_t pixel = _mm_cvtsi128_si32(sum4);
+        memcpy(dst + x * 4, &pixel, 4);
+    }
+}
+#endif
+
+int scaler_init(struct scaler *s, uint32_t dst_format, uint32_t dst_width, uint32_t dst_height,
+                uint32_t src_format, uint32_t src_width, uint32_t src_height,
+                enum scale_filter filter, enum convert_impl impl)
+{
+    int res;
+
+    memset(s, 0, sizeof(*s));
+    if (!dst_width || !dst_height || !src_width || !src_height)
+        return -EINVAL;
+    if (impl == CONVERT_IMPL_AUTO)
+        impl = convert_best_impl();
+    else if (impl > convert_best_impl())
+        return -ENOTSUP;
+    if ((res = convert_init(&s->swizzle, dst_format, src_format, impl)) < 0)
+        return res;
+
+    s->src_format = src_format;
+    s->src_width = src_width;
+    s->src_height = src_height;
+    s->dst_format = dst_format;
+    s->dst_width = dst_width;
+    s->dst_height = dst_height;
+    s->bpp = convert_format_bpp(src_format);
+    s->filter = filter;
+    s->impl = impl;
+    s->convert = dst_format != src_format;
+    if ((res = scale_taps_init(&s->rows, src_height, dst_height, filter)) < 0 ||
+        (res = scale_taps_init(&s->columns, src_width, dst_width, filter)) < 0)
+    {
+        scaler_clear(s);
+        return res;
+    }
+
+    s->filter_rows = scale_rows_scalar;
+    s->filter_columns = scale_columns_scalar;
+#ifdef SCALE_X86
+    if (impl == CONVERT_IMPL_AVX2)
+    {
+        s->filter_rows = scale_rows_avx2;
+        if (s->bpp == 4)
+            s->filter_columns = scale_columns_avx2;
+    }
+#endif
+    return 0;
+}
+
+void scaler_clear(struct scaler *s)
+{
+    scale_taps_clear(&s->rows);
+    scale_taps_clear(&s->columns);
+}
+
+static size_t scaler_acc_size(const struct scaler *s)
+{
+    return ((size_t)s->src_width * s->bpp * sizeof(uint16_t) + 63) & ~(size_t)63;
+}
+
+size_t scaler_scratch_size(const struct scaler *s)
+{
+    return scaler_acc_size(s) + (size_t)s->dst_width * s->bpp;
+}
+
+void scaler_rows(const struct scaler *s, uint8_t *dst, uint32_t dst_stride, const uint8_t *src,
+                 uint32_t src_stride, uint32_t y_begin, uint32_t y_end, void *scratch)
+{
+    uint16_t *acc = scratch;
+    uint8_t *row = (uint8_t *)scratch + scaler_acc_size(s);
+
+    if (y_end > s->dst_height)
+        y_end = s->dst_height;
+    for (uint32_t y = y_begin; y < y_end; y++)
+    {
+        uint8_t *out = dst + (size_t)y * dst_stride;
+
+        s->filter_rows(s, acc, src, src_stride, y);
+        if (!s->convert)
+        {
+            s->filter_columns(s, out, acc);
+            continue;
+        }
+        s->filter_columns(s, row, acc);
+        convert_rows(&s->swizzle, out, 0, row, 0, s->dst_width, 1);
+    }
+}
+
+// Outputs whose taps reach into source pixels [begin, end).
+static void scale_taps_map(const struct scale_taps *t, uint32_t n_out, uint32_t begin,
+                           uint32_t end, uint32_t *out_begin, uint32_t *out_end)
+{
+    uint32_t lo = 0, hi = n_out;
+
+    // Starts never decrease, binary search the first output ending past
+    // `begin` and the first starting at or after `end`.
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (t->start[mid] + t->n <= begin)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *out_begin = lo;
+    hi = n_out;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (t->start[mid] < end)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *out_end = lo;
+}
+
+struct frame_rect scaler_map_rect(const struct scaler *s, const struct frame_rect *rect)
+{
+    uint32_t x0, x1, y0, y1;
+
+    scale_taps_map(&s->columns, s->dst_width, rect->x, rect->x + rect->width, &x0, &x1);
+    scale_taps_map(&s->rows, s->dst_height, rect->y, rect->y + rect->height, &y0, &y1);
+    if (x0 >= x1 || y0 >= y1)
+        return (struct frame_rect){0, 0, 0, 0};
+    return (struct frame_rect){x0, y0, x1 - x0, y1 - y0};
+}
+
+// Output buffers of a stage. One holds the last scaled frame for pointer
+// only updates, the others rotate through the consumers.
+#define SCALE_STAGE_BUFFERS 6
+#define SCALE_STAGE_MAX_CONSUMERS 8
+// Output rows per pool item.
+#define SCALE_STAGE_STRIPE_ROWS 16
+// Longest the stage waits for a frame before it looks at quit.
+#define SCALE_STAGE_POLL_MS 50
+
+struct scale_buffer
+{
+    uint8_t *data;
+    size_t capacity;
+    // A pointer-only frame shows the pixels of `base` and holds a
+    // reference on it until the buffer is reused.
+    struct frame *base;
+    struct frame frame;
+};
+
+struct scale_stage
+{
+    struct frame_ring ring;
+    struct frame_ring *consumers[SCALE_STAGE_MAX_CONSUMERS];
+    atomic_uint n_consumers;
+
+    pthread_t thread;
+    bool running;
+    atomic_bool quit;
+
+    _Atomic uint64_t size; // width | height << 32
+    uint32_t format;
+    enum scale_filter filter;
+    struct work_pool *pool;
+    struct scaler scaler;
+    bool scaler_valid;
+
+    struct frame_pool frame_pool;
+    uint64_t free; // buffers no frame refers to, stage thread only
+    struct scale_buffer buffers[SCALE_STAGE_BUFFERS];
+    struct frame *last; // latest scaled frame, referenced
+    bool skip_next;     // a frame was dropped, the next one is fully damaged
+    uint64_t seq;
+
+    _Atomic uint64_t frames;
+    _Atomic uint64_t cursor_frames;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t scale_ns;
+};
+
+struct scale_stage_job
+{
+    const struct scaler *scaler;
+    uint8_t *dst;
+    uint32_t dst_stride;
+    const uint8_t *src;
+    uint32_t src_stride;
+};
+
+static void scale_stage_stripe(void *data, uint32_t index, struct work_arena *arena)
+{
+    const struct scale_stage_job *job = data;
+    void *scratch = work_arena_alloc(arena, scaler_scratch_size(job->scaler));
+
+    if (scratch)
+        scaler_rows(job->scaler, job->dst, job->dst_stride, job->src, job->src_stride,
+                    index * SCALE_STAGE_STRIPE_ROWS, (index + 1) * SCALE_STAGE_STRIPE_ROWS,
+                    scratch);
+}
+
+// Take back the buffers consumers are done with.
+static void scale_stage_reclaim(struct scale_stage *st)
+{
+    uint64_t returned = frame_pool_drain(&st->frame_pool);
+
+    while (returned)
+    {
+        struct scale_buffer *sb = &st->buffers[__builtin_ctzll(returned)];
+
+        returned &= returned - 1;
+        if (sb->base)
+            frame_release(sb->base);
+        sb->base = NULL;
+        cursor_image_unref(sb->frame.cursor.image);
+        sb->frame.cursor.image = NULL;
+        st->free |= UINT64_C(1) << sb->frame.id;
+    }
+}
+
+static void scale_stage_drop_last(struct scale_stage *st)
+{
+    if (st->last)
+        frame_release(st->last);
+    st->last = NULL;
+}
+
+// Scale the pixels of `frame` into `sb`, false if they can't be.
+static bool scale_stage_scale(struct scale_stage *st, struct scale_buffer *sb,
+                              const struct frame *frame, bool full)
+{
+    const struct frame_plane *plane = &frame->planes[0];
+    struct scaler *s = &st->scaler;
+    uint32_t stride = s->dst_width * convert_format_bpp(s->dst_format);
+    size_t size = (size_t)stride * s->dst_height;
+    uint64_t start = frame_ring_now_ns();
+
+    if ((uint64_t)plane->stride * (frame->height - 1) + frame->width * s->bpp > plane->size)
+        return false;
+    if (sb->capacity < size)
+    {
+        free(sb->data);
+        sb->capacity = 0;
+        if (!(sb->data = aligned_alloc(64, (size + 63) & ~(size_t)63)))
+            return false;
+        sb->capacity = size;
+    }
+
+    work_pool_run(st->pool, (s->dst_height + SCALE_STAGE_STRIPE_ROWS - 1) / SCALE_STAGE_STRIPE_ROWS,
+                  scale_stage_stripe,
+                  &(struct scale_stage_job){s, sb->data, stride, plane->data, plane->stride});
+
+    sb->frame.width = s->dst_width;
+    sb->frame.height = s->dst_height;
+    sb->frame.n_planes = 1;
+    sb->frame.planes[0] = (struct frame_plane){sb->data, stride, size};
+    sb->frame.n_damage = 0;
+    if (full)
+        frame_damage_full(&sb->frame);
+    for (uint32_t i = 0; !full && i < frame->n_damage; i++)
+    {
+        struct frame_rect r = scaler_map_rect(s, &frame->damage[i]);
+        frame_damage_add(&sb->frame, r.x, r.y, r.width, r.height);
+    }
+
+    atomic_fetch_add_explicit(&st->scale_ns, frame_ring_now_ns() - start, memory_order_relaxed);
+    metrics_add(METRIC_CONVERT_BYTES, (uint64_t)plane->stride * frame->height);
+    metrics_add(METRIC_CONVERT_NS, frame_ring_now_ns() - start);
+    return true;
+}
+
+static void scale_stage_process(struct scale_stage *st, const struct frame *frame, bool skipped)
+{
+    uint64_t size = atomic_load_explicit(&st->size, memory_order_relaxed);
+    uint32_t width = (uint32_t)size, height = size >> 32;
+    uint32_t format = st->format ? st->format : frame->format;
+    struct scaler *s = &st->scaler;
+    struct scale_buffer *sb;
+    struct frame *out;
+
+    scale_stage_reclaim(st);
+    if (!st->scaler_valid || s->src_format != frame->format || s->src_width != frame->width ||
+        s->src_height != frame->height || s->dst_format != format || s->dst_width != width ||
+        s->dst_height != height)
+    {
+        if (st->scaler_valid)
+            scaler_clear(s);
+        scale_stage_drop_last(st);
+        scale_stage_reclaim(st);
+        st->scaler_valid = frame->n_planes == 1 &&
+                           scaler_init(s, format, width, height, frame->format, frame->width,
+                                       frame->height, st->filter, CONVERT_IMPL_AUTO) == 0;
+        if (st->scaler_valid)
+            printf("Scaling %ux%u to %ux%u, %s\n", frame->width, frame->height, width, height,
+                   scale_filter_name(st->filter));
+        st->skip_next = true;
+    }
+    if (!st->scaler_valid || frame->n_planes != 1 || !st->free)
+    {
+        atomic_fetch_add_explicit(&st->dropped, 1, memory_order_relaxed);
+        st->skip_next = true;
+        return;
+    }
+
+    sb = &st->buffers[__builtin_ctzll(st->free)];
+    out = &sb->frame;
+    // Unchanged pixels, only the pointer moved: show the last frame again.
+    if (frame->n_damage == 0 && !skipped && !st->skip_next && st->last)
+    {
+        out->n_planes = 1;
+        out->planes[0] = st->last->planes[0];
+        out->n_damage = 0;
+        frame_ref(st->last);
+        sb->base = st->last;
+        atomic_fetch_add_explicit(&st->cursor_frames, 1, memory_order_relaxed);
+    }
+    else if (scale_stage_scale(st, sb, frame, skipped || st->skip_next))
+    {
+        scale_stage_drop_last(st);
+        frame_ref(out);
+        st->last = out;
+        atomic_fetch_add_explicit(&st->frames, 1, memory_order_relaxed);
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&st->dropped, 1, memory_order_relaxed);
+        st->skip_next = true;
+        return;
+    }
+    st->skip_next = false;
+    st->free &= ~(UINT64_C(1) << out->id);
+
+    out->seq = st->seq++;
+    out->format = format;
+    out->width = width;
+    out->height = height;
+    out->pts = frame->pts;
+    out->queued_ns = frame->queued_ns;
+    // The bitmap isn't resized, it is drawn at the scaled position.
+    out->cursor = frame->cursor;
+    out->cursor.x = (int64_t)frame->cursor.x * width / frame->width;
+    out->cursor.y = (int64_t)frame->cursor.y * height / frame->height;
+    cursor_image_ref(out->cursor.image);
+    atomic_store(&out->refs, 1);
+
+    unsigned n_consumers = atomic_load(&st->n_consumers);
+    for (uint32_t i = 0; i < n_consumers; i++)
+    {
+        if (!frame_ring_push(st->consumers[i], out))
+            metrics_add(METRIC_FRAMES_DROPPED, 1);
+    }
+    frame_release(out);
+}
+
+static void *scale_stage_thread(void *data)
+{
+    struct scale_stage *st = data;
+
+    while (!atomic_load(&st->quit))
+    {
+        struct frame *frame = frame_ring_wait(&st->ring, SCALE_STAGE_POLL_MS);
+
+        if (!frame)
+            continue;
+        scale_stage_process(st, frame, frame_ring_skipped(&st->ring));
+        frame_release(frame);
+    }
+    return NULL;
+}
+
+struct scale_stage *scale_stage_new(uint32_t width, uint32_t height, enum scale_filter filter,
+                                    uint32_t format)
+{
+    struct scale_stage *st = calloc(1, sizeof(*st));
+    int res;
+
+    if (!st)
+        return NULL;
+    if (frame_ring_init(&st->ring, FRAME_RING_LATEST) < 0)
+    {
+        free(st);
+        return NULL;
+    }
+    st->filter = filter;
+    st->format = format;
+    scale_stage_set_size(st, width, height);
+    for (uint32_t i = 0; i < SCALE_STAGE_BUFFERS; i++)
+    {
+        st->buffers[i].frame.id = i;
+        st->buffers[i].frame.pool = &st->frame_pool;
+    }
+    st->free = (UINT64_C(1) << SCALE_STAGE_BUFFERS) - 1;
+
+    if (!(st->pool = work_pool_new(0)))
+        goto fail;
+    if ((res = pthread_create(&st->thread, NULL, scale_stage_thread, st)) != 0)
+    {
+        printf("Failed to start the scale stage thread: %s\n", strerror(res));
+        goto fail;
+    }
+    st->running = true;
+    return st;
+
+fail:
+    scale_stage_destroy(st);
+    return NULL;
+}
+
+struct frame_ring *scale_stage_ring(struct scale_stage *stage)
+{
+    return &stage->ring;
+}
+
+int scale_stage_add_consumer(struct scale_stage *stage, struct frame_ring *ring)
+{
+    unsigned n = atomic_load(&stage->n_consumers);
+
+    if (n >= SCALE_STAGE_MAX_CONSUMERS)
+        return -ENOSPC;
+    // The stage thread reads the count first, the slot is filled before.
+    stage->consumers[n] = ring;
+    atomic_store(&stage->n_consumers, n + 1);
+    return 0;
+}
+
+void scale_stage_set_size(struct scale_stage *stage, uint32_t width, uint32_t height)
+{
+    atomic_store_explicit(&stage->size, width | (uint64_t)height << 32, memory_order_relaxed);
+}
+
+void scale_stage_get_stats(struct scale_stage *stage, struct scale_stage_stats *stats)
+{
+    stats->frames = atomic_load_explicit(&stage->frames, memory_order_relaxed);
+    stats->cursor = atomic_load_explicit(&stage->cursor_frames, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&stage->dropped, memory_order_relaxed);
+    stats->scale_ns = atomic_load_explicit(&stage->scale_ns, memory_order_relaxed);
+}
+
+void scale_stage_stop(struct scale_stage *stage)
+{
+    if (!stage->running)
+        return;
+    atomic_store(&stage->quit, true);
+    frame_ring_wake(&stage->ring);
+    pthread_join(stage->thread, NULL);
+    stage->running = false;
+
+    // The consumers stopped, what they didn't take goes back now.
+    for (uint32_t i = 0; i < atomic_load(&stage->n_consumers); i++)
+    {
+        struct frame *frame;
+
+        while ((frame = frame_ring_pop(stage->consumers[i])))
+            frame_release(frame);
+    }
+    scale_stage_drop_last(stage);
+    scale_stage_reclaim(stage);
+}
+
+void scale_stage_destroy(struct scale_stage *stage)
+{
+    scale_stage_stop(stage);
+    for (uint32_t i = 0; i < SCALE_STAGE_BUFFERS; i++)
+        free(stage->buffers[i].data);
+    if (stage->scaler_valid)
+        scaler_clear(&stage->scaler);
+    work_pool_destroy(stage->pool);
+    frame_ring_clear(&stage->ring);
+    free(stage);
+}
@@ -0,0 +1,116 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+#include "frame.h"
+
+#define SCALE_SHIFT 14
+
+enum scale_filter
+{
+    SCALE_FILTER_BOX,      // plain average of the source pixels an output pixel covers
+    SCALE_FILTER_BILINEAR, // 2x2 taps around the pixel center, cheapest, aliases below 1/2
+    SCALE_FILTER_AREA,     // average weighted by the covered part of each source pixel
+};
+
+const char *scale_filter_name(enum scale_filter filter);
+// -1 for an unknown name.
+int scale_filter_from_name(const char *name);
+
+// Taps of every output row or column: `n` source pixels from `start[i]`,
+// Q14 weights summing to 1 << SCALE_SHIFT. Every output uses the same
+// number of taps, zero weights pad the short ones, so the kernels don't
+// branch on the filter.
+struct scale_taps
+{
+    uint32_t n;
+    uint32_t *start;
+    int16_t *weights; // n per output
+};
+
+struct scaler;
+typedef void (*scale_rows_func_t)(const struct scaler *s, uint16_t *acc, const uint8_t *src,
+                                  uint32_t src_stride, uint32_t y);
+typedef void (*scale_columns_func_t)(const struct scaler *s, uint8_t *dst, const uint16_t *acc);
+
+// Separable resampler from one packed RGB format and size to another. Each
+// output row is first filtered vertically out of the source rows it covers
+// into a row of 8.8 fixed point samples, then horizontally into pixels of
+// the source's byte order, converted to the output format while the row is
+// still in L1. Source rows are read once as long as the taps of
+// consecutive output rows don't overlap, which holds for downscales.
+struct scaler
+{
+    uint32_t src_format;
+    uint32_t src_width;
+    uint32_t src_height;
+    uint32_t dst_format;
+    uint32_t dst_width;
+    uint32_t dst_height;
+    uint32_t bpp; // of the source
+    enum scale_filter filter;
+    enum convert_impl impl;
+    struct scale_taps rows;
+    struct scale_taps columns;
+    scale_rows_func_t filter_rows;
+    scale_columns_func_t filter_columns;
+    // Formats differ, applied to each output row.
+    bool convert;
+    struct convert swizzle;
+};
+
+// Returns -ENOTSUP if either format isn't a packed RGB format, -EINVAL for
+// an empty size.
+int scaler_init(struct scaler *s, uint32_t dst_format, uint32_t dst_width, uint32_t dst_height,
+                uint32_t src_format, uint32_t src_width, uint32_t src_height,
+                enum scale_filter filter, enum convert_impl impl);
+void scaler_clear(struct scaler *s);
+
+// Scratch one scaler_rows call needs.
+size_t scaler_scratch_size(const struct scaler *s);
+
+// Produce output rows [y_begin, y_end). Disjoint ranges can be scaled
+// concurrently, each with scratch of its own.
+void scaler_rows(const struct scaler *s, uint8_t *dst, uint32_t dst_stride, const uint8_t *src,
+                 uint32_t src_stride, uint32_t y_begin, uint32_t y_end, void *scratch);
+
+// Output rectangle covering everything `rect` of the source touches.
+struct frame_rect scaler_map_rect(const struct scaler *s, const struct frame_rect *rect);
+
+// A consumer of full resolution frames that republishes them scaled to a
+// fixed size, independent of the size negotiated with the compositor, to
+// consumers of its own. Frames are scaled in stripes on a work pool into
+// buffers of the stage, which are reused once every consumer released
+// them.
+struct scale_stage;
+
+struct scale_stage_stats
+{
+    uint64_t frames;  // scaled and published
+    uint64_t cursor;  // pointer only, published without scaling again
+    uint64_t dropped; // no free buffer, or a format that can't be scaled
+    uint64_t scale_ns;
+};
+
+// `format` 0 keeps the source format.
+struct scale_stage *scale_stage_new(uint32_t width, uint32_t height, enum scale_filter filter,
+                                    uint32_t format);
+// Where the stage takes frames from, add it as a consumer of a stream.
+struct frame_ring *scale_stage_ring(struct scale_stage *stage);
+// Consumers are added from one thread only, before frames flow.
+int scale_stage_add_consumer(struct scale_stage *stage, struct frame_ring *ring);
+// Output size for the frames from now on.
+void scale_stage_set_size(struct scale_stage *stage, uint32_t width, uint32_t height);
+void scale_stage_get_stats(struct scale_stage *stage, struct scale_stage_stats *stats);
+// Stop the stage after its consumers and before the stream feeding it is
+// destroyed, frames left in the consumers' rings are released here.
+void scale_stage_stop(struct scale_stage *stage);
+// Every frame of the stage must have been released.
+void scale_stage_destroy(struct scale_stage *stage);
+
+#endif
@@ -128,74 +128,95 @@ static struct {
 #endif
 };
 
-static inline uint32_t sdl_format_to_id(Uint32 format)
+/* Direct lookup tables built from sdl_video_formats on first use, so the
+ * per-format lookups don't scan the whole list. The first entry of the list
+ * wins for duplicate formats and ids, like the scan did. */
+#define SDL_FORMAT_HASH_SIZE	128
+#define SDL_FORMAT_ID_MAX	128
+
+static Uint32 sdl_format_hash_keys[SDL_FORMAT_HASH_SIZE];
+static uint32_t sdl_format_hash_ids[SDL_FORMAT_HASH_SIZE];
+static Uint32 sdl_id_formats[SDL_FORMAT_ID_MAX];
+static bool sdl_formats_ready;
+
+static inline uint32_t sdl_format_hash(Uint32 format)
+{
+	return (format * 2654435761u) >> 25;
+}
+
+static inline void sdl_formats_init(void)
 {
 	size_t i;
+
+	if (sdl_formats_ready)
+		return;
+
 	for (i = 0; i < SPA_N_ELEMENTS(sdl_video_formats); i++) {
-		if (sdl_video_formats[i].format == format)
-			return sdl_video_formats[i].id;
+		Uint32 format = sdl_video_formats[i].format;
+		uint32_t id = sdl_video_formats[i].id, h;
+
+		if (id == SPA_VIDEO_FORMAT_UNKNOWN)
+			continue;
+
+		for (h = sdl_format_hash(format);
+		     sdl_format_hash_keys[h] != 0 && sdl_format_hash_keys[h] != format;
+		     h = (h + 1) % SDL_FORMAT_HASH_SIZE);
+		if (sdl_format_hash_keys[h] == 0) {
+			sdl_format_hash_keys[h] = format;
+			sdl_format_hash_ids[h] = id;
+		}
+
+		if (id < SDL_FORMAT_ID_MAX && sdl_id_formats[id] == SDL_PIXELFORMAT_UNKNOWN)
+			sdl_id_formats[id] = format;
+	}
+	sdl_formats_ready = true;
+}
+
+static inline uint32_t sdl_format_to_id(Uint32 format)
+{
+	uint32_t h;
+
+	sdl_formats_init();
+	if (format == SDL_PIXELFORMAT_UNKNOWN)
+		return SPA_VIDEO_FORMAT_UNKNOWN;
+
+	for (h = sdl_format_hash(format); sdl_format_hash_keys[h] != 0;
+	     h = (h + 1) % SDL_FORMAT_HASH_SIZE) {
+		if (sdl_format_hash_keys[h] == format)
+			return sdl_format_hash_ids[h];
 	}
 	return SPA_VIDEO_FORMAT_UNKNOWN;
 }
 
 static inline Uint32 id_to_sdl_format(uint32_t id)
 {
-	size_t i;
-	for (i = 0; i < SPA_N_ELEMENTS(sdl_video_formats); i++) {
-		if (sdl_video_formats[i].id == id)
-			return sdl_video_formats[i].format;
-	}
-	return SDL_PIXELFORMAT_UNKNOWN;
+	sdl_formats_init();
+	if (id >= SDL_FORMAT_ID_MAX)
+		return SDL_PIXELFORMAT_UNKNOWN;
+	return sdl_id_formats[id];
 }
 
 
-static inline struct spa_pod *sdl_build_formats(SDL_RendererInfo *info, struct spa_pod_builder *b)
+/* Formats to offer when frames go to an SDL renderer: the ones its textures
+ * take first, then the ones SDL can convert from. Returns the number of
+ * formats stored in ids, for wire_set_formats(). */
+static inline uint32_t sdl_renderer_formats(SDL_RendererInfo *info, uint32_t *ids, uint32_t max_ids)
 {
-	uint32_t i, c;
-	struct spa_pod_frame f[2];
-
-	/* make an object of type SPA_TYPE_OBJECT_Format and id SPA_PARAM_EnumFormat.
-	 * The object type is important because it defines the properties that are
-	 * acceptable. The id gives more context about what the object is meant to
-	 * contain. In this case we enumerate supported formats. */
-	spa_pod_builder_push_object(b, &f[0], SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
-	/* add media type and media subtype properties */
-	spa_pod_builder_prop(b, SPA_FORMAT_mediaType, 0);
-	spa_pod_builder_id(b, SPA_MEDIA_TYPE_video);
-	spa_pod_builder_prop(b, SPA_FORMAT_mediaSubtype, 0);
-	spa_pod_builder_id(b, SPA_MEDIA_SUBTYPE_raw);
-
-	/* build an enumeration of formats */
-	spa_pod_builder_prop(b, SPA_FORMAT_VIDEO_format, 0);
-	spa_pod_builder_push_choice(b, &f[1], SPA_CHOICE_Enum, 0);
-	/* first the formats supported by the textures */
-	for (i = 0, c = 0; i < info->num_texture_formats; i++) {
-		uint32_t id = sdl_format_to_id(info->texture_formats[i]);
-		if (id == 0)
+	uint32_t i, j, n = 0;
+
+	for (i = 0; i < info->num_texture_formats + SPA_N_ELEMENTS(sdl_video_formats); i++) {
+		uint32_t id = i < info->num_texture_formats ?
+			sdl_format_to_id(info->texture_formats[i]) :
+			sdl_video_formats[i - info->num_texture_formats].id;
+
+		if (id == SPA_VIDEO_FORMAT_UNKNOWN)
 			continue;
-		if (c++ == 0)
-			spa_pod_builder_id(b, id);
-		spa_pod_builder_id(b, id);
-	}
-	/* then all the other ones SDL can convert from/to */
-	for (i = 0; i < SPA_N_ELEMENTS(sdl_video_formats); i++) {
-		uint32_t id = sdl_video_formats[i].id;
-		if (id != SPA_VIDEO_FORMAT_UNKNOWN)
-			spa_pod_builder_id(b, id);
+		for (j = 0; j < n && ids[j] != id; j++);
+		if (j < n)
+			continue;
+		if (n == max_ids)
+			break;
+		ids[n++] = id;
 	}
-	spa_pod_builder_id(b, SPA_VIDEO_FORMAT_RGBA_F32);
-	spa_pod_builder_pop(b, &f[1]);
-	/* add size and framerate ranges */
-	spa_pod_builder_add(b,
-		SPA_FORMAT_VIDEO_size,      SPA_POD_CHOICE_RANGE_Rectangle(
-							&SPA_RECTANGLE(WIDTH, HEIGHT),
-							&SPA_RECTANGLE(1,1),
-							&SPA_RECTANGLE(info->max_texture_width,
-								      info->max_texture_height)),
-		SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
-							&SPA_FRACTION(25,1),
-							&SPA_FRACTION(0,1),
-							&SPA_FRACTION(30,1)),
-		0);
-	return spa_pod_builder_pop(b, &f[0]);
+	return n;
 }
@@ -0,0 +1,849 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "codec.h"
+#include "cursor.h"
+#include "latency.h"
+#include "server.h"
+
+// A client that stops reading mid-frame for this long is dropped, it would
+// hold its frame forever.
+#define SERVER_STALL_NS 2000000000ull
+#define SERVER_TICK_MS 500
+#define SERVER_MAX_EVENTS 64
+// Capture frames other than the newest that clients may keep pinned while
+// sending them. Past that the oldest is copied off its buffer, so slow
+// clients stuck on different frames can't run the capture pool dry.
+#define SERVER_HELD_FRAMES 1
+// Encoded frames and copies alive at once. Every client holds at most two,
+// mostly the same ones; with none free a frame is sent raw, and a client
+// whose frame can't be copied is dropped.
+#define SERVER_PACKETS 32
+
+struct stream_client
+{
+    int fd;
+    // Being sent, `sent` bytes of header and planes are out already.
+    struct frame *current;
+    struct stream_frame_header header;
+    uint64_t sent;
+    uint64_t total;
+    // The newest frame after `current`, replaced by every newer one.
+    struct frame *pending;
+    // Pointer bitmap the client was sent last.
+    struct cursor_image *cursor;
+    // The next frame started must be fully damaged.
+    bool skip;
+    bool writing; // EPOLLOUT registered
+    uint64_t stalled_ns;
+};
+
+// A codec packet, dressed as a frame of one plane so clients hold and
+// send it like any other, or a copy of a capture frame.
+struct server_packet
+{
+    uint8_t *data;
+    size_t capacity;
+    bool coded;
+    struct frame frame;
+};
+
+struct stream_server
+{
+    int epoll_fd;
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    struct frame_ring ring;
+    pthread_t thread;
+    bool running;
+    atomic_bool quit;
+    struct latency_histogram *latency; // dequeue until sent to a client
+
+    struct stream_client *clients[STREAM_MAX_CLIENTS];
+    uint32_t n_clients;
+
+    bool encode;
+    struct codec_encoder encoder;
+    // Frames were taken without being encoded, the next delta can't trust
+    // the frame's damage.
+    bool encoder_behind;
+    // Key packet of the newest frame, shared by every client starting on it.
+    struct frame *key;
+    uint64_t key_seq;
+    struct server_packet packets[SERVER_PACKETS];
+    struct frame_pool packet_pool;
+    uint64_t packets_free;
+
+    atomic_uint stat_clients;
+    _Atomic uint64_t frames;
+    _Atomic uint64_t sent;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t copied;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t encoded;
+    _Atomic uint64_t keyframes;
+};
+
+// Distinguish the two fixed epoll entries from clients.
+static char listen_tag_, ring_tag_;
+
+// Frames go out unauthenticated and unencrypted, anyone who can connect
+// sees the screen.
+static bool server_is_loopback(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET)
+        return ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr) >> 24 == 127;
+    if (addr->sa_family == AF_INET6)
+    {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+
+        return IN6_IS_ADDR_LOOPBACK(a) ||
+               (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+    }
+    return false;
+}
+
+static int server_listen_tcp(const char *address)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *info;
+    const char *port = strrchr(address, ':');
+    char host[256];
+    int fd = -1, one = 1, res;
+
+    if (!port || (size_t)(port - address) >= sizeof(host))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+    if ((res = getaddrinfo(host[0] ? host : "127.0.0.1", port + 1, &hints, &info)) != 0)
+    {
+        printf("Failed to resolve %s: %s\n", address, gai_strerror(res));
+        errno = EINVAL;
+        return -1;
+    }
+    if (!server_is_loopback(info->ai_addr))
+    {
+        printf("Refusing to stream the screen unauthenticated on %s, use a loopback "
+               "address\n", address);
+        freeaddrinfo(info);
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    fd = socket(info->ai_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd >= 0 &&
+        (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+         bind(fd, info->ai_addr, info->ai_addrlen) < 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+static int server_listen_unix(struct stream_server *s, const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    // A socket left behind by an earlier run.
+    unlink(path);
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    return fd;
+}
+
+static void client_close(struct stream_server *s, uint32_t index)
+{
+    struct stream_client *c = s->clients[index];
+
+    if (c->current)
+        frame_release(c->current);
+    if (c->pending)
+        frame_release(c->pending);
+    cursor_image_unref(c->cursor);
+    close(c->fd);
+    free(c);
+    s->clients[index] = s->clients[--s->n_clients];
+    atomic_store(&s->stat_clients, s->n_clients);
+}
+
+static uint32_t client_index(struct stream_server *s, struct stream_client *c)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->n_clients && s->clients[i] != c; i++)
+        ;
+    return i;
+}
+
+static struct frame *server_key(struct stream_server *s, struct frame *frame);
+
+// Make `frame` the one being sent, taking over the client's reference. When
+// encoding, a raw frame is what clients that fell behind are given: it is
+// the newest frame, sent as a key packet if one can be made. A frame without
+// damage, like one that only moved the pointer, goes out as a header alone
+// to clients that have the picture.
+static void client_start(struct stream_server *s, struct stream_client *c, struct frame *frame)
+{
+    struct stream_frame_header *h = &c->header;
+    struct cursor_image *cursor = frame->cursor.image;
+    bool coded = frame->pool == &s->packet_pool && s->packets[frame->id].coded;
+    bool unchanged = !c->skip && !coded && frame->n_damage == 0;
+
+    if (s->encode && !unchanged && frame->pool != &s->packet_pool)
+    {
+        struct frame *key = server_key(s, frame);
+
+        if (key)
+        {
+            frame_release(frame);
+            frame = key;
+            coded = true;
+        }
+    }
+    c->current = frame;
+    c->sent = 0;
+    *h = (struct stream_frame_header){
+        .magic = coded ? STREAM_CODEC_MAGIC : STREAM_MAGIC,
+        .format = frame->format,
+        .width = frame->width,
+        .height = frame->height,
+        .n_planes = unchanged ? 0 : frame->n_planes,
+        .seq = frame->seq,
+        .pts = frame->pts,
+        .queued_ns = frame->queued_ns,
+    };
+    c->total = sizeof(*h);
+    for (uint32_t i = 0; i < h->n_planes; i++)
+    {
+        h->strides[i] = frame->planes[i].stride;
+        h->sizes[i] = frame->planes[i].size;
+        c->total += frame->planes[i].size;
+    }
+    if (c->skip)
+    {
+        h->n_damage = 1;
+        h->damage[0] = (struct frame_rect){0, 0, frame->width, frame->height};
+        c->skip = false;
+    }
+    else
+    {
+        h->n_damage = frame->n_damage;
+        memcpy(h->damage, frame->damage, frame->n_damage * sizeof(h->damage[0]));
+    }
+
+    // Bitmaps come in the frame's byte order, anything else isn't sent.
+    if (cursor && cursor->format == frame->format)
+    {
+        h->cursor_x = frame->cursor.x;
+        h->cursor_y = frame->cursor.y;
+        h->cursor_width = cursor->width;
+        h->cursor_height = cursor->height;
+        h->cursor_alpha = cursor->alpha;
+        if (cursor != c->cursor)
+        {
+            cursor_image_unref(c->cursor);
+            c->cursor = cursor_image_ref(cursor);
+            h->cursor_size = cursor->width * cursor->height * 4;
+            c->total += h->cursor_size;
+        }
+    }
+}
+
+// Send as much as the socket takes, straight from the frame's planes.
+// Returns a negative errno once the client is gone.
+static int client_flush(struct stream_server *s, struct stream_client *c)
+{
+    while (c->current)
+    {
+        struct iovec iov[2 + FRAME_MAX_PLANES];
+        struct msghdr msg = {.msg_iov = iov};
+        uint64_t skip = c->sent;
+        ssize_t res;
+
+        if (skip < sizeof(c->header))
+            iov[msg.msg_iovlen++] = (struct iovec){(uint8_t *)&c->header + skip,
+                                                   sizeof(c->header) - skip};
+        skip = skip > sizeof(c->header) ? skip - sizeof(c->header) : 0;
+        if (skip < c->header.cursor_size)
+            iov[msg.msg_iovlen++] = (struct iovec){(uint8_t *)c->cursor->pixels + skip,
+                                                   c->header.cursor_size - skip};
+        skip = skip > c->header.cursor_size ? skip - c->header.cursor_size : 0;
+        for (uint32_t i = 0; i < c->header.n_planes; i++)
+        {
+            const struct frame_plane *plane = &c->current->planes[i];
+
+            if (skip >= plane->size)
+            {
+                skip -= plane->size;
+                continue;
+            }
+            iov[msg.msg_iovlen++] = (struct iovec){(uint8_t *)plane->data + skip,
+                                                   plane->size - skip};
+            skip = 0;
+        }
+
+        res = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0 && errno == EAGAIN)
+        {
+            if (!c->stalled_ns)
+                c->stalled_ns = frame_ring_now_ns();
+            return 0;
+        }
+        if (res < 0)
+            return -errno;
+
+        c->stalled_ns = 0;
+        c->sent += res;
+        atomic_fetch_add_explicit(&s->bytes, res, memory_order_relaxed);
+        if (c->sent < c->total)
+            continue;
+
+        latency_record_since(s->latency, c->current->queued_ns);
+        atomic_fetch_add_explicit(&s->sent, 1, memory_order_relaxed);
+        frame_release(c->current);
+        c->current = NULL;
+        if (c->pending)
+        {
+            client_start(s, c, c->pending);
+            c->pending = NULL;
+        }
+    }
+    return 0;
+}
+
+// Flush, then watch for writability only while something is left to send.
+static int client_update(struct stream_server *s, struct stream_client *c)
+{
+    struct epoll_event ev = {.data.ptr = c};
+    int res;
+
+    if ((res = client_flush(s, c)) < 0)
+        return res;
+    if (c->writing == (c->current != NULL))
+        return 0;
+    c->writing = c->current != NULL;
+    ev.events = EPOLLIN | EPOLLRDHUP | (c->writing ? EPOLLOUT : 0);
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        return -errno;
+    return 0;
+}
+
+static void server_accept(struct stream_server *s)
+{
+    int fd, one = 1;
+
+    while ((fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+    {
+        struct stream_client *c;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP};
+
+        if (s->n_clients == STREAM_MAX_CLIENTS)
+        {
+            printf("Too many stream clients\n");
+            close(fd);
+            continue;
+        }
+        if (!(c = calloc(1, sizeof(*c))))
+        {
+            close(fd);
+            continue;
+        }
+        // Ignored on Unix sockets.
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->fd = fd;
+        // Nothing sent yet, the first frame is all new to the client.
+        c->skip = true;
+        ev.data.ptr = c;
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            printf("Failed to watch a stream client: %m\n");
+            close(fd);
+            free(c);
+            continue;
+        }
+        s->clients[s->n_clients++] = c;
+        atomic_store(&s->stat_clients, s->n_clients);
+    }
+    if (errno != EAGAIN)
+        printf("Failed to accept a stream client: %m\n");
+}
+
+// The client won't have the previous frame when it gets the next one: it
+// never had it, or its waiting frame is about to be replaced.
+static bool client_behind(const struct stream_client *c)
+{
+    return c->skip || c->pending;
+}
+
+// A free packet with room for `size` bytes, dressed as `frame` but without
+// planes. NULL if none is free.
+static struct server_packet *server_packet_get(struct stream_server *s, const struct frame *frame,
+                                               size_t size)
+{
+    struct server_packet *p;
+    struct frame *out;
+
+    s->packets_free |= frame_pool_drain(&s->packet_pool);
+    if (!s->packets_free)
+        return NULL;
+    p = &s->packets[__builtin_ctzll(s->packets_free)];
+    if (size > p->capacity)
+    {
+        uint8_t *d = realloc(p->data, size);
+
+        if (!d)
+            return NULL;
+        p->data = d;
+        p->capacity = size;
+    }
+    s->packets_free &= ~(UINT64_C(1) << p->frame.id);
+
+    out = &p->frame;
+    out->seq = frame->seq;
+    out->format = frame->format;
+    out->width = frame->width;
+    out->height = frame->height;
+    out->n_planes = 0;
+    out->pts = frame->pts;
+    out->n_damage = frame->n_damage;
+    memcpy(out->damage, frame->damage, frame->n_damage * sizeof(out->damage[0]));
+    out->queued_ns = frame->queued_ns;
+    cursor_image_unref(out->cursor.image);
+    out->cursor = frame->cursor;
+    cursor_image_ref(out->cursor.image);
+    atomic_store(&out->refs, 1);
+    return p;
+}
+
+// Copy an encoded frame into a free packet, NULL if none is.
+static struct frame *server_packet(struct stream_server *s, const struct frame *frame,
+                                   const uint8_t *data, size_t size)
+{
+    struct server_packet *p = server_packet_get(s, frame, size);
+
+    if (!p)
+        return NULL;
+    memcpy(p->data, data, size);
+    p->coded = true;
+    p->frame.n_planes = 1;
+    p->frame.planes[0] = (struct frame_plane){p->data, 0, size};
+    return &p->frame;
+}
+
+// Copy the planes of a capture frame back to back into a free packet, NULL
+// if none is.
+static struct frame *server_copy(struct stream_server *s, const struct frame *frame)
+{
+    struct server_packet *p;
+    size_t size = 0, offset = 0;
+
+    for (uint32_t i = 0; i < frame->n_planes; i++)
+        size += frame->planes[i].size;
+    if (!(p = server_packet_get(s, frame, size)))
+        return NULL;
+    p->coded = false;
+    p->frame.n_planes = frame->n_planes;
+    for (uint32_t i = 0; i < frame->n_planes; i++)
+    {
+        const struct frame_plane *plane = &frame->planes[i];
+
+        memcpy(p->data + offset, plane->data, plane->size);
+        p->frame.planes[i] = (struct frame_plane){p->data + offset, plane->stride, plane->size};
+        offset += plane->size;
+    }
+    atomic_fetch_add_explicit(&s->copied, 1, memory_order_relaxed);
+    return &p->frame;
+}
+
+static void server_count_packets(struct stream_server *s)
+{
+    atomic_store_explicit(&s->encoded, s->encoder.frames, memory_order_relaxed);
+    atomic_store_explicit(&s->keyframes, s->encoder.keyframes, memory_order_relaxed);
+}
+
+// Delta packet of `frame` for the clients in step with the stream, `frame`
+// itself if none is or encoding failed.
+static struct frame *server_delta(struct stream_server *s, struct frame *frame, bool skipped)
+{
+    const uint8_t *data;
+    size_t size;
+    struct frame *packet;
+    bool needed = false;
+
+    for (uint32_t i = 0; i < s->n_clients; i++)
+        needed |= !client_behind(s->clients[i]);
+    if (!needed)
+    {
+        s->encoder_behind = true;
+        return frame;
+    }
+    if (codec_encode(&s->encoder, frame, false, skipped || s->encoder_behind, &data, &size) < 0)
+        return frame;
+    s->encoder_behind = false;
+    server_count_packets(s);
+    packet = server_packet(s, frame, data, size);
+    return packet ? packet : frame;
+}
+
+// A new reference to the key packet of `frame`, which is the newest frame
+// taken, made the first time a client starts on it. NULL if it can't be
+// encoded, the raw frame is as good a start. Either way the encoder is left
+// at `frame`, where the client will be.
+static struct frame *server_key(struct stream_server *s, struct frame *frame)
+{
+    const uint8_t *data;
+    size_t size;
+
+    if (!s->key || s->key_seq != frame->seq)
+    {
+        if (s->key)
+            frame_release(s->key);
+        s->key = NULL;
+        if (codec_encode(&s->encoder, frame, true, false, &data, &size) < 0)
+            return NULL;
+        s->encoder_behind = false;
+        server_count_packets(s);
+        s->key = server_packet(s, frame, data, size);
+        s->key_seq = frame->seq;
+    }
+    if (s->key)
+        frame_ref(s->key);
+    return s->key;
+}
+
+// Leave clients at most SERVER_HELD_FRAMES capture frames besides `newest`
+// that they are still sending. The oldest go to copies, which clients carry
+// on sending from where they are; those on a frame that can't be copied are
+// dropped.
+static void server_unpin(struct stream_server *s, const struct frame *newest)
+{
+    while (true)
+    {
+        struct frame *oldest = NULL, *copy;
+        uint32_t n_held = 0;
+
+        for (uint32_t i = 0; i < s->n_clients; i++)
+        {
+            struct frame *f = s->clients[i]->current;
+            bool seen = false;
+
+            if (!f || f == newest || f->pool == &s->packet_pool)
+                continue;
+            for (uint32_t j = 0; j < i && !seen; j++)
+                seen = s->clients[j]->current == f;
+            if (seen)
+                continue;
+            n_held++;
+            if (!oldest || f->seq < oldest->seq)
+                oldest = f;
+        }
+        if (n_held <= SERVER_HELD_FRAMES)
+            return;
+
+        copy = server_copy(s, oldest);
+        for (uint32_t i = s->n_clients; i-- > 0;)
+        {
+            struct stream_client *c = s->clients[i];
+
+            if (c->current != oldest)
+                continue;
+            if (!copy)
+            {
+                printf("Dropping a stream client too slow to keep its frame\n");
+                client_close(s, i);
+                continue;
+            }
+            frame_ref(copy);
+            frame_release(c->current);
+            c->current = copy;
+        }
+        if (copy)
+            frame_release(copy);
+    }
+}
+
+// Hand `frame` to every client. A client still sending an older frame keeps
+// only this one for later.
+static void server_publish(struct stream_server *s, struct frame *frame, bool skipped)
+{
+    // For clients in step with the stream and for those behind.
+    struct frame *sent[2] = {frame, frame};
+
+    atomic_fetch_add_explicit(&s->frames, 1, memory_order_relaxed);
+    // The encoder's picture is still right for a frame without damage, which
+    // clients in step get as a header only.
+    if (s->encode && (frame->n_damage || skipped))
+        sent[0] = server_delta(s, frame, skipped);
+
+    for (uint32_t i = s->n_clients; i-- > 0;)
+    {
+        struct stream_client *c = s->clients[i];
+        struct frame *f = sent[client_behind(c)];
+
+        frame_ref(f);
+        if (skipped)
+            c->skip = true;
+        if (c->current)
+        {
+            if (c->pending)
+            {
+                frame_release(c->pending);
+                atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+                c->skip = true;
+            }
+            c->pending = f;
+            continue;
+        }
+        client_start(s, c, f);
+        if (client_update(s, c) < 0)
+            client_close(s, i);
+    }
+    server_unpin(s, frame);
+    if (sent[0] != frame)
+        frame_release(sent[0]);
+    frame_release(frame);
+}
+
+static void server_drop_stalled(struct stream_server *s)
+{
+    uint64_t now = frame_ring_now_ns();
+
+    for (uint32_t i = s->n_clients; i-- > 0;)
+    {
+        struct stream_client *c = s->clients[i];
+
+        if (c->stalled_ns && now - c->stalled_ns > SERVER_STALL_NS)
+        {
+            printf("Dropping a stream client that stopped reading\n");
+            client_close(s, i);
+        }
+    }
+}
+
+static void *server_thread(void *data)
+{
+    struct stream_server *s = data;
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    uint64_t value;
+
+    while (!atomic_load(&s->quit))
+    {
+        int n = epoll_wait(s->epoll_fd, events, SERVER_MAX_EVENTS, SERVER_TICK_MS);
+
+        if (n < 0 && errno != EINTR)
+        {
+            printf("Failed to wait for stream clients: %m\n");
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct stream_client *c = events[i].data.ptr;
+            char discard[256];
+            uint32_t index;
+
+            if (c == (void *)&listen_tag_)
+            {
+                server_accept(s);
+                continue;
+            }
+            if (c == (void *)&ring_tag_)
+            {
+                struct frame *frame;
+
+                if (read(s->ring.wakeup_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    printf("Failed to read the frame wakeup: %m\n");
+                while ((frame = frame_ring_pop(&s->ring)))
+                    server_publish(s, frame, frame_ring_skipped(&s->ring));
+                continue;
+            }
+
+            // Closed by an earlier event of this batch.
+            if ((index = client_index(s, c)) == s->n_clients)
+                continue;
+            // Clients have nothing to say, anything readable is thrown away
+            // and end of file is a hangup.
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                ssize_t res = read(c->fd, discard, sizeof(discard));
+
+                if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR))
+                {
+                    client_close(s, index);
+                    continue;
+                }
+            }
+            if ((events[i].events & EPOLLOUT) && client_update(s, c) < 0)
+                client_close(s, index);
+        }
+        server_drop_stalled(s);
+    }
+
+    while (s->n_clients)
+        client_close(s, s->n_clients - 1);
+    if (s->key)
+        frame_release(s->key);
+    s->key = NULL;
+    return NULL;
+}
+
+struct stream_server *stream_server_new(const char *address, bool encode)
+{
+    struct stream_server *s = calloc(1, sizeof(*s));
+    struct epoll_event ev = {.events = EPOLLIN};
+    int res;
+
+    if (!s)
+        return NULL;
+    s->epoll_fd = s->listen_fd = -1;
+    if (frame_ring_init(&s->ring, FRAME_RING_LATEST) < 0)
+    {
+        free(s);
+        return NULL;
+    }
+    s->latency = latency_stage("server");
+    for (uint32_t i = 0; i < SERVER_PACKETS; i++)
+    {
+        s->packets[i].frame.id = i;
+        s->packets[i].frame.pool = &s->packet_pool;
+    }
+    s->packets_free = (UINT64_C(1) << SERVER_PACKETS) - 1;
+    if (encode)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        if (codec_encoder_init(&s->encoder, n_cpus > 0 ? n_cpus : 1, CONVERT_IMPL_AUTO) < 0)
+        {
+            frame_ring_clear(&s->ring);
+            free(s);
+            return NULL;
+        }
+        s->encode = true;
+    }
+
+    if (strncmp(address, "tcp:", 4) == 0)
+        s->listen_fd = server_listen_tcp(address + 4);
+    else
+        s->listen_fd = server_listen_unix(s, address);
+    if (s->listen_fd < 0 || listen(s->listen_fd, STREAM_MAX_CLIENTS) < 0)
+    {
+        printf("Failed to listen on %s: %m\n", address);
+        goto fail;
+    }
+
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0)
+        goto fail_epoll;
+    ev.data.ptr = &listen_tag_;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) < 0)
+        goto fail_epoll;
+    ev.data.ptr = &ring_tag_;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, frame_ring_poll_fd(&s->ring), &ev) < 0)
+        goto fail_epoll;
+
+    if ((res = pthread_create(&s->thread, NULL, server_thread, s)) != 0)
+    {
+        printf("Failed to start the stream server thread: %s\n", strerror(res));
+        goto fail;
+    }
+    s->running = true;
+    printf("Streaming %s on %s\n", encode ? "encoded frames" : "frames", address);
+    return s;
+
+fail_epoll:
+    printf("Failed to set up the stream server: %m\n");
+fail:
+    stream_server_destroy(s);
+    return NULL;
+}
+
+struct frame_ring *stream_server_ring(struct stream_server *server)
+{
+    return &server->ring;
+}
+
+void stream_server_get_stats(struct stream_server *server, struct stream_server_stats *stats)
+{
+    stats->clients = atomic_load(&server->stat_clients);
+    stats->frames = atomic_load_explicit(&server->frames, memory_order_relaxed);
+    stats->sent = atomic_load_explicit(&server->sent, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&server->dropped, memory_order_relaxed);
+    stats->copied = atomic_load_explicit(&server->copied, memory_order_relaxed);
+    stats->bytes = atomic_load_explicit(&server->bytes, memory_order_relaxed);
+    stats->packets = atomic_load_explicit(&server->encoded, memory_order_relaxed);
+    stats->keyframes = atomic_load_explicit(&server->keyframes, memory_order_relaxed);
+}
+
+void stream_server_stop(struct stream_server *server)
+{
+    struct stream_server_stats stats;
+
+    if (!server->running || atomic_exchange(&server->quit, true))
+        return;
+    // Wakes the epoll loop through the ring's poll fd.
+    frame_ring_wake(&server->ring);
+    pthread_join(server->thread, NULL);
+
+    stream_server_get_stats(server, &stats);
+    printf("Streamed %lu frames to clients out of %lu taken, %lu replaced, %lu copied, "
+           "%lu MB\n",
+           (unsigned long)stats.sent, (unsigned long)stats.frames, (unsigned long)stats.dropped,
+           (unsigned long)stats.copied, (unsigned long)(stats.bytes >> 20));
+    if (server->encode)
+        printf("Encoded %lu packets, %lu of them key packets, %.1fx smaller than raw\n",
+               (unsigned long)stats.packets, (unsigned long)stats.keyframes,
+               server->encoder.coded_bytes
+                   ? (double)server->encoder.raw_bytes / server->encoder.coded_bytes
+                   : 0.0);
+}
+
+void stream_server_destroy(struct stream_server *server)
+{
+    stream_server_stop(server);
+    if (server->epoll_fd >= 0)
+        close(server->epoll_fd);
+    if (server->listen_fd >= 0)
+        close(server->listen_fd);
+    if (server->path[0])
+        unlink(server->path);
+    frame_ring_clear(&server->ring);
+    if (server->encode)
+        codec_encoder_clear(&server->encoder);
+    for (uint32_t i = 0; i < SERVER_PACKETS; i++)
+    {
+        cursor_image_unref(server->packets[i].frame.cursor.image);
+        free(server->packets[i].data);
+    }
+    free(server);
+}
@@ -0,0 +1,93 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "ring.h"
+
+#define STREAM_MAGIC 0x4d525453       // "STRM"
+#define STREAM_CODEC_MAGIC 0x43525453 // "STRC"
+#define STREAM_MAX_CLIENTS 256
+
+// Sent before the pixels of every frame: `cursor_size` bytes of pointer
+// bitmap, then the planes back to back, `sizes[i]` bytes each. With
+// STREAM_CODEC_MAGIC a single codec packet of `sizes[0]` bytes follows
+// instead, see codec.h. A packet that isn't a key packet applies to the
+// picture of the previous frame, which may have been sent either way. A
+// frame without planes leaves the picture as it was, it only moves the
+// pointer.
+struct stream_frame_header
+{
+    uint32_t magic;
+    uint32_t format; // enum spa_video_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    uint32_t n_damage;
+    uint64_t seq;
+    int64_t pts;
+    uint64_t queued_ns; // CLOCK_MONOTONIC dequeue time, for local clients
+    uint32_t strides[FRAME_MAX_PLANES];
+    uint32_t sizes[FRAME_MAX_PLANES];
+    // Changed since the previous frame sent to this client, the whole frame
+    // after a drop.
+    struct frame_rect damage[FRAME_MAX_DAMAGE];
+    // Pointer for the client to draw over the picture, which doesn't contain
+    // it: top left corner in the frame and size, 0 x 0 while hidden. The
+    // bitmap is only sent when it changed, as premultiplied 32-bit pixels in
+    // the frame's byte order with alpha in byte `cursor_alpha`.
+    int32_t cursor_x;
+    int32_t cursor_y;
+    uint32_t cursor_width;
+    uint32_t cursor_height;
+    uint32_t cursor_alpha;
+    uint32_t cursor_size; // of the bitmap following, 0 keeps the last one
+};
+
+// Streams frames to any number of clients from one epoll thread. Pixels are
+// sent with sendmsg straight from the mapped buffers. Each client has room
+// for the frame it is being sent and the newest one after it; a newer frame
+// replaces the waiting one, so a slow client sees fewer frames but never
+// more buffering or latency, and never holds back the others: between them
+// clients pin no more than the newest capture buffer and one older, an older
+// frame a slow client is still sending is copied off its buffer first.
+//
+// With encoding, frames are sent as packets of the lossless codec instead.
+// Each frame is encoded once for all clients: as a delta for those that got
+// the previous frame, and as a key packet once a new client or one that
+// missed a frame starts on it. A frame that can't be encoded is sent as is.
+//
+// The pointer travels as metadata in the header, its bitmap only when it
+// changed, so a frame that just moved it costs every client a header.
+struct stream_server;
+
+struct stream_server_stats
+{
+    uint32_t clients;
+    uint64_t frames;  // taken from the ring
+    uint64_t sent;    // frames completely sent, over all clients
+    uint64_t dropped; // frames replaced before a client got them
+    uint64_t copied;  // capture frames copied for slow clients
+    uint64_t bytes;
+    uint64_t packets;   // encoded, key packets included
+    uint64_t keyframes; // key packets encoded
+};
+
+// `address` is "tcp:HOST:PORT", with HOST a loopback address, 127.0.0.1 if
+// empty, or the path of a Unix socket. `encode` sends
+// codec packets instead of raw planes.
+struct stream_server *stream_server_new(const char *address, bool encode);
+
+// Hand to wire_add_consumer().
+struct frame_ring *stream_server_ring(struct stream_server *server);
+
+void stream_server_get_stats(struct stream_server *server, struct stream_server_stats *stats);
+
+// Stop the thread and drop every client. The ring stays valid until
+// stream_server_destroy, call that once the stream feeding it is gone.
+void stream_server_stop(struct stream_server *server);
+void stream_server_destroy(struct stream_server *server);
+
+#endif
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "convert.h"
+#include "cursor.h"
+#include "latency.h"
+#include "metrics.h"
+#include "shmexport.h"
+
+#define SHM_PAGE_SIZE 4096
+// Planes start on a cache line, like the rows of the buffers we ask for.
+#define SHM_PLANE_ALIGN 64
+// Longest the export thread waits for a frame before it looks for readers.
+#define SHM_EXPORT_POLL_MS 50
+
+#define SHM_ALIGN(v, a) (((v) + (a)-1) & ~(uint64_t)((a)-1))
+
+struct shm_client
+{
+    int socket_fd;
+    int event_fd;
+};
+
+struct shm_writer
+{
+    int memfd;
+    int readonly_fd; // reopened O_RDONLY, readers can't map it writable
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    struct shm_ring_header *header;
+    size_t size;
+    bool skip_next;
+    // Drawn into the previous slot, its rect is damaged once it moves.
+    struct frame_cursor cursor;
+
+    struct shm_client clients[SHM_EXPORT_MAX_READERS];
+    uint32_t n_clients;
+
+    uint64_t published;
+    uint64_t oversized;
+};
+
+struct shm_writer *shm_writer_new(const char *path, uint32_t n_slots, size_t slot_size)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct shm_writer *w;
+    char fd_path[64];
+    uint64_t data_offset = SHM_ALIGN(sizeof(struct shm_ring_header), SHM_PAGE_SIZE);
+    void *map;
+
+    if (n_slots < 2 || n_slots > SHM_RING_MAX_SLOTS || strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(w = calloc(1, sizeof(*w))))
+        return NULL;
+    w->readonly_fd = w->listen_fd = -1;
+    slot_size = SHM_ALIGN(slot_size, SHM_PAGE_SIZE);
+    w->size = data_offset + n_slots * slot_size;
+
+    // Sealed at its size, a reader's mapping can never be cut short under
+    // it.
+    w->memfd = memfd_create("screencast-consume-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (w->memfd < 0 || ftruncate(w->memfd, w->size) < 0 ||
+        fcntl(w->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+    {
+        printf("Failed to create the frame memfd: %m\n");
+        goto fail;
+    }
+    map = mmap(NULL, w->size, PROT_READ | PROT_WRITE, MAP_SHARED, w->memfd, 0);
+    if (map == MAP_FAILED)
+    {
+        printf("Failed to map the frame memfd: %m\n");
+        goto fail;
+    }
+    w->header = map;
+    w->header->magic = SHM_RING_MAGIC;
+    w->header->version = SHM_RING_VERSION;
+    w->header->n_slots = n_slots;
+    w->header->size = w->size;
+    w->header->data_offset = data_offset;
+    w->header->slot_size = slot_size;
+
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", w->memfd);
+    w->readonly_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+    if (w->readonly_fd < 0)
+    {
+        printf("Failed to reopen the frame memfd read-only: %m\n");
+        goto fail;
+    }
+
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    w->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    // A socket left behind by an earlier run.
+    unlink(path);
+    if (w->listen_fd < 0 || bind(w->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(w->listen_fd, SHM_EXPORT_MAX_READERS) < 0)
+    {
+        printf("Failed to listen on %s: %m\n", path);
+        goto fail;
+    }
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    return w;
+
+fail:
+    shm_writer_destroy(w);
+    return NULL;
+}
+
+static void shm_client_close(struct shm_client *client)
+{
+    close(client->socket_fd);
+    close(client->event_fd);
+}
+
+void shm_writer_destroy(struct shm_writer *writer)
+{
+    for (uint32_t i = 0; i < writer->n_clients; i++)
+        shm_client_close(&writer->clients[i]);
+    if (writer->listen_fd >= 0)
+        close(writer->listen_fd);
+    if (writer->path[0])
+        unlink(writer->path);
+    if (writer->header)
+        munmap(writer->header, writer->size);
+    if (writer->readonly_fd >= 0)
+        close(writer->readonly_fd);
+    if (writer->memfd >= 0)
+        close(writer->memfd);
+    cursor_image_unref(writer->cursor.image);
+    free(writer);
+}
+
+static int shm_writer_send_hello(struct shm_writer *w, struct shm_client *client)
+{
+    struct shm_ring_hello hello = {SHM_RING_MAGIC, SHM_RING_VERSION};
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    int fds[2] = {w->readonly_fd, client->event_fd};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control = {};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(client->socket_fd, &msg, MSG_NOSIGNAL) != sizeof(hello))
+        return -errno;
+    return 0;
+}
+
+void shm_writer_accept(struct shm_writer *writer)
+{
+    struct pollfd pfds[SHM_EXPORT_MAX_READERS];
+    uint32_t i;
+    int fd;
+
+    // Readers never send anything, a readable socket is a hangup.
+    for (i = 0; i < writer->n_clients; i++)
+        pfds[i] = (struct pollfd){.fd = writer->clients[i].socket_fd, .events = POLLIN};
+    if (writer->n_clients && poll(pfds, writer->n_clients, 0) > 0)
+    {
+        for (i = writer->n_clients; i-- > 0;)
+        {
+            if (!pfds[i].revents)
+                continue;
+            shm_client_close(&writer->clients[i]);
+            writer->clients[i] = writer->clients[--writer->n_clients];
+            printf("Frame reader left, %u left\n", writer->n_clients);
+        }
+    }
+
+    while ((fd = accept4(writer->listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        struct shm_client client = {.socket_fd = fd};
+        int res;
+
+        if (writer->n_clients == SHM_EXPORT_MAX_READERS)
+        {
+            printf("Too many frame readers\n");
+            close(fd);
+            continue;
+        }
+        client.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (client.event_fd < 0 || (res = shm_writer_send_hello(writer, &client)) < 0)
+        {
+            printf("Failed to hand the frame ring to a reader: %m\n");
+            if (client.event_fd >= 0)
+                close(client.event_fd);
+            close(fd);
+            continue;
+        }
+        writer->clients[writer->n_clients++] = client;
+        printf("Frame reader joined, %u readers\n", writer->n_clients);
+    }
+}
+
+// Bytes per row of a packed single-plane frame once its padding is dropped,
+// 0 when the planes are copied as they are. A cropped frame keeps the
+// stride of the whole buffer, packed its copy only costs the visible part.
+static uint32_t shm_frame_row(const struct frame *frame)
+{
+    uint32_t row = frame->width * convert_format_bpp(frame->format);
+
+    if (frame->n_planes != 1 || !row || frame->planes[0].stride <= row ||
+        (uint64_t)frame->planes[0].stride * (frame->height - 1) + row > frame->planes[0].size)
+        return 0;
+    return row;
+}
+
+int shm_writer_publish(struct shm_writer *writer, const struct frame *frame, bool skipped)
+{
+    struct shm_ring_header *h = writer->header;
+    uint64_t number = writer->published, one = 1;
+    uint32_t index = number % h->n_slots;
+    struct shm_ring_slot *slot = &h->slots[index];
+    uint64_t base = h->data_offset + index * h->slot_size, offset = 0;
+    struct frame_cursor cursor = {0};
+    uint32_t row = shm_frame_row(frame);
+    uint32_t i;
+
+    for (i = 0; i < frame->n_planes; i++)
+        offset = SHM_ALIGN(offset, SHM_PLANE_ALIGN) +
+                 (row ? (uint64_t)row * frame->height : frame->planes[i].size);
+    if (offset > h->slot_size)
+    {
+        if (!writer->oversized++)
+            printf("Frame of %lu bytes doesn't fit the %lu byte slots\n",
+                   (unsigned long)offset, (unsigned long)h->slot_size);
+        writer->skip_next = true;
+        return -ENOSPC;
+    }
+
+    atomic_store_explicit(&slot->seq, number * 2 + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->pts = frame->pts;
+    slot->format = frame->format;
+    slot->width = frame->width;
+    slot->height = frame->height;
+    slot->n_planes = frame->n_planes;
+    for (i = 0, offset = 0; i < frame->n_planes; i++)
+    {
+        offset = SHM_ALIGN(offset, SHM_PLANE_ALIGN);
+        slot->planes[i].offset = base + offset;
+        if (row)
+        {
+            slot->planes[i].stride = row;
+            slot->planes[i].size = row * frame->height;
+            for (uint32_t y = 0; y < frame->height; y++)
+                memcpy((uint8_t *)h + base + offset + (size_t)y * row,
+                       frame->planes[i].data + (size_t)y * frame->planes[i].stride, row);
+        }
+        else
+        {
+            slot->planes[i].stride = frame->planes[i].stride;
+            slot->planes[i].size = frame->planes[i].size;
+            memcpy((uint8_t *)h + base + offset, frame->planes[i].data, frame->planes[i].size);
+        }
+        offset += slot->planes[i].size;
+    }
+    // Readers get the picture with the pointer in it, drawn over the copy.
+    if (cursor_drawable(frame))
+    {
+        cursor = frame->cursor;
+        cursor_blend(&cursor, (uint8_t *)h + slot->planes[0].offset, slot->planes[0].stride,
+                     &(struct frame_rect){0, 0, frame->width, frame->height});
+    }
+    if (skipped || writer->skip_next)
+    {
+        slot->n_damage = 1;
+        slot->damage[0] = (struct frame_rect){0, 0, frame->width, frame->height};
+    }
+    else
+    {
+        slot->n_damage = frame->n_damage;
+        memcpy(slot->damage, frame->damage, frame->n_damage * sizeof(frame->damage[0]));
+        cursor_damage(&writer->cursor, &cursor, frame->width, frame->height, slot->damage,
+                      &slot->n_damage);
+    }
+    cursor_track(&writer->cursor, &cursor);
+    writer->skip_next = false;
+
+    atomic_store_explicit(&slot->seq, number * 2 + 2, memory_order_release);
+    atomic_store_explicit(&h->frames, number + 1, memory_order_release);
+    writer->published++;
+
+    // A full counter only means the reader hasn't woken up yet.
+    for (i = 0; i < writer->n_clients; i++)
+    {
+        if (write(writer->clients[i].event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            printf("Failed to wake frame reader: %m\n");
+    }
+    return 0;
+}
+
+void shm_writer_get_stats(struct shm_writer *writer, struct shm_writer_stats *stats)
+{
+    stats->published = writer->published;
+    stats->oversized = writer->oversized;
+    stats->readers = writer->n_clients;
+}
+
+struct shm_export
+{
+    struct shm_writer *writer;
+    struct frame_ring ring;
+    pthread_t thread;
+    atomic_bool quit;
+    struct latency_histogram *latency; // dequeue until copied out
+};
+
+static void *shm_export_thread(void *data)
+{
+    struct shm_export *ex = data;
+
+    while (!atomic_load(&ex->quit))
+    {
+        shm_writer_accept(ex->writer);
+
+        struct frame *frame = frame_ring_wait(&ex->ring, SHM_EXPORT_POLL_MS);
+        if (!frame)
+            continue;
+
+        uint64_t start = frame_ring_now_ns();
+        if (shm_writer_publish(ex->writer, frame, frame_ring_skipped(&ex->ring)) == 0)
+        {
+            for (uint32_t i = 0; i < frame->n_planes; i++)
+                metrics_add(METRIC_CONVERT_BYTES, frame->planes[i].size);
+            metrics_add(METRIC_CONVERT_NS, frame_ring_now_ns() - start);
+        }
+        latency_record_since(ex->latency, frame->queued_ns);
+        frame_release(frame);
+    }
+    return NULL;
+}
+
+struct shm_export *shm_export_new(const char *path)
+{
+    struct shm_export *ex = calloc(1, sizeof(*ex));
+    int res;
+
+    if (!ex)
+        return NULL;
+    if (frame_ring_init(&ex->ring, FRAME_RING_LATEST) < 0)
+    {
+        free(ex);
+        return NULL;
+    }
+    ex->latency = latency_stage("shm");
+    ex->writer = shm_writer_new(path, SHM_EXPORT_SLOTS, SHM_EXPORT_SLOT_SIZE);
+    if (!ex->writer)
+        goto fail;
+    if ((res = pthread_create(&ex->thread, NULL, shm_export_thread, ex)) != 0)
+    {
+        printf("Failed to start the frame export thread: %s\n", strerror(res));
+        goto fail;
+    }
+    printf("Exporting frames on %s\n", path);
+    return ex;
+
+fail:
+    if (ex->writer)
+        shm_writer_destroy(ex->writer);
+    frame_ring_clear(&ex->ring);
+    free(ex);
+    return NULL;
+}
+
+struct frame_ring *shm_export_ring(struct shm_export *ex)
+{
+    return &ex->ring;
+}
+
+void shm_export_stop(struct shm_export *ex)
+{
+    struct shm_writer_stats stats;
+
+    if (atomic_exchange(&ex->quit, true))
+        return;
+    frame_ring_wake(&ex->ring);
+    pthread_join(ex->thread, NULL);
+
+    shm_writer_get_stats(ex->writer, &stats);
+    printf("Exported %lu frames to %u readers, %lu too large\n",
+           (unsigned long)stats.published, stats.readers, (unsigned long)stats.oversized);
+}
+
+void shm_export_destroy(struct shm_export *ex)
+{
+    shm_export_stop(ex);
+    shm_writer_destroy(ex->writer);
+    frame_ring_clear(&ex->ring);
+    free(ex);
+}
@@ -0,0 +1,52 @@
+#ifndef SHMEXPORT_H
+#define SHMEXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ring.h"
+#include "shmring.h"
+
+#define SHM_EXPORT_SLOTS 4
+// Room for one 4K frame of 32-bit pixels per slot. memfd pages are only
+// allocated once written, smaller frames don't cost the full size.
+#define SHM_EXPORT_SLOT_SIZE ((size_t)3840 * 2160 * 4)
+#define SHM_EXPORT_MAX_READERS 16
+
+// Writer side of shmring.h: the memfd, the socket readers connect to and
+// their eventfds. Not thread safe, one thread publishes and accepts.
+struct shm_writer;
+
+struct shm_writer_stats
+{
+    uint64_t published;
+    uint64_t oversized; // frames that didn't fit a slot
+    uint32_t readers;
+};
+
+struct shm_writer *shm_writer_new(const char *path, uint32_t n_slots, size_t slot_size);
+void shm_writer_destroy(struct shm_writer *writer);
+
+// Take new readers and drop the ones that went away, never blocks.
+void shm_writer_accept(struct shm_writer *writer);
+
+// Copy `frame` into the next slot and wake every reader. With `skipped` the
+// frame is marked fully damaged.
+int shm_writer_publish(struct shm_writer *writer, const struct frame *frame, bool skipped);
+
+void shm_writer_get_stats(struct shm_writer *writer, struct shm_writer_stats *stats);
+
+// A capture consumer that runs a shm_writer on a thread of its own, fed
+// through a FRAME_RING_LATEST ring by wire_add_consumer(). While the copy
+// can't keep up it publishes the newest frame and marks it skipped.
+struct shm_export;
+
+struct shm_export *shm_export_new(const char *path);
+struct frame_ring *shm_export_ring(struct shm_export *ex);
+
+// Same two steps as the preview: stop the thread before the session is
+// destroyed, destroy the export after.
+void shm_export_stop(struct shm_export *ex);
+void shm_export_destroy(struct shm_export *ex);
+
+#endif
@@ -0,0 +1,241 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "shmring.h"
+
+struct shm_reader
+{
+    int socket_fd;
+    int event_fd;
+    const struct shm_ring_header *header;
+    size_t size;
+    uint64_t next; // first frame number not taken yet
+
+    uint64_t frames;
+    uint64_t lost;
+    uint64_t torn;
+};
+
+// Receive the hello and its two fds: the memfd, then the eventfd.
+static int shm_reader_handshake(struct shm_reader *r, int *memfd)
+{
+    struct shm_ring_hello hello;
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    union
+    {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    ssize_t res;
+    int fds[2];
+
+    while ((res = recvmsg(r->socket_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (res < 0)
+        return -errno;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return -EPROTO;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    *memfd = fds[0];
+    r->event_fd = fds[1];
+
+    if (res != sizeof(hello) || hello.magic != SHM_RING_MAGIC ||
+        hello.version != SHM_RING_VERSION)
+        return -EPROTO;
+    return 0;
+}
+
+struct shm_reader *shm_reader_connect(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct shm_reader *r;
+    struct stat st;
+    int memfd = -1, res;
+    void *map;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if (!(r = calloc(1, sizeof(*r))))
+        return NULL;
+    r->event_fd = -1;
+    r->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (r->socket_fd < 0 || connect(r->socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        res = -errno;
+        goto fail;
+    }
+    if ((res = shm_reader_handshake(r, &memfd)) < 0)
+        goto fail;
+
+    if (fstat(memfd, &st) < 0)
+    {
+        res = -errno;
+        goto fail;
+    }
+    r->size = st.st_size;
+    if (r->size < sizeof(struct shm_ring_header))
+    {
+        res = -EPROTO;
+        goto fail;
+    }
+    map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED)
+    {
+        res = -errno;
+        goto fail;
+    }
+    close(memfd);
+    memfd = -1;
+    r->header = map;
+
+    if (r->header->magic != SHM_RING_MAGIC || r->header->version != SHM_RING_VERSION ||
+        r->header->size != r->size || r->header->n_slots == 0 ||
+        r->header->n_slots > SHM_RING_MAX_SLOTS)
+    {
+        res = -EPROTO;
+        goto fail;
+    }
+    // Only frames published from now on.
+    r->next = atomic_load(&r->header->frames);
+    return r;
+
+fail:
+    if (memfd >= 0)
+        close(memfd);
+    shm_reader_destroy(r);
+    errno = -res;
+    return NULL;
+}
+
+void shm_reader_destroy(struct shm_reader *reader)
+{
+    if (reader->header)
+        munmap((void *)reader->header, reader->size);
+    if (reader->event_fd >= 0)
+        close(reader->event_fd);
+    if (reader->socket_fd >= 0)
+        close(reader->socket_fd);
+    free(reader);
+}
+
+int shm_reader_fd(struct shm_reader *reader)
+{
+    return reader->event_fd;
+}
+
+// Copy the description of frame `number` out of its slot. Fails if the slot
+// doesn't hold that frame (anymore).
+static bool shm_reader_read_slot(struct shm_reader *r, uint64_t number, struct shm_frame *frame)
+{
+    const struct shm_ring_slot *slot = &r->header->slots[number % r->header->n_slots];
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    uint32_t i;
+
+    if (seq != number * 2 + 2)
+        return false;
+
+    frame->number = number;
+    frame->pts = slot->pts;
+    frame->format = slot->format;
+    frame->width = slot->width;
+    frame->height = slot->height;
+    frame->n_planes = slot->n_planes < FRAME_MAX_PLANES ? slot->n_planes : FRAME_MAX_PLANES;
+    for (i = 0; i < frame->n_planes; i++)
+    {
+        const struct shm_ring_plane *plane = &slot->planes[i];
+
+        // Never trust offsets from another process with our pointers.
+        if (plane->offset > r->size || plane->size > r->size - plane->offset)
+            return false;
+        frame->planes[i].data = (const uint8_t *)r->header + plane->offset;
+        frame->planes[i].stride = plane->stride;
+        frame->planes[i].size = plane->size;
+    }
+    frame->n_damage = slot->n_damage < FRAME_MAX_DAMAGE ? slot->n_damage : FRAME_MAX_DAMAGE;
+    memcpy(frame->damage, slot->damage, frame->n_damage * sizeof(frame->damage[0]));
+    frame->seq = seq;
+    frame->slot = slot;
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+}
+
+int shm_reader_acquire(struct shm_reader *reader, struct shm_frame *frame, int timeout_ms)
+{
+    struct pollfd pfds[2] = {
+        {.fd = reader->event_fd, .events = POLLIN},
+        {.fd = reader->socket_fd, .events = POLLIN},
+    };
+    uint64_t value;
+
+    while (true)
+    {
+        uint64_t frames = atomic_load_explicit(&reader->header->frames, memory_order_acquire);
+
+        // A failed read means the writer already moved on to a newer frame,
+        // the next look at `frames` finds it.
+        if (frames > reader->next && shm_reader_read_slot(reader, frames - 1, frame))
+        {
+            frame->skipped = frames - 1 != reader->next;
+            reader->lost += frames - 1 - reader->next;
+            reader->next = frames;
+            reader->frames++;
+            return 0;
+        }
+        if (frames > reader->next)
+            continue;
+
+        int res = poll(pfds, 2, timeout_ms);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -errno;
+        if (res == 0)
+            return -ETIMEDOUT;
+        // The writer never sends anything after the hello, readable means
+        // it closed the connection.
+        if (pfds[1].revents)
+            return -EPIPE;
+        if (read(reader->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+            return -errno;
+    }
+}
+
+bool shm_reader_release(struct shm_reader *reader, const struct shm_frame *frame)
+{
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&frame->slot->seq, memory_order_relaxed) == frame->seq)
+        return true;
+    reader->torn++;
+    return false;
+}
+
+void shm_reader_get_stats(struct shm_reader *reader, struct shm_reader_stats *stats)
+{
+    stats->frames = reader->frames;
+    stats->lost = reader->lost;
+    stats->torn = reader->torn;
+}
@@ -0,0 +1,117 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+// Frames shared with other processes through one memfd. The capture process
+// (shmexport.c) copies every frame into the next of a few slots; readers map
+// the memfd read-only and read the pixels in place. Each slot carries a
+// sequence number that is odd while the slot is written, so a reader finds
+// out after the fact whether the writer reused the slot under it. The writer
+// never waits for anyone, a reader that falls behind by more than the slot
+// count only loses frames of its own.
+//
+// A reader connects to the writer's Unix socket and gets the memfd and an
+// eventfd of its own, signaled after every published frame.
+
+#define SHM_RING_MAGIC 0x52534353 // "SCSR"
+#define SHM_RING_VERSION 1
+#define SHM_RING_MAX_SLOTS 8
+
+struct shm_ring_plane
+{
+    uint64_t offset; // from the start of the memfd
+    uint32_t stride;
+    uint32_t size;
+};
+
+struct shm_ring_slot
+{
+    // 2 * number + 1 while frame `number` is written, 2 * number + 2 once
+    // it is complete.
+    _Alignas(64) _Atomic uint64_t seq;
+    int64_t pts;
+    uint32_t format; // enum spa_video_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    struct shm_ring_plane planes[FRAME_MAX_PLANES];
+    // Changed since the previous frame number, the whole frame if the
+    // writer itself skipped frames.
+    uint32_t n_damage;
+    struct frame_rect damage[FRAME_MAX_DAMAGE];
+};
+
+struct shm_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t n_slots;
+    uint32_t reserved;
+    uint64_t size;        // of the whole memfd
+    uint64_t data_offset; // of the first slot's pixels
+    uint64_t slot_size;   // pixel bytes per slot
+    // Frames published so far, the newest is in slot (frames - 1) % n_slots.
+    _Alignas(64) _Atomic uint64_t frames;
+    struct shm_ring_slot slots[SHM_RING_MAX_SLOTS];
+};
+
+// Sent with the memfd and the reader's eventfd as SCM_RIGHTS.
+struct shm_ring_hello
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+// A frame taken by a reader. The planes point into the read-only mapping
+// and stay readable until shm_reader_release says whether they still held
+// this frame.
+struct shm_frame
+{
+    uint64_t number;
+    int64_t pts;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    struct frame_plane planes[FRAME_MAX_PLANES];
+    uint32_t n_damage;
+    struct frame_rect damage[FRAME_MAX_DAMAGE];
+    // Frames were lost before this one, its damage doesn't cover
+    // everything that changed since the frame taken before.
+    bool skipped;
+    uint64_t seq;
+    const struct shm_ring_slot *slot;
+};
+
+struct shm_reader_stats
+{
+    uint64_t frames; // taken
+    uint64_t lost;   // published but never taken
+    uint64_t torn;   // overwritten before they were released
+};
+
+struct shm_reader;
+
+struct shm_reader *shm_reader_connect(const char *path);
+void shm_reader_destroy(struct shm_reader *reader);
+
+// Readable when a new frame was published, for callers with a poll loop.
+int shm_reader_fd(struct shm_reader *reader);
+
+// Take the newest frame not taken yet, waiting up to `timeout_ms` (-1
+// forever) for one. Returns -ETIMEDOUT without a frame and -EPIPE once the
+// writer is gone.
+int shm_reader_acquire(struct shm_reader *reader, struct shm_frame *frame, int timeout_ms);
+
+// Done with the pixels of `frame`. Returns false if the writer reused the
+// slot meanwhile, whatever was read from it must then be thrown away.
+bool shm_reader_release(struct shm_reader *reader, const struct shm_frame *frame);
+
+void shm_reader_get_stats(struct shm_reader *reader, struct shm_reader_stats *stats);
+
+#endif
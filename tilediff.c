@@ -0,0 +1,317 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tilediff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TILEDIFF_X86 1
+#endif
+
+// Widest frame we hash, 16384 pixels.
+#define MAX_TILES_X 256
+#define CHUNK 32
+#define PRIME32 0x9E3779B1u
+
+// Per-chunk keys of an XXH3 style accumulator: four 64-bit lanes, each
+// accumulating (word ^ key).lo32 * (word ^ key).hi32 plus the neighbour
+// word, scrambled after every row so rows can't be swapped unnoticed.
+static const uint64_t tilediff_keys[TILEDIFF_TILE * 4 / CHUNK + 1][4] = {
+    {0xbe4ba423396cfeb8, 0x1cad21f72c81017c, 0xdb979083e96dd4de, 0x1f67b3b7a4a44072},
+    {0x78e5c0cc4ee679cb, 0x2172ffcc7dd05a82, 0x8e2443f7744608b8, 0x4c263a81e69035e0},
+    {0xcb00c391bb52283c, 0xa32e531b8b65d088, 0x4ef90da297486471, 0xd8acdea946ef1938},
+    {0x3f349ce33f76faa8, 0x1d4f0bc7c7bbdcf9, 0x3159b4cd4be0518a, 0x647378d9c97e9fc8},
+    {0xc3ebd33483acc5ea, 0xeb6313faffa081c5, 0x49daf0b751dd0d17, 0x9e68d429265516d3},
+    {0xfca1477d58be162b, 0xce31d07ad1b8f88f, 0x280416958f3acb45, 0x7e404bbbcafbd7af},
+    {0xf0b5de7b7d1e8f3f, 0x8a13c8be9a31e3e4, 0x5f1c2a6e8fd7c1b1, 0x13a2e45cd0c35b2a},
+    {0x6b2d0c1e7e9a5f43, 0xa4c1e3f0b2d59876, 0x2e8f6d4c3b1a0957, 0xd7c6b5a493827160},
+    {0x81e4c2a6b8d0f1e3, 0x5c3a1e0f2d4b6987, 0x9f8e7d6c5b4a3928, 0x17263544a5b6c7d8},
+};
+static const uint64_t tilediff_row_key[4] = {
+    0x7c01812cf721ad1c, 0xded46de9839097db, 0x7240a4a4b7b3671f, 0xcb79e64eccc0e578,
+};
+
+static inline void accumulate_scalar(uint64_t acc[4], const uint8_t *data, const uint64_t key[4])
+{
+    uint64_t w[4];
+
+    memcpy(w, data, sizeof(w));
+    for (int l = 0; l < 4; l++)
+    {
+        uint64_t dk = w[l] ^ key[l];
+        acc[l] += w[l ^ 1] + (dk & 0xffffffff) * (dk >> 32);
+    }
+}
+
+static inline void scramble_scalar(uint64_t acc[4])
+{
+    for (int l = 0; l < 4; l++)
+    {
+        acc[l] ^= acc[l] >> 47;
+        acc[l] ^= tilediff_row_key[l];
+        acc[l] *= PRIME32;
+    }
+}
+
+// Bytes of the row that don't fill a chunk, zero padded.
+static inline void accumulate_tail(uint64_t acc[4], const uint8_t *data, uint32_t size,
+                                   const uint64_t key[4])
+{
+    uint8_t chunk[CHUNK] = {};
+
+    memcpy(chunk, data, size);
+    accumulate_scalar(acc, chunk, key);
+}
+
+static void hash_row_scalar(uint64_t (*acc)[4], const uint8_t *row,
+                            uint32_t tiles_x, uint32_t tile_bytes, uint32_t row_bytes)
+{
+    for (uint32_t tx = 0; tx < tiles_x; tx++)
+    {
+        const uint8_t *p = row + tx * tile_bytes;
+        uint32_t size = row_bytes - tx * tile_bytes, k = 0;
+
+        if (size > tile_bytes)
+            size = tile_bytes;
+        for (; size >= CHUNK; k++, p += CHUNK, size -= CHUNK)
+            accumulate_scalar(acc[tx], p, tilediff_keys[k]);
+        if (size)
+            accumulate_tail(acc[tx], p, size, tilediff_keys[k]);
+        scramble_scalar(acc[tx]);
+    }
+}
+
+#ifdef TILEDIFF_X86
+__attribute__((target("avx2"))) static void hash_row_avx2(uint64_t (*acc)[4], const uint8_t *row,
+                                                          uint32_t tiles_x, uint32_t tile_bytes,
+                                                          uint32_t row_bytes)
+{
+    const __m256i row_key = _mm256_loadu_si256((const __m256i *)tilediff_row_key);
+    const __m256i prime = _mm256_set1_epi64x(PRIME32);
+
+    for (uint32_t tx = 0; tx < tiles_x; tx++)
+    {
+        const uint8_t *p = row + tx * tile_bytes;
+        uint32_t size = row_bytes - tx * tile_bytes, k = 0;
+        __m256i a = _mm256_loadu_si256((const __m256i *)acc[tx]);
+
+        if (size > tile_bytes)
+            size = tile_bytes;
+        for (; size >= CHUNK; k++, p += CHUNK, size -= CHUNK)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            __m256i dk = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)tilediff_keys[k]));
+            __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+            __m256i swapped = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+            a = _mm256_add_epi64(a, _mm256_add_epi64(prod, swapped));
+        }
+        if (size)
+        {
+            _mm256_storeu_si256((__m256i *)acc[tx], a);
+            accumulate_tail(acc[tx], p, size, tilediff_keys[k]);
+            a = _mm256_loadu_si256((const __m256i *)acc[tx]);
+        }
+
+        // acc * PRIME32 mod 2^64 from two 32x32 multiplies.
+        a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+        a = _mm256_xor_si256(a, row_key);
+        a = _mm256_add_epi64(_mm256_mul_epu32(a, prime),
+                             _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime), 32));
+        _mm256_storeu_si256((__m256i *)acc[tx], a);
+    }
+}
+#endif
+
+static inline uint64_t rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t hash_final(const uint64_t acc[4])
+{
+    uint64_t h = acc[0] ^ rotl64(acc[1], 17) ^ rotl64(acc[2], 31) ^ rotl64(acc[3], 47);
+
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+static void hash_tile_row(void *user, uint32_t ty, struct work_arena *arena)
+{
+    struct tilediff *td = user;
+    const struct frame *frame = td->frame;
+    const uint8_t *data = frame->planes[0].data;
+    const uint32_t stride = frame->planes[0].stride;
+    const uint32_t tile_bytes = TILEDIFF_TILE * td->bpp;
+    const uint32_t row_bytes = td->width * td->bpp;
+    uint64_t (*acc)[4] = work_arena_alloc(arena, sizeof(acc[0]) * td->tiles_x);
+    uint32_t y0 = ty * TILEDIFF_TILE, y1 = y0 + TILEDIFF_TILE;
+
+    if (!acc)
+    {
+        // Reported changed, better than a missed update.
+        memset(td->dirty + ty * td->tiles_x, 1, td->tiles_x);
+        return;
+    }
+    if (y1 > td->height)
+        y1 = td->height;
+    memset(acc, 0, sizeof(acc[0]) * td->tiles_x);
+
+    // Walk whole pixel rows so memory is read sequentially.
+    for (uint32_t y = y0; y < y1; y++)
+    {
+        const uint8_t *row = data + (size_t)y * stride;
+#ifdef TILEDIFF_X86
+        if (td->impl == CONVERT_IMPL_AVX2)
+        {
+            hash_row_avx2(acc, row, td->tiles_x, tile_bytes, row_bytes);
+            continue;
+        }
+#endif
+        hash_row_scalar(acc, row, td->tiles_x, tile_bytes, row_bytes);
+    }
+
+    for (uint32_t tx = 0; tx < td->tiles_x; tx++)
+    {
+        uint32_t i = ty * td->tiles_x + tx;
+        uint64_t h = hash_final(acc[tx]);
+
+        td->dirty[i] = !td->valid || td->hashes[i] != h;
+        td->hashes[i] = h;
+    }
+}
+
+int tilediff_init(struct tilediff *td, uint32_t n_threads, enum convert_impl impl)
+{
+    memset(td, 0, sizeof(*td));
+    if (impl == CONVERT_IMPL_AUTO)
+        impl = convert_best_impl();
+    td->impl = impl;
+    if (!(td->pool = work_pool_new(n_threads < 1 ? 1 : n_threads)))
+        return -ENOMEM;
+    return 0;
+}
+
+void tilediff_clear(struct tilediff *td)
+{
+    work_pool_destroy(td->pool);
+    td->pool = NULL;
+    free(td->hashes);
+    free(td->dirty);
+    free(td->rects);
+    td->hashes = NULL;
+    td->dirty = NULL;
+    td->rects = NULL;
+}
+
+static int tilediff_configure(struct tilediff *td, uint32_t width, uint32_t height, uint32_t bpp)
+{
+    uint32_t tiles_x = (width + TILEDIFF_TILE - 1) / TILEDIFF_TILE;
+    uint32_t tiles_y = (height + TILEDIFF_TILE - 1) / TILEDIFF_TILE;
+
+    if (tiles_x > MAX_TILES_X)
+        return -ENOTSUP;
+
+    free(td->hashes);
+    free(td->dirty);
+    free(td->rects);
+    td->hashes = calloc((size_t)tiles_x * tiles_y, sizeof(*td->hashes));
+    td->dirty = calloc((size_t)tiles_x * tiles_y, sizeof(*td->dirty));
+    td->rects = calloc((size_t)tiles_x * tiles_y, sizeof(*td->rects));
+    if (!td->hashes || !td->dirty || !td->rects)
+        return -ENOMEM;
+
+    td->width = width;
+    td->height = height;
+    td->bpp = bpp;
+    td->tiles_x = tiles_x;
+    td->tiles_y = tiles_y;
+    td->valid = false;
+    return 0;
+}
+
+// Turn runs of dirty tiles into rectangles, runs over the same columns in
+// consecutive tile rows are merged into one.
+static uint32_t tilediff_rects(struct tilediff *td)
+{
+    uint32_t n_rects = 0;
+
+    for (uint32_t ty = 0; ty < td->tiles_y; ty++)
+    {
+        const uint8_t *dirty = td->dirty + ty * td->tiles_x;
+
+        for (uint32_t tx = 0; tx < td->tiles_x;)
+        {
+            uint32_t x0, i;
+
+            if (!dirty[tx])
+            {
+                tx++;
+                continue;
+            }
+            for (x0 = tx; tx < td->tiles_x && dirty[tx]; tx++)
+                ;
+
+            for (i = 0; i < n_rects; i++)
+            {
+                struct frame_rect *r = &td->rects[i];
+                if (r->x == x0 * TILEDIFF_TILE && r->width == (tx - x0) * TILEDIFF_TILE &&
+                    r->y + r->height == ty * TILEDIFF_TILE)
+                {
+                    r->height += TILEDIFF_TILE;
+                    break;
+                }
+            }
+            if (i == n_rects)
+            {
+                td->rects[n_rects++] = (struct frame_rect){
+                    x0 * TILEDIFF_TILE, ty * TILEDIFF_TILE,
+                    (tx - x0) * TILEDIFF_TILE, TILEDIFF_TILE};
+            }
+        }
+    }
+    return n_rects;
+}
+
+int tilediff_process(struct tilediff *td, struct frame *frame, bool full)
+{
+    uint32_t bpp = convert_format_bpp(frame->format), dirty = 0, n_tiles, n_rects;
+    int res;
+
+    if (bpp == 0 || frame->n_planes < 1)
+        return -ENOTSUP;
+    if (frame->width != td->width || frame->height != td->height || bpp != td->bpp)
+    {
+        if ((res = tilediff_configure(td, frame->width, frame->height, bpp)) < 0)
+            return res;
+    }
+    // Without valid hashes every tile compares as changed.
+    if (full)
+        td->valid = false;
+
+    td->frame = frame;
+    work_pool_run(td->pool, td->tiles_y, hash_tile_row, td);
+    td->frame = NULL;
+    td->valid = true;
+
+    n_tiles = td->tiles_x * td->tiles_y;
+    for (uint32_t i = 0; i < n_tiles; i++)
+        dirty += td->dirty[i];
+
+    td->frames++;
+    td->change_ratio = n_tiles ? (double)dirty / n_tiles : 0;
+    if (dirty == 0)
+    {
+        frame->n_damage = 0;
+        return 0;
+    }
+
+    n_rects = tilediff_rects(td);
+    frame->n_damage = 0;
+    for (uint32_t i = 0; i < n_rects; i++)
+        frame_damage_add(frame, td->rects[i].x, td->rects[i].y,
+                         td->rects[i].width, td->rects[i].height);
+    return dirty;
+}
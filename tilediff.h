@@ -0,0 +1,49 @@
+#ifndef TILEDIFF_H
+#define TILEDIFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "convert.h"
+#include "frame.h"
+#include "pool.h"
+
+#define TILEDIFF_TILE 64
+
+// Software damage for compositors that send no SPA_META_VideoDamage. Frames
+// are cut into TILEDIFF_TILE square tiles, each hashed and compared with the
+// hash of the same tile in the previous frame. Only hashes are kept, never a
+// copy of the previous frame.
+struct tilediff
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    enum convert_impl impl;
+
+    uint64_t *hashes; // previous frame, tiles_y * tiles_x
+    uint8_t *dirty;   // current frame
+    struct frame_rect *rects;
+    bool valid;
+
+    // Tile rows are the pool's items.
+    const struct frame *frame;
+    struct work_pool *pool;
+
+    uint64_t frames;
+    double change_ratio; // of the last frame
+};
+
+// `n_threads` counts the calling thread, 1 runs everything inline.
+int tilediff_init(struct tilediff *td, uint32_t n_threads, enum convert_impl impl);
+void tilediff_clear(struct tilediff *td);
+
+// Hash `frame`, mark tiles that differ from the previous frame and replace
+// the frame's damage with them. Returns the number of changed tiles, 0 for
+// an unchanged frame, or a negative error if the format can't be hashed.
+// With `full` every tile is reported changed, the hashes are still updated.
+int tilediff_process(struct tilediff *td, struct frame *frame, bool full);
+
+#endif
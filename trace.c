@@ -0,0 +1,400 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "trace.h"
+
+// Longest the writer thread waits for a frame before it looks at quit.
+#define TRACE_POLL_MS 50
+
+#define TRACE_ALIGN_UP(v) (((v) + TRACE_ALIGN - 1) & ~(uint64_t)(TRACE_ALIGN - 1))
+
+struct trace_writer
+{
+    int fd;
+    struct frame_ring ring;
+    pthread_t thread;
+    bool running;
+    atomic_bool quit;
+    uint64_t offset;
+
+    // Everything but the pixels of each pushed frame, by stream and buffer
+    // id. A slot is only reused once its frame was written and released.
+    struct trace_frame_header meta[TRACE_MAX_STREAMS][MAX_BUFFERS];
+    // Tells the streams' frames apart, see trace_writer_stream.
+    struct frame_pool *pools[TRACE_MAX_STREAMS];
+
+    _Atomic uint64_t frames;
+    _Atomic uint64_t bytes;
+};
+
+static const uint8_t zeros_[TRACE_ALIGN];
+
+// Write all of `iov`, resuming after short writes.
+static int write_iov(int fd, struct iovec *iov, int n_iov)
+{
+    while (n_iov)
+    {
+        ssize_t res = writev(fd, iov, n_iov);
+
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0)
+            return -errno;
+        while (n_iov && (size_t)res >= iov->iov_len)
+        {
+            res -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    return 0;
+}
+
+static int trace_writer_stream(struct trace_writer *w, const struct frame *frame)
+{
+    for (int i = 0; i < TRACE_MAX_STREAMS; i++)
+        if (w->pools[i] == frame->pool)
+            return i;
+    return -1;
+}
+
+static int trace_writer_write(struct trace_writer *w, const struct frame *frame)
+{
+    int stream = trace_writer_stream(w, frame);
+    struct trace_frame_header header;
+    struct iovec iov[2 + 2 * FRAME_MAX_PLANES];
+    uint64_t size;
+    int n_iov = 0, res;
+
+    if (stream < 0)
+        return -EINVAL;
+    header = w->meta[stream][frame->id];
+    size = TRACE_ALIGN_UP(sizeof(header));
+    iov[n_iov++] = (struct iovec){&header, sizeof(header)};
+    iov[n_iov++] = (struct iovec){(void *)zeros_, size - sizeof(header)};
+    for (uint32_t i = 0; i < header.n_planes; i++)
+    {
+        uint64_t padded = TRACE_ALIGN_UP(header.sizes[i]);
+
+        header.offsets[i] = size;
+        iov[n_iov++] = (struct iovec){(void *)frame->planes[i].data, header.sizes[i]};
+        iov[n_iov++] = (struct iovec){(void *)zeros_, padded - header.sizes[i]};
+        size += padded;
+    }
+    header.size = size;
+
+    if ((res = write_iov(w->fd, iov, n_iov)) < 0)
+        return res;
+    w->offset += size;
+    atomic_fetch_add_explicit(&w->frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->bytes, size, memory_order_relaxed);
+    return 0;
+}
+
+static void *trace_writer_thread(void *data)
+{
+    struct trace_writer *w = data;
+    bool failed = false;
+
+    // Frames queued before the stop are still written.
+    while (true)
+    {
+        bool quit = atomic_load(&w->quit);
+        struct frame *frame = quit ? frame_ring_pop(&w->ring)
+                                   : frame_ring_wait(&w->ring, TRACE_POLL_MS);
+        int res;
+
+        if (!frame && quit)
+            break;
+        if (!frame)
+            continue;
+        if (!failed && (res = trace_writer_write(w, frame)) < 0)
+        {
+            printf("Trace write failed, tracing stopped: %s\n", strerror(-res));
+            failed = true;
+        }
+        frame_release(frame);
+    }
+    return NULL;
+}
+
+struct trace_writer *trace_writer_new(const char *path)
+{
+    struct trace_writer *w = calloc(1, sizeof(*w));
+    struct trace_file_header header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .header_size = TRACE_ALIGN_UP(sizeof(header)),
+    };
+    struct iovec iov[2] = {
+        {&header, sizeof(header)},
+        {(void *)zeros_, TRACE_ALIGN_UP(sizeof(header)) - sizeof(header)},
+    };
+    int res;
+
+    if (!w)
+        return NULL;
+    w->fd = -1;
+    // Every buffer of a stream may be queued, the ring only drops when the
+    // streams together have more frames in it than it has slots.
+    if (frame_ring_init(&w->ring, FRAME_RING_QUEUE) < 0)
+    {
+        free(w);
+        return NULL;
+    }
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0 || write_iov(w->fd, iov, 2) < 0)
+    {
+        printf("Failed to create the trace %s: %m\n", path);
+        goto fail;
+    }
+    w->offset = header.header_size;
+
+    if ((res = pthread_create(&w->thread, NULL, trace_writer_thread, w)) != 0)
+    {
+        printf("Failed to start the trace thread: %s\n", strerror(res));
+        goto fail;
+    }
+    w->running = true;
+    printf("Tracing frames to %s\n", path);
+    return w;
+
+fail:
+    trace_writer_destroy(w);
+    return NULL;
+}
+
+void trace_writer_push(struct trace_writer *writer, uint32_t stream, struct frame *frame,
+                       uint32_t flags)
+{
+    struct trace_frame_header *meta;
+
+    if (stream >= TRACE_MAX_STREAMS || frame->id >= MAX_BUFFERS ||
+        atomic_load_explicit(&writer->quit, memory_order_relaxed))
+        return;
+    writer->pools[stream] = frame->pool;
+    meta = &writer->meta[stream][frame->id];
+    *meta = (struct trace_frame_header){
+        .magic = TRACE_FRAME_MAGIC,
+        .stream = stream,
+        .format = frame->format,
+        .width = frame->width,
+        .height = frame->height,
+        .n_planes = frame->n_planes,
+        .flags = flags,
+        .n_damage = frame->n_damage,
+        .seq = frame->seq,
+        .pts = frame->pts,
+        .time_ns = frame->queued_ns,
+    };
+    for (uint32_t i = 0; i < frame->n_planes; i++)
+    {
+        meta->strides[i] = frame->planes[i].stride;
+        meta->sizes[i] = frame->planes[i].size;
+    }
+    memcpy(meta->damage, frame->damage, frame->n_damage * sizeof(frame->damage[0]));
+    frame_ring_push(&writer->ring, frame);
+}
+
+struct frame_ring *trace_writer_ring(struct trace_writer *writer)
+{
+    return &writer->ring;
+}
+
+void trace_writer_get_stats(struct trace_writer *writer, struct trace_writer_stats *stats)
+{
+    struct frame_ring_stats ring;
+
+    frame_ring_get_stats(&writer->ring, &ring);
+    stats->frames = atomic_load_explicit(&writer->frames, memory_order_relaxed);
+    stats->dropped = ring.dropped;
+    stats->bytes = atomic_load_explicit(&writer->bytes, memory_order_relaxed);
+}
+
+void trace_writer_stop(struct trace_writer *writer)
+{
+    struct trace_writer_stats stats;
+
+    if (!writer->running || atomic_exchange(&writer->quit, true))
+        return;
+    frame_ring_wake(&writer->ring);
+    pthread_join(writer->thread, NULL);
+
+    trace_writer_get_stats(writer, &stats);
+    printf("Traced %lu frames, %lu MB, %lu dropped\n", (unsigned long)stats.frames,
+           (unsigned long)(stats.bytes >> 20), (unsigned long)stats.dropped);
+}
+
+void trace_writer_destroy(struct trace_writer *writer)
+{
+    struct frame *frame;
+
+    trace_writer_stop(writer);
+    // Only frames of a stream that is still alive can be left here.
+    while ((frame = frame_ring_pop(&writer->ring)))
+        frame_release(frame);
+    if (writer->fd >= 0)
+        close(writer->fd);
+    frame_ring_clear(&writer->ring);
+    free(writer);
+}
+
+struct trace_reader
+{
+    const uint8_t *data;
+    size_t size;
+    uint64_t start; // first record
+    uint64_t end;   // past the last complete record
+    uint64_t cursor;
+
+    uint64_t frames;
+    uint32_t streams;
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+// The record at `offset` if it is complete and consistent, NULL otherwise.
+static const struct trace_frame_header *trace_reader_record(struct trace_reader *r,
+                                                            uint64_t offset)
+{
+    const struct trace_frame_header *h;
+
+    if (offset > r->size || r->size - offset < sizeof(*h))
+        return NULL;
+    h = (const struct trace_frame_header *)(r->data + offset);
+    if (h->magic != TRACE_FRAME_MAGIC || h->size < sizeof(*h) || h->size > r->size - offset ||
+        h->n_planes > FRAME_MAX_PLANES || h->n_damage > FRAME_MAX_DAMAGE ||
+        h->stream >= TRACE_MAX_STREAMS)
+        return NULL;
+    for (uint32_t i = 0; i < h->n_planes; i++)
+    {
+        if (h->offsets[i] % TRACE_ALIGN || h->offsets[i] > h->size ||
+            h->sizes[i] > h->size - h->offsets[i])
+            return NULL;
+    }
+    return h;
+}
+
+struct trace_reader *trace_reader_open(const char *path)
+{
+    struct trace_reader *r = calloc(1, sizeof(*r));
+    const struct trace_file_header *header;
+    const struct trace_frame_header *h;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (!r)
+        return NULL;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        printf("Failed to open the trace %s: %m\n", path);
+        goto fail;
+    }
+    r->size = st.st_size;
+    if (r->size < sizeof(*header))
+    {
+        printf("%s is not a trace\n", path);
+        goto fail;
+    }
+    map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        printf("Failed to map the trace %s: %m\n", path);
+        goto fail;
+    }
+    close(fd);
+    fd = -1;
+    r->data = map;
+    madvise(map, r->size, MADV_SEQUENTIAL);
+
+    header = map;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->header_size < sizeof(*header) || header->header_size % TRACE_ALIGN)
+    {
+        printf("%s is not a trace of version %u\n", path, TRACE_VERSION);
+        goto fail;
+    }
+
+    // One pass over the headers only, the pixels aren't touched.
+    r->start = r->end = header->header_size;
+    while ((h = trace_reader_record(r, r->end)))
+    {
+        if (!r->frames++)
+            r->first_ns = h->time_ns;
+        r->last_ns = h->time_ns;
+        if (h->stream >= r->streams)
+            r->streams = h->stream + 1;
+        r->end += h->size;
+    }
+    if (r->end != r->size)
+        printf("Trace %s is cut short, replaying %lu complete frames\n", path,
+               (unsigned long)r->frames);
+    r->cursor = r->start;
+    return r;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    trace_reader_close(r);
+    return NULL;
+}
+
+void trace_reader_close(struct trace_reader *reader)
+{
+    if (reader->data)
+        munmap((void *)reader->data, reader->size);
+    free(reader);
+}
+
+uint64_t trace_reader_frames(struct trace_reader *reader)
+{
+    return reader->frames;
+}
+
+uint32_t trace_reader_streams(struct trace_reader *reader)
+{
+    return reader->streams;
+}
+
+uint64_t trace_reader_duration_ns(struct trace_reader *reader)
+{
+    return reader->last_ns > reader->first_ns ? reader->last_ns - reader->first_ns : 0;
+}
+
+bool trace_reader_next(struct trace_reader *reader, struct trace_frame *frame)
+{
+    const struct trace_frame_header *h;
+
+    if (reader->cursor >= reader->end || !(h = trace_reader_record(reader, reader->cursor)))
+        return false;
+    reader->cursor += h->size;
+
+    frame->header = h;
+    for (uint32_t i = 0; i < h->n_planes; i++)
+    {
+        frame->planes[i].data = (const uint8_t *)h + h->offsets[i];
+        frame->planes[i].stride = h->strides[i];
+        frame->planes[i].size = h->sizes[i];
+    }
+    return true;
+}
+
+void trace_reader_rewind(struct trace_reader *reader)
+{
+    reader->cursor = reader->start;
+}
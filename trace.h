@@ -0,0 +1,112 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "ring.h"
+
+// Capture trace: every buffer on_stream_process dequeued, with its format,
+// damage and timestamps, so the frame path can be replayed and measured
+// without a compositor. The file is a header followed by one record per
+// frame. Records and planes start on TRACE_ALIGN, a reader maps the file
+// and hands out pixels in place with the alignment the SIMD kernels get
+// from live buffers.
+
+#define TRACE_MAGIC 0x52544353       // "SCTR"
+#define TRACE_FRAME_MAGIC 0x46544353 // "SCTF"
+#define TRACE_VERSION 1
+#define TRACE_ALIGN 64
+#define TRACE_MAX_STREAMS 8
+
+// The compositor's damage was trusted, the damage list is its own.
+#define TRACE_FRAME_DAMAGE (1u << 0)
+// The frame had to be treated as fully changed, after a format change.
+#define TRACE_FRAME_FULL (1u << 1)
+
+struct trace_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size; // of this header, records follow
+    uint32_t reserved;
+};
+
+struct trace_frame_header
+{
+    uint32_t magic;
+    uint32_t stream; // index in the session
+    uint32_t format; // enum spa_video_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t n_planes;
+    uint32_t flags;
+    uint32_t n_damage;
+    uint64_t size; // of the whole record, the next one follows
+    uint64_t seq;
+    int64_t pts;      // SPA_META_Header pts, -1 without
+    uint64_t time_ns; // CLOCK_MONOTONIC dequeue time
+    uint32_t strides[FRAME_MAX_PLANES];
+    uint32_t sizes[FRAME_MAX_PLANES];
+    uint32_t offsets[FRAME_MAX_PLANES]; // from the start of the record
+    struct frame_rect damage[FRAME_MAX_DAMAGE];
+};
+
+// Writes a trace on a thread of its own. Frames are pushed by the PipeWire
+// thread right after the dequeue and queued until written, every queued
+// frame holds its buffer, so a slow disk costs capture buffers rather
+// than trace frames.
+struct trace_writer;
+
+struct trace_writer_stats
+{
+    uint64_t frames;  // written
+    uint64_t dropped; // the queue was full
+    uint64_t bytes;
+};
+
+struct trace_writer *trace_writer_new(const char *path);
+
+// On the PipeWire thread, never blocks. Takes its own reference on `frame`
+// and copies everything but the pixels, so the worker may still rewrite
+// the frame's damage.
+void trace_writer_push(struct trace_writer *writer, uint32_t stream, struct frame *frame,
+                       uint32_t flags);
+
+// Frames pushed but not written yet. Once the writer is stopped the owner
+// of the frames drains this ring before their buffers go away.
+struct frame_ring *trace_writer_ring(struct trace_writer *writer);
+
+void trace_writer_get_stats(struct trace_writer *writer, struct trace_writer_stats *stats);
+
+// Same two steps as the consumers: stop before the session is destroyed,
+// destroy after.
+void trace_writer_stop(struct trace_writer *writer);
+void trace_writer_destroy(struct trace_writer *writer);
+
+// A mapped trace. Records are read in place, the planes of a
+// trace_frame point into the mapping and stay valid until the reader is
+// closed.
+struct trace_reader;
+
+struct trace_frame
+{
+    const struct trace_frame_header *header;
+    struct frame_plane planes[FRAME_MAX_PLANES];
+};
+
+struct trace_reader *trace_reader_open(const char *path);
+void trace_reader_close(struct trace_reader *reader);
+
+// Complete records, a trace cut short by a crash ends at the last one.
+uint64_t trace_reader_frames(struct trace_reader *reader);
+uint32_t trace_reader_streams(struct trace_reader *reader);
+// From the first record's dequeue to the last one's.
+uint64_t trace_reader_duration_ns(struct trace_reader *reader);
+
+// The next record, false at the end. trace_reader_rewind starts over.
+bool trace_reader_next(struct trace_reader *reader, struct trace_frame *frame);
+void trace_reader_rewind(struct trace_reader *reader);
+
+#endif
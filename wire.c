@@ -1,7 +1,14 @@
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 #include <spa/utils/result.h>
 #include <spa/param/video/format-utils.h>
@@ -12,59 +19,1039 @@
 #include <gio/gio.h>
 #include <gio/gunixfdlist.h>
 
+#include "cursor.h"
+#include "latency.h"
+#include "metrics.h"
+#include "ring.h"
+#include "tilediff.h"
+#include "trace.h"
+#include "wire.h"
+
 struct pw_core_events;
 struct pw_thread_loop;
 struct pw_context;
 
 struct pw_core_events pw_core_events_ = {};
+struct pw_stream_events pw_stream_events_;
+
+// One thread loop and context serve every session of the process. They are
+// created with the first session and torn down with the last one.
 struct pw_thread_loop *pw_main_loop_ = NULL;
 struct pw_context *pw_context_ = NULL;
-
-uint32_t pw_stream_node_id_ = 0;
-int pw_fd_ = 0;
+uint32_t pw_context_users_ = 0;
+pthread_mutex_t pw_context_lock_ = PTHREAD_MUTEX_INITIALIZER;
 char *pw_client_version_ = "";
-struct pw_core *pw_core_ = NULL;
-struct pw_stream_events pw_stream_events_;
-struct spa_hook spa_core_listener_;
-struct spa_source *renegotiate_ = NULL;
+
+#define MAX_DAMAGE_REGIONS FRAME_MAX_DAMAGE
+
+#define CURSOR_META_SIZE(w, h) \
+    (sizeof(struct spa_meta_cursor) + sizeof(struct spa_meta_bitmap) + (w) * (h) * 4)
+
+// Rows are padded to BUFFER_ALIGN so the SIMD kernels never straddle a row
+// with a load.
+#define BUFFER_ALIGN 64
+
+// Halve the rate when consumers drop frames within a window, double it
+// again after LOAD_SHED_RECOVER quiet windows.
+#define LOAD_SHED_WINDOW_NS 1000000000ull
+#define LOAD_SHED_RECOVER 5
+#define LOAD_SHED_MIN_FPS 5
+
+#define TILEDIFF_THREADS 4
+
+// Formats each kind of consumer takes without a conversion of its own, in
+// order of preference. The encoder feeds yuv.c, the recorder and the shm
+// export take anything convert.c handles.
+static const uint32_t encoder_formats_[] = {
+    SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx,
+    SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGBA,
+};
+static const uint32_t recorder_formats_[] = {
+    SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx,
+    SPA_VIDEO_FORMAT_xRGB, SPA_VIDEO_FORMAT_xBGR,
+    SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGBA,
+    SPA_VIDEO_FORMAT_ARGB, SPA_VIDEO_FORMAT_ABGR,
+};
+static const uint32_t shm_formats_[] = {
+    SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGBA,
+    SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx,
+};
+
+// Mapped planes of one pw_buffer. Filled once in on_stream_add_buffer and
+// reused for every frame carried by that buffer.
+struct wire_buffer
+{
+    struct pw_buffer *buffer;
+    uint8_t *planes[FRAME_MAX_PLANES];
+    void *map[FRAME_MAX_PLANES];
+    size_t map_size[FRAME_MAX_PLANES];
+    bool dequeued; // owned by us until all frame references are gone
+    bool removed;  // unmap once the last consumer released the frame
+    bool tilediff; // worker has to find the damage itself
+    bool full;     // worker has to report every tile changed
+    // A cursor-only buffer carries no pixels, its frame shows those of
+    // `base` and holds a reference on it until the buffer is requeued.
+    struct frame *base;
+    // Part of the buffer the frame shows, see wire_frame_crop.
+    struct frame_rect crop;
+    struct frame frame;
+};
+
+#define MAX_CONSUMERS 8
+
+// One portal stream. PipeWire callbacks run on the shared thread loop and
+// only dequeue and describe buffers; hashing and publishing run on the
+// stream's own worker, so monitors are processed in parallel.
+struct wire_stream
+{
+    struct wire_session *session;
+    uint32_t index;
+    uint32_t node_id;
+    struct pw_stream *stream;
+    struct spa_hook listener;
+    struct spa_source *renegotiate;
+    struct spa_source *release;
+
+    // Negotiated format, valid once param_changed delivered SPA_PARAM_Format.
+    struct spa_video_info_raw format;
+    bool format_valid;
+    // Damage metadata is only trusted once the compositor sent a real
+    // region, some attach the meta but never fill it in.
+    bool damage_seen;
+    // The first frame after a format change has to be complete.
+    bool force_full_damage;
+
+    // Capture rectangle set by wire_set_roi, x, y, width and height in 16
+    // bits each so it is replaced in one store. Zero size for none.
+    _Atomic uint64_t roi;
+    // Rectangle the last frame showed, a new one is fully damaged.
+    struct frame_rect crop;
+
+    // Pointer from SPA_META_Cursor, PipeWire thread only. Bitmaps are
+    // cached by id, so a move only updates the position.
+    struct cursor_cache cursors;
+    struct frame_cursor cursor;
+    bool cursor_seen;
+    // Newest frame with pixels, shown again by cursor-only buffers. Only
+    // held once the compositor sends cursor metadata, it keeps one buffer.
+    struct frame *last_frame;
+
+    uint32_t fps;
+    atomic_bool formats_dirty;
+    uint64_t shed_window_start_ns;
+    uint64_t shed_dropped;
+    uint32_t shed_quiet_windows;
+
+    struct wire_buffer buffers[MAX_BUFFERS];
+    struct frame_pool pool;
+    uint64_t frame_seq;
+
+    // Frames handed from on_stream_process to the worker.
+    struct frame_ring work;
+    pthread_t worker;
+    bool worker_started;
+    struct tilediff tilediff;
+
+    struct frame_ring *consumers[MAX_CONSUMERS];
+    atomic_uint n_consumers;
+
+    // Shared by all streams, see wire_stream_connect.
+    struct latency_histogram *capture_latency;
+    struct latency_histogram *publish_latency;
+    struct latency_histogram *requeue_latency;
+
+    _Atomic uint64_t frames;
+    _Atomic uint64_t published;
+    _Atomic uint64_t unchanged;
+    _Atomic uint32_t change_ppm; // change ratio of the tile diff, in millionths
+    _Atomic uint64_t corrupted;
+    atomic_bool quit;
+};
+
+// One portal session: its own connection to PipeWire through the portal's
+// fd, and the streams of that session.
+struct wire_session
+{
+    int pw_fd;
+    struct pw_core *core;
+    struct spa_hook core_listener;
+
+    // Buffers asked from the producer, within [2, MAX_BUFFERS].
+    uint32_t buffer_count;
+    // Size and rate the compositor is asked for. A stream's rate drops
+    // below max_fps while load shedding, a fixed size also caps the range.
+    struct spa_rectangle target_size;
+    bool target_size_fixed;
+    uint32_t max_fps;
+    // Read on the PipeWire or replay thread.
+    atomic_bool load_shedding;
+    // Software damage while the compositor doesn't send any, read there too.
+    atomic_bool tilediff_enabled;
+    // Offered in EnumFormat, in order of preference.
+    uint32_t formats[WIRE_MAX_FORMATS];
+    uint32_t n_formats;
+
+    // Told once, on a stream worker, when the first frame is published.
+    void (*first_frame_cb)(void *data);
+    void *first_frame_data;
+    atomic_bool first_frame_seen;
+
+    // Gets every dequeued frame, see wire_set_trace.
+    struct trace_writer *trace;
+
+    // Set by wire_session_replay, which takes the place of PipeWire: the
+    // replay thread owns the buffers and is woken through `replay_wake_fd`
+    // when consumers release them.
+    struct trace_reader *replay;
+    bool replay_realtime;
+    pthread_t replay_thread;
+    bool replay_started;
+    atomic_bool replay_quit;
+    int replay_wake_fd;
+    void (*replay_done_cb)(void *data);
+    void *replay_done_data;
+
+    struct wire_stream streams[WIRE_MAX_STREAMS];
+    uint32_t n_streams;
+};
 
 struct DATA
 {
 };
 struct DATA userdata;
 
+int __pw_loop_signal_event(struct pw_loop *loop, struct spa_source *source);
+
+static void wire_signal(struct spa_source *source)
+{
+    if (pw_main_loop_ && source)
+        __pw_loop_signal_event(pw_thread_loop_get_loop(pw_main_loop_), source);
+}
+
+void wire_set_buffer_count(struct wire_session *session, uint32_t count)
+{
+    if (pw_main_loop_)
+        pw_thread_loop_lock(pw_main_loop_);
+    session->buffer_count = SPA_CLAMP(count, 2u, (uint32_t)MAX_BUFFERS);
+    for (uint32_t i = 0; i < session->n_streams; i++)
+        wire_signal(session->streams[i].renegotiate);
+    if (pw_main_loop_)
+        pw_thread_loop_unlock(pw_main_loop_);
+}
+
+void wire_set_target(struct wire_session *session, uint32_t fps, uint32_t width,
+                     uint32_t height)
+{
+    if (pw_main_loop_)
+        pw_thread_loop_lock(pw_main_loop_);
+    if (fps)
+        session->max_fps = SPA_MIN(fps, 240u);
+    session->target_size_fixed = width && height;
+    session->target_size = session->target_size_fixed ? SPA_RECTANGLE(width, height)
+                                                      : SPA_RECTANGLE(WIDTH, HEIGHT);
+    for (uint32_t i = 0; i < session->n_streams; i++)
+    {
+        struct wire_stream *ws = &session->streams[i];
+
+        ws->fps = session->max_fps;
+        ws->shed_quiet_windows = 0;
+        atomic_store(&ws->formats_dirty, true);
+        wire_signal(ws->renegotiate);
+    }
+    if (pw_main_loop_)
+        pw_thread_loop_unlock(pw_main_loop_);
+}
+
+void wire_set_formats(struct wire_session *session, const uint32_t *formats,
+                      uint32_t n_formats)
+{
+    if (pw_main_loop_)
+        pw_thread_loop_lock(pw_main_loop_);
+    session->n_formats = SPA_MIN(n_formats, (uint32_t)WIRE_MAX_FORMATS);
+    memcpy(session->formats, formats, session->n_formats * sizeof(*formats));
+    for (uint32_t i = 0; i < session->n_streams; i++)
+    {
+        atomic_store(&session->streams[i].formats_dirty, true);
+        wire_signal(session->streams[i].renegotiate);
+    }
+    if (pw_main_loop_)
+        pw_thread_loop_unlock(pw_main_loop_);
+}
+
+void wire_set_consumer(struct wire_session *session, enum wire_consumer consumer)
+{
+    switch (consumer)
+    {
+    case WIRE_CONSUMER_ENCODER:
+        wire_set_formats(session, encoder_formats_, SPA_N_ELEMENTS(encoder_formats_));
+        break;
+    case WIRE_CONSUMER_RECORDER:
+        wire_set_formats(session, recorder_formats_, SPA_N_ELEMENTS(recorder_formats_));
+        break;
+    case WIRE_CONSUMER_SHM:
+        wire_set_formats(session, shm_formats_, SPA_N_ELEMENTS(shm_formats_));
+        break;
+    }
+}
+
+void wire_set_load_shedding(struct wire_session *session, bool enabled)
+{
+    atomic_store(&session->load_shedding, enabled);
+}
+
+void wire_set_first_frame_callback(struct wire_session *session,
+                                   void (*callback)(void *data), void *data)
+{
+    session->first_frame_cb = callback;
+    session->first_frame_data = data;
+}
+
+void wire_set_tile_diff(struct wire_session *session, bool enabled)
+{
+    atomic_store(&session->tilediff_enabled, enabled);
+}
+
+int wire_set_roi(struct wire_session *session, uint32_t stream, const struct frame_rect *roi)
+{
+    uint64_t value = 0;
+
+    if (stream >= WIRE_MAX_STREAMS)
+        return -EINVAL;
+    if (roi && roi->width && roi->height)
+    {
+        if (roi->x > UINT16_MAX || roi->y > UINT16_MAX || roi->width > UINT16_MAX ||
+            roi->height > UINT16_MAX)
+            return -EINVAL;
+        value = roi->x | (uint64_t)roi->y << 16 | (uint64_t)roi->width << 32 |
+                (uint64_t)roi->height << 48;
+    }
+    atomic_store_explicit(&session->streams[stream].roi, value, memory_order_relaxed);
+    return 0;
+}
+
+void wire_set_trace(struct wire_session *session, struct trace_writer *trace)
+{
+    session->trace = trace;
+}
+
+uint32_t wire_stream_count(struct wire_session *session)
+{
+    return session->n_streams;
+}
+
+int wire_add_consumer(struct wire_session *session, uint32_t stream, struct frame_ring *ring)
+{
+    if (stream >= session->n_streams)
+        return -EINVAL;
+
+    struct wire_stream *ws = &session->streams[stream];
+    unsigned n = atomic_load(&ws->n_consumers);
+
+    if (n >= MAX_CONSUMERS)
+        return -ENOSPC;
+    // The worker reads the count first, the slot is filled before.
+    ws->consumers[n] = ring;
+    atomic_store(&ws->n_consumers, n + 1);
+    return 0;
+}
+
+int wire_get_stream_stats(struct wire_session *session, uint32_t stream,
+                          struct wire_stream_stats *stats)
+{
+    if (stream >= session->n_streams)
+        return -EINVAL;
+
+    struct wire_stream *ws = &session->streams[stream];
+
+    stats->node_id = ws->node_id;
+    stats->width = ws->format.size.width;
+    stats->height = ws->format.size.height;
+    stats->fps = ws->fps;
+    stats->frames = atomic_load(&ws->frames);
+    stats->published = atomic_load(&ws->published);
+    stats->unchanged = atomic_load(&ws->unchanged);
+    stats->change_ratio = atomic_load(&ws->change_ppm) / 1e6;
+    stats->corrupted = atomic_load(&ws->corrupted);
+    return 0;
+}
+
+// Called from whatever thread dropped the last reference of a frame.
+static void wire_pool_wake(void *data)
+{
+    struct wire_stream *ws = data;
+
+    wire_signal(ws->release);
+}
+
+// Drop what the frame of `wb` references besides its own buffer, once no
+// consumer holds it anymore.
+static void wire_buffer_drop_refs(struct wire_buffer *wb)
+{
+    if (wb->base)
+        frame_release(wb->base);
+    wb->base = NULL;
+    cursor_image_unref(wb->frame.cursor.image);
+    wb->frame.cursor.image = NULL;
+}
+
+static void wire_buffer_unmap(struct wire_buffer *wb)
+{
+    uint32_t i;
+
+    wire_buffer_drop_refs(wb);
+    for (i = 0; i < FRAME_MAX_PLANES; i++)
+    {
+        if (wb->map[i])
+            munmap(wb->map[i], wb->map_size[i]);
+    }
+    spa_zero(*wb);
+}
+
+// Forget the pointer and the frame cursor-only buffers show again.
+static void wire_stream_drop_cursor(struct wire_stream *ws)
+{
+    cursor_cache_clear(&ws->cursors);
+    cursor_image_unref(ws->cursor.image);
+    ws->cursor = (struct frame_cursor){0};
+    if (ws->last_frame)
+        frame_release(ws->last_frame);
+    ws->last_frame = NULL;
+}
+
+// Give every frame released by the consumers back to PipeWire. Runs on the
+// PipeWire thread only, so pw_stream_queue_buffer is never called
+// concurrently with on_stream_process.
+static void wire_requeue_released(struct wire_stream *ws)
+{
+    uint64_t mask = frame_pool_drain(&ws->pool);
+
+    while (mask)
+    {
+        struct wire_buffer *wb = &ws->buffers[__builtin_ctzll(mask)];
+        mask &= mask - 1;
+
+        // Skip stale bits of a slot that was reused or is in flight again,
+        // its own release sets the bit once more.
+        if (atomic_load(&wb->frame.refs) > 0)
+            continue;
+        if (wb->removed)
+        {
+            if (wb->dequeued)
+                metrics_add(METRIC_BUFFERS_REQUEUED, 1);
+            wire_buffer_unmap(wb);
+        }
+        else if (wb->buffer && wb->dequeued)
+        {
+            wb->dequeued = false;
+            wire_buffer_drop_refs(wb);
+            latency_record_since(ws->requeue_latency, wb->frame.queued_ns);
+            metrics_add(METRIC_BUFFERS_REQUEUED, 1);
+            pw_stream_queue_buffer(ws->stream, wb->buffer);
+        }
+    }
+}
+
+static void on_release_frames(void *data, uint64_t count)
+{
+    wire_requeue_released(data);
+}
+
+static void wire_update_params(struct wire_stream *ws);
+static void wire_update_formats(struct wire_stream *ws);
+
 static void on_renegotiate_format(void *data, uint64_t foo)
 {
-    printf("renegonitiating\n");
-    return;
+    struct wire_stream *ws = data;
+
+    if (!ws->stream)
+        return;
+    metrics_add(METRIC_RENEGOTIATIONS, 1);
+    if (atomic_exchange(&ws->formats_dirty, false))
+        wire_update_formats(ws);
+    else
+        wire_update_params(ws);
 }
 
 static void on_core_info(void *data, const struct pw_core_info *info)
 {
-    return;
+    printf("Connected to %s %s on %s\n", info->name, info->version, info->host_name);
+    metrics_set_core_info(info->name, info->version);
 }
 static void on_core_done(void *object, uint32_t id, int seq)
 {
     return;
 }
 
+// The session's streams report their own failures through state_changed,
+// an error on the core object itself means the connection is gone.
 static void on_core_error(void *data, uint32_t id, int seq, int res, const char *message)
 {
-    return;
+    metrics_add(METRIC_CORE_ERRORS, 1);
+    printf("PipeWire error on object %u, seq %d: %s (%s)\n", id, seq, message,
+           spa_strerror(res));
+    if (id == PW_ID_CORE && res == -EPIPE)
+        printf("Lost the connection to PipeWire\n");
 }
 
 static void on_stream_state_changed(void *data, enum pw_stream_state old_state,
                                     enum pw_stream_state state, const char *error_message)
 {
+    struct wire_stream *ws = data;
+
+    if (state >= PW_STREAM_STATE_ERROR && state <= PW_STREAM_STATE_STREAMING)
+        metrics_add(METRIC_STREAM_STATE_ERROR + (state - PW_STREAM_STATE_ERROR), 1);
+    printf("Stream %u: %s -> %s%s%s\n", ws->index, pw_stream_state_as_string(old_state),
+           pw_stream_state_as_string(state), error_message ? ": " : "",
+           error_message ? error_message : "");
+}
+
+// Stream parameters that depend on the negotiated format.
+static uint32_t build_stream_params(struct wire_stream *ws, struct spa_pod_builder *b,
+                                    const struct spa_pod **params)
+{
+    uint32_t n_params = 0;
+
+    params[n_params++] = spa_pod_builder_add_object(b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+        SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header)));
+    params[n_params++] = spa_pod_builder_add_object(b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+        SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+                                 sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS,
+                                 sizeof(struct spa_meta_region) * 1,
+                                 sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS));
+    params[n_params++] = spa_pod_builder_add_object(b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+        SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_region)));
+    params[n_params++] = spa_pod_builder_add_object(b,
+        SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+        SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Cursor),
+        SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+                                 CURSOR_META_SIZE(64, 64),
+                                 CURSOR_META_SIZE(1, 1),
+                                 CURSOR_META_SIZE(CURSOR_MAX_SIZE, CURSOR_MAX_SIZE)));
+
+    if (!ws->format_valid)
+        return n_params;
+
+    uint32_t bpp = convert_format_bpp(ws->format.format);
+    uint32_t stride = SPA_ROUND_UP_N(ws->format.size.width * (bpp ? bpp : 4), BUFFER_ALIGN);
+    uint32_t size = stride * ws->format.size.height;
+
+    // Params are matched in order, the MemFd only variant comes first so a
+    // producer that can do both hands out fds we map once in add_buffer.
+    const uint32_t data_types[] = {1 << SPA_DATA_MemFd,
+                                   (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr)};
+    for (uint32_t i = 0; i < SPA_N_ELEMENTS(data_types); i++)
+    {
+        params[n_params++] = spa_pod_builder_add_object(b,
+            SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+            SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(ws->session->buffer_count, 2, MAX_BUFFERS),
+            SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+            SPA_PARAM_BUFFERS_size, SPA_POD_Int(size),
+            SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride),
+            SPA_PARAM_BUFFERS_align, SPA_POD_Int(BUFFER_ALIGN),
+            SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(data_types[i]));
+    }
+    return n_params;
+}
+
+static void wire_update_params(struct wire_stream *ws)
+{
+    uint8_t buffer[1024];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const struct spa_pod *params[8];
+    uint32_t n_params = build_stream_params(ws, &b, params);
+
+    pw_stream_update_params(ws->stream, params, n_params);
 }
 
 static void on_streamParam_changed(void *data, uint32_t id, const struct spa_pod *format)
 {
-    return;
+    struct wire_stream *ws = data;
+    uint32_t media_type, media_subtype;
+
+    if (id != SPA_PARAM_Format)
+        return;
+
+    if (!format)
+    {
+        ws->format_valid = false;
+        return;
+    }
+
+    if (spa_format_parse(format, &media_type, &media_subtype) < 0 ||
+        media_type != SPA_MEDIA_TYPE_video ||
+        media_subtype != SPA_MEDIA_SUBTYPE_raw)
+        return;
+
+    spa_zero(ws->format);
+    if (spa_format_video_raw_parse(format, &ws->format) < 0)
+        return;
+    ws->format_valid = true;
+    ws->force_full_damage = true;
+    // Bitmaps are converted for the frame format and cursor-only buffers
+    // can't show pixels of the old one.
+    wire_stream_drop_cursor(ws);
+    metrics_add(METRIC_FORMATS_NEGOTIATED, 1);
+
+    printf("Stream %u negotiated format %d %dx%d@%d/%d\n", ws->index, ws->format.format,
+           ws->format.size.width, ws->format.size.height,
+           ws->format.framerate.num, ws->format.framerate.denom);
+
+    wire_update_params(ws);
+}
+
+static void on_stream_add_buffer(void *data, struct pw_buffer *buffer)
+{
+    struct wire_stream *ws = data;
+    struct spa_buffer *buf = buffer->buffer;
+    struct wire_buffer *wb = NULL;
+    uint32_t i;
+
+    for (i = 0; i < MAX_BUFFERS; i++)
+    {
+        if (!ws->buffers[i].buffer && !ws->buffers[i].removed)
+        {
+            wb = &ws->buffers[i];
+            break;
+        }
+    }
+    if (!wb)
+    {
+        printf("No free slot for PipeWire buffer\n");
+        return;
+    }
+
+    spa_zero(*wb);
+    metrics_add(METRIC_BUFFERS_ADDED, 1);
+    wb->buffer = buffer;
+    wb->frame.id = i;
+    wb->frame.pool = &ws->pool;
+    buffer->user_data = wb;
+
+    for (i = 0; i < buf->n_datas && i < FRAME_MAX_PLANES; i++)
+    {
+        struct spa_data *d = &buf->datas[i];
+
+        switch (d->type)
+        {
+        case SPA_DATA_MemPtr:
+            wb->planes[i] = d->data;
+            break;
+        case SPA_DATA_MemFd:
+            // Map the whole fd once; per-frame chunks are offsets into it.
+            wb->map_size[i] = d->maxsize + d->mapoffset;
+            wb->map[i] = mmap(NULL, wb->map_size[i], PROT_READ, MAP_SHARED,
+                              d->fd, 0);
+            if (wb->map[i] == MAP_FAILED)
+            {
+                printf("Failed to mmap buffer plane: %m\n");
+                wb->map[i] = NULL;
+                break;
+            }
+            wb->planes[i] = (uint8_t *)wb->map[i] + d->mapoffset;
+            break;
+        default:
+            printf("Unsupported buffer data type %d\n", d->type);
+            break;
+        }
+    }
+}
+
+static void on_stream_remove_buffer(void *data, struct pw_buffer *buffer)
+{
+    struct wire_buffer *wb = buffer->user_data;
+
+    if (!wb)
+        return;
+    buffer->user_data = NULL;
+    metrics_add(METRIC_BUFFERS_REMOVED, 1);
+
+    // A consumer still reads from the mapping, wire_requeue_released unmaps
+    // it after the last release.
+    if (atomic_load(&wb->frame.refs) > 0)
+    {
+        wb->buffer = NULL;
+        wb->removed = true;
+        return;
+    }
+    if (wb->dequeued)
+        metrics_add(METRIC_BUFFERS_REQUEUED, 1);
+    wire_buffer_unmap(wb);
+}
+
+// Copy the compositor's damage into the frame, moved to the origin of the
+// cropped view. Without usable damage metadata every frame is fully
+// damaged.
+static void wire_buffer_damage(struct wire_stream *ws, struct wire_buffer *wb,
+                               struct spa_buffer *buf)
+{
+    struct frame *frame = &wb->frame;
+    struct spa_meta *meta = spa_buffer_find_meta(buf, SPA_META_VideoDamage);
+    struct spa_meta_region *r;
+
+    frame->n_damage = 0;
+    if (meta)
+    {
+        spa_meta_for_each(r, meta)
+        {
+            if (!spa_meta_region_is_valid(r))
+                break;
+            ws->damage_seen = true;
+            frame_damage_add(frame, r->region.position.x - (int32_t)wb->crop.x,
+                             r->region.position.y - (int32_t)wb->crop.y,
+                             r->region.size.width, r->region.size.height);
+        }
+    }
+
+    if (!meta || !ws->damage_seen || ws->force_full_damage)
+        frame_damage_full(frame);
+    ws->force_full_damage = false;
+}
+
+// Intersect `rect` with the rectangle at x, y of width x height.
+static void wire_rect_clip(struct frame_rect *rect, int64_t x, int64_t y, int64_t width,
+                           int64_t height)
+{
+    int64_t x0 = SPA_MAX((int64_t)rect->x, x), y0 = SPA_MAX((int64_t)rect->y, y);
+    int64_t x1 = SPA_MIN((int64_t)rect->x + rect->width, x + width);
+    int64_t y1 = SPA_MIN((int64_t)rect->y + rect->height, y + height);
+
+    *rect = x0 < x1 && y0 < y1 ? (struct frame_rect){x0, y0, x1 - x0, y1 - y0}
+                               : (struct frame_rect){0, 0, 0, 0};
+}
+
+// Narrow the frame view of `wb` to the compositor's crop and the stream's
+// ROI. The plane only starts further in, so every later pass over the
+// pixels touches the ROI's rows and columns only. Planar formats keep the
+// whole frame. True if the view differs from the last frame's.
+static bool wire_frame_crop(struct wire_stream *ws, struct wire_buffer *wb,
+                            const struct frame_rect *crop)
+{
+    struct frame *frame = &wb->frame;
+    struct frame_plane *plane = &frame->planes[0];
+    uint32_t bpp = convert_format_bpp(frame->format);
+    uint64_t roi = atomic_load_explicit(&ws->roi, memory_order_relaxed);
+    struct frame_rect full = {0, 0, frame->width, frame->height}, rect = full;
+    bool changed;
+
+    if (crop)
+        wire_rect_clip(&rect, crop->x, crop->y, crop->width, crop->height);
+    if (roi >> 32)
+        wire_rect_clip(&rect, roi & 0xffff, (roi >> 16) & 0xffff, (roi >> 32) & 0xffff,
+                       roi >> 48);
+    if (!bpp || frame->n_planes != 1 || !rect.width ||
+        (uint64_t)(rect.y + rect.height - 1) * plane->stride + (rect.x + rect.width) * bpp >
+            plane->size)
+        rect = full;
+
+    changed = memcmp(&rect, &ws->crop, sizeof(rect)) != 0;
+    ws->crop = rect;
+    wb->crop = rect;
+    if (!memcmp(&rect, &full, sizeof(rect)))
+        return changed;
+    plane->data += (size_t)rect.y * plane->stride + (size_t)rect.x * bpp;
+    plane->size = (rect.height - 1) * plane->stride + rect.width * bpp;
+    frame->width = rect.width;
+    frame->height = rect.height;
+    frame->cursor.x -= (int32_t)rect.x;
+    frame->cursor.y -= (int32_t)rect.y;
+    return changed;
+}
+
+// Update the stream's pointer from SPA_META_Cursor, true if it changed.
+// A bitmap only comes along when the shape behind an id changed.
+static bool wire_buffer_cursor(struct wire_stream *ws, struct spa_buffer *buf)
+{
+    struct spa_meta *meta = spa_buffer_find_meta(buf, SPA_META_Cursor);
+    struct spa_meta_cursor *mc;
+    struct frame_cursor cursor = {0};
+    bool changed;
+
+    if (!meta || meta->size < sizeof(*mc))
+        return false;
+    mc = meta->data;
+    ws->cursor_seen = true;
+    if (spa_meta_cursor_is_valid(mc))
+    {
+        if (mc->bitmap_offset >= sizeof(*mc) &&
+            mc->bitmap_offset + sizeof(struct spa_meta_bitmap) <= meta->size)
+        {
+            struct spa_meta_bitmap *bitmap = SPA_PTROFF(mc, mc->bitmap_offset, struct spa_meta_bitmap);
+            uint64_t end = (uint64_t)mc->bitmap_offset + bitmap->offset +
+                           (uint64_t)bitmap->stride * bitmap->size.height;
+            struct cursor_image *image = NULL;
+
+            if (bitmap->format != SPA_VIDEO_FORMAT_UNKNOWN && end <= meta->size &&
+                bitmap->stride >= bitmap->size.width * 4)
+                image = cursor_image_new(mc->id, ws->format.format, bitmap->format,
+                                         bitmap->size.width, bitmap->size.height,
+                                         bitmap->stride, SPA_PTROFF(bitmap, bitmap->offset, uint8_t));
+            if (image)
+                cursor_cache_put(&ws->cursors, image);
+        }
+        cursor.image = cursor_cache_get(&ws->cursors, mc->id);
+        cursor.x = mc->position.x - mc->hotspot.x;
+        cursor.y = mc->position.y - mc->hotspot.y;
+    }
+
+    changed = !cursor_equal(&cursor, &ws->cursor);
+    cursor_image_unref(ws->cursor.image);
+    ws->cursor = cursor;
+    cursor_image_ref(cursor.image);
+    return changed;
+}
+
+// Fill the cached frame view of `wb` from the chunks of the current buffer.
+// Only pointers are computed here; pixel data stays in the mapped buffer.
+// A buffer without pixels whose cursor moved shows the last frame again.
+// `full` is set when the frame shows another part of the buffer than the
+// previous one.
+static struct frame *wire_buffer_frame(struct wire_stream *ws, struct wire_buffer *wb,
+                                       bool *full)
+{
+    struct spa_buffer *buf = wb->buffer->buffer;
+    struct frame *frame = &wb->frame;
+    bool cursor_changed;
+    uint32_t i;
+
+    frame->n_planes = 0;
+    for (i = 0; i < buf->n_datas && i < FRAME_MAX_PLANES; i++)
+    {
+        struct spa_data *d = &buf->datas[i];
+        struct spa_chunk *chunk = d->chunk;
+
+        if (!wb->planes[i] || chunk->size == 0 || d->maxsize == 0)
+            break;
+        if (chunk->offset % d->maxsize + chunk->size > d->maxsize)
+            break;
+
+        frame->planes[i].data = wb->planes[i] + chunk->offset % d->maxsize;
+        frame->planes[i].stride = chunk->stride;
+        frame->planes[i].size = chunk->size;
+        frame->n_planes++;
+    }
+
+    frame->seq = ws->frame_seq++;
+    frame->format = ws->format.format;
+    frame->width = ws->format.size.width;
+    frame->height = ws->format.size.height;
+    cursor_changed = wire_buffer_cursor(ws, buf);
+    cursor_image_unref(frame->cursor.image);
+    frame->cursor = ws->cursor;
+    cursor_image_ref(frame->cursor.image);
+    if (!frame->n_planes && (!cursor_changed || !ws->last_frame))
+        return NULL;
+
+    struct spa_meta_header *header =
+        spa_buffer_find_meta_data(buf, SPA_META_Header, sizeof(*header));
+    if (header && (header->flags & SPA_META_HEADER_FLAG_CORRUPTED))
+    {
+        atomic_fetch_add_explicit(&ws->corrupted, 1, memory_order_relaxed);
+        metrics_add(METRIC_FRAMES_CORRUPTED, 1);
+        return NULL;
+    }
+    frame->pts = header ? header->pts : -1;
+
+    if (!frame->n_planes)
+    {
+        struct frame *base = ws->last_frame;
+
+        // Shown as the last frame was, whatever the ROI is by now.
+        wb->crop = ws->buffers[base->id].crop;
+        frame->n_planes = base->n_planes;
+        memcpy(frame->planes, base->planes, base->n_planes * sizeof(frame->planes[0]));
+        frame->width = base->width;
+        frame->height = base->height;
+        frame->cursor.x -= (int32_t)wb->crop.x;
+        frame->cursor.y -= (int32_t)wb->crop.y;
+        frame->n_damage = 0;
+        frame_ref(base);
+        wb->base = base;
+        metrics_add(METRIC_CURSOR_FRAMES, 1);
+        return frame;
+    }
+
+    struct spa_meta_region *video_crop =
+        spa_buffer_find_meta_data(buf, SPA_META_VideoCrop, sizeof(*video_crop));
+    struct frame_rect crop;
+    bool has_crop = video_crop && spa_meta_region_is_valid(video_crop) &&
+                    video_crop->region.position.x >= 0 && video_crop->region.position.y >= 0;
+
+    if (has_crop)
+        crop = (struct frame_rect){video_crop->region.position.x, video_crop->region.position.y,
+                                   video_crop->region.size.width, video_crop->region.size.height};
+    // Areas that just came into view were never sent, the whole view is.
+    if (wire_frame_crop(ws, wb, has_crop ? &crop : NULL))
+        ws->force_full_damage = *full = true;
+    wire_buffer_damage(ws, wb, buf);
+    return frame;
+}
+
+// Ask the compositor for fewer frames while consumers can't keep up, rather
+// than dropping frames it already spent time producing.
+static void wire_shed_load(struct wire_stream *ws)
+{
+    struct frame_ring_stats stats;
+    uint64_t now = frame_ring_now_ns();
+    uint64_t dropped = 0;
+    uint32_t fps = ws->fps;
+    unsigned n_consumers = atomic_load(&ws->n_consumers);
+
+    if (!atomic_load_explicit(&ws->session->load_shedding, memory_order_relaxed) ||
+        now - ws->shed_window_start_ns < LOAD_SHED_WINDOW_NS)
+        return;
+
+    for (uint32_t i = 0; i < n_consumers; i++)
+    {
+        frame_ring_get_stats(ws->consumers[i], &stats);
+        dropped += stats.dropped;
+    }
+
+    if (ws->shed_window_start_ns && dropped != ws->shed_dropped)
+    {
+        ws->shed_quiet_windows = 0;
+        fps = SPA_MAX(ws->fps / 2, (uint32_t)LOAD_SHED_MIN_FPS);
+    }
+    else if (++ws->shed_quiet_windows >= LOAD_SHED_RECOVER)
+    {
+        ws->shed_quiet_windows = 0;
+        fps = SPA_MIN(ws->fps * 2, ws->session->max_fps);
+    }
+    ws->shed_window_start_ns = now;
+    ws->shed_dropped = dropped;
+
+    if (fps != ws->fps)
+    {
+        printf("Stream %u load shedding: %u -> %u fps\n", ws->index, ws->fps, fps);
+        ws->fps = fps;
+        atomic_store(&ws->formats_dirty, true);
+        wire_signal(ws->renegotiate);
+    }
+}
+
+// Hash and publish frames of one stream. The frame is owned by this thread
+// until it is pushed, so its damage can still be rewritten here.
+static void *wire_stream_worker(void *data)
+{
+    struct wire_stream *ws = data;
+    struct wire_session *session = ws->session;
+
+    while (!atomic_load(&ws->quit))
+    {
+        struct frame *frame = frame_ring_wait(&ws->work, -1);
+        if (!frame)
+            continue;
+
+        struct wire_buffer *wb = &ws->buffers[frame->id];
+
+        // Without compositor damage, diff the tiles ourselves and don't
+        // publish frames that didn't change at all.
+        if (wb->tilediff)
+        {
+            uint64_t start = frame_ring_now_ns();
+            int changed = tilediff_process(&ws->tilediff, frame, wb->full);
+
+            metrics_add(METRIC_CONVERT_BYTES, (uint64_t)frame->planes[0].stride * frame->height);
+            metrics_add(METRIC_CONVERT_NS, frame_ring_now_ns() - start);
+            if (changed >= 0)
+            {
+                metrics_add(METRIC_TILES_HASHED,
+                            (uint64_t)ws->tilediff.tiles_x * ws->tilediff.tiles_y);
+                metrics_add(METRIC_TILES_CHANGED, changed);
+                atomic_store_explicit(&ws->change_ppm, ws->tilediff.change_ratio * 1e6,
+                                      memory_order_relaxed);
+            }
+            if (changed == 0)
+            {
+                atomic_fetch_add_explicit(&ws->unchanged, 1, memory_order_relaxed);
+                metrics_add(METRIC_FRAMES_DUPLICATED, 1);
+                frame_release(frame);
+                continue;
+            }
+            if (changed < 0)
+                frame_damage_full(frame);
+        }
+
+        latency_record_since(ws->publish_latency, frame->queued_ns);
+        unsigned n_consumers = atomic_load(&ws->n_consumers);
+        for (uint32_t i = 0; i < n_consumers; i++)
+        {
+            if (!frame_ring_push(ws->consumers[i], frame))
+                metrics_add(METRIC_FRAMES_DROPPED, 1);
+        }
+        atomic_fetch_add_explicit(&ws->published, 1, memory_order_relaxed);
+        metrics_add(METRIC_FRAMES_PUBLISHED, 1);
+        frame_release(frame);
+
+        if (!atomic_exchange(&session->first_frame_seen, true) && session->first_frame_cb)
+            session->first_frame_cb(session->first_frame_data);
+    }
+    return NULL;
 }
+
+// Hand the frame described in `wb` to the stream's worker. Shared by
+// on_stream_process and the trace replay, so both measure the same path.
+static void wire_stream_submit(struct wire_stream *ws, struct wire_buffer *wb, bool full)
+{
+    struct wire_session *session = ws->session;
+    struct frame *frame = &wb->frame;
+
+    // The producer holds one reference while publishing, so a release
+    // on the worker can't requeue the buffer under our feet.
+    wb->dequeued = true;
+    metrics_add(METRIC_BUFFERS_DEQUEUED, 1);
+    wb->tilediff = atomic_load_explicit(&session->tilediff_enabled, memory_order_relaxed) &&
+                   !ws->damage_seen && !wb->base;
+    wb->full = full;
+    atomic_store(&frame->refs, 1);
+    frame->queued_ns = frame_ring_now_ns();
+    latency_record_since(ws->capture_latency, frame->pts);
+    if (ws->cursor_seen && !wb->base)
+    {
+        if (ws->last_frame)
+            frame_release(ws->last_frame);
+        frame_ref(frame);
+        ws->last_frame = frame;
+    }
+    // Traces hold pixels only, cursor-only frames would repeat them.
+    if (session->trace && !session->replay && !wb->base)
+        trace_writer_push(session->trace, ws->index, frame,
+                          (ws->damage_seen ? TRACE_FRAME_DAMAGE : 0) |
+                              (full ? TRACE_FRAME_FULL : 0));
+    frame_ring_push(&ws->work, frame);
+    frame_release(frame);
+}
+
 static void on_stream_process(void *data)
 {
-    return;
+    struct wire_stream *ws = data;
+    struct pw_buffer *buffer;
+
+    while ((buffer = pw_stream_dequeue_buffer(ws->stream)))
+    {
+        struct wire_buffer *wb = buffer->user_data;
+        struct frame *frame = NULL;
+        bool full = ws->force_full_damage;
+
+        atomic_fetch_add_explicit(&ws->frames, 1, memory_order_relaxed);
+        metrics_add(METRIC_FRAMES_RECEIVED, 1);
+        if (wb && ws->format_valid)
+            frame = wire_buffer_frame(ws, wb, &full);
+
+        if (!frame)
+        {
+            pw_stream_queue_buffer(ws->stream, buffer);
+            continue;
+        }
+        wire_stream_submit(ws, wb, full);
+    }
+    wire_requeue_released(ws);
+    wire_shed_load(ws);
 }
 // unwrap macros
 struct spa_source *__pw_loop_add_event(struct pw_loop *loop,
@@ -90,35 +1077,184 @@ int __pw_loop_signal_event(struct pw_loop *loop, struct spa_source *source)
     res = _f->signal_event(callbacks->data, source);
     return res;
 }
+
+void __pw_loop_destroy_source(struct pw_loop *loop, struct spa_source *source)
+{
+    struct spa_loop_utils *utils = loop->utils;
+    struct spa_interface *iface = &utils->iface;
+    struct spa_callbacks *callbacks = &iface->cb;
+    const struct spa_loop_utils_methods *_f = (const struct spa_loop_utils_methods *)callbacks->funcs;
+    _f->destroy_source(callbacks->data, source);
+}
 // unwrap macros
 
-void process_pipewire(int pw_fd, uint32_t pw_stream_node_id)
+static const struct spa_pod *build_format(struct spa_pod_builder *b,
+                                          uint32_t format,
+                                          const struct spa_rectangle *resolution,
+                                          const struct spa_rectangle *max_resolution,
+                                          uint32_t fps)
+{
+    struct spa_pod_frame f;
+
+    spa_pod_builder_push_object(b, &f, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+    spa_pod_builder_add(b,
+                        SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                        SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+                        SPA_FORMAT_VIDEO_format, SPA_POD_Id(format),
+                        SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
+                                                   resolution,
+                                                   &SPA_RECTANGLE(1, 1),
+                                                   max_resolution),
+                        SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
+                                                        &SPA_FRACTION(fps, 1),
+                                                        &SPA_FRACTION(0, 1),
+                                                        &SPA_FRACTION(fps, 1)),
+                        0);
+    return spa_pod_builder_pop(b, &f);
+}
+
+// EnumFormat for every format the session takes, at the stream's current
+// target.
+static uint32_t build_formats(struct wire_stream *ws, struct spa_pod_builder *b,
+                              const struct spa_pod **params)
+{
+    struct wire_session *session = ws->session;
+    struct spa_rectangle max_resolution =
+        session->target_size_fixed ? session->target_size : SPA_RECTANGLE(8192, 8192);
+    uint32_t n_params = 0;
+
+    for (uint32_t i = 0; i < session->n_formats; i++)
+        params[n_params++] = build_format(b, session->formats[i], &session->target_size,
+                                          &max_resolution, ws->fps);
+    return n_params;
+}
+
+// Offer new formats; pw_stream only replaces the param ids passed in, so
+// Meta and Buffers stay as they are until the new format arrives.
+static void wire_update_formats(struct wire_stream *ws)
+{
+    uint8_t buffer[4096];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const struct spa_pod *params[WIRE_MAX_FORMATS];
+    uint32_t n_params = build_formats(ws, &b, params);
+
+    pw_stream_update_params(ws->stream, params, n_params);
+}
+
+// Hashing threads are split between the streams, each worker counts as
+// one of its stream's threads.
+static uint32_t wire_tilediff_threads(uint32_t n_streams)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t threads = n_streams ? (n_cpus > 0 ? n_cpus : 1) / n_streams : 1;
+
+    return SPA_CLAMP(threads, 1u, (uint32_t)TILEDIFF_THREADS);
+}
+
+// Start the worker of `ws`, everything a stream needs before frames are
+// submitted.
+static int wire_stream_start(struct wire_stream *ws, uint32_t tilediff_threads)
+{
+    int res;
+
+    ws->fps = ws->session->max_fps;
+    ws->force_full_damage = true;
+    // Frame age at each step, from the compositor's pts (CLOCK_MONOTONIC
+    // on mutter and wlroots) to the dequeue, from the dequeue to the
+    // consumers after the tile diff, and until the buffer went back.
+    ws->capture_latency = latency_stage("capture");
+    ws->publish_latency = latency_stage("publish");
+    ws->requeue_latency = latency_stage("requeue");
+    if ((res = frame_ring_init(&ws->work, FRAME_RING_QUEUE)) < 0)
+        return res;
+    if ((res = tilediff_init(&ws->tilediff, tilediff_threads, CONVERT_IMPL_AUTO)) < 0)
+    {
+        frame_ring_clear(&ws->work);
+        return res;
+    }
+    if ((res = pthread_create(&ws->worker, NULL, wire_stream_worker, ws)) != 0)
+    {
+        tilediff_clear(&ws->tilediff);
+        frame_ring_clear(&ws->work);
+        return -res;
+    }
+    ws->worker_started = true;
+    return 0;
+}
+
+// Create and connect the pw_stream of `ws` on the shared core, with the
+// thread loop locked.
+static int wire_stream_connect(struct wire_stream *ws, uint32_t tilediff_threads)
 {
-    uint32_t width = 1920;
-    uint32_t height = 1080;
+    struct pw_loop *loop = pw_thread_loop_get_loop(pw_main_loop_);
+    char name[64];
+    int res;
 
-    pw_stream_node_id_ = pw_stream_node_id;
-    pw_fd_ = pw_fd;
+    ws->pool.wake = wire_pool_wake;
+    ws->pool.wake_data = ws;
+    if ((res = wire_stream_start(ws, tilediff_threads)) < 0)
+        return res;
+
+    //  Add events that can be later invoked by pw_loop_signal_event()
+    ws->renegotiate = __pw_loop_add_event(loop, &on_renegotiate_format, ws);
+    ws->release = __pw_loop_add_event(loop, &on_release_frames, ws);
+
+    snprintf(name, sizeof(name), "screencast-consume-stream-%u", ws->index);
+    struct pw_properties *reuseProps =
+        pw_properties_new_string("pipewire.client.reuse=1");
+    ws->stream = pw_stream_new(ws->session->core, name, reuseProps);
+    if (!ws->stream)
+        return -errno;
+    pw_stream_add_listener(ws->stream, &ws->listener, &pw_stream_events_, ws);
+
+    uint8_t buffer[4096] = {};
+    struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const struct spa_pod *params[WIRE_MAX_FORMATS];
+    uint32_t n_params = build_formats(ws, &builder, params);
+
+    // Buffers are mapped by us once in on_stream_add_buffer, so no
+    // PW_STREAM_FLAG_MAP_BUFFERS here.
+    return pw_stream_connect(ws->stream, PW_DIRECTION_INPUT, ws->node_id,
+                             PW_STREAM_FLAG_AUTOCONNECT, params, n_params);
+}
+
+// Take a reference on the shared context, starting the thread loop with
+// the first user.
+static int wire_context_ref(void)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&pw_context_lock_);
+    if (pw_context_users_++ > 0)
+        goto out;
 
     pw_init(/*argc=*/NULL, /*argc=*/NULL);
 
     pw_main_loop_ = pw_thread_loop_new("pipewire-main-loop", NULL);
+    if (!pw_main_loop_)
+    {
+        printf("Failed to create PipeWire loop\n");
+        res = -errno;
+        goto fail;
+    }
 
     pw_context_ =
         pw_context_new(pw_thread_loop_get_loop(pw_main_loop_), NULL, 0);
     if (!pw_context_)
     {
-        "Failed to create PipeWire context";
-        return false;
+        printf("Failed to create PipeWire context\n");
+        res = -errno;
+        goto fail;
     }
 
     if (pw_thread_loop_start(pw_main_loop_) < 0)
     {
-        printf("Failed to start main PipeWire loop");
-        return false;
+        printf("Failed to start main PipeWire loop\n");
+        res = -EIO;
+        goto fail;
     }
 
-    pw_client_version_ = pw_get_library_version();
+    pw_client_version_ = (char *)pw_get_library_version();
 
     // Initialize event handlers, remote end and stream-related.
     pw_core_events_.version = PW_VERSION_CORE_EVENTS;
@@ -129,120 +1265,404 @@ void process_pipewire(int pw_fd, uint32_t pw_stream_node_id)
     pw_stream_events_.version = PW_VERSION_STREAM_EVENTS;
     pw_stream_events_.state_changed = &on_stream_state_changed;
     pw_stream_events_.param_changed = &on_streamParam_changed;
+    pw_stream_events_.add_buffer = &on_stream_add_buffer;
+    pw_stream_events_.remove_buffer = &on_stream_remove_buffer;
     pw_stream_events_.process = &on_stream_process;
+    goto out;
+
+fail:
+    if (pw_context_)
+        pw_context_destroy(pw_context_);
+    if (pw_main_loop_)
+        pw_thread_loop_destroy(pw_main_loop_);
+    pw_context_ = NULL;
+    pw_main_loop_ = NULL;
+    pw_context_users_--;
+out:
+    pthread_mutex_unlock(&pw_context_lock_);
+    return res;
+}
+
+static void wire_context_unref(void)
+{
+    pthread_mutex_lock(&pw_context_lock_);
+    if (--pw_context_users_ == 0)
+    {
+        pw_thread_loop_stop(pw_main_loop_);
+        pw_context_destroy(pw_context_);
+        pw_thread_loop_destroy(pw_main_loop_);
+        pw_context_ = NULL;
+        pw_main_loop_ = NULL;
+    }
+    pthread_mutex_unlock(&pw_context_lock_);
+}
+
+struct wire_session *wire_session_new(void)
+{
+    struct wire_session *session = calloc(1, sizeof(*session));
+
+    if (!session)
+        return NULL;
+    if (wire_context_ref() < 0)
+    {
+        free(session);
+        return NULL;
+    }
+    session->buffer_count = 8;
+    session->target_size = SPA_RECTANGLE(WIDTH, HEIGHT);
+    session->max_fps = 30;
+    atomic_init(&session->load_shedding, true);
+    atomic_init(&session->tilediff_enabled, true);
+    session->replay_wake_fd = -1;
+    wire_set_consumer(session, WIRE_CONSUMER_SHM);
+    return session;
+}
+
+int wire_session_connect(struct wire_session *session, int pw_fd,
+                         const uint32_t *node_ids, uint32_t n_streams)
+{
+    session->pw_fd = pw_fd;
+    n_streams = SPA_MIN(n_streams, (uint32_t)WIRE_MAX_STREAMS);
+    uint32_t tilediff_threads = wire_tilediff_threads(n_streams);
 
     {
         pw_thread_loop_lock(pw_main_loop_);
 
-        if (!pw_fd_)
+        if (!session->pw_fd)
         {
-            pw_core_ = pw_context_connect(pw_context_, NULL, 0);
+            session->core = pw_context_connect(pw_context_, NULL, 0);
         }
         else
         {
-            pw_core_ = pw_context_connect_fd(pw_context_, pw_fd_, NULL, 0);
+            session->core = pw_context_connect_fd(pw_context_, session->pw_fd, NULL, 0);
         }
 
-        if (!pw_core_)
+        if (!session->core)
         {
-            printf("Failed to connect PipeWire context");
-            return false;
+            int res = -errno;
+            printf("Failed to connect PipeWire context\n");
+            pw_thread_loop_unlock(pw_main_loop_);
+            return res;
         }
 
-        // pw_core_add_listener(pw_core_, &spa_core_listener_, &pw_core_events_, &userdata);
-        //  core_method_marshal_add_listener
-        pw_proxy_add_listener(pw_core_, &spa_core_listener_, &pw_core_events_, &userdata);
-        //  Add an event that can be later invoked by pw_loop_signal_event()
-        struct pw_loop *loop__ = pw_thread_loop_get_loop(pw_main_loop_);
-        renegotiate_ = __pw_loop_add_event(loop__,
-                                           &on_renegotiate_format, &userdata);
-        __pw_loop_signal_event(pw_thread_loop_get_loop(pw_main_loop_), renegotiate_);
+        pw_core_add_listener(session->core, &session->core_listener, &pw_core_events_, session);
 
-        pw_main_loop_run(pw_main_loop_);
-        /*
-        server_version_sync_ =
-            pw_core_sync(pw_core_, PW_ID_CORE, server_version_sync_);
+        for (uint32_t i = 0; i < n_streams; i++)
+        {
+            struct wire_stream *ws = &session->streams[i];
+            int res;
 
-        pw_thread_loop_wait(pw_main_loop_);
+            // A stream that failed to connect keeps its slot, so indices
+            // match the portal's stream order.
+            ws->session = session;
+            ws->index = i;
+            ws->node_id = node_ids[i];
+            session->n_streams++;
+            if ((res = wire_stream_connect(ws, tilediff_threads)) < 0)
+                printf("Could not connect receiving stream %u: %s\n", node_ids[i],
+                       spa_strerror(res));
+        }
+
+        printf("PipeWire remote opened, %u streams.\n", session->n_streams);
+        pw_thread_loop_unlock(pw_main_loop_);
+    }
+    return 0;
+}
+
+// Called from whatever thread dropped the last reference of a replayed
+// frame.
+static void wire_replay_wake(void *data)
+{
+    struct wire_session *session = data;
+    uint64_t one = 1;
+
+    if (write(session->replay_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        printf("Failed to wake the replay: %m\n");
+}
+
+// Sleep until woken or `deadline_ns` passed, 0 waits for a wakeup only.
+static void wire_replay_sleep(struct wire_session *session, uint64_t deadline_ns)
+{
+    struct pollfd pfd = {.fd = session->replay_wake_fd, .events = POLLIN};
+    uint64_t now = frame_ring_now_ns(), value;
+    int timeout = -1;
 
-        pw_properties *reuseProps =
-            pw_properties_new_string("pipewire.client.reuse=1");
-        pw_stream_ = pw_stream_new(pw_core_, "webrtc-consume-stream", reuseProps);
+    if (deadline_ns)
+    {
+        if (deadline_ns <= now)
+            return;
+        timeout = (deadline_ns - now + 999999) / 1000000;
+    }
+    if (poll(&pfd, 1, timeout) > 0 &&
+        read(session->replay_wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        printf("Failed to read the replay wakeup: %m\n");
+}
+
+// What wire_requeue_released does for PipeWire, the buffers just become
+// free for the next replayed frames.
+static void wire_replay_requeue(struct wire_stream *ws)
+{
+    uint64_t mask = frame_pool_drain(&ws->pool);
+
+    while (mask)
+    {
+        struct wire_buffer *wb = &ws->buffers[__builtin_ctzll(mask)];
+        mask &= mask - 1;
+
+        if (atomic_load(&wb->frame.refs) > 0 || !wb->dequeued)
+            continue;
+        wb->dequeued = false;
+        latency_record_since(ws->requeue_latency, wb->frame.queued_ns);
+        metrics_add(METRIC_BUFFERS_REQUEUED, 1);
+    }
+}
+
+// A buffer of `ws` no consumer holds. While every buffer is held the
+// replay waits, the way a compositor runs out of buffers to render into.
+static struct wire_buffer *wire_replay_buffer(struct wire_stream *ws)
+{
+    struct wire_session *session = ws->session;
 
-        if (!pw_stream_)
+    while (!atomic_load(&session->replay_quit))
+    {
+        wire_replay_requeue(ws);
+        for (uint32_t i = 0; i < session->buffer_count; i++)
         {
-            printf("Failed to create PipeWire stream";
-            return false;
+            if (!ws->buffers[i].dequeued)
+                return &ws->buffers[i];
         }
-        struct spa_hook spa_stream_listener_;
-        pw_stream_add_listener(pw_stream_, &spa_stream_listener_,
-                               &pw_stream_events_, this);
-        uint8_t buffer[2048] = {};
+        wire_replay_sleep(session, 0);
+    }
+    return NULL;
+}
+
+// Describe a recorded frame in `wb` the way wire_buffer_frame describes a
+// dequeued one, the pixels stay in the trace mapping. True if the frame
+// shows another part of the recorded one than the previous frame did.
+static bool wire_replay_frame(struct wire_stream *ws, struct wire_buffer *wb,
+                              const struct trace_frame *tf)
+{
+    const struct trace_frame_header *h = tf->header;
+    struct frame *frame = &wb->frame;
+
+    if (!ws->format_valid || h->format != ws->format.format ||
+        h->width != ws->format.size.width || h->height != ws->format.size.height)
+    {
+        ws->format.format = h->format;
+        ws->format.size = SPA_RECTANGLE(h->width, h->height);
+        ws->format_valid = true;
+        metrics_add(METRIC_FORMATS_NEGOTIATED, 1);
+        printf("Stream %u replays format %d %ux%u\n", ws->index, h->format, h->width,
+               h->height);
+    }
+
+    frame->n_planes = h->n_planes;
+    memcpy(frame->planes, tf->planes, h->n_planes * sizeof(frame->planes[0]));
+    frame->seq = ws->frame_seq++;
+    frame->format = h->format;
+    frame->width = h->width;
+    frame->height = h->height;
+    // Keep the recorded delay from the compositor's pts to the dequeue.
+    frame->pts = h->pts >= 0 && (uint64_t)h->pts <= h->time_ns
+                     ? (int64_t)(frame_ring_now_ns() - (h->time_ns - h->pts))
+                     : h->pts;
+    frame->cursor = (struct frame_cursor){0};
+    ws->damage_seen = h->flags & TRACE_FRAME_DAMAGE;
+    if (wire_frame_crop(ws, wb, NULL))
+    {
+        frame_damage_full(frame);
+        return true;
+    }
+    frame->n_damage = 0;
+    for (uint32_t i = 0; i < h->n_damage; i++)
+        frame_damage_add(frame, (int32_t)h->damage[i].x - (int32_t)wb->crop.x,
+                         (int32_t)h->damage[i].y - (int32_t)wb->crop.y, h->damage[i].width,
+                         h->damage[i].height);
+    return false;
+}
+
+static void *wire_replay_thread(void *data)
+{
+    struct wire_session *session = data;
+    struct trace_frame tf;
+    uint64_t start = frame_ring_now_ns(), first_ns = 0, frames = 0;
+
+    while (!atomic_load(&session->replay_quit) && trace_reader_next(session->replay, &tf))
+    {
+        const struct trace_frame_header *h = tf.header;
+        struct wire_stream *ws;
+        struct wire_buffer *wb;
+
+        if (h->stream >= session->n_streams)
+            continue;
+        ws = &session->streams[h->stream];
+        if (!frames++)
+            first_ns = h->time_ns;
+        while (session->replay_realtime && !atomic_load(&session->replay_quit) &&
+               frame_ring_now_ns() < start + (h->time_ns - first_ns))
+            wire_replay_sleep(session, start + (h->time_ns - first_ns));
+        if (!(wb = wire_replay_buffer(ws)))
+            break;
 
-        spa_pod_builder builder = spa_pod_builder{buffer, sizeof(buffer)};
+        atomic_fetch_add_explicit(&ws->frames, 1, memory_order_relaxed);
+        metrics_add(METRIC_FRAMES_RECEIVED, 1);
+        bool full = wire_replay_frame(ws, wb, &tf);
+        wire_stream_submit(ws, wb, full || (h->flags & TRACE_FRAME_FULL));
+    }
+
+    // Done once the consumers handed every frame back.
+    for (uint32_t i = 0; i < session->n_streams; i++)
+    {
+        struct wire_stream *ws = &session->streams[i];
 
-        std::vector<const spa_pod *> params;
-        const bool has_required_pw_client_version =
-            pw_client_version_ >= kDmaBufModifierMinVersion;
-        const bool has_required_pw_server_version =
-            pw_server_version_ >= kDmaBufModifierMinVersion;
-        struct spa_rectangle resolution;
-        bool set_resolution = false;
-        if (width && height)
+        for (uint32_t j = 0; j < session->buffer_count && !atomic_load(&session->replay_quit);)
         {
-            resolution = SPA_RECTANGLE(width, height);
-            set_resolution = true;
+            wire_replay_requeue(ws);
+            if (ws->buffers[j].dequeued)
+                wire_replay_sleep(session, frame_ring_now_ns() + 50000000ull);
+            else
+                j++;
         }
-        for (uint32_t format : {SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGBA,
-                                SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx})
-        {
-            // Modifiers can be used with PipeWire >= 0.3.33
-            if (has_required_pw_client_version && has_required_pw_server_version)
-            {
-                modifiers_ = egl_dmabuf_->QueryDmaBufModifiers(format);
+    }
+    printf("Replayed %lu frames in %.1f ms\n", (unsigned long)frames,
+           (frame_ring_now_ns() - start) / 1e6);
+    // Not when stopped by wire_session_destroy, the owner is already done.
+    if (session->replay_done_cb && !atomic_load(&session->replay_quit))
+        session->replay_done_cb(session->replay_done_data);
+    return NULL;
+}
 
-                if (!modifiers_.empty())
-                {
-                    params.push_back(BuildFormat(&builder, format, modifiers_,
-                                                 set_resolution ? &resolution : NULL));
-                }
-            }
+int wire_session_replay(struct wire_session *session, const char *path, bool realtime)
+{
+    uint32_t n_streams, tilediff_threads;
+    int res;
 
-            params.push_back(BuildFormat(&builder, format, /*modifiers=*/
-        /*{},
-set_resolution ? &resolution : NULL));
+    if (!(session->replay = trace_reader_open(path)))
+        return -EINVAL;
+    session->replay_realtime = realtime;
+    session->buffer_count = SPA_MIN(session->buffer_count, (uint32_t)MAX_BUFFERS);
+    session->replay_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (session->replay_wake_fd < 0)
+        return -errno;
+
+    n_streams = SPA_MIN(trace_reader_streams(session->replay), (uint32_t)WIRE_MAX_STREAMS);
+    tilediff_threads = wire_tilediff_threads(n_streams);
+    for (uint32_t i = 0; i < n_streams; i++)
+    {
+        struct wire_stream *ws = &session->streams[i];
+
+        ws->session = session;
+        ws->index = i;
+        session->n_streams++;
+        for (uint32_t j = 0; j < MAX_BUFFERS; j++)
+        {
+            ws->buffers[j].frame.id = j;
+            ws->buffers[j].frame.pool = &ws->pool;
+        }
+        ws->pool.wake = wire_replay_wake;
+        ws->pool.wake_data = session;
+        if ((res = wire_stream_start(ws, tilediff_threads)) < 0)
+            return res;
+    }
+    printf("Replaying %lu frames of %u streams from %s, %.1f s %s\n",
+           (unsigned long)trace_reader_frames(session->replay), n_streams, path,
+           trace_reader_duration_ns(session->replay) / 1e9,
+           realtime ? "at the recorded pace" : "as fast as consumers allow");
+    return 0;
 }
 
-if (pw_stream_connect(pw_stream_, PW_DIRECTION_INPUT, pw_stream_node_id_,
-PW_STREAM_FLAG_AUTOCONNECT, params.data(),
-params.size()) != 0)
+int wire_session_replay_start(struct wire_session *session, void (*done)(void *data),
+                              void *data)
 {
-printf("Could not connect receiving stream.";
-return false;
+    int res;
+
+    if (!session->replay || session->replay_started)
+        return -EINVAL;
+    session->replay_done_cb = done;
+    session->replay_done_data = data;
+    if ((res = pthread_create(&session->replay_thread, NULL, wire_replay_thread, session)) != 0)
+        return -res;
+    session->replay_started = true;
+    return 0;
 }
 
-std::cout << "PipeWire remote opened.";*/
+void wire_session_destroy(struct wire_session *session)
+{
+    struct pw_loop *loop = pw_thread_loop_get_loop(pw_main_loop_);
+    uint32_t i, j;
+
+    // Stop the producer first, nothing is pushed to the workers after.
+    if (session->replay_started)
+    {
+        atomic_store(&session->replay_quit, true);
+        wire_replay_wake(session);
+        pthread_join(session->replay_thread, NULL);
     }
-}
+    pw_thread_loop_lock(pw_main_loop_);
+    for (i = 0; i < session->n_streams; i++)
+    {
+        struct wire_stream *ws = &session->streams[i];
 
-//   struct pw_loop * loop__ = pw_thread_loop_get_loop(pw_main_loop_);
-//   renegotiate_ = pw_loop_add_event(loop__,
-//                          &on_renegotiate_format, &userdata);
-/*struct spa_source *  pw_add_event(loop, usermethod, userdata){
-    int vers = 0;
-    void * utils = loop->utils;
-    char* method = "add_event";
+        if (ws->stream)
+            pw_stream_destroy(ws->stream);
+        if (ws->renegotiate)
+            __pw_loop_destroy_source(loop, ws->renegotiate);
+        if (ws->release)
+            __pw_loop_destroy_source(loop, ws->release);
+        ws->stream = NULL;
+        ws->renegotiate = NULL;
+        ws->release = NULL;
+    }
+    if (session->core)
+        pw_core_disconnect(session->core);
+    for (i = 0; i < session->n_streams; i++)
+        wire_stream_drop_cursor(&session->streams[i]);
+    pw_thread_loop_unlock(pw_main_loop_);
 
-    struct spa_source *_res = NULL;
-    struct spa_loop_utils *_o = utils;
-    typedef struct spa_loop_utils_methods method_type;
-    void * iface = &_o->iface;
+    // Frames the stopped trace writer didn't get to.
+    if (session->trace)
+    {
+        struct frame *frame;
+
+        while ((frame = frame_ring_pop(trace_writer_ring(session->trace))))
+            frame_release(frame);
+    }
 
-    void *callbacks = &(iface)->cb;
+    for (i = 0; i < session->n_streams; i++)
+    {
+        struct wire_stream *ws = &session->streams[i];
+
+        if (ws->worker_started)
+        {
+            atomic_store(&ws->quit, true);
+            frame_ring_wake(&ws->work);
+            pthread_join(ws->worker, NULL);
+            tilediff_clear(&ws->tilediff);
+            frame_ring_clear(&ws->work);
+        }
+        // Nothing is pushed anymore, frames left in the rings of the stopped
+        // consumers go back before their buffers are unmapped.
+        for (j = 0; j < atomic_load(&ws->n_consumers); j++)
+        {
+            struct frame *frame;
 
-    const method_type *_f = (const method_type *) (callbacks)->funcs;
-    //res = _f->method((callbacks)->data, userdata);
-    res = _f->add_event((callbacks)->data, usermethod, userdata);
-    res;
+            while ((frame = frame_ring_pop(ws->consumers[j])))
+                frame_release(frame);
+        }
+        // Buffers removed while consumers held them, those must be released
+        // by now. Cursor-only frames let go of the frames they show first.
+        for (j = 0; j < MAX_BUFFERS; j++)
+            wire_buffer_drop_refs(&ws->buffers[j]);
+        for (j = 0; j < MAX_BUFFERS; j++)
+        {
+            if (ws->buffers[j].removed)
+                wire_buffer_unmap(&ws->buffers[j]);
+        }
+    }
+    if (session->replay)
+        trace_reader_close(session->replay);
+    if (session->replay_wake_fd >= 0)
+        close(session->replay_wake_fd);
+    free(session);
+    wire_context_unref();
 }
-*/
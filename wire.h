@@ -0,0 +1,123 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+
+#define WIRE_MAX_STREAMS 8
+#define WIRE_MAX_FORMATS 16
+
+struct frame_ring;
+struct trace_writer;
+
+// A capture session: one connection to PipeWire through the portal's fd and
+// one pw_stream per portal stream. All sessions of the process share one
+// pw_context and thread loop, created with the first session.
+struct wire_session;
+
+// Settings below apply to the streams connected afterwards and, where
+// noted, renegotiate already connected ones.
+struct wire_session *wire_session_new(void);
+
+// Connect one pw_stream per portal stream node, all on the session's core.
+int wire_session_connect(struct wire_session *session, int pw_fd,
+                         const uint32_t *node_ids, uint32_t n_streams);
+
+// Instead of wire_session_connect: one stream per stream of the trace at
+// `path` (trace.h), fed through the same path captured frames take once
+// wire_session_replay_start is called, so consumers can be added first.
+// With `realtime` frames come at their recorded pace, otherwise as fast as
+// the consumers hand the buffers back.
+int wire_session_replay(struct wire_session *session, const char *path, bool realtime);
+
+// Start feeding frames from a thread of the session. `done` is called on
+// that thread once every frame was replayed and released.
+int wire_session_replay_start(struct wire_session *session, void (*done)(void *data),
+                              void *data);
+
+// Disconnect and free the session. Consumer threads must have stopped and
+// released the frames they hold, frames still in their rings are released
+// here.
+void wire_session_destroy(struct wire_session *session);
+
+struct wire_stream_stats
+{
+    uint32_t node_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps;       // currently requested rate
+    uint64_t frames;    // dequeued from PipeWire
+    uint64_t published; // handed to the consumers
+    uint64_t unchanged; // dropped by the tile diff
+    double change_ratio; // tiles changed in the last frame the tile diff saw
+    uint64_t corrupted;
+};
+
+// Streams connected by wire_session_connect, in portal order.
+uint32_t wire_stream_count(struct wire_session *session);
+int wire_get_stream_stats(struct wire_session *session, uint32_t stream,
+                          struct wire_stream_stats *stats);
+
+// Publish every captured frame of `stream` into `ring`. Buffers go back to
+// PipeWire only after all consumers released their frames, so a slow
+// consumer costs buffers (and then drops), never time in on_stream_process.
+// Consumers are added from one thread only.
+int wire_add_consumer(struct wire_session *session, uint32_t stream, struct frame_ring *ring);
+
+// Number of buffers to ask the producer for, clamped to [2, MAX_BUFFERS].
+// More buffers let slow consumers hold frames longer before drops start.
+// Takes effect through a renegotiation on the PipeWire thread.
+void wire_set_buffer_count(struct wire_session *session, uint32_t count);
+
+// Frame rate and size to ask the compositor for, 0 keeps the current rate
+// and 0x0 lets it pick any size. The formats are renegotiated on the
+// PipeWire thread. The rate is also the ceiling for load shedding.
+void wire_set_target(struct wire_session *session, uint32_t fps, uint32_t width,
+                     uint32_t height);
+
+// What the frames are for, picks the formats offered to the compositor so
+// they fit the consumer instead of whatever a renderer happens to support.
+enum wire_consumer
+{
+    WIRE_CONSUMER_ENCODER,  // YUV conversion for a video encoder
+    WIRE_CONSUMER_RECORDER, // raw frames to disk
+    WIRE_CONSUMER_SHM,      // exported to other processes as is, the default
+};
+void wire_set_consumer(struct wire_session *session, enum wire_consumer consumer);
+
+// Offer exactly `formats` (enum spa_video_format), in order of preference.
+// Connected streams are renegotiated.
+void wire_set_formats(struct wire_session *session, const uint32_t *formats,
+                      uint32_t n_formats);
+
+// Halve the requested rate while consumers drop frames and raise it back
+// once they keep up again. Enabled by default.
+void wire_set_load_shedding(struct wire_session *session, bool enabled);
+
+// Called once, on a stream worker thread, when the first frame of any of
+// the session's streams is published.
+void wire_set_first_frame_callback(struct wire_session *session,
+                                   void (*callback)(void *data), void *data);
+
+// Push every dequeued frame of a connected session to `trace` as well, from
+// the PipeWire thread. The writer must be stopped before the session is
+// destroyed and freed after.
+void wire_set_trace(struct wire_session *session, struct trace_writer *trace);
+
+// Hash tiles to find damage when the compositor sends none, unchanged
+// frames are then not published at all. Enabled by default.
+void wire_set_tile_diff(struct wire_session *session, bool enabled);
+
+// Capture only `roi` of a stream's frames, in the compositor's frame
+// coordinates and within its SPA_META_VideoCrop. NULL or an empty rect
+// captures everything again. Takes effect with the next frame, without a
+// renegotiation, and only for packed formats: the frame view is narrowed,
+// so hashing, copies and conversions touch the ROI's bytes only.
+int wire_set_roi(struct wire_session *session, uint32_t stream, const struct frame_rect *roi);
+
+#endif
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include <spa/param/video/raw.h>
+
+#include "yuv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_X86 1
+#endif
+
+#define Y_ROUND (1 << (YUV_SHIFT - 1))
+// Chroma is computed from the sum of a 2x2 block, the /4 is in the shift.
+#define UV_SHIFT (YUV_SHIFT + 2)
+#define UV_ROUND (1 << (UV_SHIFT - 1))
+
+static inline uint8_t clamp_u8(int32_t v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void store_uv(const struct yuv_converter *c, struct yuv_image *dst,
+                            uint32_t cy, uint32_t cx, uint8_t u, uint8_t v)
+{
+    if (c->dst_format == SPA_VIDEO_FORMAT_NV12)
+    {
+        uint8_t *uv = dst->planes[1] + (size_t)cy * dst->strides[1] + cx * 2;
+        uv[0] = u;
+        uv[1] = v;
+    }
+    else
+    {
+        dst->planes[1][(size_t)cy * dst->strides[1] + cx] = u;
+        dst->planes[2][(size_t)cy * dst->strides[2] + cx] = v;
+    }
+}
+
+// Reference fixed-point path, also used for the column tails of the SIMD
+// kernel. `row1` is `row0` again for the last row of an odd height.
+static void yuv_rows_scalar_from(const struct yuv_converter *c, struct yuv_image *dst,
+                                 const uint8_t *row0, const uint8_t *row1,
+                                 uint32_t y, uint32_t x)
+{
+    const int16_t *yc = c->y_coeff, *uc = c->u_coeff, *vc = c->v_coeff;
+    uint8_t *y0 = dst->planes[0] + (size_t)y * dst->strides[0];
+    uint8_t *y1 = y + 1 < dst->height ? y0 + dst->strides[0] : NULL;
+
+    for (; x < dst->width; x += 2)
+    {
+        const uint8_t *p[4] = {
+            row0 + x * 4,
+            row0 + (x + 1 < dst->width ? x + 1 : x) * 4,
+            row1 + x * 4,
+            row1 + (x + 1 < dst->width ? x + 1 : x) * 4,
+        };
+        int32_t s[3];
+
+        for (int i = 0; i < 4; i++)
+        {
+            uint8_t *out = i < 2 ? y0 : y1;
+            if (!out || (i & 1 && x + 1 >= dst->width))
+                continue;
+            out[x + (i & 1)] = clamp_u8(((yc[0] * p[i][0] + yc[1] * p[i][1] +
+                                          yc[2] * p[i][2] + Y_ROUND) >> YUV_SHIFT) +
+                                        c->y_offset);
+        }
+
+        for (int k = 0; k < 3; k++)
+            s[k] = p[0][k] + p[1][k] + p[2][k] + p[3][k];
+        store_uv(c, dst, y / 2, x / 2,
+                 clamp_u8(((uc[0] * s[0] + uc[1] * s[1] + uc[2] * s[2] + UV_ROUND) >> UV_SHIFT) + 128),
+                 clamp_u8(((vc[0] * s[0] + vc[1] * s[1] + vc[2] * s[2] + UV_ROUND) >> UV_SHIFT) + 128));
+    }
+}
+
+static void yuv_rows_scalar(const struct yuv_converter *c, struct yuv_image *dst,
+                            const uint8_t *row0, const uint8_t *row1, uint32_t y)
+{
+    yuv_rows_scalar_from(c, dst, row0, row1, y, 0);
+}
+
+#ifdef YUV_X86
+static inline int64_t pack_coeff(const int16_t *coeff)
+{
+    return (int64_t)((uint64_t)(uint16_t)coeff[0] |
+                     (uint64_t)(uint16_t)coeff[1] << 16 |
+                     (uint64_t)(uint16_t)coeff[2] << 32 |
+                     (uint64_t)(uint16_t)coeff[3] << 48);
+}
+
+// Eight pixels of two rows per iteration: 16 luma samples, 4 U and 4 V.
+__attribute__((target("avx2"))) static void yuv_rows_avx2(const struct yuv_converter *c,
+                                                          struct yuv_image *dst,
+                                                          const uint8_t *row0,
+                                                          const uint8_t *row1,
+                                                          uint32_t y)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i yc = _mm256_set1_epi64x(pack_coeff(c->y_coeff));
+    const __m256i uc = _mm256_set1_epi64x(pack_coeff(c->u_coeff));
+    const __m256i vc = _mm256_set1_epi64x(pack_coeff(c->v_coeff));
+    const __m256i y_round = _mm256_set1_epi32(Y_ROUND);
+    const __m256i y_offset = _mm256_set1_epi32(c->y_offset);
+    const __m256i uv_round = _mm256_set1_epi32(UV_ROUND);
+    const __m256i uv_offset = _mm256_set1_epi32(128);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m128i uv_order = c->dst_format == SPA_VIDEO_FORMAT_NV12
+                                 ? _mm_setr_epi8(0, 2, 1, 3, 4, 6, 5, 7, -1, -1, -1, -1, -1, -1, -1, -1)
+                                 : _mm_setr_epi8(0, 1, 4, 5, 2, 3, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+    uint8_t *y0 = dst->planes[0] + (size_t)y * dst->strides[0];
+    uint8_t *y1 = y + 1 < dst->height ? y0 + dst->strides[0] : NULL;
+    uint32_t x = 0;
+
+    for (; x + 8 <= dst->width; x += 8)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(row0 + x * 4));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(row1 + x * 4));
+        // lane 0 holds pixels 0,1 (lo) and 2,3 (hi), lane 1 pixels 4-7
+        __m256i lo0 = _mm256_unpacklo_epi8(v0, zero), hi0 = _mm256_unpackhi_epi8(v0, zero);
+        __m256i lo1 = _mm256_unpacklo_epi8(v1, zero), hi1 = _mm256_unpackhi_epi8(v1, zero);
+        __m256i l0, l1, lum, slo, shi, sum, uv;
+        __m128i out;
+
+        l0 = _mm256_hadd_epi32(_mm256_madd_epi16(lo0, yc), _mm256_madd_epi16(hi0, yc));
+        l1 = _mm256_hadd_epi32(_mm256_madd_epi16(lo1, yc), _mm256_madd_epi16(hi1, yc));
+        l0 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(l0, y_round), YUV_SHIFT), y_offset);
+        l1 = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(l1, y_round), YUV_SHIFT), y_offset);
+        lum = _mm256_packus_epi16(_mm256_packs_epi32(l0, l1), zero);
+        lum = _mm256_permutevar8x32_epi32(lum, gather);
+        out = _mm256_castsi256_si128(lum);
+        _mm_storel_epi64((__m128i *)(y0 + x), out);
+        if (y1)
+            _mm_storel_epi64((__m128i *)(y1 + x), _mm_srli_si128(out, 8));
+
+        // 2x2 sums: add the rows, then neighbouring pixels.
+        slo = _mm256_add_epi16(lo0, lo1);
+        shi = _mm256_add_epi16(hi0, hi1);
+        slo = _mm256_add_epi16(slo, _mm256_srli_si256(slo, 8));
+        shi = _mm256_add_epi16(shi, _mm256_srli_si256(shi, 8));
+        sum = _mm256_unpacklo_epi64(slo, shi);
+
+        uv = _mm256_hadd_epi32(_mm256_madd_epi16(sum, uc), _mm256_madd_epi16(sum, vc));
+        uv = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(uv, uv_round), UV_SHIFT), uv_offset);
+        uv = _mm256_packus_epi16(_mm256_packs_epi32(uv, uv), zero);
+        uv = _mm256_permutevar8x32_epi32(uv, gather);
+        out = _mm_shuffle_epi8(_mm256_castsi256_si128(uv), uv_order);
+
+        if (c->dst_format == SPA_VIDEO_FORMAT_NV12)
+        {
+            _mm_storel_epi64((__m128i *)(dst->planes[1] + (size_t)(y / 2) * dst->strides[1] + x), out);
+        }
+        else
+        {
+            uint32_t u = _mm_cvtsi128_si32(out), v = _mm_extract_epi32(out, 1);
+            memcpy(dst->planes[1] + (size_t)(y / 2) * dst->strides[1] + x / 2, &u, 4);
+            memcpy(dst->planes[2] + (size_t)(y / 2) * dst->strides[2] + x / 2, &v, 4);
+        }
+    }
+    yuv_rows_scalar_from(c, dst, row0, row1, y, x);
+}
+#endif
+
+int yuv_converter_init(struct yuv_converter *c, uint32_t dst_format, uint32_t src_format,
+                       enum yuv_matrix matrix, enum yuv_range range,
+                       enum convert_impl impl)
+{
+    double kr, kb, kg, ys, cs, coeff[3][3];
+    int r, g, b;
+
+    switch (src_format)
+    {
+    case SPA_VIDEO_FORMAT_BGRx:
+    case SPA_VIDEO_FORMAT_BGRA:
+        b = 0, g = 1, r = 2;
+        break;
+    case SPA_VIDEO_FORMAT_RGBx:
+    case SPA_VIDEO_FORMAT_RGBA:
+        r = 0, g = 1, b = 2;
+        break;
+    default:
+        return -ENOTSUP;
+    }
+    if (dst_format != SPA_VIDEO_FORMAT_NV12 && dst_format != SPA_VIDEO_FORMAT_I420)
+        return -ENOTSUP;
+
+    if (impl == CONVERT_IMPL_AUTO)
+        impl = convert_best_impl();
+    else if (impl > convert_best_impl())
+        return -ENOTSUP;
+
+    memset(c, 0, sizeof(*c));
+    c->src_format = src_format;
+    c->dst_format = dst_format;
+    c->matrix = matrix;
+    c->range = range;
+
+    kr = matrix == YUV_BT709 ? 0.2126 : 0.299;
+    kb = matrix == YUV_BT709 ? 0.0722 : 0.114;
+    kg = 1.0 - kr - kb;
+    ys = range == YUV_RANGE_FULL ? 1.0 : 219.0 / 255.0;
+    cs = range == YUV_RANGE_FULL ? 1.0 : 224.0 / 255.0;
+    c->y_offset = range == YUV_RANGE_FULL ? 0 : 16;
+
+    // rows Y, U, V; columns R, G, B
+    coeff[0][0] = ys * kr, coeff[0][1] = ys * kg, coeff[0][2] = ys * kb;
+    coeff[1][0] = -cs * kr / (2 * (1 - kb)), coeff[1][1] = -cs * kg / (2 * (1 - kb)), coeff[1][2] = cs / 2;
+    coeff[2][0] = cs / 2, coeff[2][1] = -cs * kg / (2 * (1 - kr)), coeff[2][2] = -cs * kb / (2 * (1 - kr));
+
+    for (int i = 0; i < 3; i++)
+    {
+        int16_t *out = i == 0 ? c->y_coeff : i == 1 ? c->u_coeff : c->v_coeff;
+        out[r] = lround(coeff[i][0] * (1 << YUV_SHIFT));
+        out[g] = lround(coeff[i][1] * (1 << YUV_SHIFT));
+        out[b] = lround(coeff[i][2] * (1 << YUV_SHIFT));
+        out[3] = 0;
+    }
+
+    c->impl = CONVERT_IMPL_SCALAR;
+    c->rows = yuv_rows_scalar;
+#ifdef YUV_X86
+    if (impl == CONVERT_IMPL_AVX2)
+    {
+        c->impl = CONVERT_IMPL_AVX2;
+        c->rows = yuv_rows_avx2;
+    }
+#endif
+    return 0;
+}
+
+void yuv_convert(const struct yuv_converter *c, struct yuv_image *dst,
+                 const uint8_t *src, uint32_t src_stride,
+                 uint32_t y_begin, uint32_t y_end)
+{
+    if (y_end > dst->height)
+        y_end = dst->height;
+
+    for (uint32_t y = y_begin; y < y_end; y += 2)
+    {
+        const uint8_t *row0 = src + (size_t)y * src_stride;
+        const uint8_t *row1 = y + 1 < dst->height ? row0 + src_stride : row0;
+        c->rows(c, dst, row0, row1, y);
+    }
+}
+
+void yuv_convert_rects(const struct yuv_converter *c, struct yuv_image *dst,
+                       const uint8_t *src, uint32_t src_stride,
+                       const struct frame_rect *rects, uint32_t n_rects)
+{
+    for (uint32_t i = 0; i < n_rects; i++)
+    {
+        uint32_t x0 = rects[i].x & ~1u, y0 = rects[i].y & ~1u;
+        uint32_t x1 = (rects[i].x + rects[i].width + 1) & ~1u;
+        uint32_t y1 = (rects[i].y + rects[i].height + 1) & ~1u;
+        struct yuv_image view = *dst;
+
+        // Rounding up may step past an odd edge, which the row functions
+        // already replicate, so clamp to the image.
+        if (x1 > dst->width)
+            x1 = dst->width;
+        if (y1 > dst->height)
+            y1 = dst->height;
+        if (x0 >= x1 || y0 >= y1)
+            continue;
+
+        view.width = x1 - x0;
+        view.height = y1 - y0;
+        view.planes[0] += (size_t)y0 * dst->strides[0] + x0;
+        if (dst->format == SPA_VIDEO_FORMAT_NV12)
+        {
+            view.planes[1] += (size_t)(y0 / 2) * dst->strides[1] + x0;
+        }
+        else
+        {
+            view.planes[1] += (size_t)(y0 / 2) * dst->strides[1] + x0 / 2;
+            view.planes[2] += (size_t)(y0 / 2) * dst->strides[2] + x0 / 2;
+        }
+        yuv_convert(c, &view, src + (size_t)y0 * src_stride + x0 * 4, src_stride,
+                    0, view.height);
+    }
+}
+
+int yuv_convert_frame(const struct yuv_converter *c, struct yuv_image *dst,
+                      const struct frame *frame, bool full)
+{
+    if (frame->format != c->src_format || dst->format != c->dst_format ||
+        frame->width != dst->width || frame->height != dst->height ||
+        frame->n_planes < 1)
+        return -EINVAL;
+    if ((uint64_t)frame->planes[0].stride * (frame->height - 1) + frame->width * 4 >
+        frame->planes[0].size)
+        return -EINVAL;
+
+    if (full)
+        yuv_convert(c, dst, frame->planes[0].data, frame->planes[0].stride, 0, dst->height);
+    else
+        yuv_convert_rects(c, dst, frame->planes[0].data, frame->planes[0].stride,
+                          frame->damage, frame->n_damage);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef YUV_H
+#define YUV_H
+
+#include <stdint.h>
+
+#include "convert.h"
+#include "frame.h"
+
+enum yuv_matrix
+{
+    YUV_BT601,
+    YUV_BT709,
+};
+
+enum yuv_range
+{
+    YUV_RANGE_LIMITED,
+    YUV_RANGE_FULL,
+};
+
+// Destination of a conversion, SPA_VIDEO_FORMAT_NV12 (Y + interleaved UV) or
+// SPA_VIDEO_FORMAT_I420 (Y + U + V).
+struct yuv_image
+{
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint8_t *planes[3];
+    uint32_t strides[3];
+};
+
+struct yuv_converter;
+typedef void (*yuv_rows_func_t)(const struct yuv_converter *c, struct yuv_image *dst,
+                                const uint8_t *row0, const uint8_t *row1, uint32_t y);
+
+// Fused 32-bit RGB to NV12/I420 converter. Two source rows are consumed per
+// pass, luma of both rows and the 2x2 subsampled chroma are computed from
+// the same loads, so every source cache line is read once.
+struct yuv_converter
+{
+    uint32_t src_format;
+    uint32_t dst_format;
+    enum yuv_matrix matrix;
+    enum yuv_range range;
+    enum convert_impl impl;
+    yuv_rows_func_t rows;
+
+    // Q14 coefficients in source byte order, the 4th byte is ignored.
+    int16_t y_coeff[4];
+    int16_t u_coeff[4];
+    int16_t v_coeff[4];
+    int32_t y_offset;
+};
+
+#define YUV_SHIFT 14
+
+int yuv_converter_init(struct yuv_converter *c, uint32_t dst_format, uint32_t src_format,
+                       enum yuv_matrix matrix, enum yuv_range range,
+                       enum convert_impl impl);
+
+// Convert source rows [y_begin, y_end), y_begin must be even. Disjoint row
+// ranges can be converted concurrently.
+void yuv_convert(const struct yuv_converter *c, struct yuv_image *dst,
+                 const uint8_t *src, uint32_t src_stride,
+                 uint32_t y_begin, uint32_t y_end);
+
+// Convert only the given regions into a persistent image of the same size.
+// Regions are widened to the 2x2 chroma grid.
+void yuv_convert_rects(const struct yuv_converter *c, struct yuv_image *dst,
+                       const uint8_t *src, uint32_t src_stride,
+                       const struct frame_rect *rects, uint32_t n_rects);
+
+// Convert straight out of the mapped PipeWire buffer, no intermediate copy.
+// Only the damaged regions of the frame are converted, unless `full` is set.
+int yuv_convert_frame(const struct yuv_converter *c, struct yuv_image *dst,
+                      const struct frame *frame, bool full);
+
+#endif